@@ -9,11 +9,25 @@
  
 #include "BTreeIndex.h"
 #include "BTreeNode.h"
+#include <sched.h>
+#include <climits>
+#include <cstdio>
+#include <algorithm>
 
 using namespace std;
 
 const int MAX_KEY_NUM = 85;
 const int PAGE_SIZE = PageFile::PAGE_SIZE;
+const int MAX_TREE_HEIGHT = 32;
+
+//a nonleaf node moves its insert buffer down once the buffer has this many
+//pages. the insert buffer of the root, kept in memory, holds as many pairs
+const int MAX_BUFFER_PAGES = 16;
+const int ROOT_BUFFER_SIZE = MAX_BUFFER_PAGES * BTBufferNode::MAX_MESSAGE_NUM;
+
+int BTreeIndex::pinClock = 1;
+pthread_rwlock_t BTreeIndex::pinLock = PTHREAD_RWLOCK_INITIALIZER;
+struct BTreeIndex::pinStruct BTreeIndex::pinned[BTreeIndex::PIN_INDEX_COUNT];
 
 /*
  * BTreeIndex constructor
@@ -21,14 +35,45 @@ const int PAGE_SIZE = PageFile::PAGE_SIZE;
 BTreeIndex::BTreeIndex()
 {
     rootPid = -1;
+    treeHeight = 0;
+    format = 0;
+    freePid = -1;
+    memset(latches, 0, sizeof(latches));
+    latchedCount = 0;
+    writing = false;
+    pthread_mutex_init(&writeLock, NULL);
+    allocEnd = 0;
+    snapRoot = -1;
+    snapHeight = 0;
+    epoch = 0;
+    pthread_mutex_init(&snapLock, NULL);
+    deferHeader = false;
+    writeEnd = 0;
+    mode = 'r';
+    pthread_mutex_init(&bufferLock, NULL);
+    buffered = false;
+}
+
+/*
+ * BTreeIndex destructor
+ */
+BTreeIndex::~BTreeIndex()
+{
+    pthread_mutex_destroy(&writeLock);
+    pthread_mutex_destroy(&snapLock);
+    pthread_mutex_destroy(&bufferLock);
 }
 
 
 /* 
- *write the current root and height into file
+ *write the current root, height and node format into file
 */
 RC BTreeIndex::updateRH()
 {
+	//a copy-on-write header changes only when the write commits
+	if (deferHeader)
+		return 0;
+
 	char temp [PAGE_SIZE];
 	memset(temp, -1, PAGE_SIZE);
 
@@ -37,9 +82,25 @@ RC BTreeIndex::updateRH()
 	memcpy(idx, &rootPid, sizeof(int));
 	idx += sizeof(int);
 	memcpy(idx, &treeHeight, sizeof(int));
+	idx += sizeof(int);
+	memcpy(idx, &format, sizeof(int));
+	idx += sizeof(int);
+	memcpy(idx, &freePid, sizeof(int));
 
+	latchPage(0);
 	if(pf.write(0,temp)) return RC_FILE_WRITE_FAILED;
 
+	//keep the pinned header in sync
+	pthread_rwlock_wrlock(&pinLock);
+	int slot = pinSlot(false);
+	if (slot >= 0) {
+		pinned[slot].rootPid = rootPid;
+		pinned[slot].treeHeight = treeHeight;
+		pinned[slot].format = format;
+		pinned[slot].freePid = freePid;
+	}
+	pthread_rwlock_unlock(&pinLock);
+
 	return 0;
 }
 
@@ -48,374 +109,3792 @@ RC BTreeIndex::updateRH()
  * Under 'w' mode, the index file should be created if it does not exist.
  * @param indexname[IN] the name of the index file
  * @param mode[IN] 'r' for read, 'w' for write
+ * @param format[IN] node format flags of a newly created index
  * @return error code. 0 if no error
  */
-RC BTreeIndex::open(const string& indexname, char mode)
+RC BTreeIndex::open(const string& indexname, char mode, int format)
 {	
-	//if new file, initialize first page to have two ints
+	//open file
+	if (pf.open(indexname, mode))
+		return RC_FILE_OPEN_FAILED;
+
+	//nodes are pinned by file, so a rebuilt index that took over the
+	//name is not served the nodes of the one it replaced
+	char id [32];
+	sprintf(id, "#%ld", pf.fileId());
+	name = indexname + id;
+	allocEnd = 0;
+	this->mode = mode;
+	inserts.clear();
+	buffered = false;
+
+	//if new file, initialize first page to have three ints
 	//first int is rootpid, which is -1 for emtpy tree
 	//second int is height, which is 0 for empty tree
-	if (pf.endPid() == 0 && mode == 'w') {
-		//open file
-		if (pf.open(indexname, 'w'))
-			return RC_FILE_OPEN_FAILED;		
-		
-		//temporary buffer
-		char temp [PAGE_SIZE];
-		memset(temp, -1, PAGE_SIZE);
-		char * idx = temp;
-		
-		//fill first ints into buffer
-		treeHeight = 0;
-		rootPid = -1;
-		memcpy(idx, &rootPid, sizeof(int));
-		idx += sizeof(int);
-		memcpy(idx, &treeHeight, sizeof(int));
+	//third int is the node format of the tree
+	//fourth int is the first page of the free page list, -1 if empty
+	if (pf.endPid() == 0) {
+		if (mode != 'w' && mode != 'W')
+			return RC_INVALID_FILE_FORMAT;
 
-		//write buffer to file
-		if (pf.write(0, temp))
-			return RC_FILE_WRITE_FAILED;
-	} else {
-		//open file
-		if (pf.open(indexname, 'r'))
-			return RC_FILE_OPEN_FAILED;
+		//nodes pinned for an earlier file of the same name are stale
+		pthread_rwlock_wrlock(&pinLock);
+		pinned[pinSlot(true)].count = 0;
+		pthread_rwlock_unlock(&pinLock);
 
-		//read the first page to initiate height and root
-		char temp [PAGE_SIZE];
-		if (pf.read(0,temp))
-			return RC_FILE_READ_FAILED;
+		treeHeight = 0;
+		rootPid = -1;
+		freePid = -1;
+		snapRoot = -1;
+		snapHeight = 0;
+
+		//an insert buffer takes the place of the counts
+		if (format & BT_BUFFERED)
+			format &= ~(BT_NONLEAF_COUNTS | BT_COPY_ON_WRITE);
+
+		//copied leaves cannot keep links to their neighbours
+		if (format & BT_COPY_ON_WRITE)
+			format &= ~(BT_LEAF_COMPACT | BT_LEAF_PREV);
+		this->format = format;
+		return updateRH();
+	}
 
-		//get height and root
-		char * idx = temp;
-		memcpy(&rootPid, idx, sizeof(int));
-		idx += sizeof(int);
-		memcpy(&treeHeight, idx, sizeof(int));
+	//the header of a pinned index needs no page read
+	pthread_rwlock_rdlock(&pinLock);
+	int slot = pinSlot(false);
+	if (slot >= 0) {
+		rootPid = pinned[slot].rootPid;
+		treeHeight = pinned[slot].treeHeight;
+		this->format = pinned[slot].format;
+		freePid = pinned[slot].freePid;
+	}
+	pthread_rwlock_unlock(&pinLock);
+	snapRoot = rootPid;
+	snapHeight = treeHeight;
+	if (slot >= 0)
+		return 0;
 
-		//if write, close the read and open write
-		if(mode == 'w') {
-			if(pf.close()) return RC_FILE_CLOSE_FAILED;
-			if(pf.open(indexname,'w')) return RC_FILE_OPEN_FAILED;
-		}
+	//read the first page to initiate height, root and format
+	char temp [PAGE_SIZE];
+	if (pf.read(0,temp))
+		return RC_FILE_READ_FAILED;
 
-	}
+	char * idx = temp;
+	memcpy(&rootPid, idx, sizeof(int));
+	idx += sizeof(int);
+	memcpy(&treeHeight, idx, sizeof(int));
+	idx += sizeof(int);
+	memcpy(&this->format, idx, sizeof(int));
+	idx += sizeof(int);
+	memcpy(&freePid, idx, sizeof(int));
+
+	//index files written before the format was stored have it unset
+	if (this->format == -1)
+		this->format = 0;
+	snapRoot = rootPid;
+	snapHeight = treeHeight;
+
+	//pin the header of the index
+	pthread_rwlock_wrlock(&pinLock);
+	slot = pinSlot(true);
+	pinned[slot].rootPid = rootPid;
+	pinned[slot].treeHeight = treeHeight;
+	pinned[slot].format = this->format;
+	pinned[slot].freePid = freePid;
+	pinned[slot].count = 0;
+	pthread_rwlock_unlock(&pinLock);
 
 	return 0;
 }
 
 /*
- * Close the index file.
+ * Close the index file. Under BT_BUFFERED in write mode, the insert
+ * buffers are emptied into the leaves first.
  * @return error code. 0 if no error
  */
 RC BTreeIndex::close()
 {
+    //the buffered pairs go to the leaves before the file is closed
+    if ((format & BT_BUFFERED) && (mode == 'w' || mode == 'W') && rootPid >= 0) {
+        beginWrite();
+        RC rc = flushAll();
+        endWrite();
+        if (rc) {
+            pf.close();
+            return rc;
+        }
+    }
+
+    //with no snapshot left, every replaced page can be reused
+    if (!retired.empty()) {
+        beginWrite();
+        deferHeader = false;
+        for (size_t i = 0; i < retired.size(); i++)
+            releasePage(retired[i].second);
+        retired.clear();
+        endWrite();
+    }
     return pf.close();
 }
 
+/*
+ * Find the pin slot of this index, taking over the least recently
+ * used slot if the index has none. The caller holds pinLock, for writing
+ * if create is true, so the clock is only ticked atomically.
+ * @param create[IN] whether to take over a slot if none is found
+ * @return the slot number. -1 if not found and create is false.
+ */
+int BTreeIndex::pinSlot(bool create)
+{
+	int toEvict = 0;
+	for (int i = 0; i < PIN_INDEX_COUNT; i++) {
+		if (!pinned[i].name.empty() && pinned[i].name == name) {
+			__atomic_store_n(&pinned[i].lastAccessed,
+			                 __atomic_add_fetch(&pinClock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			return i;
+		}
+		if (pinned[i].lastAccessed < pinned[toEvict].lastAccessed)
+			toEvict = i;
+	}
+	if (!create)
+		return -1;
+
+	pinned[toEvict].name = name;
+	pinned[toEvict].lastAccessed = ++pinClock;
+	pinned[toEvict].count = 0;
+	return toEvict;
+}
 
 /*
- * Get the parent node of the page ID
- * @param key[IN] the first key of child node
- * @param child[IN] the child node pageId
- * @param searchPid[IN] pid of current node to search in
- * @return -1 if not found. PageId if no error
+ * Read a nonleaf node, serving it from the pinned upper levels if possible.
+ * The node is read again until no writer changed it meanwhile, and a node
+ * read from disk is only pinned if it is still current, since a writer
+ * refreshes only the copies already pinned.
+ * @param pid[IN] the PageId of the node
+ * @param level[IN] the level of the node (the root is level 1)
+ * @param node[OUT] the node read
+ * @param version[OUT] the version of the node read, if not NULL
+ * @return error code. 0 if no error
  */
-PageId BTreeIndex::getParent(const int& key, const PageId& child, const PageId& searchPid, int tHeight) {
-	
-	//emtpry tree
-	if(rootPid == -1) return -1;
+RC BTreeIndex::readNonLeaf(PageId pid, int level, BTNonLeafNode& node, unsigned* version)
+{
+	int rc = 0;
+	unsigned v;
+	bool found;
+
+	pid = physical(pid);
+	do {
+		v = readLatch(pid);
+		found = false;
+
+		//serve the node from memory if it is pinned
+		pthread_rwlock_rdlock(&pinLock);
+		int slot = pinSlot(false);
+		if (slot >= 0) {
+			for (int i = 0; i < pinned[slot].count && !found; i++) {
+				if (pinned[slot].pid[i] == pid) {
+					node = pinned[slot].node[i];
+					found = true;
+				}
+			}
+		}
+		pthread_rwlock_unlock(&pinLock);
+
+		if (!found)
+			rc = node.read(pid, pf);
+	} while (!validate(pid, v));
+
+	if (version)
+		*version = v;
+	if (found || rc)
+		return rc;
+
+	//pin the node if it belongs to the upper levels and there is room
+	if (level <= PINNED_LEVELS) {
+		pthread_rwlock_wrlock(&pinLock);
+		int slot = pinSlot(false);
+		if (slot >= 0 && pinned[slot].count < PIN_NODE_COUNT && validate(pid, v)) {
+			for (int i = 0; i < pinned[slot].count && !found; i++)
+				found = (pinned[slot].pid[i] == pid);
+			if (!found) {
+				int i = pinned[slot].count++;
+				pinned[slot].pid[i] = pid;
+				pinned[slot].node[i] = node;
+			}
+		}
+		pthread_rwlock_unlock(&pinLock);
+	}
+	return 0;
+}
 
-	//temp variables
-	PageId tempId;
-	BTNonLeafNode tempnode;
+/*
+ * Latch the page of a nonleaf node, write the node and refresh its
+ * pinned copy, if it has one.
+ * Under BT_COPY_ON_WRITE the write goes to a copy of the page.
+ * @param pid[IN] the PageId of the node
+ * @param node[IN] the node to write
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::writeNonLeaf(PageId pid, BTNonLeafNode& node)
+{
+	pid = shadowPage(pid, 'n');
+	latchPage(pid);
+	int rc = node.write(pid, pf);
+	if(rc) return rc;
 
-	//read page into temporary node and locate child pointer
-	tempnode.read(searchPid, pf);
-	tempnode.locateChildPtr(key, tempId);
-	
-	//check if child pointer found, if not recursively call
-	if (tempId == child) return searchPid; 
-	else if (tHeight == treeHeight-1) return -1;
-	else return getParent(key, child, tempId, tHeight+1);
+	refreshPinned(pid, node);
+	return 0;
 }
 
+/*
+ * Refresh the pinned copy of a nonleaf node, if it has one.
+ * @param pid[IN] the PageId of the node
+ * @param node[IN] the node as written
+ */
+void BTreeIndex::refreshPinned(PageId pid, BTNonLeafNode& node)
+{
+	pthread_rwlock_wrlock(&pinLock);
+	int slot = pinSlot(false);
+	if (slot >= 0) {
+		for (int i = 0; i < pinned[slot].count; i++) {
+			if (pinned[slot].pid[i] == pid) {
+				pinned[slot].node[i] = node;
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&pinLock);
+}
 
 /*
- * Get the child node for the key
- * @param key[IN] the searchkey
- * @param searchPid[IN] pid of current node to search in
- * @return -1 if not found. PageId if no error
+ * Read a leaf node, again until no writer changed it meanwhile.
+ * @param pid[IN] the PageId of the node
+ * @param leaf[OUT] the node read
+ * @param version[OUT] the version of the node read, if not NULL
+ * @return error code. 0 if no error
  */
-PageId BTreeIndex::getChild(const int& key, const PageId& searchPid, int tHeight) {
-	
-	//empty tree
-	if(rootPid == -1) return -1;
+RC BTreeIndex::readLeaf(PageId pid, BTLeafNode& leaf, unsigned* version)
+{
+	int rc;
+	unsigned v;
 
-	//temp variables
-	PageId tempId;
-	BTNonLeafNode tempnode;
+	pid = physical(pid);
+	do {
+		v = readLatch(pid);
+		rc = leaf.read(pid, pf);
+	} while (!validate(pid, v));
 
-	//read page into temporary node and search for child pointer
-	tempnode.read(searchPid, pf);
-	tempnode.locateChildPtr(key, tempId);
+	if (version)
+		*version = v;
+	return rc;
+}
 
-	//recursive call until a height right before leaf nodes
-	if (tHeight == treeHeight-1) return tempId;
-	else return getChild(key, tempId, tHeight+1);
+/*
+ * Latch the page of a leaf node and write the node.
+ * Under BT_COPY_ON_WRITE the write goes to a copy of the page.
+ * @param pid[IN] the PageId of the node
+ * @param leaf[IN] the node to write
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::writeLeaf(PageId pid, BTLeafNode& leaf)
+{
+	pid = shadowPage(pid, 'l');
+	latchPage(pid);
+	return leaf.write(pid, pf);
 }
 
-RC BTreeIndex::insertNonLeafNode(const PageId& Parent, const int& key, const PageId& PID, int tHeight) {
+/*
+ * Read a posting list page, again until no writer changed it meanwhile.
+ * @param pid[IN] the PageId of the page
+ * @param node[OUT] the page read
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readPostingNode(PageId pid, BTPostingNode& node)
+{
 	int rc;
+	unsigned v;
+
+	pid = physical(pid);
+	do {
+		v = readLatch(pid);
+		rc = node.read(pid, pf);
+	} while (!validate(pid, v));
+	return rc;
+}
 
-	BTNonLeafNode tempNode;
-	tempNode.read(Parent, pf);
-
-	if(tHeight == 1 && tempNode.getKeyCount() >= MAX_KEY_NUM) {
-		//make new node
-		BTNonLeafNode sibling;
-		PageId siblingPid = pf.endPid();
-
-		//split root into two
-		int midKey;
-		rc = tempNode.insertAndSplit(key, PID, sibling, midKey);
-		if(rc) return rc;
+/*
+ * Latch a posting list page and write it.
+ * Under BT_COPY_ON_WRITE the write goes to a copy of the page.
+ * @param pid[IN] the PageId of the page
+ * @param node[IN] the page to write
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::writePostingNode(PageId pid, BTPostingNode& node)
+{
+	pid = shadowPage(pid, 'p');
+	latchPage(pid);
+	return node.write(pid, pf);
+}
 
-		//write new node to disk
-		rc = sibling.write(siblingPid, pf);
-		if(rc) return rc;
+/*
+ * Read an insert buffer page, again until no writer changed it meanwhile.
+ * @param pid[IN] the PageId of the page
+ * @param node[OUT] the page read
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readBufferNode(PageId pid, BTBufferNode& node)
+{
+	int rc;
+	unsigned v;
 
-		//write udpated node into disk
-		rc = tempNode.write(Parent, pf);
-		if(rc) return rc;
+	do {
+		v = readLatch(pid);
+		rc = node.read(pid, pf);
+	} while (!validate(pid, v));
+	return rc;
+}
 
-		//make new root
-		BTNonLeafNode newRoot;
-		PageId newRootPid = pf.endPid();
+/*
+ * Latch an insert buffer page and write it.
+ * @param pid[IN] the PageId of the page
+ * @param node[IN] the page to write
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::writeBufferNode(PageId pid, BTBufferNode& node)
+{
+	latchPage(pid);
+	return node.write(pid, pf);
+}
 
-		//initialize new root
-		rc = newRoot.initializeRoot(Parent, midKey, siblingPid);
-		if(rc) return rc;
+/*
+ * Wait until no other thread latches a page, and return its version.
+ * The writer reads the pages it latched itself without waiting.
+ * @param pid[IN] the PageId of the page
+ * @return the version of the page
+ */
+unsigned BTreeIndex::readLatch(PageId pid)
+{
+	unsigned* latch = &latches[pid & (LATCH_COUNT - 1)];
+	unsigned version;
 
-		//write new root to disk
-		rc = newRoot.write(newRootPid, pf);
-		if(rc) return rc;
+	while ((version = __atomic_load_n(latch, __ATOMIC_ACQUIRE)) & 1) {
+		if (isWriter())
+			break;
+		sched_yield();
+	}
+	return version;
+}
 
-		//update new root and height
-		rootPid = newRootPid;
-		treeHeight++;
-		updateRH();
+/*
+ * Check that a page is still at the version read by readLatch().
+ * @param pid[IN] the PageId of the page
+ * @param version[IN] the version read
+ * @return true if no writer latched the page since
+ */
+bool BTreeIndex::validate(PageId pid, unsigned version)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&latches[pid & (LATCH_COUNT - 1)], __ATOMIC_RELAXED) == version;
+}
 
-		return 0;
-	} else if (tempNode.getKeyCount() >= MAX_KEY_NUM) {  //not root but still full
-		
-		//make new sibling
-		BTNonLeafNode sibling;
-		PageId siblingPid = pf.endPid();
+/*
+ * Latch a page before the writer changes it, by making the version of
+ * its stripe odd. The page stays latched until endWrite().
+ * @param pid[IN] the PageId of the page
+ */
+void BTreeIndex::latchPage(PageId pid)
+{
+	int stripe = pid & (LATCH_COUNT - 1);
 
-		//split into two 
-		int midKey;
-		rc = tempNode.insertAndSplit(key, PID, sibling, midKey);
-		if(rc) return rc;
+	//only the writer makes a version odd, so an odd one is already held
+	if (latches[stripe] & 1)
+		return;
+	__atomic_add_fetch(&latches[stripe], 1, __ATOMIC_SEQ_CST);
+	latched[latchedCount++] = stripe;
+}
 
-		//write sibling to disk
-		rc = sibling.write(siblingPid, pf);
-		if(rc) return rc;
+/*
+ * Wait for the turn of this thread to write the index.
+ */
+void BTreeIndex::beginWrite()
+{
+	pthread_mutex_lock(&writeLock);
+	writer = pthread_self();
+	__atomic_store_n(&writing, true, __ATOMIC_RELEASE);
+
+	//a copy-on-write header is written once, by commit()
+	if (format & BT_COPY_ON_WRITE) {
+		writeEnd = max(pf.endPid(), allocEnd);
+		deferHeader = true;
+	}
+}
 
-		rc = tempNode.write(Parent, pf);
-		if(rc) return rc;
+/*
+ * Release the pages latched by the writer and end its turn. Every page
+ * changed becomes visible to the readers at once.
+ */
+void BTreeIndex::endWrite()
+{
+	while (latchedCount > 0)
+		__atomic_add_fetch(&latches[latched[--latchedCount]], 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&writing, false, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&writeLock);
+}
 
-		//get the first key of tempNode
-		int childKey = tempNode.getFirstKey();
+/*
+ * Check whether the calling thread is the writer.
+ * @return true if it holds writeLock
+ */
+bool BTreeIndex::isWriter()
+{
+	return __atomic_load_n(&writing, __ATOMIC_ACQUIRE) && pthread_equal(writer, pthread_self());
+}
 
-		//use first key to get parent
-		PageId gParent = getParent(childKey, Parent, rootPid, 1);
-		
-		//insert overflow key to parent
-		rc = insertNonLeafNode(gParent, midKey, siblingPid, tHeight-1);
-		if(rc) return rc;
+/*
+ * Give the page that holds the content of a node for the running write.
+ * Under BT_COPY_ON_WRITE a node copied by the writer lives elsewhere
+ * until the write commits; readers always get pid back.
+ * @param pid[IN] the PageId of the node
+ * @return the PageId of the page holding it
+ */
+PageId BTreeIndex::physical(PageId pid)
+{
+	if (shadow.empty() || !isWriter())
+		return pid;
+	map<PageId, PageId>::iterator it = shadow.find(pid);
+	return it == shadow.end() ? pid : it->second;
+}
 
-		return 0;
-	} else { //not full
-		//simple insert no overflow
-		rc = tempNode.insert(key, PID);
-		if(rc) return rc;
+/*
+ * Give the page a write of a node goes to under BT_COPY_ON_WRITE,
+ * copying the node to a new page if it existed before the write.
+ * Pages allocated by the write are written in place.
+ * @param pid[IN] the PageId of the node
+ * @param kind[IN] 'l' for a leaf, 'n' for a nonleaf, 'p' for a posting page
+ * @return the PageId of the page to write
+ */
+PageId BTreeIndex::shadowPage(PageId pid, char kind)
+{
+	if (!(format & BT_COPY_ON_WRITE))
+		return pid;
+
+	PageId target = pid;
+	map<PageId, PageId>::iterator it = shadow.find(pid);
+	if (it != shadow.end())
+		target = it->second;
+	else if (pid < writeEnd && !recycled.count(pid)) {
+		target = allocatePage();
+		shadow[pid] = target;
+		retiring.insert(pid);
+	}
+	written[target] = kind;
+	return target;
+}
 
-		rc = tempNode.write(Parent, pf);
-		if(rc) return rc;
+/*
+ * Copy a node that the write did not change, so that its pointers can
+ * be set to the copies of its children. Does nothing if the node was
+ * copied or freed by the write already.
+ * @param pid[IN] the PageId of the node
+ * @param kind[IN] the kind of the node, as for shadowPage()
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::copyPage(PageId pid, char kind)
+{
+	char page [PAGE_SIZE];
 
+	if (retiring.count(pid))
 		return 0;
-	}
+	if (pf.read(pid, page))
+		return RC_FILE_READ_FAILED;
+	PageId target = shadowPage(pid, kind);
+	latchPage(target);
+	if (pf.write(target, page))
+		return RC_FILE_WRITE_FAILED;
+	return 0;
 }
 
 /*
- * Insert (key, RecordId) pair to the index.
- * @param key[IN] the key for the value inserted into the index
- * @param rid[IN] the RecordId for the record being inserted into the index
+ * Commit a write under BT_COPY_ON_WRITE. The nodes the write changed were
+ * written to copies, and the nodes it allocated in place, so the published
+ * tree is intact. The published path of the key is copied as well, since
+ * every node changed hangs off it or off another node changed, and then
+ * each page written is pointed at the copies of its children. The pages
+ * replaced wait until no snapshot is older than this write, and the new
+ * root is published last, after the header is written.
+ * @param key[IN] the key inserted or removed
+ * @param posting[IN] whether a page deep in a posting list of the key
+ *                    may have been copied
  * @return error code. 0 if no error
  */
-RC BTreeIndex::insert(int key, const RecordId& rid)
+RC BTreeIndex::commit(int key, bool posting)
 {
 	int rc;
 
-	//if empty tree, create root node
-	//root always points to 2 and 3 at first
-	if (pf.endPid() == 1) {
-		
-		//create rootnode, initialize, write to first page
-		BTNonLeafNode rootnode;
-		rc = rootnode.initializeRoot(2,key,3);
-		if(rc) return rc;
-		rc = rootnode.write(1, pf);
-		if(rc) return rc;
-
-		//create right leafnode, initialize, write to page
-		BTLeafNode leafright;
-		rc = leafright.insert(key, rid);
-		if(rc) return rc;
-		rc = leafright.setNextNodePtr(-1);
-		if(rc) return rc;
-		rc = leafright.write(3, pf);
-		if(rc) return rc;
-		
+	if (written.empty() && retiring.empty()) {
+		deferHeader = false;
+		return 0;
+	}
 
-		BTLeafNode leafleft;
-		rc = leafleft.setNextNodePtr(3);
+	//copy the published path, reading the published pages themselves
+	PageId pid = snapRoot;
+	for (int level = 1; pid >= 0 && level < snapHeight; level++) {
+		BTNonLeafNode node(format);
+		rc = node.read(pid, pf);
 		if(rc) return rc;
-		rc = leafleft.write(2, pf);
+		rc = copyPage(pid, 'n');
 		if(rc) return rc;
-
-		rootPid = 1;
-		treeHeight = 2; // height will never be 1 or just root
-		rc = updateRH();
+		pid = node.getChildPtr(node.locateChildIndex(key));
+	}
+	if (pid >= 0) {
+		rc = copyPage(pid, 'l');
 		if(rc) return rc;
+	}
 
-
-	} else {	//not empty
-		
-		//run getchild to get where key must be inserted
-		PageId childPid = getChild(key, rootPid, 1);
-
-		if(key == 4727) printf("cid is:%d     ", childPid );
-		
-		//read into childNode
-		BTLeafNode childNode;
-		rc = childNode.read(childPid, pf);
+	//a posting list page is reached through the pages in front of it
+	PageId leafPid = -1;
+	BTLeafNode leaf(format);
+	if (posting && rootPid >= 0) {
+		rc = findLeaf(key, rootPid, treeHeight, leafPid, leaf);
 		if(rc) return rc;
-
-		int keycount = childNode.getKeyCount();
-		if(keycount == MAX_KEY_NUM) {
-			//create sibling and find next page
-			BTLeafNode siblingNode;
-			PageId siblingPid = pf.endPid();
-
-			//set next pointer for child and sibling
-			PageId nextNode = childNode.getNextNodePtr();
-			rc = siblingNode.setNextNodePtr(nextNode);
-			if(rc) return rc;
-			rc = childNode.setNextNodePtr(siblingPid);
-			if(rc) return rc;
-
-			//split childNode
-			int siblingKey;
-			rc = childNode.insertAndSplit(key, rid, siblingNode, siblingKey);
-
-			//write both nodes into disk
-			rc = childNode.write(childPid, pf);
+	}
+	int eid, k;
+	RecordId r;
+	if (leafPid >= 0 && leaf.locate(key, eid) == 0 &&
+	    leaf.readEntry(eid, k, r) == 0 && r.sid == BT_POSTING_SID) {
+		vector<PageId> chain;
+		size_t last = 0;
+		for (PageId p = r.pid; p >= 0; ) {
+			if (shadow.count(p))
+				last = chain.size();
+			chain.push_back(p);
+			BTPostingNode node;
+			rc = readPostingNode(p, node);
 			if(rc) return rc;
-			rc = siblingNode.write(siblingPid, pf);
+			p = node.getNextNodePtr();
+		}
+		for (size_t i = 0; i < last; i++) {
+			rc = copyPage(chain[i], 'p');
 			if(rc) return rc;
+		}
+	}
 
-			//get first key of childPid
-			int childKey;
-			RecordId childRid;
-			childNode.readEntry(0, childKey, childRid);
-
-			//get parent
-			PageId parentPid = getParent(childKey, childPid, rootPid, 1);
-
-			//insert siblingKey into parent
-			rc = insertNonLeafNode(parentPid, siblingKey, siblingPid, treeHeight - 1);
+	//point the pages written at the copies
+	map<PageId, PageId>::iterator s;
+	for (map<PageId, char>::iterator it = written.begin(); it != written.end(); ++it) {
+		PageId p = it->first;
+		bool changed = false;
+		if (it->second == 'n') {
+			BTNonLeafNode node(format);
+			rc = node.read(p, pf);
 			if(rc) return rc;
-
-		} else if ( keycount < MAX_KEY_NUM) {
-			rc = childNode.insert(key, rid);
+			for (int i = 0; i <= node.getKeyCount(); i++) {
+				if ((s = shadow.find(node.getChildPtr(i))) != shadow.end()) {
+					node.setChildPtr(i, s->second);
+					changed = true;
+				}
+			}
+			if (changed) {
+				latchPage(p);
+				rc = node.write(p, pf);
+				if(rc) return rc;
+				refreshPinned(p, node);
+			}
+		} else if (it->second == 'l') {
+			BTLeafNode node(format);
+			rc = node.read(p, pf);
 			if(rc) return rc;
-
-			rc = childNode.write(childPid, pf);
+			for (int i = 0; i < node.getKeyCount(); i++) {
+				node.readEntry(i, k, r);
+				if (r.sid == BT_POSTING_SID && (s = shadow.find(r.pid)) != shadow.end()) {
+					r.pid = s->second;
+					node.setRecordId(i, r);
+					changed = true;
+				}
+			}
+			if (changed) {
+				latchPage(p);
+				rc = node.write(p, pf);
+				if(rc) return rc;
+			}
+		} else {
+			BTPostingNode node;
+			rc = node.read(p, pf);
 			if(rc) return rc;
+			if ((s = shadow.find(node.getNextNodePtr())) != shadow.end()) {
+				node.setNextNodePtr(s->second);
+				latchPage(p);
+				rc = node.write(p, pf);
+				if(rc) return rc;
+			}
 		}
 	}
-    return 0;
-}
-
-/**
- * Run the standard B+Tree key search algorithm and identify the
- * leaf node where searchKey may exist. If an index entry with
- * searchKey exists in the leaf node, set IndexCursor to its location
- * (i.e., IndexCursor.pid = PageId of the leaf node, and
- * IndexCursor.eid = the searchKey index entry number.) and return 0.
- * If not, set IndexCursor.pid = PageId of the leaf node and
- * IndexCursor.eid = the index entry immediately after the largest
- * index key that is smaller than searchKey, and return the error
- * code RC_NO_SUCH_RECORD.
- * Using the returned "IndexCursor", you will have to call readForward()
- * to retrieve the actual (key, rid) pair from the index.
- * @param key[IN] the key to find
- * @param cursor[OUT] the cursor pointing to the index entry with
- *                    searchKey or immediately behind the largest key
- *                    smaller than searchKey.
- * @return 0 if searchKey is found. Othewise an error code
- */
-RC BTreeIndex::locate(int searchKey, IndexCursor& cursor)
-{
-	PageId root = rootPid;
-	PageId childPid;
-	childPid = getChild(searchKey, root, 1);
+	if ((s = shadow.find(rootPid)) != shadow.end())
+		rootPid = s->second;
+
+	//reuse the pages that no open snapshot reads any more
+	pthread_mutex_lock(&snapLock);
+	int oldest = snapshots.empty() ? INT_MAX : *snapshots.begin();
+	pthread_mutex_unlock(&snapLock);
+	size_t kept = 0;
+	for (size_t i = 0; i < retired.size(); i++) {
+		if (retired[i].first <= oldest) {
+			rc = releasePage(retired[i].second);
+			if(rc) return rc;
+		} else
+			retired[kept++] = retired[i];
+	}
+	retired.resize(kept);
+	for (set<PageId>::iterator it = retiring.begin(); it != retiring.end(); ++it)
+		retired.push_back(make_pair(epoch + 1, *it));
 
-	cursor.pid = childPid;
+	deferHeader = false;
+	rc = updateRH();
+	if(rc) return rc;
 
-	BTLeafNode templeaf;
-	templeaf.read(childPid, pf);
+	pthread_mutex_lock(&snapLock);
+	__atomic_store_n(&snapRoot, rootPid, __ATOMIC_RELEASE);
+	snapHeight = treeHeight;
+	epoch++;
+	pthread_mutex_unlock(&snapLock);
 
-	return templeaf.locate(searchKey, cursor.eid);
+	shadow.clear();
+	written.clear();
+	recycled.clear();
+	retiring.clear();
+	return 0;
+}
+
+
+/*
+ * Take a page for a new node, reusing a freed page if there is one.
+ * The page must be written before the next page is allocated.
+ * @return the PageId of the page
+ */
+PageId BTreeIndex::allocatePage()
+{
+	//a page taken from the end is only written later, so the end is
+	//remembered until then
+	char temp [PAGE_SIZE];
+	PageId pid = freePid;
+	if (pid < 0 || pf.read(pid, temp)) {
+		pid = max(pf.endPid(), allocEnd);
+		allocEnd = pid + 1;
+		return pid;
+	}
+
+	//the first int of a free page links to the next free page
+	memcpy(&freePid, temp, sizeof(PageId));
+	if (format & BT_COPY_ON_WRITE)
+		recycled.insert(pid);
+	updateRH();
+	return pid;
+}
+
+/*
+ * Put the page of a node that is no longer used on the free page list.
+ * Under BT_COPY_ON_WRITE a page that existed before the write is freed
+ * only once no snapshot reads it.
+ * @param pid[IN] the PageId of the page
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::freePage(PageId pid)
+{
+	if (!(format & BT_COPY_ON_WRITE))
+		return releasePage(pid);
+
+	//the old page of a copied node is already retiring
+	map<PageId, PageId>::iterator it = shadow.find(pid);
+	if (it != shadow.end()) {
+		PageId copy = it->second;
+		shadow.erase(it);
+		written.erase(copy);
+		return releasePage(copy);
+	}
+	if (pid < writeEnd && !recycled.count(pid)) {
+		retiring.insert(pid);
+		return 0;
+	}
+	written.erase(pid);
+	return releasePage(pid);
+}
+
+/*
+ * Put a page on the free page list right away.
+ * @param pid[IN] the PageId of the page
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::releasePage(PageId pid)
+{
+	char temp [PAGE_SIZE];
+	memset(temp, -1, PAGE_SIZE);
+	memcpy(temp, &freePid, sizeof(PageId));
+	latchPage(pid);
+	if (pf.write(pid, temp))
+		return RC_FILE_WRITE_FAILED;
+
+	//a freed node must not be served from the pinned levels
+	pthread_rwlock_wrlock(&pinLock);
+	int slot = pinSlot(false);
+	if (slot >= 0) {
+		for (int i = 0; i < pinned[slot].count; i++) {
+			if (pinned[slot].pid[i] == pid) {
+				pinned[slot].count--;
+				pinned[slot].pid[i] = pinned[slot].pid[pinned[slot].count];
+				pinned[slot].node[i] = pinned[slot].node[pinned[slot].count];
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&pinLock);
+
+	freePid = pid;
+	return updateRH();
+}
+
+/*
+ * Get the parent node of the page ID
+ * @param key[IN] the first key of child node
+ * @param child[IN] the child node pageId
+ * @param searchPid[IN] pid of current node to search in
+ * @return -1 if not found. PageId if no error
+ */
+PageId BTreeIndex::getParent(const int& key, const PageId& child, const PageId& searchPid, int tHeight) {
+	
+	//emtpry tree
+	if(rootPid == -1) return -1;
+
+	//temp variables
+	PageId tempId;
+	BTNonLeafNode tempnode(format);
+
+	//read page into temporary node and locate child pointer
+	readNonLeaf(searchPid, tHeight, tempnode);
+	tempnode.locateChildPtr(key, tempId);
+	
+	//check if child pointer found, if not recursively call
+	if (tempId == child) return searchPid; 
+	else if (tHeight == treeHeight-1) return -1;
+	else return getParent(key, child, tempId, tHeight+1);
+}
+
+
+/*
+ * Get the child node for the key
+ * @param key[IN] the searchkey
+ * @param searchPid[IN] pid of current node to search in
+ * @return -1 if not found. PageId if no error
+ */
+PageId BTreeIndex::getChild(const int& key, const PageId& searchPid, int tHeight) {
+	
+	//empty tree
+	if(rootPid == -1) return -1;
+
+	//temp variables
+	PageId tempId;
+	BTNonLeafNode tempnode(format);
+
+	//read page into temporary node and search for child pointer
+	readNonLeaf(searchPid, tHeight, tempnode);
+	tempnode.locateChildPtr(key, tempId);
+
+	//recursive call until a height right before leaf nodes
+	if (tHeight == treeHeight-1) return tempId;
+	else return getChild(key, tempId, tHeight+1);
+}
+
+/*
+ * Insert (key, RecordId) pair to the index.
+ * @param key[IN] the key for the value inserted into the index
+ * @param rid[IN] the RecordId for the record being inserted into the index
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::insert(int key, const RecordId& rid)
+{
+	beginWrite();
+	RC rc = 0;
+	if ((format & BT_BUFFERED) && rootPid >= 0) {
+		//the pair waits in the insert buffer of the root
+		pthread_mutex_lock(&bufferLock);
+		inserts.push_back(Message(key, rid));
+		__atomic_store_n(&buffered, true, __ATOMIC_RELEASE);
+		bool full = (inserts.size() >= (size_t) ROOT_BUFFER_SIZE);
+		pthread_mutex_unlock(&bufferLock);
+		if (full)
+			rc = flushInserts();
+	} else
+		rc = insertEntry(key, rid);
+	if (format & BT_COPY_ON_WRITE) {
+		RC crc = commit(key, false);
+		if (rc == 0) rc = crc;
+	}
+	endWrite();
+	return rc;
+}
+
+/*
+ * The body of insert(), run by the writer.
+ */
+RC BTreeIndex::insertEntry(int key, const RecordId& rid)
+{
+	int rc;
+
+	//if empty tree, create root node
+	//root always points to 2 and 3 at first
+	if (pf.endPid() == 1) {
+		
+		//create rootnode, initialize, write to first page
+		BTNonLeafNode rootnode(format);
+		rc = rootnode.initializeRoot(2,key,3);
+		if(rc) return rc;
+		rootnode.setCount(0, 0);
+		rootnode.setCount(1, 1);
+		rc = writeNonLeaf(1, rootnode);
+		if(rc) return rc;
+
+		//create right leafnode, initialize, write to page
+		BTLeafNode leafright(format);
+		rc = leafright.insert(key, rid);
+		if(rc) return rc;
+		rc = leafright.setNextNodePtr(-1);
+		if(rc) return rc;
+		rc = leafright.setPrevNodePtr(2);
+		if(rc) return rc;
+		rc = writeLeaf(3, leafright);
+		if(rc) return rc;
+		
+
+		BTLeafNode leafleft(format);
+		rc = leafleft.setNextNodePtr(3);
+		if(rc) return rc;
+		rc = writeLeaf(2, leafleft);
+		if(rc) return rc;
+
+		//readers take the root and the height from the header
+		latchPage(0);
+		rootPid = 1;
+		treeHeight = 2; // height will never be 1 or just root
+		rc = updateRH();
+		if(rc) return rc;
+
+
+	} else {	//not empty
+		
+		//descend from the root, remembering the nodes and child slots passed
+		PageId path[MAX_TREE_HEIGHT];
+		int slot[MAX_TREE_HEIGHT];
+		PageId childPid = rootPid;
+		for (int level = 1; level < treeHeight; level++) {
+			BTNonLeafNode node(format);
+			rc = readNonLeaf(childPid, level, node);
+			if(rc) return rc;
+			path[level] = childPid;
+			slot[level] = node.locateChildIndex(key);
+			childPid = node.getChildPtr(slot[level]);
+		}
+
+		//read into childNode
+		BTLeafNode childNode(format);
+		rc = readLeaf(childPid, childNode);
+		if(rc) return rc;
+
+		//duplicates of a key may go to its posting list instead
+		RecordId entry = rid;
+		bool stored;
+		rc = insertPosting(childNode, key, entry, stored);
+		if(rc) return rc;
+		if(stored) return updateCounts(path, slot, treeHeight - 1, 1);
+
+		//simple insert if the leaf has room for the entry
+		rc = childNode.insert(key, entry);
+		if(rc == 0) {
+			rc = writeLeaf(childPid, childNode);
+			if(rc) return rc;
+			return updateCounts(path, slot, treeHeight - 1, 1);
+		}
+		if(rc != RC_NODE_FULL) return rc;
+
+		//create sibling and find next page
+		BTLeafNode siblingNode(format);
+		PageId siblingPid = allocatePage();
+
+		//set next pointer for child and sibling
+		PageId nextNode = childNode.getNextNodePtr();
+		rc = siblingNode.setNextNodePtr(nextNode);
+		if(rc) return rc;
+		rc = childNode.setNextNodePtr(siblingPid);
+		if(rc) return rc;
+		rc = siblingNode.setPrevNodePtr(childPid);
+		if(rc) return rc;
+
+		//split childNode
+		int siblingKey;
+		rc = childNode.insertAndSplit(key, entry, siblingNode, siblingKey, nextNode == -1);
+		if(rc) return rc;
+
+		//write both nodes into disk
+		rc = writeLeaf(childPid, childNode);
+		if(rc) return rc;
+		rc = writeLeaf(siblingPid, siblingNode);
+		if(rc) return rc;
+		rc = setPrevLeaf(nextNode, siblingPid);
+		if(rc) return rc;
+
+		//insert siblingKey into parent
+		int siblingCount = 0;
+		if (format & BT_NONLEAF_COUNTS)
+			siblingCount = leafWeight(siblingNode, 0, siblingNode.getKeyCount());
+		rc = insertSeparator(path, slot, treeHeight - 1, siblingKey, siblingPid, siblingCount, nextNode == -1);
+		if(rc) return rc;
+	}
+    return 0;
+}
+
+/*
+ * Insert the separator of a node that was split into its parent, splitting
+ * the parents up to the root as needed. With BT_NONLEAF_COUNTS the counts
+ * of the split node and its new sibling are set and the counts of the
+ * nodes above are raised by the entry inserted.
+ * @param path[IN] the nonleaf nodes from the root to the split node
+ * @param slot[IN] the child pointer followed in each node of path
+ * @param level[IN] the level of the parent of the split node
+ * @param key[IN] the first key below the new sibling
+ * @param pid[IN] the PageId of the new sibling
+ * @param count[IN] the number of pairs below the new sibling
+ * @param rightEdge[IN] true if the path is the rightmost one of the tree
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::insertSeparator(const PageId path[], const int slot[], int level, int key, PageId pid, int count,
+                               bool rightEdge)
+{
+	int rc;
+	int total = 0;
+
+	for (; level >= 1; level--) {
+		BTNonLeafNode node(format);
+		rc = readNonLeaf(path[level], level, node);
+		if(rc) return rc;
+
+		//the split node keeps the rest of its old entries and the new one
+		node.setCount(slot[level], node.getCount(slot[level]) + 1 - count);
+
+		//simple insert if the node has room for the separator
+		rc = node.insert(key, pid, count);
+		if(rc == 0) {
+			rc = writeNonLeaf(path[level], node);
+			if(rc) return rc;
+			return updateCounts(path, slot, level - 1, 1);
+		}
+		if(rc != RC_NODE_FULL) return rc;
+
+		//otherwise split the node and move its middle key up
+		BTNonLeafNode sibling(format);
+		PageId siblingPid = allocatePage();
+		int midKey;
+		rc = node.insertAndSplit(key, pid, sibling, midKey, count, rightEdge);
+		if(rc) return rc;
+		rc = moveMessages(node, sibling, midKey, INT_MAX);
+		if(rc) return rc;
+		rc = writeNonLeaf(siblingPid, sibling);
+		if(rc) return rc;
+		rc = writeNonLeaf(path[level], node);
+		if(rc) return rc;
+
+		key = midKey;
+		pid = siblingPid;
+		count = sibling.getTotal();
+		total = node.getTotal();
+	}
+
+	//the root was split: make a new root above the two halves
+	BTNonLeafNode newRoot(format);
+	PageId newRootPid = allocatePage();
+	rc = newRoot.initializeRoot(rootPid, key, pid);
+	if(rc) return rc;
+	newRoot.setCount(0, total);
+	newRoot.setCount(1, count);
+	rc = writeNonLeaf(newRootPid, newRoot);
+	if(rc) return rc;
+
+	latchPage(0);
+	rootPid = newRootPid;
+	treeHeight++;
+	return updateRH();
+}
+
+/*
+ * Add delta to the counts of the child pointers followed from the root
+ * down to the given level. Does nothing without BT_NONLEAF_COUNTS.
+ * @param path[IN] the nonleaf nodes from the root
+ * @param slot[IN] the child pointer followed in each node of path
+ * @param level[IN] the lowest level to update
+ * @param delta[IN] the change in the number of pairs
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::updateCounts(const PageId path[], const int slot[], int level, int delta)
+{
+	int rc;
+
+	if (!(format & BT_NONLEAF_COUNTS))
+		return 0;
+
+	for (; level >= 1; level--) {
+		BTNonLeafNode node(format);
+		rc = readNonLeaf(path[level], level, node);
+		if(rc) return rc;
+		node.setCount(slot[level], node.getCount(slot[level]) + delta);
+		rc = writeNonLeaf(path[level], node);
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+/*
+ * Return the number of (key, rid) pairs held by the entries [from, to) of
+ * a leaf, reading the first page of every posting list among them.
+ * @param leaf[IN] the leaf
+ * @param from[IN] the first entry
+ * @param to[IN] the entry behind the last one
+ * @return the number of pairs
+ */
+int BTreeIndex::leafWeight(BTLeafNode& leaf, int from, int to)
+{
+	int weight = 0, k;
+	RecordId r;
+
+	for (int eid = from; eid < to; eid++) {
+		leaf.readEntry(eid, k, r);
+		if (r.sid == BT_POSTING_SID) {
+			BTPostingNode head;
+			if (readPostingNode(r.pid, head) == 0)
+				weight += head.getTotal();
+		} else
+			weight++;
+	}
+	return weight;
+}
+
+/*
+ * Append the RecordIds of a key in a leaf to rids, reading its posting
+ * list if it has one.
+ * @param leaf[IN] the leaf the key belongs to
+ * @param key[IN] the key
+ * @param rids[IN/OUT] the RecordIds read
+ * @return error code. 0 if no error, also when the key is not there
+ */
+RC BTreeIndex::readKeyRids(BTLeafNode& leaf, int key, vector<RecordId>& rids)
+{
+	int rc, eid, k;
+	RecordId r;
+
+	if (leaf.locate(key, eid) != 0)
+		return 0;
+	for (; leaf.readEntry(eid, k, r) == 0 && k == key; eid++) {
+		if (r.sid != BT_POSTING_SID) {
+			rids.push_back(r);
+			continue;
+		}
+		BTPostingNode posting;
+		RecordId list [BTPostingNode::MAX_RID_NUM];
+		for (PageId pid = r.pid; pid >= 0; pid = posting.getNextNodePtr()) {
+			rc = readPostingNode(pid, posting);
+			if(rc) return rc;
+			int n = posting.readAll(list);
+			rids.insert(rids.end(), list, list + n);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Add a duplicate of a key that is in the leaf to the posting list of
+ * the key, first moving its inline entries to a new posting list if the
+ * key has reached BT_INLINE_RID_NUM entries.
+ * @param leaf[IN/OUT] the leaf the key belongs to, not yet written
+ * @param key[IN] the key inserted
+ * @param rid[IN/OUT] the RecordId inserted. when a new posting list is
+ *                    created, set to the leaf entry for the list
+ * @param stored[OUT] true if rid is stored and the leaf is unchanged.
+ *                    otherwise (key, rid) must still be inserted in the leaf
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::insertPosting(BTLeafNode& leaf, int key, RecordId& rid, bool& stored)
+{
+	int rc, eid, k;
+	RecordId r;
+
+	stored = false;
+	if (leaf.locate(key, eid) != 0)
+		return 0;
+	rc = leaf.readEntry(eid, k, r);
+	if(rc) return rc;
+
+	//the key already has a posting list: add to its first page, or to
+	//the second one if the first is full. a new page goes second, so the
+	//leaf entry of the list never changes. the first page also keeps the
+	//size of the whole list
+	if (r.sid == BT_POSTING_SID) {
+		stored = true;
+		PageId headPid = r.pid;
+		BTPostingNode head, node;
+		rc = readPostingNode(headPid, head);
+		if(rc) return rc;
+		head.setTotal(head.getTotal() + 1);
+		if (head.insert(rid) == 0)
+			return writePostingNode(headPid, head);
+
+		PageId second = head.getNextNodePtr();
+		if (second >= 0) {
+			rc = readPostingNode(second, node);
+			if(rc) return rc;
+			if (node.insert(rid) == 0) {
+				rc = writePostingNode(second, node);
+				if(rc) return rc;
+				return writePostingNode(headPid, head);
+			}
+			node = BTPostingNode();
+		}
+
+		node.insert(rid);
+		node.setNextNodePtr(second);
+		PageId pid = allocatePage();
+		rc = writePostingNode(pid, node);
+		if(rc) return rc;
+		head.setNextNodePtr(pid);
+		return writePostingNode(headPid, head);
+	}
+
+	//keep the first few duplicates inline
+	int run = 1;
+	while (leaf.readEntry(eid + run, k, r) == 0 && k == key)
+		run++;
+	if (run < BT_INLINE_RID_NUM)
+		return 0;
+
+	//move them to a new posting list that the leaf points to instead
+	BTPostingNode posting;
+	for (int i = 0; i < run; i++) {
+		leaf.readEntry(eid, k, r);
+		posting.insert(r);
+		leaf.remove(eid);
+	}
+	posting.insert(rid);
+	posting.setTotal(run + 1);
+
+	PageId pid = allocatePage();
+	rc = writePostingNode(pid, posting);
+	if(rc) return rc;
+	rid.pid = pid;
+	rid.sid = BT_POSTING_SID;
+	return 0;
+}
+
+/*
+ * Remove a RecordId from a posting list, freeing the pages it empties.
+ * @param head[IN] the first page of the list
+ * @param rid[IN] the RecordId to remove
+ * @param empty[OUT] true if the list is now empty and its entry
+ *                   must be removed from the leaf
+ * @return error code. RC_NO_SUCH_RECORD if rid is not in the list
+ */
+RC BTreeIndex::removePosting(PageId head, const RecordId& rid, bool& empty)
+{
+	int rc;
+	BTPostingNode first, node, prev;
+	PageId pid = head, prevPid = -1;
+
+	empty = false;
+	rc = readPostingNode(head, first);
+	if(rc) return rc;
+	while (pid >= 0) {
+		if (pid == head)
+			node = first;
+		else {
+			rc = readPostingNode(pid, node);
+			if(rc) return rc;
+		}
+		if (node.remove(rid) == 0)
+			break;
+		prev = node;
+		prevPid = pid;
+		pid = node.getNextNodePtr();
+	}
+	if (pid < 0)
+		return RC_NO_SUCH_RECORD;
+
+	//the first page keeps the size of the whole list
+	int total = first.getTotal() - 1;
+	if (pid == head) {
+		node.setTotal(total);
+	} else {
+		first.setTotal(total);
+		if (prevPid == head)
+			prev.setTotal(total);
+		rc = writePostingNode(head, first);
+		if(rc) return rc;
+	}
+	if (node.getCount() > 0)
+		return writePostingNode(pid, node);
+
+	//unlink the emptied page. the first page keeps its place in the leaf,
+	//so it takes over the content of the second page instead
+	PageId next = node.getNextNodePtr();
+	if (prevPid >= 0) {
+		prev.setNextNodePtr(next);
+		rc = writePostingNode(prevPid, prev);
+		if(rc) return rc;
+		return freePage(pid);
+	}
+	if (next < 0) {
+		empty = true;
+		return freePage(pid);
+	}
+	rc = readPostingNode(next, node);
+	if(rc) return rc;
+	node.setTotal(total);
+	rc = writePostingNode(pid, node);
+	if(rc) return rc;
+	return freePage(next);
+}
+
+/*
+ * Order buffered pairs by their keys only.
+ */
+static bool messageLess(const pair<int, RecordId>& a, const pair<int, RecordId>& b)
+{
+	return a.first < b.first;
+}
+
+/*
+ * Append the pairs of an insert buffer to msgs.
+ * @param head[IN] the first page of the buffer. -1 for an empty buffer
+ * @param msgs[IN/OUT] the pairs read
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readBuffer(PageId head, vector<Message>& msgs)
+{
+	int rc, key;
+	RecordId rid;
+	BTBufferNode node;
+
+	//the first page knows the length of the chain, so a reader is not led
+	//astray by a page that was reused meanwhile
+	int pages = 1;
+	PageId pid = head;
+	for (int n = 0; pid >= 0 && n < pages; n++) {
+		rc = readBufferNode(pid, node);
+		if(rc) return rc;
+		if (n == 0)
+			pages = node.getPageCount();
+		for (int i = 0; node.readEntry(i, key, rid) == 0; i++)
+			msgs.push_back(Message(key, rid));
+		pid = node.getNextNodePtr();
+	}
+	return 0;
+}
+
+/*
+ * Put the pages of an insert buffer on the free page list.
+ * @param head[IN] the first page of the buffer. -1 for an empty buffer
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::freeBuffer(PageId head)
+{
+	int rc;
+	BTBufferNode node;
+
+	while (head >= 0) {
+		rc = readBufferNode(head, node);
+		if(rc) return rc;
+		rc = freePage(head);
+		if(rc) return rc;
+		head = node.getNextNodePtr();
+	}
+	return 0;
+}
+
+/*
+ * Write pairs to a new insert buffer.
+ * @param msgs[IN] the pairs to write
+ * @param head[OUT] the first page of the buffer. -1 if msgs is empty
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::writeBuffer(const vector<Message>& msgs, PageId& head)
+{
+	int rc;
+	int per = BTBufferNode::MAX_MESSAGE_NUM;
+	int pages = ((int) msgs.size() + per - 1) / per;
+
+	//write the pages from the last one, each pointing to the one before
+	head = -1;
+	for (int p = pages - 1; p >= 0; p--) {
+		BTBufferNode node;
+		for (size_t i = (size_t) p * per; i < msgs.size() && i < (size_t) (p + 1) * per; i++)
+			node.insert(msgs[i].first, msgs[i].second);
+		node.setNextNodePtr(head);
+		node.setPageCount(pages - p);
+		PageId pid = allocatePage();
+		rc = writeBufferNode(pid, node);
+		if(rc) return rc;
+		head = pid;
+	}
+	return 0;
+}
+
+/*
+ * Move the buffered pairs with lo <= key <= hi from one nonleaf node to
+ * another, after children moved between the two. Both nodes must be
+ * written by the caller.
+ * @param from[IN/OUT] the node that gave up the children
+ * @param to[IN/OUT] the node that took them
+ * @param lo[IN] the smallest key to move
+ * @param hi[IN] the largest key to move
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::moveMessages(BTNonLeafNode& from, BTNonLeafNode& to, int lo, int hi)
+{
+	int rc;
+	vector<Message> all, kept, moved;
+
+	if (from.getBufferPtr() < 0)
+		return 0;
+	rc = readBuffer(from.getBufferPtr(), all);
+	if(rc) return rc;
+	for (size_t i = 0; i < all.size(); i++) {
+		if (all[i].first >= lo && all[i].first <= hi)
+			moved.push_back(all[i]);
+		else
+			kept.push_back(all[i]);
+	}
+	if (moved.empty() && !kept.empty())
+		return 0;
+
+	//both buffers are written again in full
+	rc = readBuffer(to.getBufferPtr(), moved);
+	if(rc) return rc;
+	rc = freeBuffer(from.getBufferPtr());
+	if(rc) return rc;
+	rc = freeBuffer(to.getBufferPtr());
+	if(rc) return rc;
+
+	PageId head;
+	rc = writeBuffer(kept, head);
+	if(rc) return rc;
+	from.setBufferPtr(head);
+	rc = writeBuffer(moved, head);
+	if(rc) return rc;
+	to.setBufferPtr(head);
+	return 0;
+}
+
+/*
+ * Descend from the root to the node at the given height where key belongs.
+ * @param key[IN] the key to find
+ * @param height[IN] the height of the node (0 for a leaf)
+ * @param pid[OUT] the PageId of the node
+ * @param bound[OUT] the smallest key above key that belongs elsewhere.
+ *                   INT_MAX if there is none
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::findNode(int key, int height, PageId& pid, int& bound)
+{
+	int rc;
+
+	pid = rootPid;
+	bound = INT_MAX;
+	for (int level = 1; level < treeHeight - height; level++) {
+		BTNonLeafNode node(format);
+		rc = readNonLeaf(pid, level, node);
+		if(rc) return rc;
+		int i = node.locateChildIndex(key);
+		if (i < node.getKeyCount())
+			bound = min(bound, node.getKey(i));
+		pid = node.getChildPtr(i);
+	}
+	return 0;
+}
+
+/*
+ * Add sorted pairs to the insert buffers of the nonleaf nodes at the
+ * given height, flushing a buffer that gets full.
+ * @param height[IN] the height of the nodes (the root is treeHeight-1)
+ * @param msgs[IN] the pairs, sorted by key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::bufferMessages(int height, const vector<Message>& msgs)
+{
+	int rc;
+	size_t i = 0;
+
+	while (i < msgs.size()) {
+		//the pairs up to the bound all go to the same node
+		PageId pid;
+		int bound;
+		rc = findNode(msgs[i].first, height, pid, bound);
+		if(rc) return rc;
+		size_t end = i + 1;
+		while (end < msgs.size() && msgs[end].first < bound)
+			end++;
+
+		rc = appendMessages(pid, height, msgs, i, end);
+		if(rc) return rc;
+
+		//a full buffer is moved down before the rest is added. the node
+		//may be split meanwhile, so the rest looks for its node again
+		if (i < end) {
+			rc = flushBuffer(pid, height);
+			if(rc) return rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Add pairs msgs[i..end) that belong to one nonleaf node to its insert
+ * buffer, until the buffer has MAX_BUFFER_PAGES pages.
+ * @param pid[IN] the PageId of the node
+ * @param height[IN] the height of the node
+ * @param msgs[IN] the pairs
+ * @param i[IN/OUT] the first pair to add. set to the first pair left
+ * @param end[IN] the end of the pairs to add
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::appendMessages(PageId pid, int height, const vector<Message>& msgs, size_t& i, size_t end)
+{
+	int rc;
+	BTNonLeafNode node(format);
+	rc = readNonLeaf(pid, treeHeight - height, node);
+	if(rc) return rc;
+
+	PageId head = node.getBufferPtr();
+	BTBufferNode page;
+	int pages = 0;
+	if (head >= 0) {
+		rc = readBufferNode(head, page);
+		if(rc) return rc;
+		pages = page.getPageCount();
+	}
+
+	//new pairs go to the first page, and a new first page is put in front
+	//when it is full
+	bool dirty = false;
+	while (i < end) {
+		if (head >= 0 && page.insert(msgs[i].first, msgs[i].second) == 0) {
+			i++;
+			dirty = true;
+			continue;
+		}
+		if (dirty) {
+			rc = writeBufferNode(head, page);
+			if(rc) return rc;
+			dirty = false;
+		}
+		if (pages >= MAX_BUFFER_PAGES)
+			break;
+
+		BTBufferNode first;
+		first.setNextNodePtr(head);
+		first.setPageCount(++pages);
+		page = first;
+		head = allocatePage();
+		dirty = true;
+	}
+	if (dirty) {
+		rc = writeBufferNode(head, page);
+		if(rc) return rc;
+	}
+
+	if (head == node.getBufferPtr())
+		return 0;
+	node.setBufferPtr(head);
+	return writeNonLeaf(pid, node);
+}
+
+/*
+ * Move the insert buffer of the root down, out of memory.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::flushInserts()
+{
+	vector<Message> msgs;
+
+	pthread_mutex_lock(&bufferLock);
+	msgs.swap(inserts);
+	pthread_mutex_unlock(&bufferLock);
+
+	stable_sort(msgs.begin(), msgs.end(), messageLess);
+	if (treeHeight <= 2)
+		return applyMessages(msgs);
+	return bufferMessages(treeHeight - 2, msgs);
+}
+
+/*
+ * Empty the insert buffer of a nonleaf node into its children.
+ * @param pid[IN] the PageId of the node
+ * @param height[IN] the height of the node
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::flushBuffer(PageId pid, int height)
+{
+	int rc;
+	vector<Message> msgs;
+
+	BTNonLeafNode node(format);
+	rc = readNonLeaf(pid, treeHeight - height, node);
+	if(rc) return rc;
+	PageId head = node.getBufferPtr();
+	rc = readBuffer(head, msgs);
+	if(rc) return rc;
+	node.setBufferPtr(-1);
+	rc = writeNonLeaf(pid, node);
+	if(rc) return rc;
+	rc = freeBuffer(head);
+	if(rc) return rc;
+
+	stable_sort(msgs.begin(), msgs.end(), messageLess);
+	if (height == 1)
+		return applyMessages(msgs);
+	return bufferMessages(height - 1, msgs);
+}
+
+/*
+ * Insert sorted pairs into the leaves, writing each leaf once for all
+ * the pairs that fit in it.
+ * @param msgs[IN] the pairs, sorted by key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::applyMessages(const vector<Message>& msgs)
+{
+	int rc;
+	size_t i = 0;
+
+	while (i < msgs.size()) {
+		PageId pid;
+		int bound;
+		rc = findNode(msgs[i].first, 0, pid, bound);
+		if(rc) return rc;
+		BTLeafNode leaf(format);
+		rc = readLeaf(pid, leaf);
+		if(rc) return rc;
+
+		//insert the pairs of the leaf in memory while it has room
+		bool changed = false, full = false;
+		for (; i < msgs.size() && msgs[i].first < bound; i++) {
+			RecordId entry = msgs[i].second;
+			bool stored;
+			rc = insertPosting(leaf, msgs[i].first, entry, stored);
+			if(rc) return rc;
+			if (stored)
+				continue;
+			rc = leaf.insert(msgs[i].first, entry);
+			if (rc == RC_NODE_FULL) {
+				full = true;
+				break;
+			}
+			if(rc) return rc;
+			changed = true;
+		}
+		if (changed) {
+			rc = writeLeaf(pid, leaf);
+			if(rc) return rc;
+		}
+
+		//a pair that does not fit splits the leaf the usual way
+		if (full) {
+			rc = insertEntry(msgs[i].first, msgs[i].second);
+			if(rc) return rc;
+			i++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Remove a pair from the insert buffers on the path of its key.
+ * @param key[IN] the key of the pair
+ * @param rid[IN] the RecordId of the pair
+ * @param found[OUT] whether the pair was buffered
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::removeMessage(int key, const RecordId& rid, bool& found)
+{
+	int rc, k;
+	RecordId r;
+
+	found = false;
+	pthread_mutex_lock(&bufferLock);
+	for (size_t i = 0; i < inserts.size() && !found; i++) {
+		if (inserts[i].first == key && inserts[i].second == rid) {
+			inserts[i] = inserts.back();
+			inserts.pop_back();
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&bufferLock);
+	if (found)
+		return 0;
+
+	PageId pid = rootPid;
+	for (int level = 1; level < treeHeight; level++) {
+		BTNonLeafNode node(format);
+		rc = readNonLeaf(pid, level, node);
+		if(rc) return rc;
+
+		BTBufferNode page;
+		for (PageId p = node.getBufferPtr(); p >= 0; p = page.getNextNodePtr()) {
+			rc = readBufferNode(p, page);
+			if(rc) return rc;
+			for (int i = 0; page.readEntry(i, k, r) == 0; i++) {
+				if (k == key && r == rid) {
+					found = true;
+					page.remove(i);
+					return writeBufferNode(p, page);
+				}
+			}
+		}
+		pid = node.getChildPtr(node.locateChildIndex(key));
+	}
+	return 0;
+}
+
+/*
+ * Find a nonleaf node in the subtree of pid that has a buffered pair,
+ * looking at the nodes above before the nodes below.
+ * @param pid[IN] the PageId of the root of the subtree
+ * @param level[IN] the level of the node (the root is level 1)
+ * @param found[OUT] the PageId of the node found. -1 if none
+ * @param height[OUT] the height of the node found
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::findBuffered(PageId pid, int level, PageId& found, int& height)
+{
+	int rc;
+	BTNonLeafNode node(format);
+	rc = readNonLeaf(pid, level, node);
+	if(rc) return rc;
+
+	found = -1;
+	if (node.getBufferPtr() >= 0) {
+		found = pid;
+		height = treeHeight - level;
+		return 0;
+	}
+	if (level + 1 >= treeHeight)
+		return 0;
+	for (int i = 0; i <= node.getKeyCount() && found < 0; i++) {
+		rc = findBuffered(node.getChildPtr(i), level + 1, found, height);
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+/*
+ * Empty every insert buffer into the leaves.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::flushAll()
+{
+	int rc;
+	PageId pid;
+	int height;
+
+	rc = flushInserts();
+	if(rc) return rc;
+	for (;;) {
+		rc = findBuffered(rootPid, 1, pid, height);
+		if(rc) return rc;
+		if (pid < 0)
+			return 0;
+		rc = flushBuffer(pid, height);
+		if(rc) return rc;
+	}
+}
+
+/*
+ * Empty every insert buffer into the leaves if a pair was buffered
+ * since the last time, for the readers of the leaves.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::flushForRead()
+{
+	if (!__atomic_load_n(&buffered, __ATOMIC_ACQUIRE))
+		return 0;
+
+	//another reader may have flushed while this one waited its turn
+	beginWrite();
+	RC rc = 0;
+	if (buffered && rootPid >= 0)
+		rc = flushAll();
+	if (rc == 0)
+		__atomic_store_n(&buffered, false, __ATOMIC_RELEASE);
+	endWrite();
+	return rc;
+}
+
+/*
+ * Append the buffered pairs with lo <= key <= hi, in no particular order.
+ * @param lo[IN] the smallest key
+ * @param hi[IN] the largest key
+ * @param msgs[IN/OUT] the pairs found
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::collectMessages(int lo, int hi, vector<Message>& msgs)
+{
+	int rc;
+	PageId root = rootPid;
+
+	if (root >= 0) {
+		rc = collectBuffered(root, 1, lo, hi, msgs);
+		if(rc) return rc;
+	}
+
+	pthread_mutex_lock(&bufferLock);
+	for (size_t i = 0; i < inserts.size(); i++) {
+		if (inserts[i].first >= lo && inserts[i].first <= hi)
+			msgs.push_back(inserts[i]);
+	}
+	pthread_mutex_unlock(&bufferLock);
+	return 0;
+}
+
+/*
+ * Append the pairs with lo <= key <= hi in the insert buffers of the
+ * subtree of pid. The buffer of a node is read again until the node
+ * did not change meanwhile.
+ * @param pid[IN] the PageId of the root of the subtree
+ * @param level[IN] the level of the node (the root is level 1)
+ * @param lo[IN] the smallest key
+ * @param hi[IN] the largest key
+ * @param msgs[IN/OUT] the pairs found
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::collectBuffered(PageId pid, int level, int lo, int hi, vector<Message>& msgs)
+{
+	int rc;
+	unsigned version;
+	BTNonLeafNode node(format);
+	vector<Message> buffered;
+
+	do {
+		buffered.clear();
+		rc = readNonLeaf(pid, level, node, &version);
+		if(rc) return rc;
+		rc = readBuffer(node.getBufferPtr(), buffered);
+	} while (!validate(pid, version));
+	if(rc) return rc;
+
+	for (size_t i = 0; i < buffered.size(); i++) {
+		if (buffered[i].first >= lo && buffered[i].first <= hi)
+			msgs.push_back(buffered[i]);
+	}
+	if (level + 1 >= treeHeight)
+		return 0;
+	int last = node.locateChildIndex(hi);
+	for (int i = node.locateChildIndex(lo); i <= last; i++) {
+		rc = collectBuffered(node.getChildPtr(i), level + 1, lo, hi, msgs);
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+/*
+ * Remove the (key, RecordId) pair from the index.
+ * @param key[IN] the key of the pair to remove
+ * @param rid[IN] the RecordId of the pair to remove
+ * @return error code. RC_NO_SUCH_RECORD if the pair is not in the index
+ */
+RC BTreeIndex::remove(int key, const RecordId& rid)
+{
+	beginWrite();
+	bool found = false;
+	RC rc = 0;
+	if (format & BT_BUFFERED)
+		rc = removeMessage(key, rid, found);
+	if (rc == 0 && !found)
+		rc = removeEntry(key, rid);
+	if (format & BT_COPY_ON_WRITE) {
+		RC crc = commit(key, true);
+		if (rc == 0) rc = crc;
+	}
+	endWrite();
+	return rc;
+}
+
+/*
+ * The body of remove(), run by the writer.
+ */
+RC BTreeIndex::removeEntry(int key, const RecordId& rid)
+{
+	int rc;
+	PageId path[MAX_TREE_HEIGHT];
+	int slot[MAX_TREE_HEIGHT];
+
+	if (rootPid == -1)
+		return RC_NO_SUCH_RECORD;
+
+	//descend from the root, remembering the nodes and child slots passed
+	PageId pid = rootPid;
+	for (int level = 1; level < treeHeight; level++) {
+		BTNonLeafNode node(format);
+		rc = readNonLeaf(pid, level, node);
+		if(rc) return rc;
+		path[level] = pid;
+		slot[level] = node.locateChildIndex(key);
+		pid = node.getChildPtr(slot[level]);
+	}
+
+	//find the pair in the leaf
+	BTLeafNode leaf(format);
+	rc = readLeaf(pid, leaf);
+	if(rc) return rc;
+
+	int eid, k;
+	RecordId r;
+	if (leaf.locate(key, eid) != 0)
+		return RC_NO_SUCH_RECORD;
+	for (;; eid++) {
+		if (leaf.readEntry(eid, k, r) != 0 || k != key)
+			return RC_NO_SUCH_RECORD;
+		if (r == rid)
+			break;
+
+		//a key with a posting list has no other entries in the leaf.
+		//the entry goes only when the list is empty
+		if (r.sid == BT_POSTING_SID) {
+			bool empty;
+			rc = removePosting(r.pid, rid, empty);
+			if(rc) return rc;
+			if(!empty) return updateCounts(path, slot, treeHeight - 1, -1);
+			break;
+		}
+	}
+
+	rc = updateCounts(path, slot, treeHeight - 1, -1);
+	if(rc) return rc;
+	rc = leaf.remove(eid);
+	if(rc) return rc;
+
+	if (!leaf.isUnderflow())
+		return writeLeaf(pid, leaf);
+	return rebalanceLeaf(leaf, path, slot);
+}
+
+/*
+ * Fix an underflowing leaf by merging it with a sibling, or by borrowing
+ * an entry from the sibling if the two do not fit in one node.
+ * @param leaf[IN] the leaf, not yet written
+ * @param path[IN] the nonleaf nodes from the root to the leaf
+ * @param slot[IN] the child pointer followed in each node of path
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rebalanceLeaf(BTLeafNode& leaf, const PageId path[], const int slot[])
+{
+	int rc;
+	int level = treeHeight - 1;
+	BTNonLeafNode parent(format);
+	rc = readNonLeaf(path[level], level, parent);
+	if(rc) return rc;
+
+	//use the left sibling if there is one, otherwise the right sibling
+	int i = slot[level];
+	int sep = (i > 0) ? i - 1 : i;
+	PageId leftPid = parent.getChildPtr(sep);
+	PageId rightPid = parent.getChildPtr(sep + 1);
+	BTLeafNode left(format), right(format);
+	if (i > 0) {
+		rc = readLeaf(leftPid, left);
+		right = leaf;
+	} else {
+		left = leaf;
+		rc = readLeaf(rightPid, right);
+	}
+	if(rc) return rc;
+
+	int k;
+	RecordId r;
+
+	//merge the right leaf into the left one if they fit in one node.
+	//the root always keeps at least two leaves below it.
+	if (level > 1 || parent.getKeyCount() > 1) {
+		BTLeafNode merged = left;
+		bool fits = true;
+		for (int eid = 0; eid < right.getKeyCount() && fits; eid++) {
+			right.readEntry(eid, k, r);
+			fits = (merged.insert(k, r) == 0);
+		}
+
+		if (fits) {
+			merged.setNextNodePtr(right.getNextNodePtr());
+			rc = writeLeaf(leftPid, merged);
+			if(rc) return rc;
+			rc = setPrevLeaf(right.getNextNodePtr(), leftPid);
+			if(rc) return rc;
+			rc = freePage(rightPid);
+			if(rc) return rc;
+
+			parent.setCount(sep, parent.getCount(sep) + parent.getCount(sep + 1));
+			rc = parent.remove(sep);
+			if(rc) return rc;
+			return rebalanceNonLeaf(level, parent, path, slot);
+		}
+	}
+
+	//otherwise borrow the entries of one key from the sibling, unless it
+	//has none to spare. the entries of a key always stay in one leaf
+	BTLeafNode& sibling = (i > 0) ? left : right;
+	int count = sibling.getKeyCount();
+	int first = (i > 0) ? count - 1 : 0;
+	int key, run = 0;
+	sibling.readEntry(first, key, r);
+	while (run < count && sibling.readEntry(i > 0 ? first - run : run, k, r) == 0 && k == key)
+		run++;
+	if (count > run) {
+		//with subtree counts, the pairs moved go from one count to the other
+		int moved = 0;
+		if (format & BT_NONLEAF_COUNTS)
+			moved = (i > 0) ? leafWeight(left, count - run, count) : leafWeight(right, 0, run);
+		parent.setCount(sep, parent.getCount(sep) + ((i > 0) ? -moved : moved));
+		parent.setCount(sep + 1, parent.getCount(sep + 1) + ((i > 0) ? moved : -moved));
+
+		if (i > 0) {
+			for (int j = 0; j < run; j++) {
+				left.readEntry(first - j, k, r);
+				left.remove(first - j);
+				right.insert(k, r);
+			}
+			parent.setKey(sep, key);
+		} else {
+			for (int j = 0; j < run; j++) {
+				right.readEntry(0, k, r);
+				right.remove(0);
+				left.insert(k, r);
+			}
+			right.readEntry(0, k, r);
+			parent.setKey(sep, k);
+		}
+	}
+
+	rc = writeLeaf(leftPid, left);
+	if(rc) return rc;
+	rc = writeLeaf(rightPid, right);
+	if(rc) return rc;
+	return writeNonLeaf(path[level], parent);
+}
+
+/*
+ * Write a nonleaf node that lost a key. An underflowing node is merged
+ * with a sibling or borrows from it, and an empty root is replaced by
+ * its only child.
+ * @param level[IN] the level of the node (the root is level 1)
+ * @param node[IN] the node, not yet written
+ * @param path[IN] the nonleaf nodes from the root to the node
+ * @param slot[IN] the child pointer followed in each node of path
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rebalanceNonLeaf(int level, BTNonLeafNode& node, const PageId path[], const int slot[])
+{
+	int rc;
+
+	//shrink the tree when the root is left with a single child
+	if (level == 1) {
+		if (node.getKeyCount() > 0 || treeHeight <= 2)
+			return writeNonLeaf(path[1], node);
+
+		//the buffered pairs of the root go to its child
+		if (node.getBufferPtr() >= 0) {
+			BTNonLeafNode child(format);
+			rc = readNonLeaf(node.getChildPtr(0), 2, child);
+			if(rc) return rc;
+			rc = moveMessages(node, child, INT_MIN, INT_MAX);
+			if(rc) return rc;
+			rc = writeNonLeaf(node.getChildPtr(0), child);
+			if(rc) return rc;
+		}
+
+		latchPage(0);
+		rootPid = node.getChildPtr(0);
+		treeHeight--;
+		return freePage(path[1]);
+	}
+
+	if (!node.isUnderflow())
+		return writeNonLeaf(path[level], node);
+
+	BTNonLeafNode parent(format);
+	rc = readNonLeaf(path[level - 1], level - 1, parent);
+	if(rc) return rc;
+
+	//use the left sibling if there is one, otherwise the right sibling
+	int i = slot[level - 1];
+	int sep = (i > 0) ? i - 1 : i;
+	PageId leftPid = parent.getChildPtr(sep);
+	PageId rightPid = parent.getChildPtr(sep + 1);
+	BTNonLeafNode left(format), right(format);
+	if (i > 0) {
+		rc = readNonLeaf(leftPid, level, left);
+		right = node;
+	} else {
+		left = node;
+		rc = readNonLeaf(rightPid, level, right);
+	}
+	if(rc) return rc;
+
+	//merge the right node and the separator key into the left node
+	int leftCount = left.getKeyCount(), rightCount = right.getKeyCount();
+	if (leftCount + rightCount + 1 <= left.getMaxKeyCount()) {
+		left.insert(parent.getKey(sep), right.getChildPtr(0), right.getCount(0));
+		for (int j = 0; j < rightCount; j++)
+			left.insert(right.getKey(j), right.getChildPtr(j + 1), right.getCount(j + 1));
+		rc = moveMessages(right, left, INT_MIN, INT_MAX);
+		if(rc) return rc;
+
+		rc = writeNonLeaf(leftPid, left);
+		if(rc) return rc;
+		rc = freePage(rightPid);
+		if(rc) return rc;
+
+		parent.setCount(sep, parent.getCount(sep) + parent.getCount(sep + 1));
+		rc = parent.remove(sep);
+		if(rc) return rc;
+		return rebalanceNonLeaf(level - 1, parent, path, slot);
+	}
+
+	//otherwise rotate one child through the parent
+	int moved;
+	if (i > 0) {
+		moved = left.getCount(leftCount);
+		right.insertFirst(left.getChildPtr(leftCount), parent.getKey(sep), moved);
+		parent.setKey(sep, left.getKey(leftCount - 1));
+		rc = moveMessages(left, right, left.getKey(leftCount - 1), INT_MAX);
+		if(rc) return rc;
+		left.remove(leftCount - 1);
+		moved = -moved;
+	} else {
+		moved = right.getCount(0);
+		left.insert(parent.getKey(sep), right.getChildPtr(0), moved);
+		parent.setKey(sep, right.getKey(0));
+		rc = moveMessages(right, left, INT_MIN, right.getKey(0) - 1);
+		if(rc) return rc;
+		right.removeFirst();
+	}
+	parent.setCount(sep, parent.getCount(sep) + moved);
+	parent.setCount(sep + 1, parent.getCount(sep + 1) - moved);
+
+	rc = writeNonLeaf(leftPid, left);
+	if(rc) return rc;
+	rc = writeNonLeaf(rightPid, right);
+	if(rc) return rc;
+	return writeNonLeaf(path[level - 1], parent);
+}
+
+/**
+ * Run the standard B+Tree key search algorithm and identify the
+ * leaf node where searchKey may exist. If an index entry with
+ * searchKey exists in the leaf node, set IndexCursor to its location
+ * (i.e., IndexCursor.pid = PageId of the leaf node, and
+ * IndexCursor.eid = the searchKey index entry number.) and return 0.
+ * If not, set IndexCursor.pid = PageId of the leaf node and
+ * IndexCursor.eid = the index entry immediately after the largest
+ * index key that is smaller than searchKey, and return the error
+ * code RC_NO_SUCH_RECORD.
+ * Using the returned "IndexCursor", you will have to call readForward()
+ * to retrieve the actual (key, rid) pair from the index.
+ * @param key[IN] the key to find
+ * @param cursor[OUT] the cursor pointing to the index entry with
+ *                    searchKey or immediately behind the largest key
+ *                    smaller than searchKey.
+ * @return 0 if searchKey is found. Othewise an error code
+ */
+RC BTreeIndex::locate(int searchKey, IndexCursor& cursor)
+{
+	//the cursor reads the leaves only
+	RC rc = flushForRead();
+	if(rc) return rc;
+
+	cursor.root = -1;
+	cursor.height = 0;
+	return seek(searchKey, cursor, false);
+}
+
+/*
+ * Run locate() on the tree of a snapshot. readForward() and
+ * readBackward() go on reading the snapshot through the cursor.
+ * @param searchKey[IN] the key to find
+ * @param cursor[OUT] the cursor, as set by locate()
+ * @param snapshot[IN] a snapshot opened by openSnapshot()
+ * @return 0 if searchKey is found. Othewise, an error code
+ */
+RC BTreeIndex::locate(int searchKey, IndexCursor& cursor, const IndexSnapshot& snapshot)
+{
+	cursor.root = snapshot.rootPid;
+	cursor.height = snapshot.treeHeight;
+	if (snapshot.rootPid < 0) {
+		cursor.pid = -1;
+		cursor.eid = 0;
+		cursor.postPid = -1;
+		cursor.postEid = 0;
+		return RC_NO_SUCH_RECORD;
+	}
+	return seek(searchKey, cursor, false);
+}
+
+/*
+ * Open a snapshot of the tree as of the last committed write. Needs an
+ * index with BT_COPY_ON_WRITE.
+ * @param snapshot[OUT] the snapshot
+ * @return error code. RC_INVALID_FILE_FORMAT if the index is not
+ *         copied on write
+ */
+RC BTreeIndex::openSnapshot(IndexSnapshot& snapshot)
+{
+	if (!(format & BT_COPY_ON_WRITE))
+		return RC_INVALID_FILE_FORMAT;
+
+	pthread_mutex_lock(&snapLock);
+	snapshot.rootPid = snapRoot;
+	snapshot.treeHeight = snapHeight;
+	snapshot.epoch = epoch;
+	snapshots.insert(epoch);
+	pthread_mutex_unlock(&snapLock);
+	return 0;
+}
+
+/*
+ * Close a snapshot, letting later writes reuse the pages only it reads.
+ * @param snapshot[IN] a snapshot opened by openSnapshot()
+ */
+void BTreeIndex::closeSnapshot(const IndexSnapshot& snapshot)
+{
+	pthread_mutex_lock(&snapLock);
+	multiset<int>::iterator it = snapshots.find(snapshot.epoch);
+	if (it != snapshots.end())
+		snapshots.erase(it);
+	pthread_mutex_unlock(&snapLock);
+}
+
+/*
+ * Set the cursor to searchKey in the tree the cursor reads, as locate()
+ * or locateBackward() does.
+ * @param searchKey[IN] the key to find
+ * @param cursor[IN/OUT] the cursor, with its root and height set
+ * @param backward[IN] whether to set it as locateBackward() does
+ * @return error code, as returned by locate() or locateBackward()
+ */
+RC BTreeIndex::seek(int searchKey, IndexCursor& cursor, bool backward)
+{
+	int rc, k;
+	RecordId r;
+
+	cursor.postPid = -1;
+	cursor.postEid = 0;
+	cursor.key = searchKey;
+
+	BTLeafNode templeaf(format);
+	rc = findLeaf(searchKey, cursor.root, cursor.height, cursor.pid, templeaf, &cursor.version);
+	if (!backward)
+		return templeaf.locate(searchKey, cursor.eid);
+	if (rc || cursor.pid < 0)
+		return rc;
+
+	//step over the entries of searchKey, then back to the last one before
+	templeaf.locate(searchKey, cursor.eid);
+	while (templeaf.readEntry(cursor.eid, k, r) == 0 && k == searchKey)
+		cursor.eid++;
+	cursor.eid--;
+	if (cursor.eid < 0) {
+		cursor.version = 1;
+		return prevLeaf(templeaf, searchKey, cursor.pid, cursor.root, cursor.height);
+	}
+	return 0;
+}
+
+/*
+ * Give the root and the height of the current tree: the tree last
+ * published under BT_COPY_ON_WRITE, or the one in the header.
+ * @param root[OUT] the PageId of the root. -1 if the tree is empty
+ * @param height[OUT] the height of the tree
+ */
+void BTreeIndex::currentTree(PageId& root, int& height)
+{
+	if (format & BT_COPY_ON_WRITE) {
+		pthread_mutex_lock(&snapLock);
+		root = snapRoot;
+		height = snapHeight;
+		pthread_mutex_unlock(&snapLock);
+	} else {
+		root = rootPid;
+		height = treeHeight;
+	}
+}
+
+/*
+ * Descend from the root to the leaf where key belongs. Every node is
+ * copied at a stable version, and the version of its parent is checked
+ * after the copy: if a writer changed the parent meanwhile, the pointer
+ * followed may be stale and the descent starts over from the root.
+ * The header page, which holds the root, is the parent of the root. A
+ * published copy-on-write root is checked against the last one published
+ * instead, and the pages of a given root do not change at all.
+ * @param key[IN] the key to find
+ * @param root[IN] the root of the tree to read. -1 for the current tree
+ * @param height[IN] the height of the tree to read, if root is given
+ * @param pid[OUT] the PageId of the leaf. -1 if the tree is empty
+ * @param leaf[OUT] the leaf
+ * @param version[OUT] if not NULL, the version of the leaf
+ * @param below[OUT] if not NULL, the count of the pairs left of the path
+ * @param leafCount[OUT] if not NULL, the count of the pairs of the leaf
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::findLeaf(int key, PageId root, int height, PageId& pid, BTLeafNode& leaf,
+                        unsigned* version, int* below, int* leafCount)
+{
+	int rc;
+	unsigned nodeVersion, parentVersion = 0;
+	bool published = (root < 0 && (format & BT_COPY_ON_WRITE));
+
+	for (;;) {
+		PageId parent = -1;
+		if (root >= 0)
+			pid = root;
+		else if (published)
+			currentTree(pid, height);
+		else {
+			parent = 0;
+			parentVersion = readLatch(0);
+			pid = rootPid;
+			height = treeHeight;
+		}
+		PageId top = pid;
+		if (below) *below = 0;
+		if (leafCount) *leafCount = 0;
+		if (pid < 0) {
+			if (parent < 0 || validate(0, parentVersion))
+				return 0;
+			continue;
+		}
+
+		bool valid = true;
+		for (int level = 1; level < height; level++) {
+			BTNonLeafNode node(format);
+			rc = readNonLeaf(pid, level, node, &nodeVersion);
+			if (parent >= 0)
+				valid = validate(parent, parentVersion);
+			else if (published)
+				valid = (__atomic_load_n(&snapRoot, __ATOMIC_ACQUIRE) == top);
+			if (!valid) break;
+			if(rc) return rc;
+
+			int idx = node.locateChildIndex(key);
+			if (below)
+				for (int i = 0; i < idx; i++)
+					*below += node.getCount(i);
+			if (leafCount)
+				*leafCount = node.getCount(idx);
+			//the nodes of a given root are not checked at all
+			if (root < 0) {
+				parent = pid;
+				parentVersion = nodeVersion;
+			}
+			pid = node.getChildPtr(idx);
+		}
+		if (!valid)
+			continue;
+
+		rc = readLeaf(pid, leaf, version);
+		if (parent >= 0 ? validate(parent, parentVersion)
+		    : !published || __atomic_load_n(&snapRoot, __ATOMIC_ACQUIRE) == top)
+			return rc;
+	}
+}
+
+/*
+ * Count the (key, rid) pairs with lo <= key <= hi.
+ * @param lo[IN] the smallest key counted
+ * @param hi[IN] the largest key counted
+ * @param count[OUT] the number of pairs in the range
+ * @return error code. RC_INVALID_FILE_FORMAT if the index has no counts
+ */
+RC BTreeIndex::countRange(int lo, int hi, int& count)
+{
+	int rc, below;
+
+	count = 0;
+	if (!(format & BT_NONLEAF_COUNTS))
+		return RC_INVALID_FILE_FORMAT;
+	if (pf.endPid() == 1 || lo > hi)
+		return 0;
+
+	rc = countBelow(hi, true, count);
+	if(rc) return rc;
+	rc = countBelow(lo, false, below);
+	if(rc) return rc;
+	count -= below;
+	return 0;
+}
+
+/*
+ * Count the pairs with a key below the given one, adding up the counts of
+ * the children left of the path to the key and the entries before the key
+ * in its leaf.
+ * @param key[IN] the bound
+ * @param inclusive[IN] whether pairs with the key itself are counted
+ * @param count[OUT] the number of pairs
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::countBelow(int key, bool inclusive, int& count)
+{
+	int rc, parentCount = 0;
+	PageId pid;
+
+	BTLeafNode leaf(format);
+	rc = findLeaf(key, -1, 0, pid, leaf, NULL, &count, &parentCount);
+	if(rc) return rc;
+
+	//the entries of the key are adjacent, so skip them when inclusive
+	int eid, k, n = leaf.getKeyCount();
+	RecordId r;
+	leaf.locate(key, eid);
+	if (inclusive)
+		while (eid < n && leaf.readEntry(eid, k, r) == 0 && k == key)
+			eid++;
+
+	//add up the shorter side of the leaf, reading fewer posting lists
+	if (eid <= n / 2)
+		count += leafWeight(leaf, 0, eid);
+	else
+		count += parentCount - leafWeight(leaf, eid, n);
+	return 0;
+}
+
+//the nodes of a batch lookup on one level of the tree: the sorted probes
+//[lo, hi) go through the node pid, which was pointed to by the node parent
+//at version (parent is 0, the header page, for the root; -1 for a
+//published copy-on-write root)
+struct ProbeRange {
+	PageId   pid;
+	size_t   lo, hi;
+	PageId   parent;
+	unsigned version;
+};
+
+/*
+ * Look up a batch of keys, walking the tree once for all of them.
+ * The probes are sorted and handed down one level at a time, each node
+ * splitting its probes among its children, so every node on the paths of
+ * the keys is read once. The lookups advance in lock-step, and the pages
+ * of a level are all prefetched before the first of them is read.
+ * The probes of a node whose parent a writer changed meanwhile are looked
+ * up one by one instead.
+ * @param keys[IN] the keys to look up, in any order and possibly repeated
+ * @param k[IN] the number of keys
+ * @param rids[OUT] the RecordIds found: those of keys[i] are
+ *                  rids[first[i]] to rids[first[i+1]-1]
+ * @param first[OUT] k+1 offsets into rids
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::locateMany(const int* keys, size_t k, vector<RecordId>& rids,
+                          vector<size_t>& first)
+{
+	int rc, height;
+	unsigned version;
+	bool published = (format & BT_COPY_ON_WRITE);
+
+	rc = flushForRead();
+	if(rc) return rc;
+
+	//sort the probes by key, keeping the position of each
+	vector<pair<int, size_t> > probes(k);
+	for (size_t i = 0; i < k; i++)
+		probes[i] = make_pair(keys[i], i);
+	sort(probes.begin(), probes.end());
+
+	ProbeRange top = { -1, 0, k, -1, 0 };
+	if (published)
+		currentTree(top.pid, height);
+	else {
+		top.parent = 0;
+		top.version = readLatch(0);
+		top.pid = rootPid;
+		height = treeHeight;
+	}
+	PageId root = top.pid;
+
+	vector<vector<RecordId> > found(k);
+	vector<ProbeRange> nodes, children;
+	vector<size_t> retry;
+	if (root >= 0 && k > 0)
+		nodes.push_back(top);
+	else if (top.parent == 0 && !validate(0, top.version))
+		for (size_t j = 0; j < k; j++)
+			retry.push_back(j);
+
+	for (int level = 1; level < height; level++) {
+		children.clear();
+		for (size_t i = 0; i < nodes.size(); i++) {
+			ProbeRange& r = nodes[i];
+			BTNonLeafNode node(format);
+			rc = readNonLeaf(r.pid, level, node, &version);
+			if (r.parent >= 0 ? !validate(r.parent, r.version)
+			    : __atomic_load_n(&snapRoot, __ATOMIC_ACQUIRE) != root) {
+				for (size_t j = r.lo; j < r.hi; j++)
+					retry.push_back(j);
+				continue;
+			}
+			if(rc) return rc;
+
+			//the probes below the next separator key share a child
+			int keyCount = node.getKeyCount();
+			for (size_t j = r.lo; j < r.hi; ) {
+				int idx = node.locateChildIndex(probes[j].first);
+				size_t end = j + 1;
+				if (idx == keyCount)
+					end = r.hi;
+				else
+					while (end < r.hi && probes[end].first < node.getKey(idx))
+						end++;
+				ProbeRange child = { node.getChildPtr(idx), j, end, r.pid, version };
+				children.push_back(child);
+				j = end;
+			}
+		}
+		nodes.swap(children);
+
+		//start reading all nodes of the next level before waiting on
+		//any of them, so the page reads of the batch overlap. the pinned
+		//nonleaf levels are served from memory
+		if (!nodes.empty() && (level + 1 == height || level + 1 > PINNED_LEVELS)) {
+			vector<PageId> pids(nodes.size());
+			for (size_t i = 0; i < nodes.size(); i++)
+				pids[i] = physical(nodes[i].pid);
+			pf.prefetch(&pids[0], pids.size());
+		}
+	}
+
+	//the entries of a key are kept in one leaf
+	for (size_t i = 0; i < nodes.size(); i++) {
+		ProbeRange& r = nodes[i];
+		BTLeafNode leaf(format);
+		rc = readLeaf(r.pid, leaf);
+		if (r.parent >= 0 ? !validate(r.parent, r.version)
+		    : __atomic_load_n(&snapRoot, __ATOMIC_ACQUIRE) != root) {
+			for (size_t j = r.lo; j < r.hi; j++)
+				retry.push_back(j);
+			continue;
+		}
+		if(rc) return rc;
+
+		for (size_t j = r.lo; j < r.hi; j++) {
+			if (j > r.lo && probes[j].first == probes[j - 1].first)
+				found[probes[j].second] = found[probes[j - 1].second];
+			else {
+				rc = readKeyRids(leaf, probes[j].first, found[probes[j].second]);
+				if(rc) return rc;
+			}
+		}
+	}
+
+	//look up the probes of the changed nodes through their own descents
+	for (size_t i = 0; i < retry.size(); i++) {
+		PageId pid;
+		BTLeafNode leaf(format);
+		int key = probes[retry[i]].first;
+		vector<RecordId>& list = found[probes[retry[i]].second];
+		list.clear();
+		rc = findLeaf(key, -1, 0, pid, leaf);
+		if(rc) return rc;
+		if (pid >= 0) {
+			rc = readKeyRids(leaf, key, list);
+			if(rc) return rc;
+		}
+	}
+
+	//lay the RecordIds out in the order of the keys
+	rids.clear();
+	first.resize(k + 1);
+	for (size_t i = 0; i < k; i++) {
+		first[i] = rids.size();
+		rids.insert(rids.end(), found[i].begin(), found[i].end());
+	}
+	first[k] = rids.size();
+	return 0;
+}
+
+/*
+ * Measure the shape of the tree by reading every node, a level at a time
+ * and each level in key order.
+ * @param stats[OUT] the shape of the tree
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::getStats(IndexStats& stats)
+{
+	int rc, height;
+	PageId root;
+	vector<PageId> nodes, children;
+
+	currentTree(root, height);
+	stats.height = height;
+	stats.leafCount = 0;
+	stats.nonLeafCount = 0;
+	stats.leafFill = 0;
+	stats.leafSeeks = 0;
+	if (root < 0)
+		return 0;
+
+	nodes.push_back(root);
+	for (int level = 1; level < height; level++) {
+		children.clear();
+		for (size_t i = 0; i < nodes.size(); i++) {
+			BTNonLeafNode node(format);
+			rc = readNonLeaf(nodes[i], level, node);
+			if(rc) return rc;
+			for (int j = 0; j <= node.getKeyCount(); j++)
+				children.push_back(node.getChildPtr(j));
+		}
+		stats.nonLeafCount += nodes.size();
+		nodes.swap(children);
+	}
+
+	long fill = 0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		BTLeafNode leaf(format);
+		rc = readLeaf(nodes[i], leaf);
+		if(rc) return rc;
+		fill += leaf.getFill();
+		if (i > 0 && nodes[i] < nodes[i - 1])
+			stats.leafSeeks++;
+	}
+	stats.leafCount = nodes.size();
+	stats.leafFill = fill / stats.leafCount;
+	return 0;
+}
+
+/*
+ * Rewrite an index in key order with IndexBuilder and put the new file
+ * in place of the old one. The old file is only read, so readers keep
+ * using it meanwhile, and the new one takes over its name in a single
+ * rename; readers that opened the old file read it until they close it.
+ * Writes to the old file during the rebuild are lost.
+ * @param indexname[IN] the name of the index file
+ * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+ * @param before[OUT] the shape of the old tree
+ * @param after[OUT] the shape of the new tree
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rebuild(const string& indexname, int fill, IndexStats& before,
+                       IndexStats& after)
+{
+	int rc;
+	BTreeIndex old, fresh;
+	string temp = indexname + ".new";
+
+	rc = old.open(indexname, 'r');
+	if(rc) return rc;
+	rc = old.getStats(before);
+
+	//the new tree goes to a file of its own, in the format of the old one
+	::remove(temp.c_str());
+	if (rc == 0)
+		rc = fresh.open(temp, 'w', old.format);
+	if (rc) {
+		old.close();
+		return rc;
+	}
+
+	//IndexScanner also returns the pairs still in insert buffers
+	IndexScanner scanner;
+	IndexBuilder builder;
+	int keys [MAX_KEY_NUM], count;
+	RecordId rids [MAX_KEY_NUM];
+	rc = scanner.open(old, INT_MIN, INT_MAX);
+	if (rc == 0)
+		rc = builder.open(fresh, fill);
+	while (rc == 0 && (rc = scanner.next(keys, rids, MAX_KEY_NUM, count)) == 0)
+		for (int i = 0; i < count && rc == 0; i++)
+			rc = builder.add(keys[i], rids[i]);
+	if (rc == RC_END_OF_TREE)
+		rc = builder.close();
+	if (rc == 0)
+		rc = fresh.getStats(after);
+
+	if (fresh.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	old.close();
+	if (rc == 0 && ::rename(temp.c_str(), indexname.c_str()) < 0)
+		rc = RC_FILE_WRITE_FAILED;
+	if (rc) {
+		::remove(temp.c_str());
+		return rc;
+	}
+
+	//no one opens either file by its pinned name again, and a later file
+	//may get its inode number back
+	pthread_rwlock_wrlock(&pinLock);
+	int slot = old.pinSlot(false);
+	if (slot >= 0) {
+		pinned[slot].name.clear();
+		pinned[slot].count = 0;
+	}
+	slot = fresh.pinSlot(false);
+	if (slot >= 0) {
+		pinned[slot].name.clear();
+		pinned[slot].count = 0;
+	}
+	pthread_rwlock_unlock(&pinLock);
+	return 0;
 }
 
 /*
  * Read the (key, rid) pair at the location specified by the index cursor,
  * and move foward the cursor to the next entry.
  * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
- * @param key[OUT] the key stored at the index cursor location.
- * @param rid[OUT] the RecordId stored at the index cursor location.
+ * @param key[OUT] the key stored at the index cursor location.
+ * @param rid[OUT] the RecordId stored at the index cursor location.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid)
+{
+	int rc;
+	unsigned version;
+
+	//create temporary node, passing over empty leaves. if a writer moved
+	//the entries since the cursor was set, set it again by its key
+	BTLeafNode tempnode(format);
+	for (;;) {
+		if (cursor.pid < 0)
+			return RC_END_OF_TREE;
+		rc = readLeaf(cursor.pid, tempnode, &version);
+		if(rc) return rc;
+		if (!(cursor.version & 1) && version != cursor.version) {
+			seek(cursor.key, cursor, false);
+			continue;
+		}
+		if (cursor.eid < tempnode.getKeyCount())
+			break;
+		rc = nextLeaf(tempnode, cursor.key, cursor.pid, cursor.root, cursor.height);
+		if(rc) return rc;
+		cursor.eid = 0;
+		cursor.version = 1;
+	}
+
+	//store eid
+	int mEid = cursor.eid;
+
+	rc = tempnode.readEntry(mEid, key, rid);
+	if(rc) return rc;
+	cursor.key = key;
+	cursor.version = version;
+
+	//step through the posting list of a key before moving to the next entry
+	if (rid.sid == BT_POSTING_SID) {
+		if (cursor.postPid < 0) {
+			cursor.postPid = rid.pid;
+			cursor.postEid = 0;
+		}
+
+		BTPostingNode posting;
+		RecordId rids [BTPostingNode::MAX_RID_NUM];
+		rc = readPostingNode(cursor.postPid, posting);
+		if(rc) return rc;
+		int postCount = posting.readAll(rids);
+		rid = rids[cursor.postEid++];
+		if (cursor.postEid < postCount)
+			return 0;
+		cursor.postPid = posting.getNextNodePtr();
+		cursor.postEid = 0;
+		if (cursor.postPid >= 0)
+			return 0;
+	}
+
+	if(tempnode.getKeyCount() <= mEid+1) {
+		PageId tempId;
+		rc = nextLeaf(tempnode, key, tempId, cursor.root, cursor.height);
+		if(rc) return rc;
+		cursor.pid = tempId;
+		cursor.eid = 0;
+		cursor.version = 1;
+	} else {
+		RecordId r;
+		cursor.eid++;
+		tempnode.readEntry(cursor.eid, cursor.key, r);
+	}
+
+    return 0;
+}
+
+/*
+ * Set the cursor to the last index entry with a key <= searchKey, for
+ * reading the index backward with readBackward().
+ * @param searchKey[IN] the largest key to read
+ * @param cursor[OUT] the cursor pointing to the entry. its eid is -1 if
+ *                    the entry is the last one of the leaf cursor.pid
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::locateBackward(int searchKey, IndexCursor& cursor)
+{
+	RC rc = flushForRead();
+	if(rc) return rc;
+
+	cursor.root = -1;
+	cursor.height = 0;
+	return seek(searchKey, cursor, true);
+}
+
+/*
+ * Read the (key, rid) pair at the location specified by the index cursor,
+ * and move the cursor to the entry before it. The RecordIds of a key with
+ * a posting list are read in their stored order before moving on.
+ * @param cursor[IN/OUT] the cursor set by locateBackward() or locate()
+ * @param key[OUT] the key stored at the index cursor location
+ * @param rid[OUT] the RecordId stored at the index cursor location
+ * @return 0 if a pair was read. RC_END_OF_TREE if the cursor is in front
+ *         of the first entry. Otherwise an error code.
+ */
+RC BTreeIndex::readBackward(IndexCursor& cursor, int& key, RecordId& rid)
+{
+	int rc;
+	unsigned version;
+	BTLeafNode leaf(format);
+
+	//find the entry under the cursor, passing over empty leaves. an eid
+	//behind the entries stands for the last one. if a writer moved the
+	//entries since the cursor was set, set it again by its key
+	for (;;) {
+		if (cursor.pid < 0)
+			return RC_END_OF_TREE;
+		rc = readLeaf(cursor.pid, leaf, &version);
+		if(rc) return rc;
+		if (!(cursor.version & 1) && version != cursor.version) {
+			rc = seek(cursor.key, cursor, true);
+			if(rc) return rc;
+			continue;
+		}
+		int keyCount = leaf.getKeyCount();
+		if (cursor.eid < 0 || cursor.eid >= keyCount)
+			cursor.eid = keyCount - 1;
+		if (cursor.eid >= 0)
+			break;
+		cursor.version = 1;
+		rc = prevLeaf(leaf, cursor.key, cursor.pid, cursor.root, cursor.height);
+		if(rc) return rc;
+	}
+
+	rc = leaf.readEntry(cursor.eid, key, rid);
+	if(rc) return rc;
+	cursor.key = key;
+	cursor.version = version;
+
+	//step through the posting list of a key before moving to the entry before
+	if (rid.sid == BT_POSTING_SID) {
+		if (cursor.postPid < 0) {
+			cursor.postPid = rid.pid;
+			cursor.postEid = 0;
+		}
+
+		BTPostingNode posting;
+		RecordId rids [BTPostingNode::MAX_RID_NUM];
+		rc = readPostingNode(cursor.postPid, posting);
+		if(rc) return rc;
+		int postCount = posting.readAll(rids);
+		rid = rids[cursor.postEid++];
+		if (cursor.postEid < postCount)
+			return 0;
+		cursor.postPid = posting.getNextNodePtr();
+		cursor.postEid = 0;
+		if (cursor.postPid >= 0)
+			return 0;
+	}
+
+	if (cursor.eid > 0) {
+		RecordId r;
+		cursor.eid--;
+		leaf.readEntry(cursor.eid, cursor.key, r);
+		return 0;
+	}
+	cursor.eid = -1;
+	cursor.version = 1;
+	return prevLeaf(leaf, cursor.key, cursor.pid, cursor.root, cursor.height);
+}
+
+/*
+ * Descend a tree along a key, remembering the nonleaf nodes passed and
+ * the child followed in each, for stepPath().
+ * @param key[IN] the key to follow
+ * @param root[IN] the root of the tree. must not be -1
+ * @param height[IN] the height of the tree
+ * @param path[OUT] the nonleaf nodes from the root, indexed by level
+ * @param slot[OUT] the child pointer followed in each node of path
+ * @param pid[OUT] the PageId of the leaf reached
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::findPath(int key, PageId root, int height, PageId path[], int slot[], PageId& pid)
+{
+	int rc;
+
+	pid = root;
+	for (int level = 1; level < height; level++) {
+		BTNonLeafNode node(format);
+		rc = readNonLeaf(pid, level, node);
+		if(rc) return rc;
+		path[level] = pid;
+		slot[level] = node.locateChildIndex(key);
+		pid = node.getChildPtr(slot[level]);
+	}
+	return 0;
+}
+
+/*
+ * Move a path from the root to the leaf beside its leaf: up to the lowest
+ * node with a child on that side of the path, then down the near edge of
+ * that child. Only the nodes of the path are read, so a scan crosses the
+ * leaves without descending from the root again for each of them.
+ * @param path[IN/OUT] the nonleaf nodes from the root, as set by findPath()
+ * @param slot[IN/OUT] the child pointer followed in each node of path
+ * @param height[IN] the height of the tree
+ * @param forward[IN] true for the leaf behind, false for the leaf in front
+ * @param pid[OUT] the PageId of the leaf. -1 if there is none
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::stepPath(PageId path[], int slot[], int height, bool forward, PageId& pid)
+{
+	int rc, level;
+	BTNonLeafNode node(format);
+
+	pid = -1;
+	for (level = height - 1; level >= 1; level--) {
+		rc = readNonLeaf(path[level], level, node);
+		if(rc) return rc;
+		if (forward ? slot[level] < node.getKeyCount() : slot[level] > 0)
+			break;
+	}
+	if (level < 1)
+		return 0;
+
+	slot[level] += forward ? 1 : -1;
+	PageId child = node.getChildPtr(slot[level]);
+	for (level++; level < height; level++) {
+		rc = readNonLeaf(child, level, node);
+		if(rc) return rc;
+		path[level] = child;
+		slot[level] = forward ? 0 : node.getKeyCount();
+		child = node.getChildPtr(slot[level]);
+	}
+	pid = child;
+	return 0;
+}
+
+/*
+ * Find the leaf beside a leaf by descending the tree along a key of the
+ * leaf and stepping the path over, passing over the leaves that removes
+ * emptied.
+ * @param leaf[IN] the leaf
+ * @param key[IN] a key that leads to the leaf, used if it is empty
+ * @param pid[OUT] the PageId of the leaf beside. -1 if there is none
+ * @param root[IN] the root of the tree read. -1 for the current tree
+ * @param height[IN] the height of the tree read
+ * @param forward[IN] true for the leaf behind, false for the leaf in front
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::siblingLeaf(BTLeafNode& leaf, int key, PageId& pid, PageId root, int height,
+                           bool forward)
+{
+	int rc;
+	RecordId r;
+	PageId path[MAX_TREE_HEIGHT];
+	int slot[MAX_TREE_HEIGHT];
+
+	pid = -1;
+	leaf.readEntry(0, key, r);
+	if (root < 0)
+		currentTree(root, height);
+	if (root < 0)
+		return 0;
+	rc = findPath(key, root, height, path, slot, pid);
+	if(rc) return rc;
+
+	BTLeafNode sibling(format);
+	do {
+		rc = stepPath(path, slot, height, forward, pid);
+		if(rc) return rc;
+		if (pid < 0)
+			return 0;
+		rc = readLeaf(pid, sibling);
+		if(rc) return rc;
+	} while (sibling.getKeyCount() == 0);
+	return 0;
+}
+
+/*
+ * Find the leaf in front of a leaf. Without BT_LEAF_PREV the tree is
+ * descended again along the first key of the leaf, and the leaf in front
+ * is the rightmost nonempty one left of that path.
+ * @param leaf[IN] the leaf
+ * @param key[IN] a key that leads to the leaf, used if it is empty
+ * @param pid[OUT] the PageId of the leaf in front. -1 if there is none
+ * @param root[IN] the root of the tree read. -1 for the current tree
+ * @param height[IN] the height of the tree read
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::prevLeaf(BTLeafNode& leaf, int key, PageId& pid, PageId root, int height)
+{
+	if (format & BT_LEAF_PREV) {
+		pid = leaf.getPrevNodePtr();
+		return 0;
+	}
+	return siblingLeaf(leaf, key, pid, root, height, false);
+}
+
+/*
+ * Find the leaf behind a leaf. Under BT_COPY_ON_WRITE the sibling pointers
+ * are not kept, so the tree is descended along the first key of the leaf,
+ * and the leaf behind is the leftmost nonempty one right of that path.
+ * @param leaf[IN] the leaf
+ * @param key[IN] a key that leads to the leaf, used if it is empty
+ * @param pid[OUT] the PageId of the leaf behind. -1 if there is none
+ * @param root[IN] the root of the tree read. -1 for the current tree
+ * @param height[IN] the height of the tree read
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::nextLeaf(BTLeafNode& leaf, int key, PageId& pid, PageId root, int height)
+{
+	if (!(format & BT_COPY_ON_WRITE)) {
+		pid = leaf.getNextNodePtr();
+		return 0;
+	}
+	return siblingLeaf(leaf, key, pid, root, height, true);
+}
+
+/*
+ * Point the leaf pid back at the leaf prev. Does nothing without
+ * BT_LEAF_PREV or if pid is -1.
+ * @param pid[IN] the PageId of the leaf
+ * @param prev[IN] the PageId of the leaf in front of it
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::setPrevLeaf(PageId pid, PageId prev)
+{
+	int rc;
+
+	if (!(format & BT_LEAF_PREV) || pid < 0)
+		return 0;
+	BTLeafNode leaf(format);
+	rc = readLeaf(pid, leaf);
+	if(rc) return rc;
+	leaf.setPrevNodePtr(prev);
+	return writeLeaf(pid, leaf);
+}
+
+/*
+ * Read up to n (key, rid) pairs starting at the location specified by
+ * the index cursor, crossing leaf nodes as needed, and move the cursor
+ * behind the last pair read.
+ * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+ * @param keys[OUT] the keys read
+ * @param rids[OUT] the RecordIds read
+ * @param n[IN] the maximum number of pairs to read
+ * @param count[OUT] the number of pairs read
+ * @return 0 if at least one pair was read. RC_END_OF_TREE if the cursor
+ *         is at the end of the tree. Otherwise an error code.
+ */
+RC BTreeIndex::readForward(IndexCursor& cursor, int keys[], RecordId rids[], int n, int& count)
+{
+	int rc;
+	BTLeafNode tempnode(format);
+	BTPostingNode posting;
+	RecordId postRids [BTPostingNode::MAX_RID_NUM];
+
+	count = 0;
+	while (count < n && cursor.pid >= 0) {
+		unsigned version;
+		rc = readLeaf(cursor.pid, tempnode, &version);
+		if(rc) return rc;
+
+		//if a writer moved the entries since the cursor was set, set it
+		//again by its key
+		if (!(cursor.version & 1) && version != cursor.version) {
+			seek(cursor.key, cursor, false);
+			continue;
+		}
+
+		//copy as many entries of this leaf as fit
+		int keyCount = tempnode.getKeyCount();
+		while (count < n && cursor.eid < keyCount) {
+			rc = tempnode.readEntry(cursor.eid, keys[count], rids[count]);
+			if(rc) return rc;
+
+			//expand a posting list one page at a time
+			if (rids[count].sid == BT_POSTING_SID) {
+				int key = keys[count];
+				if (cursor.postPid < 0) {
+					cursor.postPid = rids[count].pid;
+					cursor.postEid = 0;
+				}
+				while (count < n && cursor.postPid >= 0) {
+					rc = readPostingNode(cursor.postPid, posting);
+					if(rc) return rc;
+					int postCount = posting.readAll(postRids);
+					while (count < n && cursor.postEid < postCount) {
+						keys[count] = key;
+						rids[count++] = postRids[cursor.postEid++];
+					}
+					if (cursor.postEid >= postCount) {
+						cursor.postPid = posting.getNextNodePtr();
+						cursor.postEid = 0;
+					}
+				}
+				if (cursor.postPid < 0)
+					cursor.eid++;
+				continue;
+			}
+
+			cursor.eid++;
+			count++;
+		}
+
+		//move to the next leaf if this one is used up
+		if (cursor.eid >= keyCount) {
+			rc = nextLeaf(tempnode, cursor.key, cursor.pid, cursor.root, cursor.height);
+			if(rc) return rc;
+			cursor.eid = 0;
+			cursor.version = 1;
+			if (count > 0)
+				cursor.key = keys[count - 1];
+		} else {
+			RecordId r;
+			tempnode.readEntry(cursor.eid, cursor.key, r);
+			cursor.version = version;
+		}
+	}
+
+	return (count > 0) ? 0 : RC_END_OF_TREE;
+}
+
+/*
+ * IndexScanner constructor
+ */
+IndexScanner::IndexScanner()
+{
+	index = NULL;
+	snapped = false;
+	pid = -1;
+	eid = 0;
+	keyCount = 0;
+	postEid = 0;
+	postCount = 0;
+	postNext = -1;
+	pendEid = 0;
+}
+
+IndexScanner::~IndexScanner()
+{
+	finish();
+}
+
+/*
+ * Position the scanner at the first entry with key >= lowKey.
+ * The scan ends after the last entry with key <= highKey.
+ * @param index[IN] an open index to scan
+ * @param lowKey[IN] the smallest key to return
+ * @param highKey[IN] the largest key to return
  * @return error code. 0 if no error
  */
-RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid)
+RC IndexScanner::open(BTreeIndex& index, int lowKey, int highKey)
 {
 	int rc;
+	IndexCursor cursor;
+
+	finish();
+	this->index = &index;
+	this->highKey = highKey;
+	leaf = BTLeafNode(index.format);
+	keyCount = 0;
+	postEid = 0;
+	postCount = 0;
+	postNext = -1;
+
+	//the buffered pairs of the range are merged into the scan by key
+	pending.clear();
+	pendEid = 0;
+	if (index.format & BT_BUFFERED) {
+		rc = index.collectMessages(lowKey, highKey, pending);
+		if(rc) return rc;
+		stable_sort(pending.begin(), pending.end(), messageLess);
+	}
 
-	//store pid and eid
-	PageId mPid = cursor.pid;
-	int mEid = cursor.eid;
+	//the leaves of a copy-on-write tree have no sibling pointers, so the
+	//scan keeps the path from the root of one snapshot, which later
+	//writes do not change, and steps it from leaf to leaf
+	if (index.format & BT_COPY_ON_WRITE) {
+		rc = index.openSnapshot(snapshot);
+		if(rc) return rc;
+		snapped = true;
+		cursor.pid = -1;
+		cursor.eid = 0;
+		if (snapshot.rootPid >= 0) {
+			path.resize(snapshot.treeHeight);
+			slot.resize(snapshot.treeHeight);
+			rc = index.findPath(lowKey, snapshot.rootPid, snapshot.treeHeight,
+			                    &path[0], &slot[0], cursor.pid);
+			if(rc) return rc;
+		}
+	} else {
+		//the buffered pairs were collected above, so the leaves are read
+		//as they are, without flushing them there
+		cursor.root = -1;
+		cursor.height = 0;
+		index.seek(lowKey, cursor, false);
+	}
 
-	//create buffer
-	char temp [PAGE_SIZE];
-	char* idx = temp;
+	//an empty tree has nothing to scan
+	this->lowKey = lowKey;
+	pid = cursor.pid;
+	eid = cursor.eid;
+	if (pid < 0 || (!snapped && index.rootPid == -1)) {
+		finish();
+		return 0;
+	}
 
-	//create temporary node
-	BTLeafNode tempnode;
-	rc = tempnode.read(mPid, pf);
+	rc = index.readLeaf(pid, leaf);
 	if(rc) return rc;
+	keyCount = leaf.getKeyCount();
+	if (snapped)
+		leaf.locate(lowKey, eid);
+	return 0;
+}
 
-	rc = tempnode.readEntry(mEid, key, rid);
+/*
+ * Read the (key, rid) pair at the scanner position and move forward.
+ * @param key[OUT] the key of the entry
+ * @param rid[OUT] the RecordId of the entry
+ * @return 0 if an entry was read. RC_END_OF_TREE after the last entry
+ *         of the range. Otherwise an error code.
+ */
+RC IndexScanner::next(int& key, RecordId& rid)
+{
+	int rc;
+
+	//finish the posting list being read first
+	if (postEid < postCount || postNext >= 0) {
+		if (postEid >= postCount) {
+			rc = readPosting(postNext);
+			if(rc) return rc;
+		}
+		key = postKey;
+		rid = posting[postEid++];
+		return 0;
+	}
+
+	rc = nextLeaf();
+	if (rc == 0)
+		rc = leaf.readEntry(eid, key, rid);
+	if (rc && rc != RC_END_OF_TREE) return rc;
+
+	//a buffered pair goes before the entries with a larger key
+	if (pendEid < pending.size() && (rc == RC_END_OF_TREE || pending[pendEid].first <= key)) {
+		key = pending[pendEid].first;
+		rid = pending[pendEid++].second;
+		return 0;
+	}
 	if(rc) return rc;
 
-	
-	if(mEid == 84 || tempnode.getKeyCount() == mEid+1) {
-		PageId tempId;
-		tempId = tempnode.getNextNodePtr();
-		cursor.pid = tempId;
-		cursor.eid = 0;
-	} else {
-		cursor.eid++;
+	//stop at the upper bound without moving past it
+	if (key > highKey) {
+		finish();
+		return RC_END_OF_TREE;
 	}
 
-    return 0;
+	eid++;
+	if (rid.sid == BT_POSTING_SID) {
+		postKey = key;
+		rc = readPosting(rid.pid);
+		if(rc) return rc;
+		rid = posting[postEid++];
+	}
+	return 0;
+}
+
+/*
+ * Read up to n (key, rid) pairs from the scanner position and move forward.
+ * @param keys[OUT] the keys read
+ * @param rids[OUT] the RecordIds read
+ * @param n[IN] the maximum number of pairs to read
+ * @param count[OUT] the number of pairs read
+ * @return 0 if at least one pair was read. RC_END_OF_TREE after the last
+ *         entry of the range. Otherwise an error code.
+ */
+RC IndexScanner::next(int keys[], RecordId rids[], int n, int& count)
+{
+	int rc = 0;
+
+	count = 0;
+	while (count < n) {
+		//copy the posting list being read
+		if (postEid < postCount || postNext >= 0) {
+			if (postEid >= postCount) {
+				rc = readPosting(postNext);
+				if(rc) return rc;
+			}
+			while (count < n && postEid < postCount) {
+				keys[count] = postKey;
+				rids[count++] = posting[postEid++];
+			}
+			continue;
+		}
+
+		rc = nextLeaf();
+		if (rc == RC_END_OF_TREE && pendEid < pending.size()) {
+			//the buffered pairs behind the last entry
+			while (count < n && pendEid < pending.size()) {
+				keys[count] = pending[pendEid].first;
+				rids[count++] = pending[pendEid++].second;
+			}
+			continue;
+		}
+		if(rc) break;
+
+		//copy entries straight out of the leaf in memory
+		while (count < n && eid < keyCount) {
+			rc = leaf.readEntry(eid, keys[count], rids[count]);
+			if(rc) return rc;
+
+			//a buffered pair goes before the entries with a larger key
+			if (pendEid < pending.size() && pending[pendEid].first <= keys[count]) {
+				keys[count] = pending[pendEid].first;
+				rids[count++] = pending[pendEid++].second;
+				continue;
+			}
+
+			//stop at the upper bound without moving past it
+			if (keys[count] > highKey) {
+				finish();
+				return (count > 0) ? 0 : RC_END_OF_TREE;
+			}
+			eid++;
+
+			//a posting list is copied on the next round
+			if (rids[count].sid == BT_POSTING_SID) {
+				postKey = keys[count];
+				rc = readPosting(rids[count].pid);
+				if(rc) return rc;
+				break;
+			}
+			count++;
+		}
+	}
+
+	if (count > 0) return 0;
+	return rc;
+}
+
+/*
+ * Move to the next leaf node that has entries, if the current one is used up.
+ * @return 0 if an entry is available. RC_END_OF_TREE after the last leaf.
+ */
+RC IndexScanner::nextLeaf()
+{
+	int rc;
+
+	//follow the sibling pointer only when the leaf is used up
+	while (eid >= keyCount) {
+		if (pid < 0)
+			return RC_END_OF_TREE;
+		if (snapped)
+			rc = index->stepPath(&path[0], &slot[0], snapshot.treeHeight, true, pid);
+		else
+			rc = index->nextLeaf(leaf, lowKey, pid, -1, 0);
+		if(rc) return rc;
+		eid = 0;
+		keyCount = 0;
+		if (pid < 0) {
+			finish();
+			return RC_END_OF_TREE;
+		}
+
+		rc = index->readLeaf(pid, leaf);
+		if(rc) return rc;
+		keyCount = leaf.getKeyCount();
+	}
+	return 0;
+}
+
+/*
+ * End the scan, closing the snapshot it reads, if any.
+ */
+void IndexScanner::finish()
+{
+	pid = -1;
+	keyCount = 0;
+	if (snapped) {
+		index->closeSnapshot(snapshot);
+		snapped = false;
+	}
+}
+
+/*
+ * Load the RecordIds of a posting list page.
+ * @param pid[IN] the PageId of the posting list page
+ * @return error code. 0 if no error
+ */
+RC IndexScanner::readPosting(PageId pid)
+{
+	int rc;
+	BTPostingNode node;
+
+	rc = index->readPostingNode(pid, node);
+	if(rc) return rc;
+	postCount = node.readAll(posting);
+	postEid = 0;
+	postNext = node.getNextNodePtr();
+	return 0;
+}
+
+/*
+ * IndexBuilder constructor
+ */
+IndexBuilder::IndexBuilder()
+{
+	index = NULL;
+	fill = 100;
+	nextPid = -1;
+	shared = NULL;
+	chunkEnd = -1;
+	leafPid = -1;
+	leafCount = 0;
+	key = 0;
+}
+
+/*
+ * Start building the tree of an index.
+ * @param index[IN] an index opened in write mode, with an empty tree
+ * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+ * @return error code. RC_INVALID_FILE_FORMAT if the tree is not empty
+ */
+RC IndexBuilder::open(BTreeIndex& index, int fill)
+{
+	return start(index, fill, NULL);
+}
+
+/*
+ * Add a (key, rid) pair to the tree.
+ * @param key[IN] the key, not smaller than the one added before
+ * @param rid[IN] the RecordId
+ * @return error code. 0 if no error
+ */
+RC IndexBuilder::add(int key, const RecordId& rid)
+{
+	int rc;
+
+	//the RecordIds of a key are gathered before it goes to the leaf
+	if (!rids.empty() && key != this->key) {
+		rc = addKey();
+		if(rc) return rc;
+	}
+	this->key = key;
+	rids.push_back(rid);
+	return 0;
+}
+
+/*
+ * Write the last leaf and the nonleaf levels, and make the tree the
+ * tree of the index.
+ * @return error code. 0 if no error
+ */
+RC IndexBuilder::close()
+{
+	int rc = endLeaves();
+	if(rc) return rc;
+
+	//with no pair added the tree stays empty
+	if (nodes.empty())
+		return 0;
+	return stack();
+}
+
+//the share of build() that one thread sorts and writes: the pairs with
+//lo <= key < hi, where no bound is checked for the first and last ranges
+struct BuildTask {
+	IndexBuilder builder;
+	const vector<pair<int, RecordId> >* pairs;
+	int         lo, hi;
+	bool        first, last;
+	RC          rc;
+};
+
+/*
+ * Build the tree of an empty index from pairs in any order.
+ * @param index[IN] an index opened in write mode, with an empty tree
+ * @param pairs[IN] the pairs, sorted by key on return
+ * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+ * @param threads[IN] the number of threads to sort and write with
+ * @return error code. RC_INVALID_FILE_FORMAT if the tree is not empty
+ */
+RC IndexBuilder::build(BTreeIndex& index, vector<pair<int, RecordId> >& pairs,
+                       int fill, int threads)
+{
+	int rc;
+	IndexBuilder top;
+
+	//a range is not worth a thread unless it fills a few chunks
+	size_t most = pairs.size() / (BUILD_CHUNK_PAGES * MAX_KEY_NUM) + 1;
+	if (threads > (int) most)
+		threads = most;
+	if (threads <= 1) {
+		rc = top.open(index, fill);
+		if(rc) return rc;
+		sort(pairs.begin(), pairs.end());
+		for (size_t i = 0; i < pairs.size(); i++) {
+			rc = top.add(pairs[i].first, pairs[i].second);
+			if(rc) return rc;
+		}
+		return top.close();
+	}
+
+	//split the keys at the quantiles of an even sample of them. the pairs
+	//of a key all go to one range, and a range may well be empty
+	vector<int> sample;
+	size_t step = pairs.size() / (threads * 64) + 1;
+	for (size_t i = 0; i < pairs.size(); i += step)
+		sample.push_back(pairs[i].first);
+	sort(sample.begin(), sample.end());
+
+	PageId next = index.pf.endPid();
+	vector<BuildTask> tasks(threads);
+	vector<pthread_t> workers(threads);
+	for (int t = 0; t < threads; t++) {
+		BuildTask& task = tasks[t];
+		task.pairs = &pairs;
+		task.first = (t == 0);
+		task.last = (t == threads - 1);
+		task.lo = task.first ? 0 : tasks[t - 1].hi;
+		task.hi = task.last ? 0 : sample[sample.size() * (t + 1) / threads];
+		task.rc = task.builder.start(index, fill, &next);
+		if (task.rc)
+			return task.rc;
+	}
+	int started = 0;
+	for (rc = 0; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, buildMain, &tasks[started]) != 0) {
+			rc = RC_FILE_WRITE_FAILED;
+			break;
+		}
+	}
+	for (int t = 0; t < started; t++) {
+		pthread_join(workers[t], NULL);
+		if (tasks[t].rc && rc == 0)
+			rc = tasks[t].rc;
+	}
+	if(rc) return rc;
+
+	//link the last leaf of every range to the first one of the next
+	rc = top.start(index, fill, &next);
+	if(rc) return rc;
+	top.unused.push_back(top.leafPid);
+	for (int t = 0; t < threads; t++) {
+		vector<Node>& leaves = tasks[t].builder.nodes;
+		vector<PageId>& unused = tasks[t].builder.unused;
+		top.unused.insert(top.unused.end(), unused.begin(), unused.end());
+		if (leaves.empty())
+			continue;
+
+		if (!top.nodes.empty() && !(index.format & BT_COPY_ON_WRITE)) {
+			BTLeafNode leaf(index.format);
+			PageId left = top.nodes.back().pid, right = leaves.front().pid;
+			rc = leaf.read(left, index.pf);
+			if(rc) return rc;
+			leaf.setNextNodePtr(right);
+			rc = leaf.write(left, index.pf);
+			if(rc) return rc;
+			if (index.format & BT_LEAF_PREV) {
+				rc = leaf.read(right, index.pf);
+				if(rc) return rc;
+				leaf.setPrevNodePtr(left);
+				rc = leaf.write(right, index.pf);
+				if(rc) return rc;
+			}
+		}
+		top.nodes.insert(top.nodes.end(), leaves.begin(), leaves.end());
+	}
+
+	if (top.nodes.empty())
+		return 0;
+	return top.stack();
+}
+
+/*
+ * The body of a thread of build(): gather the pairs of the range of the
+ * task, sort them and write their leaves.
+ * @param arg[IN] the BuildTask of the thread
+ */
+void* IndexBuilder::buildMain(void* arg)
+{
+	BuildTask* task = (BuildTask*) arg;
+	const vector<pair<int, RecordId> >& pairs = *task->pairs;
+
+	vector<pair<int, RecordId> > range;
+	for (size_t i = 0; i < pairs.size(); i++) {
+		int key = pairs[i].first;
+		if ((task->first || key >= task->lo) && (task->last || key < task->hi))
+			range.push_back(pairs[i]);
+	}
+	sort(range.begin(), range.end());
+
+	task->rc = 0;
+	for (size_t i = 0; i < range.size() && task->rc == 0; i++)
+		task->rc = task->builder.add(range[i].first, range[i].second);
+	if (task->rc == 0)
+		task->rc = task->builder.endLeaves();
+	return NULL;
+}
+
+/*
+ * Start building, alone or as one of the builders of build().
+ * @param index[IN] an index opened in write mode, with an empty tree
+ * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+ * @param shared[IN] the next page not yet taken by the builders of
+ *                   build(). NULL for a builder that has the file alone
+ * @return error code. RC_INVALID_FILE_FORMAT if the tree is not empty
+ */
+RC IndexBuilder::start(BTreeIndex& index, int fill, PageId* shared)
+{
+	if (index.rootPid >= 0)
+		return RC_INVALID_FILE_FORMAT;
+
+	this->index = &index;
+	this->fill = fill < 1 ? 1 : (fill > 100 ? 100 : fill);
+	this->shared = shared;
+	if (shared) {
+		nextPid = __atomic_fetch_add(shared, BUILD_CHUNK_PAGES, __ATOMIC_RELAXED);
+		chunkEnd = nextPid + BUILD_CHUNK_PAGES;
+	} else
+		nextPid = index.pf.endPid();
+	leaf = BTLeafNode(index.format);
+	leafPid = allocate();
+	leafCount = 0;
+	rids.clear();
+	nodes.clear();
+	unused.clear();
+	return 0;
+}
+
+/*
+ * Write the last leaf, keeping the leaves written in nodes.
+ * @return error code. 0 if no error
+ */
+RC IndexBuilder::endLeaves()
+{
+	int rc;
+
+	if (!rids.empty()) {
+		rc = addKey();
+		if(rc) return rc;
+	}
+	if (leaf.getKeyCount() > 0) {
+		rc = endLeaf(true);
+		if(rc) return rc;
+	} else if (shared)
+		unused.push_back(leafPid);
+
+	//the rest of the chunk is not written either
+	if (shared)
+		for (; nextPid < chunkEnd; nextPid++)
+			unused.push_back(nextPid);
+	return 0;
+}
+
+/*
+ * Stack the nonleaf levels on the leaves in nodes, free the pages in
+ * unused and make the tree the tree of the index.
+ * @return error code. 0 if no error
+ */
+RC IndexBuilder::stack()
+{
+	int rc;
+
+	//the children of a level are spread evenly over its nodes, so that
+	//the last one is not left with a child or two
+	BTNonLeafNode empty(index->format);
+	int fanout = (empty.getMaxKeyCount() + 1) * fill / 100;
+	if (fanout < 3)
+		fanout = 3;
+	int height = 1;
+	vector<Node> parents;
+
+	//BTreeIndex expects a root over two leaves at least, so a single leaf
+	//gets an empty one in front of it, as insert() starts a tree with
+	if (nodes.size() == 1) {
+		BTLeafNode front(index->format);
+		Node node = { allocate(), nodes[0].key, 0 };
+		if (!(index->format & BT_COPY_ON_WRITE))
+			front.setNextNodePtr(nodes[0].pid);
+		rc = front.write(node.pid, index->pf);
+		if(rc) return rc;
+		if (index->format & BT_LEAF_PREV) {
+			rc = front.read(nodes[0].pid, index->pf);
+			if(rc) return rc;
+			front.setPrevNodePtr(node.pid);
+			rc = front.write(nodes[0].pid, index->pf);
+			if(rc) return rc;
+		}
+		nodes.insert(nodes.begin(), node);
+	}
+	while (nodes.size() > 1) {
+		size_t n = nodes.size(), m = (n + fanout - 1) / fanout;
+		parents.clear();
+		for (size_t i = 0; i < m; i++) {
+			size_t from = n * i / m, to = n * (i + 1) / m;
+			BTNonLeafNode node(index->format);
+			node.initializeRoot(nodes[from].pid, nodes[from + 1].key, nodes[from + 1].pid);
+			node.setCount(0, nodes[from].count);
+			node.setCount(1, nodes[from + 1].count);
+			Node parent = { allocate(), nodes[from].key, nodes[from].count + nodes[from + 1].count };
+			for (size_t j = from + 2; j < to; j++) {
+				rc = node.insert(nodes[j].key, nodes[j].pid, nodes[j].count);
+				if(rc) return rc;
+				parent.count += nodes[j].count;
+			}
+			rc = node.write(parent.pid, index->pf);
+			if(rc) return rc;
+			parents.push_back(parent);
+		}
+		nodes.swap(parents);
+		height++;
+	}
+	if (shared)
+		for (; nextPid < chunkEnd; nextPid++)
+			unused.push_back(nextPid);
+
+	//publish the tree as a write of its own, which also releases the
+	//latch on the header left by creating the index
+	index->beginWrite();
+	index->deferHeader = false;
+	index->rootPid = nodes[0].pid;
+	index->treeHeight = height;
+	rc = index->updateRH();
+
+	//the pages taken but not written go to the free list, but for those
+	//past the end of the file
+	PageId end = index->pf.endPid();
+	for (size_t i = 0; i < unused.size() && rc == 0; i++)
+		if (unused[i] < end)
+			rc = index->releasePage(unused[i]);
+	pthread_mutex_lock(&index->snapLock);
+	index->snapRoot = index->rootPid;
+	index->snapHeight = height;
+	pthread_mutex_unlock(&index->snapLock);
+	index->endWrite();
+	return rc;
+}
+
+/*
+ * Take the next page to write.
+ * @return the PageId of the page
+ */
+PageId IndexBuilder::allocate()
+{
+	PageId pid = nextPid++;
+
+	//the builders of build() take a new chunk as soon as one is used up,
+	//so nextPid always tells the page written next
+	if (shared && nextPid == chunkEnd) {
+		nextPid = __atomic_fetch_add(shared, BUILD_CHUNK_PAGES, __ATOMIC_RELAXED);
+		chunkEnd = nextPid + BUILD_CHUNK_PAGES;
+	}
+	return pid;
+}
+
+/*
+ * Put the RecordIds of the last key added into the leaf, in a posting
+ * list if there are more than BT_INLINE_RID_NUM of them, starting a new
+ * leaf if the leaf is full enough or has no room for them.
+ * @return error code. 0 if no error
+ */
+RC IndexBuilder::addKey()
+{
+	int rc;
+	bool posting = (rids.size() > (size_t) BT_INLINE_RID_NUM);
+
+	//the entries of a key stay in one leaf, so try them on a copy first,
+	//and keep the copy if they fit. a posting list starts at the next
+	//page, right behind the leaf
+	bool added = false;
+	if (leaf.getKeyCount() > 0) {
+		bool fits = (leaf.getFill() < fill);
+		BTLeafNode trial = leaf;
+		RecordId head = { nextPid, BT_POSTING_SID };
+		if (posting)
+			fits = fits && trial.insert(key, head) == 0;
+		for (size_t i = 0; i < rids.size() && fits && !posting; i++)
+			fits = (trial.insert(key, rids[i]) == 0);
+		if (fits)
+			leaf = trial;
+		else {
+			rc = endLeaf(false);
+			if(rc) return rc;
+		}
+		added = fits;
+	}
+
+	if (!added && !posting) {
+		for (size_t i = 0; i < rids.size(); i++) {
+			rc = leaf.insert(key, rids[i]);
+			if(rc) return rc;
+		}
+	} else if (!added) {
+		RecordId head = { nextPid, BT_POSTING_SID };
+		rc = leaf.insert(key, head);
+		if(rc) return rc;
+	}
+
+	if (posting) {
+		//fill the pages of the list one after another
+		sort(rids.begin(), rids.end());
+		BTPostingNode page;
+		PageId pid = allocate();
+		page.setTotal(rids.size());
+		for (size_t i = 0; i < rids.size(); i++) {
+			if (page.insert(rids[i]) == 0)
+				continue;
+			page.setNextNodePtr(nextPid);
+			rc = page.write(pid, index->pf);
+			if(rc) return rc;
+			pid = allocate();
+			page = BTPostingNode();
+			page.insert(rids[i]);
+		}
+		rc = page.write(pid, index->pf);
+		if(rc) return rc;
+	}
+
+	leafCount += rids.size();
+	rids.clear();
+	return 0;
+}
+
+/*
+ * Write the leaf being filled.
+ * @param last[IN] whether it is the last leaf. otherwise a new leaf is
+ *                 started behind it
+ * @return error code. 0 if no error
+ */
+RC IndexBuilder::endLeaf(bool last)
+{
+	int rc, first;
+	RecordId r;
+	PageId next = last ? -1 : allocate();
+
+	//leaves copied on write are not linked, as in BTreeIndex
+	if (!(index->format & BT_COPY_ON_WRITE))
+		leaf.setNextNodePtr(next);
+	rc = leaf.write(leafPid, index->pf);
+	if(rc) return rc;
+	leaf.readEntry(0, first, r);
+	Node node = { leafPid, first, leafCount };
+	nodes.push_back(node);
+
+	if (!last) {
+		leaf = BTLeafNode(index->format);
+		leaf.setPrevNodePtr(leafPid);
+		leafPid = next;
+		leafCount = 0;
+	}
+	return 0;
 }
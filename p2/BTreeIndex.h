@@ -13,11 +13,20 @@
 #include "Bruinbase.h"
 #include "PageFile.h"
 #include "RecordFile.h"
+#include "BTreeNode.h"
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <vector>
              
 /**
  * The data structure to point to a particular entry at a b+tree leaf node.
  * An IndexCursor consists of pid (PageId of the leaf node) and 
  * eid (the location of the index entry inside the node).
+ * While the RecordIds of a key with a posting list are read, postPid and
+ * postEid give the position inside the list.
+ * The version of the leaf when the cursor was set tells whether a writer
+ * moved the entries since, and the cursor is then set again by its key.
  * IndexCursor is used for index lookup and traversal.
  */
 typedef struct {
@@ -25,19 +34,87 @@ typedef struct {
   PageId  pid;  
   // The entry number inside the node
   int     eid;  
+  // PageId of the posting list page being read (-1 if none)
+  PageId  postPid;
+  // The RecordId number inside the posting list page
+  int     postEid;
+  // The version of the leaf when the cursor was set (odd if unknown)
+  unsigned version;
+  // The key of the entry under the cursor, or a bound of it
+  int     key;
+  // The root and the height of the tree the cursor reads
+  PageId  root;
+  int     height;
 } IndexCursor;
 
+/**
+ * A snapshot of a BT_COPY_ON_WRITE index: the tree as of one committed
+ * insert or remove. Its pages are not reused while the snapshot is open.
+ */
+typedef struct {
+  // PageId of the root node (-1 if the tree was empty)
+  PageId  rootPid;
+  // The height of the tree
+  int     treeHeight;
+  // The number of writes committed before the snapshot
+  int     epoch;
+} IndexSnapshot;
+
+/**
+ * The shape of a tree, as reported by BTreeIndex::rebuild().
+ */
+typedef struct {
+  // The height of the tree
+  int     height;
+  // The number of leaf and nonleaf nodes
+  int     leafCount;
+  int     nonLeafCount;
+  // How full the leaves are on average, in percent
+  int     leafFill;
+  // The number of times a scan of all leaves goes back in the file
+  int     leafSeeks;
+} IndexStats;
+
 /**
  * Implements a B-Tree index for bruinbase.
- * 
+ *
+ * Threads may share one open index. Writers take turns, and every page a
+ * writer changes is latched from its first write until the insert or
+ * remove is done. Readers take no lock: they note the version of each node
+ * before copying it and check the version afterwards, and a lookup starts
+ * over from the root when a node or its parent changed meanwhile, so
+ * locate() always sees a consistent tree. A scan reads each leaf
+ * consistently, but may miss or repeat entries that move while it runs.
+ *
+ * Under BT_COPY_ON_WRITE a write never overwrites a page that readers may
+ * see. The nodes it changes are written to new pages, together with the
+ * path above them, and the new root is published when the write commits.
+ * A reader that opens a snapshot keeps reading the tree as it was, however
+ * many writes commit, and the replaced pages are reused once no snapshot is
+ * left that reads them. Leaves of such a tree are crossed from the root
+ * instead of by their sibling pointers, which would tie every leaf to its
+ * neighbours, so the format leaves out BT_LEAF_COMPACT and BT_LEAF_PREV.
+ *
+ * Under BT_BUFFERED an insert only adds its pair to the insert buffer of
+ * the root, which is kept in memory. A full buffer is sorted and moved
+ * down in one go, to the buffers of the nonleaf nodes below or, above the
+ * leaves, into the leaves, so a leaf is written once for many pairs.
+ * IndexScanner merges the buffered pairs of its range into the scan.
+ * Cursors and locateMany() read the leaves only, so locate(),
+ * locateBackward() and locateMany() first empty every buffer into the
+ * leaves if a pair was buffered since, as close() in write mode does. A
+ * scan may miss or repeat the pairs moved down while it runs. The buffer
+ * pointer takes the space of the counts, so the format leaves out
+ * BT_NONLEAF_COUNTS and BT_COPY_ON_WRITE.
  */
 class BTreeIndex {
  public:
   BTreeIndex();
+  ~BTreeIndex();
 
 
   /* 
-   *write the current root and height into file
+   *write the current root, height and node format into file
    */
   RC updateRH();
 
@@ -47,12 +124,15 @@ class BTreeIndex {
    * Under 'w' mode, the index file should be created if it does not exist.
    * @param indexname[IN] the name of the index file
    * @param mode[IN] 'r' for read, 'w' for write
+   * @param format[IN] node format flags (BT_LEAF_COMPACT, ...) of the index.
+   *                   only used when a new index file is created.
    * @return error code. 0 if no error
    */
-  RC open(const std::string& indexname, char mode);
+  RC open(const std::string& indexname, char mode, int format = 0);
 
   /**
-   * Close the index file.
+   * Close the index file. Under BT_BUFFERED in write mode, the insert
+   * buffers are emptied into the leaves first.
    * @return error code. 0 if no error
    */
   RC close();
@@ -82,17 +162,27 @@ class BTreeIndex {
 
 
 
-  RC insertNonLeafNode(const PageId& Parent, const int& key, const PageId& PID, int tHeight);
-
-
   /**
    * Insert (key, RecordId) pair to the index.
+   * A key may be inserted many times. Its first BT_INLINE_RID_NUM RecordIds
+   * are kept in the leaf and the rest go to a posting list.
    * @param key[IN] the key for the value inserted into the index
    * @param rid[IN] the RecordId for the record being inserted into the index
    * @return error code. 0 if no error
    */
   RC insert(int key, const RecordId& rid);
 
+  /**
+   * Remove (key, RecordId) pair from the index.
+   * A leaf or nonleaf node that falls below half full borrows from a
+   * sibling or is merged with it, and the tree shrinks when the root
+   * is left with a single child. Pages of merged nodes are reused.
+   * @param key[IN] the key of the pair to remove
+   * @param rid[IN] the RecordId of the pair to remove
+   * @return error code. RC_NO_SUCH_RECORD if the pair is not in the index
+   */
+  RC remove(int key, const RecordId& rid);
+
   /**
    * Run the standard B+Tree key search algorithm and identify the
    * leaf node where searchKey may exist. If an index entry with
@@ -113,6 +203,31 @@ class BTreeIndex {
    */
   RC locate(int searchKey, IndexCursor& cursor);
 
+  /**
+   * Run locate() on the tree of a snapshot. readForward() and
+   * readBackward() go on reading the snapshot through the cursor.
+   * @param searchKey[IN] the key to find
+   * @param cursor[OUT] the cursor, as set by locate()
+   * @param snapshot[IN] a snapshot opened by openSnapshot()
+   * @return 0 if searchKey is found. Othewise, an error code
+   */
+  RC locate(int searchKey, IndexCursor& cursor, const IndexSnapshot& snapshot);
+
+  /**
+   * Open a snapshot of the tree as of the last committed write. Needs an
+   * index with BT_COPY_ON_WRITE.
+   * @param snapshot[OUT] the snapshot
+   * @return error code. RC_INVALID_FILE_FORMAT if the index is not
+   *         copied on write
+   */
+  RC openSnapshot(IndexSnapshot& snapshot);
+
+  /**
+   * Close a snapshot, letting later writes reuse the pages only it reads.
+   * @param snapshot[IN] a snapshot opened by openSnapshot()
+   */
+  void closeSnapshot(const IndexSnapshot& snapshot);
+
   /**
    * Read the (key, rid) pair at the location specified by the index cursor,
    * and move foward the cursor to the next entry.
@@ -122,16 +237,943 @@ class BTreeIndex {
    * @return error code. 0 if no error
    */
   RC readForward(IndexCursor& cursor, int& key, RecordId& rid);
+
+  /**
+   * Read up to n (key, rid) pairs starting at the location specified by
+   * the index cursor, crossing leaf nodes as needed, and move the cursor
+   * behind the last pair read. Every leaf node is read once per call.
+   * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+   * @param keys[OUT] the keys read. must have room for n keys
+   * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+   * @param n[IN] the maximum number of pairs to read
+   * @param count[OUT] the number of pairs read
+   * @return 0 if at least one pair was read. RC_END_OF_TREE if the cursor
+   *         is at the end of the tree. Otherwise an error code.
+   */
+  RC readForward(IndexCursor& cursor, int keys[], RecordId rids[], int n, int& count);
+
+  /**
+   * Set the cursor to the last index entry with a key <= searchKey, for
+   * reading the index backward with readBackward().
+   * @param searchKey[IN] the largest key to read
+   * @param cursor[OUT] the cursor pointing to the entry
+   * @return error code. 0 if no error
+   */
+  RC locateBackward(int searchKey, IndexCursor& cursor);
+
+  /**
+   * Read the (key, rid) pair at the location specified by the index cursor,
+   * and move the cursor to the entry before it, crossing to the previous
+   * leaf through its BT_LEAF_PREV pointer (or from the root without one).
+   * The RecordIds of a key with a posting list are read in stored order.
+   * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+   * @param key[OUT] the key stored at the index cursor location
+   * @param rid[OUT] the RecordId stored at the index cursor location
+   * @return 0 if a pair was read. RC_END_OF_TREE if the cursor is in front
+   *         of the first entry. Otherwise an error code.
+   */
+  RC readBackward(IndexCursor& cursor, int& key, RecordId& rid);
+
+  /**
+   * Count the (key, rid) pairs with lo <= key <= hi. Needs an index opened
+   * with BT_NONLEAF_COUNTS, and reads one node per level for each bound.
+   * @param lo[IN] the smallest key counted
+   * @param hi[IN] the largest key counted
+   * @param count[OUT] the number of pairs in the range
+   * @return error code. RC_INVALID_FILE_FORMAT if the index has no counts
+   */
+  RC countRange(int lo, int hi, int& count);
+
+  /**
+   * Look up a batch of keys, as for an IN-list or the inner side of a
+   * nested-loop join. The keys are sorted and the tree is walked once for
+   * all of them, so a node on the paths of several keys is read once per
+   * batch instead of once per key. The lookups advance a level at a time,
+   * and the pages of a level are prefetched together so that their reads
+   * overlap. Like locate(), it empties the BT_BUFFERED insert
+   * buffers into the leaves first.
+   * @param keys[IN] the keys to look up, in any order and possibly repeated
+   * @param k[IN] the number of keys
+   * @param rids[OUT] the RecordIds found: those of keys[i] are
+   *                  rids[first[i]] to rids[first[i+1]-1]
+   * @param first[OUT] k+1 offsets into rids
+   * @return error code. 0 if no error
+   */
+  RC locateMany(const int* keys, size_t k, std::vector<RecordId>& rids,
+                std::vector<size_t>& first);
+
+  /**
+   * Measure the shape of the tree by reading every node.
+   * @param stats[OUT] the shape of the tree
+   * @return error code. 0 if no error
+   */
+  RC getStats(IndexStats& stats);
+
+  /**
+   * Rewrite an index in key order with IndexBuilder and put the new file
+   * in place of the old one. The old file is only read, so readers keep
+   * using it meanwhile, and the new one takes over its name in a single
+   * rename; readers that opened the old file read it until they close
+   * it. Writes to the old file during the rebuild are lost.
+   * @param indexname[IN] the name of the index file
+   * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+   * @param before[OUT] the shape of the old tree
+   * @param after[OUT] the shape of the new tree
+   * @return error code. 0 if no error
+   */
+  static RC rebuild(const std::string& indexname, int fill, IndexStats& before,
+                    IndexStats& after);
   
  private:
+  friend class IndexScanner;
+  friend class IndexBuilder;
+  friend class LearnedIndex;
+  friend class StaticIndex;
+
+  /**
+   * Read a nonleaf node, serving it from the pinned upper levels if possible.
+   * A node read from disk is pinned if it is within the top PINNED_LEVELS.
+   * The node is read again until no writer changed it meanwhile.
+   * @param pid[IN] the PageId of the node
+   * @param level[IN] the level of the node (the root is level 1)
+   * @param node[OUT] the node read
+   * @param version[OUT] the version of the node read, if not NULL
+   * @return error code. 0 if no error
+   */
+  RC readNonLeaf(PageId pid, int level, BTNonLeafNode& node, unsigned* version = NULL);
+
+  /**
+   * Write a nonleaf node and refresh its pinned copy, if it has one.
+   * Under BT_COPY_ON_WRITE the write goes to a copy of the page.
+   * @param pid[IN] the PageId of the node
+   * @param node[IN] the node to write
+   * @return error code. 0 if no error
+   */
+  RC writeNonLeaf(PageId pid, BTNonLeafNode& node);
+
+  /**
+   * Read a leaf node, again until no writer changed it meanwhile.
+   * @param pid[IN] the PageId of the node
+   * @param leaf[OUT] the node read
+   * @param version[OUT] the version of the node read, if not NULL
+   * @return error code. 0 if no error
+   */
+  RC readLeaf(PageId pid, BTLeafNode& leaf, unsigned* version = NULL);
+
+  /**
+   * Latch the page of a leaf node and write the node.
+   * Under BT_COPY_ON_WRITE the write goes to a copy of the page.
+   * @param pid[IN] the PageId of the node
+   * @param leaf[IN] the node to write
+   * @return error code. 0 if no error
+   */
+  RC writeLeaf(PageId pid, BTLeafNode& leaf);
+
+  /**
+   * Read a posting list page, again until no writer changed it meanwhile.
+   * @param pid[IN] the PageId of the page
+   * @param node[OUT] the page read
+   * @return error code. 0 if no error
+   */
+  RC readPostingNode(PageId pid, BTPostingNode& node);
+
+  /**
+   * Latch a posting list page and write it.
+   * Under BT_COPY_ON_WRITE the write goes to a copy of the page.
+   * @param pid[IN] the PageId of the page
+   * @param node[IN] the page to write
+   * @return error code. 0 if no error
+   */
+  RC writePostingNode(PageId pid, BTPostingNode& node);
+
+  /**
+   * Read an insert buffer page, again until no writer changed it meanwhile.
+   * @param pid[IN] the PageId of the page
+   * @param node[OUT] the page read
+   * @return error code. 0 if no error
+   */
+  RC readBufferNode(PageId pid, BTBufferNode& node);
+
+  /**
+   * Latch an insert buffer page and write it.
+   * @param pid[IN] the PageId of the page
+   * @param node[IN] the page to write
+   * @return error code. 0 if no error
+   */
+  RC writeBufferNode(PageId pid, BTBufferNode& node);
+
+  /**
+   * A (key, rid) pair waiting in an insert buffer.
+   */
+  typedef std::pair<int, RecordId> Message;
+
+  /**
+   * Append the pairs of an insert buffer to msgs.
+   * @param head[IN] the first page of the buffer. -1 for an empty buffer
+   * @param msgs[IN/OUT] the pairs read
+   * @return error code. 0 if no error
+   */
+  RC readBuffer(PageId head, std::vector<Message>& msgs);
+
+  /**
+   * Put the pages of an insert buffer on the free page list.
+   * @param head[IN] the first page of the buffer. -1 for an empty buffer
+   * @return error code. 0 if no error
+   */
+  RC freeBuffer(PageId head);
+
+  /**
+   * Write pairs to a new insert buffer.
+   * @param msgs[IN] the pairs to write
+   * @param head[OUT] the first page of the buffer. -1 if msgs is empty
+   * @return error code. 0 if no error
+   */
+  RC writeBuffer(const std::vector<Message>& msgs, PageId& head);
+
+  /**
+   * Move the buffered pairs with lo <= key <= hi from one nonleaf node to
+   * another, after children moved between the two. Both nodes must be
+   * written by the caller.
+   * @param from[IN/OUT] the node that gave up the children
+   * @param to[IN/OUT] the node that took them
+   * @param lo[IN] the smallest key to move
+   * @param hi[IN] the largest key to move
+   * @return error code. 0 if no error
+   */
+  RC moveMessages(BTNonLeafNode& from, BTNonLeafNode& to, int lo, int hi);
+
+  /**
+   * Descend from the root to the node at the given height where key
+   * belongs.
+   * @param key[IN] the key to find
+   * @param height[IN] the height of the node (0 for a leaf)
+   * @param pid[OUT] the PageId of the node
+   * @param bound[OUT] the smallest key above key that belongs elsewhere.
+   *                   INT_MAX if there is none
+   * @return error code. 0 if no error
+   */
+  RC findNode(int key, int height, PageId& pid, int& bound);
+
+  /**
+   * Add sorted pairs to the insert buffers of the nonleaf nodes at the
+   * given height, flushing a buffer that gets full.
+   * @param height[IN] the height of the nodes (the root is treeHeight-1)
+   * @param msgs[IN] the pairs, sorted by key
+   * @return error code. 0 if no error
+   */
+  RC bufferMessages(int height, const std::vector<Message>& msgs);
+
+  /**
+   * Add pairs msgs[i..end) that belong to one nonleaf node to its insert
+   * buffer, until the buffer has MAX_BUFFER_PAGES pages.
+   * @param pid[IN] the PageId of the node
+   * @param height[IN] the height of the node
+   * @param msgs[IN] the pairs
+   * @param i[IN/OUT] the first pair to add. set to the first pair left
+   * @param end[IN] the end of the pairs to add
+   * @return error code. 0 if no error
+   */
+  RC appendMessages(PageId pid, int height, const std::vector<Message>& msgs, size_t& i, size_t end);
+
+  /**
+   * Move the insert buffer of the root down, out of memory.
+   * @return error code. 0 if no error
+   */
+  RC flushInserts();
+
+  /**
+   * Empty the insert buffer of a nonleaf node into its children.
+   * @param pid[IN] the PageId of the node
+   * @param height[IN] the height of the node
+   * @return error code. 0 if no error
+   */
+  RC flushBuffer(PageId pid, int height);
+
+  /**
+   * Insert sorted pairs into the leaves, writing each leaf once for all
+   * the pairs that fit in it.
+   * @param msgs[IN] the pairs, sorted by key
+   * @return error code. 0 if no error
+   */
+  RC applyMessages(const std::vector<Message>& msgs);
+
+  /**
+   * Remove a pair from the insert buffers on the path of its key.
+   * @param key[IN] the key of the pair
+   * @param rid[IN] the RecordId of the pair
+   * @param found[OUT] whether the pair was buffered
+   * @return error code. 0 if no error
+   */
+  RC removeMessage(int key, const RecordId& rid, bool& found);
+
+  /**
+   * Find a nonleaf node in the subtree of pid that has a buffered pair.
+   * @param pid[IN] the PageId of the root of the subtree
+   * @param level[IN] the level of the node (the root is level 1)
+   * @param found[OUT] the PageId of the node found. -1 if none
+   * @param height[OUT] the height of the node found
+   * @return error code. 0 if no error
+   */
+  RC findBuffered(PageId pid, int level, PageId& found, int& height);
+
+  /**
+   * Empty every insert buffer into the leaves.
+   * @return error code. 0 if no error
+   */
+  RC flushAll();
+
+  /**
+   * Empty every insert buffer into the leaves if a pair was buffered
+   * since the last time, for the readers of the leaves.
+   * @return error code. 0 if no error
+   */
+  RC flushForRead();
+
+  /**
+   * Append the buffered pairs with lo <= key <= hi, in no particular order.
+   * @param lo[IN] the smallest key
+   * @param hi[IN] the largest key
+   * @param msgs[IN/OUT] the pairs found
+   * @return error code. 0 if no error
+   */
+  RC collectMessages(int lo, int hi, std::vector<Message>& msgs);
+
+  /**
+   * Append the pairs with lo <= key <= hi in the insert buffers of the
+   * subtree of pid.
+   * @param pid[IN] the PageId of the root of the subtree
+   * @param level[IN] the level of the node (the root is level 1)
+   * @param lo[IN] the smallest key
+   * @param hi[IN] the largest key
+   * @param msgs[IN/OUT] the pairs found
+   * @return error code. 0 if no error
+   */
+  RC collectBuffered(PageId pid, int level, int lo, int hi, std::vector<Message>& msgs);
+
+  /**
+   * Set the cursor to searchKey in the tree the cursor reads, as locate()
+   * or locateBackward() does.
+   * @param searchKey[IN] the key to find
+   * @param cursor[IN/OUT] the cursor, with its root and height set
+   * @param backward[IN] whether to set it as locateBackward() does
+   * @return error code, as returned by locate() or locateBackward()
+   */
+  RC seek(int searchKey, IndexCursor& cursor, bool backward);
+
+  /**
+   * Give the root and the height of the current tree: the tree last
+   * published under BT_COPY_ON_WRITE, or the one in the header.
+   * @param root[OUT] the PageId of the root. -1 if the tree is empty
+   * @param height[OUT] the height of the tree
+   */
+  void currentTree(PageId& root, int& height);
+
+  /**
+   * Descend from the root to the leaf where key belongs, starting over
+   * whenever a node changed after the pointer to it was read.
+   * @param key[IN] the key to find
+   * @param root[IN] the root of the tree to read. -1 for the current tree
+   * @param height[IN] the height of the tree to read, if root is given
+   * @param pid[OUT] the PageId of the leaf. -1 if the tree is empty
+   * @param leaf[OUT] the leaf
+   * @param version[OUT] if not NULL, the version of the leaf
+   * @param below[OUT] if not NULL, the count of the pairs in the subtrees
+   *                   left of the path. needs BT_NONLEAF_COUNTS
+   * @param leafCount[OUT] if not NULL, the count of the pairs of the leaf
+   *                       as kept by its parent. needs BT_NONLEAF_COUNTS
+   * @return error code. 0 if no error
+   */
+  RC findLeaf(int key, PageId root, int height, PageId& pid, BTLeafNode& leaf,
+               unsigned* version = NULL, int* below = NULL, int* leafCount = NULL);
+
+  /**
+   * Give the page that holds the content of a node for the running write.
+   * Under BT_COPY_ON_WRITE a node copied by the writer lives elsewhere
+   * until the write commits; readers always get pid back.
+   * @param pid[IN] the PageId of the node
+   * @return the PageId of the page holding it
+   */
+  PageId physical(PageId pid);
+
+  /**
+   * Give the page a write of a node goes to under BT_COPY_ON_WRITE,
+   * copying the node to a new page if it existed before the write.
+   * @param pid[IN] the PageId of the node
+   * @param kind[IN] 'l' for a leaf, 'n' for a nonleaf, 'p' for a posting page
+   * @return the PageId of the page to write
+   */
+  PageId shadowPage(PageId pid, char kind);
+
+  /**
+   * Copy a node that the write did not change, so that its pointers can
+   * be set to the copies of its children. Does nothing if the node was
+   * written or freed by the write.
+   * @param pid[IN] the PageId of the node
+   * @param kind[IN] the kind of the node, as for shadowPage()
+   * @return error code. 0 if no error
+   */
+  RC copyPage(PageId pid, char kind);
+
+  /**
+   * Commit a write under BT_COPY_ON_WRITE: copy the path of the key, point
+   * every copied node at the copies of its children, reuse the pages no
+   * snapshot reads any more, and publish the new root.
+   * @param key[IN] the key inserted or removed
+   * @param posting[IN] whether a page deep in a posting list of the key
+   *                    may have been copied
+   * @return error code. 0 if no error
+   */
+  RC commit(int key, bool posting);
+
+  /**
+   * Put a page on the free page list right away.
+   * @param pid[IN] the PageId of the page
+   * @return error code. 0 if no error
+   */
+  RC releasePage(PageId pid);
+
+  /**
+   * Refresh the pinned copy of a nonleaf node, if it has one.
+   * @param pid[IN] the PageId of the node
+   * @param node[IN] the node as written
+   */
+  void refreshPinned(PageId pid, BTNonLeafNode& node);
+
+  /**
+   * Check whether the calling thread is the writer.
+   * @return true if it holds writeLock
+   */
+  bool isWriter();
+
+  /**
+   * Wait until no other thread latches a page, and return its version.
+   * @param pid[IN] the PageId of the page
+   * @return the version of the page
+   */
+  unsigned readLatch(PageId pid);
+
+  /**
+   * Check that a page is still at the version read by readLatch().
+   * @param pid[IN] the PageId of the page
+   * @param version[IN] the version read
+   * @return true if no writer latched the page since
+   */
+  bool validate(PageId pid, unsigned version);
+
+  /**
+   * Latch a page before the writer changes it. The page stays latched
+   * until endWrite().
+   * @param pid[IN] the PageId of the page
+   */
+  void latchPage(PageId pid);
+
+  /**
+   * Wait for the turn of this thread to write the index.
+   */
+  void beginWrite();
+
+  /**
+   * Release the pages latched by the writer and end its turn.
+   */
+  void endWrite();
+
+  /**
+   * The body of insert(), run by the writer.
+   */
+  RC insertEntry(int key, const RecordId& rid);
+
+  /**
+   * The body of remove(), run by the writer.
+   */
+  RC removeEntry(int key, const RecordId& rid);
+
+  /**
+   * Take a page for a new node, reusing a freed page if there is one.
+   * The page must be written before the next page is allocated.
+   * @return the PageId of the page
+   */
+  PageId allocatePage();
+
+  /**
+   * Put the page of a node that is no longer used on the free page list.
+   * @param pid[IN] the PageId of the page
+   * @return error code. 0 if no error
+   */
+  RC freePage(PageId pid);
+
+  /**
+   * Add a duplicate of a key that is in the leaf to the posting list of
+   * the key, first moving its inline entries to a new posting list if the
+   * key has reached BT_INLINE_RID_NUM entries.
+   * @param leaf[IN/OUT] the leaf the key belongs to, not yet written
+   * @param key[IN] the key inserted
+   * @param rid[IN/OUT] the RecordId inserted. when a new posting list is
+   *                    created, set to the leaf entry for the list
+   * @param stored[OUT] true if rid is stored and the leaf is unchanged.
+   *                    otherwise (key, rid) must still be inserted in the leaf
+   * @return error code. 0 if no error
+   */
+  RC insertPosting(BTLeafNode& leaf, int key, RecordId& rid, bool& stored);
+
+  /**
+   * Remove a RecordId from a posting list, freeing the pages it empties.
+   * @param head[IN] the first page of the list
+   * @param rid[IN] the RecordId to remove
+   * @param empty[OUT] true if the list is now empty and its entry
+   *                   must be removed from the leaf
+   * @return error code. RC_NO_SUCH_RECORD if rid is not in the list
+   */
+  RC removePosting(PageId head, const RecordId& rid, bool& empty);
+
+  /**
+   * Descend a tree along a key, remembering the nonleaf nodes passed and
+   * the child followed in each, for stepPath().
+   * @param key[IN] the key to follow
+   * @param root[IN] the root of the tree. must not be -1
+   * @param height[IN] the height of the tree
+   * @param path[OUT] the nonleaf nodes from the root, indexed by level
+   * @param slot[OUT] the child pointer followed in each node of path
+   * @param pid[OUT] the PageId of the leaf reached
+   * @return error code. 0 if no error
+   */
+  RC findPath(int key, PageId root, int height, PageId path[], int slot[], PageId& pid);
+
+  /**
+   * Move a path from the root to the leaf beside its leaf, reading only
+   * the nodes of the path.
+   * @param path[IN/OUT] the nonleaf nodes from the root, as set by findPath()
+   * @param slot[IN/OUT] the child pointer followed in each node of path
+   * @param height[IN] the height of the tree
+   * @param forward[IN] true for the leaf behind, false for the leaf in front
+   * @param pid[OUT] the PageId of the leaf. -1 if there is none
+   * @return error code. 0 if no error
+   */
+  RC stepPath(PageId path[], int slot[], int height, bool forward, PageId& pid);
+
+  /**
+   * Find the nonempty leaf beside a leaf from the root along a key of it.
+   * @param leaf[IN] the leaf
+   * @param key[IN] a key that leads to the leaf, used if it is empty
+   * @param pid[OUT] the PageId of the leaf beside. -1 if there is none
+   * @param root[IN] the root of the tree read. -1 for the current tree
+   * @param height[IN] the height of the tree read
+   * @param forward[IN] true for the leaf behind, false for the leaf in front
+   * @return error code. 0 if no error
+   */
+  RC siblingLeaf(BTLeafNode& leaf, int key, PageId& pid, PageId root, int height, bool forward);
+
+  /**
+   * Find the leaf in front of a leaf, through its sibling pointer or from
+   * the root along its first key.
+   * @param leaf[IN] the leaf
+   * @param key[IN] a key that leads to the leaf, used if it is empty
+   * @param pid[OUT] the PageId of the leaf in front. -1 if there is none
+   * @param root[IN] the root of the tree read. -1 for the current tree
+   * @param height[IN] the height of the tree read
+   * @return error code. 0 if no error
+   */
+  RC prevLeaf(BTLeafNode& leaf, int key, PageId& pid, PageId root, int height);
+
+  /**
+   * Find the leaf behind a leaf, through its sibling pointer or, under
+   * BT_COPY_ON_WRITE, from the root along its first key.
+   * @param leaf[IN] the leaf
+   * @param key[IN] a key that leads to the leaf, used if it is empty
+   * @param pid[OUT] the PageId of the leaf behind. -1 if there is none
+   * @param root[IN] the root of the tree read. -1 for the current tree
+   * @param height[IN] the height of the tree read
+   * @return error code. 0 if no error
+   */
+  RC nextLeaf(BTLeafNode& leaf, int key, PageId& pid, PageId root, int height);
+
+  /**
+   * Point a leaf back at the leaf in front of it, if it has BT_LEAF_PREV.
+   * @param pid[IN] the PageId of the leaf (-1 for none)
+   * @param prev[IN] the PageId of the leaf in front of it
+   * @return error code. 0 if no error
+   */
+  RC setPrevLeaf(PageId pid, PageId prev);
+
+  /**
+   * Insert the separator of a split node into its parent, splitting the
+   * parents up to the root as needed and keeping their counts.
+   * @param path[IN] the nonleaf nodes from the root to the split node
+   * @param slot[IN] the child pointer followed in each node of path
+   * @param level[IN] the level of the parent of the split node
+   * @param key[IN] the first key below the new sibling
+   * @param pid[IN] the PageId of the new sibling
+   * @param count[IN] the number of pairs below the new sibling
+   * @param rightEdge[IN] true if the path is the rightmost one of the tree,
+   *                      where nodes split unevenly for ascending inserts
+   * @return error code. 0 if no error
+   */
+  RC insertSeparator(const PageId path[], const int slot[], int level, int key, PageId pid, int count,
+                     bool rightEdge = false);
+
+  /**
+   * Add delta to the counts along a path. Does nothing without counts.
+   * @param path[IN] the nonleaf nodes from the root
+   * @param slot[IN] the child pointer followed in each node of path
+   * @param level[IN] the lowest level to update
+   * @param delta[IN] the change in the number of pairs
+   * @return error code. 0 if no error
+   */
+  RC updateCounts(const PageId path[], const int slot[], int level, int delta);
+
+  /**
+   * Return the number of pairs held by the entries [from, to) of a leaf.
+   * @param leaf[IN] the leaf
+   * @param from[IN] the first entry
+   * @param to[IN] the entry behind the last one
+   * @return the number of pairs
+   */
+  int leafWeight(BTLeafNode& leaf, int from, int to);
+
+  /**
+   * Append the RecordIds of a key in a leaf to rids, reading its posting
+   * list if it has one.
+   * @param leaf[IN] the leaf the key belongs to
+   * @param key[IN] the key
+   * @param rids[IN/OUT] the RecordIds read
+   * @return error code. 0 if no error, also when the key is not there
+   */
+  RC readKeyRids(BTLeafNode& leaf, int key, std::vector<RecordId>& rids);
+
+  /**
+   * Count the pairs with a key below the given one.
+   * @param key[IN] the bound
+   * @param inclusive[IN] whether pairs with the key itself are counted
+   * @param count[OUT] the number of pairs
+   * @return error code. 0 if no error
+   */
+  RC countBelow(int key, bool inclusive, int& count);
+
+  /**
+   * Fix an underflowing leaf after remove() by merging it with a sibling
+   * or borrowing an entry from it.
+   * @param leaf[IN] the leaf, not yet written
+   * @param path[IN] the nonleaf nodes from the root to the leaf
+   * @param slot[IN] the child pointer followed in each node of path
+   * @return error code. 0 if no error
+   */
+  RC rebalanceLeaf(BTLeafNode& leaf, const PageId path[], const int slot[]);
+
+  /**
+   * Write a nonleaf node that lost a key, merging or rotating it with a
+   * sibling if it underflows and shrinking the tree at the root.
+   * @param level[IN] the level of the node (the root is level 1)
+   * @param node[IN] the node, not yet written
+   * @param path[IN] the nonleaf nodes from the root to the node
+   * @param slot[IN] the child pointer followed in each node of path
+   * @return error code. 0 if no error
+   */
+  RC rebalanceNonLeaf(int level, BTNonLeafNode& node, const PageId path[], const int slot[]);
+
+  /**
+   * Find the pin slot of this index, taking over the least recently
+   * used slot if the index has none. The caller holds pinLock, for
+   * writing if create is true.
+   * @param create[IN] whether to take over a slot if none is found
+   * @return the slot number. -1 if not found and create is false.
+   */
+  int pinSlot(bool create);
+
   PageFile pf;         /// the PageFile used to store the actual b+tree in disk
+  std::string name;    /// the name of the index file and its inode number
+  char     mode;       /// the mode the file was opened in
 
   PageId   rootPid;    /// the PageId of the root node
   int      treeHeight; /// the height of the tree
-  /// Note that the content of the above two variables will be gone when
+  int      format;     /// the node format flags of the tree
+  PageId   freePid;    /// the first page of the free page list (-1 if none)
+  /// Note that the content of the above four variables will be gone when
   /// this class is destructed. Make sure to store the values of the two 
   /// variables in disk, so that they can be reconstructed when the index
   /// is opened again later.
+
+  //
+  // the following members implement the page latches. a page is latched
+  // through the version of its stripe, which is odd while it is latched.
+  //
+  static const int LATCH_COUNT = 1024; // # of stripes, a power of 2
+
+  unsigned latches[LATCH_COUNT]; // the version of each stripe
+  int      latched[LATCH_COUNT]; // the stripes latched by the writer
+  int      latchedCount;         // # of stripes latched by the writer
+  pthread_mutex_t writeLock;     // held by the writer
+  pthread_t writer;              // the thread holding writeLock
+  bool     writing;              // whether a thread holds writeLock
+  PageId   allocEnd;             // the page behind the last one allocated
+
+  //
+  // the following members implement BT_COPY_ON_WRITE. the published tree
+  // and the open snapshots are guarded by snapLock, the rest belongs to
+  // the writer.
+  //
+  PageId   snapRoot;             // the root of the published tree
+  int      snapHeight;           // the height of the published tree
+  int      epoch;                // # of writes published
+  std::multiset<int> snapshots;  // the epochs of the open snapshots
+  pthread_mutex_t snapLock;
+
+  bool     deferHeader;          // whether the header waits for the commit
+  PageId   writeEnd;             // the pages below existed before the write
+  std::map<PageId, PageId> shadow;  // nodes copied by the write: old -> new
+  std::map<PageId, char>   written; // pages written by the write: kind
+  std::set<PageId> recycled;     // free pages reused by the write
+  std::set<PageId> retiring;     // pages the write replaced or freed
+  std::vector<std::pair<int, PageId> > retired; // pages replaced by a
+                                 //   published write, with its epoch
+
+  //
+  // the following members implement BT_BUFFERED. the insert buffer of the
+  // root is changed by the writer under bufferLock.
+  //
+  std::vector<Message> inserts;  // the insert buffer of the root
+  bool buffered;                 // whether a pair was buffered since the
+                                 //   last flushAll()
+  pthread_mutex_t bufferLock;
+
+  //
+  // the following members keep the header and the top PINNED_LEVELS
+  // levels of recently used indexes in memory across BTreeIndex instances.
+  // a pinned node is only refreshed when the node itself is written.
+  //
+  static const int PINNED_LEVELS = 3;  // # of upper levels kept in memory
+  static const int PIN_INDEX_COUNT = 4; // # of indexes with pinned nodes
+  static const int PIN_NODE_COUNT = 128; // max # of pinned nodes per index
+
+  static int pinClock; // clock tick counter for LRU policy
+  static pthread_rwlock_t pinLock; // guards the pinned nodes and headers
+
+  static struct pinStruct {
+    std::string   name;           // index file name ("" if the slot is empty)
+    int           lastAccessed;   // the last time the slot was accessed
+    PageId        rootPid;        // the header of the index
+    int           treeHeight;
+    int           format;
+    PageId        freePid;
+    int           count;          // # of pinned nodes
+    PageId        pid[PIN_NODE_COUNT];
+    BTNonLeafNode node[PIN_NODE_COUNT];
+  } pinned[PIN_INDEX_COUNT];
+};
+
+/**
+ * IndexScanner: a cursor for range scans over a BTreeIndex.
+ * Unlike readForward(), which reads the leaf node again for every entry,
+ * the scanner keeps the current leaf node in memory, returns its entries
+ * in place and reads the next leaf only when it crosses a leaf boundary.
+ * A posting list is likewise decoded one page at a time. A scan of a
+ * BT_COPY_ON_WRITE index reads a snapshot of the tree taken by open(),
+ * which it closes when the scan ends, and keeps the path from its root to
+ * the current leaf to find the next leaf without a sibling pointer.
+ */
+class IndexScanner {
+ public:
+  IndexScanner();
+  ~IndexScanner();
+
+  /**
+   * Position the scanner at the first entry with key >= lowKey.
+   * The scan ends after the last entry with key <= highKey.
+   * @param index[IN] an open index to scan
+   * @param lowKey[IN] the smallest key to return
+   * @param highKey[IN] the largest key to return
+   * @return error code. 0 if no error
+   */
+  RC open(BTreeIndex& index, int lowKey, int highKey);
+
+  /**
+   * Read the (key, rid) pair at the scanner position and move forward.
+   * @param key[OUT] the key of the entry
+   * @param rid[OUT] the RecordId of the entry
+   * @return 0 if an entry was read. RC_END_OF_TREE after the last entry
+   *         of the range. Otherwise an error code.
+   */
+  RC next(int& key, RecordId& rid);
+
+  /**
+   * Read up to n (key, rid) pairs from the scanner position and move forward.
+   * @param keys[OUT] the keys read. must have room for n keys
+   * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+   * @param n[IN] the maximum number of pairs to read
+   * @param count[OUT] the number of pairs read
+   * @return 0 if at least one pair was read. RC_END_OF_TREE after the last
+   *         entry of the range. Otherwise an error code.
+   */
+  RC next(int keys[], RecordId rids[], int n, int& count);
+
+ private:
+  /**
+   * Move to the next leaf node that has entries, if the current one is used up.
+   * @return 0 if an entry is available. RC_END_OF_TREE after the last leaf.
+   */
+  RC nextLeaf();
+
+  /**
+   * End the scan, closing the snapshot it reads, if any.
+   */
+  void finish();
+
+  /**
+   * Load the RecordIds of a posting list page.
+   * @param pid[IN] the PageId of the posting list page
+   * @return error code. 0 if no error
+   */
+  RC readPosting(PageId pid);
+
+  BTreeIndex* index;   /// the index being scanned
+  IndexSnapshot snapshot; /// the tree scanned under BT_COPY_ON_WRITE
+  bool        snapped; /// whether snapshot is open
+  std::vector<PageId> path; /// the nonleaf nodes above the leaf in snapshot
+  std::vector<int> slot;    /// the child followed in each node of path
+  BTLeafNode  leaf;    /// the leaf node at the scanner position
+  PageId      pid;     /// the PageId of the leaf (-1 at the end of the scan)
+  int         lowKey;  /// the smallest key to return
+  int         eid;     /// the next entry to return within the leaf
+  int         keyCount;/// # of entries in the leaf
+  int         highKey; /// the largest key to return
+
+  RecordId    posting[BTPostingNode::MAX_RID_NUM]; /// RecordIds of the posting list page being read
+  int         postKey;   /// the key of the posting list
+  int         postEid;   /// the next RecordId to return within posting
+  int         postCount; /// # of RecordIds in posting
+  PageId      postNext;  /// the next page of the posting list (-1 if none)
+
+  std::vector<BTreeIndex::Message> pending; /// buffered pairs of the range, sorted
+  size_t      pendEid;   /// the next pair to return within pending
+};
+
+/**
+ * Writes the tree of an empty index bottom-up from (key, rid) pairs given
+ * in key order, filling each node up to a fill factor instead of splitting
+ * nodes as inserts do. Every leaf is written right behind the one before
+ * it, followed by the posting lists of its keys, so a scan reads the file
+ * from front to back. The nonleaf levels are stacked on the leaves when
+ * the last pair has been added.
+ *
+ * build() sorts and writes unsorted pairs with several threads. The pairs
+ * are split into key ranges, and a builder per range sorts its pairs and
+ * writes its leaves, taking pages from the file in chunks of
+ * BUILD_CHUNK_PAGES so that its leaves still lie mostly one after another.
+ * The leaves of all ranges are then linked up and share the nonleaf
+ * levels stacked on them, and the pages left over in the chunks go to the
+ * free page list.
+ */
+class IndexBuilder {
+ public:
+  IndexBuilder();
+
+  /**
+   * Start building the tree of an index.
+   * @param index[IN] an index opened in write mode, with an empty tree
+   * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+   * @return error code. RC_INVALID_FILE_FORMAT if the tree is not empty
+   */
+  RC open(BTreeIndex& index, int fill);
+
+  /**
+   * Add a (key, rid) pair to the tree.
+   * @param key[IN] the key, not smaller than the one added before
+   * @param rid[IN] the RecordId
+   * @return error code. 0 if no error
+   */
+  RC add(int key, const RecordId& rid);
+
+  /**
+   * Write the last leaf and the nonleaf levels, and make the tree the
+   * tree of the index.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Build the tree of an empty index from pairs in any order.
+   * @param index[IN] an index opened in write mode, with an empty tree
+   * @param pairs[IN] the pairs, sorted by key on return
+   * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+   * @param threads[IN] the number of threads to sort and write with
+   * @return error code. RC_INVALID_FILE_FORMAT if the tree is not empty
+   */
+  static RC build(BTreeIndex& index, std::vector<std::pair<int, RecordId> >& pairs,
+                  int fill, int threads);
+
+ private:
+  /**
+   * Start building, alone or as one of the builders of build().
+   * @param index[IN] an index opened in write mode, with an empty tree
+   * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
+   * @param shared[IN] the next page not yet taken by the builders of
+   *                   build(). NULL for a builder that has the file alone
+   * @return error code. RC_INVALID_FILE_FORMAT if the tree is not empty
+   */
+  RC start(BTreeIndex& index, int fill, PageId* shared);
+
+  /**
+   * Write the last leaf, keeping the leaves written in nodes.
+   * @return error code. 0 if no error
+   */
+  RC endLeaves();
+
+  /**
+   * Stack the nonleaf levels on the leaves in nodes, free the pages in
+   * unused and make the tree the tree of the index.
+   * @return error code. 0 if no error
+   */
+  RC stack();
+
+  /**
+   * Take the next page to write.
+   * @return the PageId of the page
+   */
+  PageId allocate();
+
+  /**
+   * The body of a thread of build().
+   * @param arg[IN] the BuildTask of the thread
+   */
+  static void* buildMain(void* arg);
+
+  /**
+   * Put the RecordIds of the last key added into the leaf, in a posting
+   * list if there are more than BT_INLINE_RID_NUM of them, starting a new
+   * leaf if the leaf is full enough or has no room for them.
+   * @return error code. 0 if no error
+   */
+  RC addKey();
+
+  /**
+   * Write the leaf being filled.
+   * @param last[IN] whether it is the last leaf. otherwise a new leaf is
+   *                 started behind it
+   * @return error code. 0 if no error
+   */
+  RC endLeaf(bool last);
+
+  /// a node written: its page, its smallest key and the # of pairs below it
+  struct Node {
+    PageId pid;
+    int    key;
+    int    count;
+  };
+
+  static const int BUILD_CHUNK_PAGES = 64; // # of pages a builder of build() takes at once
+
+  BTreeIndex* index;   /// the index being built
+  int         fill;    /// the fill factor, in percent
+  PageId      nextPid; /// the next page to write
+  PageId*     shared;  /// the next page not taken by the builders of build()
+  PageId      chunkEnd;/// the page behind the chunk taken from shared
+  BTLeafNode  leaf;    /// the leaf being filled
+  PageId      leafPid; /// the page of the leaf
+  int         leafCount;/// # of pairs in the leaf, including its posting lists
+
+  int         key;     /// the last key added
+  std::vector<RecordId> rids; /// the RecordIds added for key
+
+  std::vector<Node> nodes; /// the leaves written so far
+  std::vector<PageId> unused; /// pages taken but not written
 };
 
 #endif /* BTREEINDEX_H */
@@ -0,0 +1,595 @@
+/*
+ * BTreeIndexT: a B+tree templated on its key type, for the value and
+ * covering indexes of Bruinbase.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef BTREEINDEXT_H
+#define BTREEINDEXT_H
+
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include "RecordFile.h"
+#include "BTreeIndex.h"
+#include <string>
+#include <string.h>
+
+/**
+ * Key traits of BTreeIndexT. The traits give the number of bytes a key
+ * takes in a node and a three-way comparison of two keys, so the node
+ * code copies keys with memcpy and is compiled for every key type without
+ * virtual calls. The default serves the integer types (int, long long).
+ */
+template <class Key>
+struct BTreeKeyTraits {
+  static const int SIZE = sizeof(Key);
+  static int compare(const Key& a, const Key& b)
+  { return (a < b) ? -1 : ((b < a) ? 1 : 0); }
+};
+
+/**
+ * A string key of N bytes. Longer strings are truncated to their first N
+ * bytes and shorter ones are padded with zeros, so a string orders before
+ * its extensions and truncation keeps the order of strcmp(): a < b implies
+ * FixedString(a) <= FixedString(b). A lookup on a truncated key must
+ * therefore check the full value of the records it returns.
+ */
+template <int N>
+struct FixedString {
+  char data[N];
+
+  FixedString() { memset(data, 0, N); }
+  FixedString(const char* s) { strncpy(data, s, N); }
+
+  /**
+   * Return the largest key of N bytes, used as an open upper bound.
+   */
+  static FixedString max() { FixedString s; memset(s.data, 0xff, N); return s; }
+};
+
+template <int N>
+struct BTreeKeyTraits<FixedString<N> > {
+  static const int SIZE = N;
+  static int compare(const FixedString<N>& a, const FixedString<N>& b)
+  { return memcmp(a.data, b.data, N); }
+};
+
+/**
+ * Order (key, rid) pairs by key and then by rid. Entries of a BTreeIndexT
+ * are kept in this order, which makes every entry unique even when keys
+ * repeat.
+ */
+template <class Key, class Traits>
+inline int compareEntry(const Key& k1, const RecordId& r1, const Key& k2, const RecordId& r2)
+{
+  int c = Traits::compare(k1, k2);
+  if (c != 0) return c;
+  return (r1 < r2) ? -1 : ((r2 < r1) ? 1 : 0);
+}
+
+/**
+ * BTLeafNodeT: a leaf node of a BTreeIndexT.
+ * The node holds the entry count, the next sibling pointer and then the
+ * (key, rid) entries in sorted order.
+ */
+template <class Key, class Traits = BTreeKeyTraits<Key> >
+class BTLeafNodeT {
+ public:
+  static const int ENTRY_SIZE = Traits::SIZE + sizeof(RecordId);
+  static const int HEADER_SIZE = 2 * sizeof(int);
+  static const int MAX_KEY_NUM = (PageFile::PAGE_SIZE - HEADER_SIZE) / ENTRY_SIZE;
+
+  BTLeafNodeT() {
+    memset(buffer, 0, PageFile::PAGE_SIZE);
+    setNextNodePtr(-1);
+  }
+
+  /**
+   * Return the number of entries stored in the node.
+   */
+  int getKeyCount() {
+    int count;
+    memcpy(&count, buffer, sizeof(int));
+    return count;
+  }
+
+  /**
+   * Return the pid of the next sibling node (-1 for the last leaf).
+   */
+  PageId getNextNodePtr() {
+    PageId pid;
+    memcpy(&pid, buffer + sizeof(int), sizeof(PageId));
+    return pid;
+  }
+
+  /**
+   * Set the pid of the next sibling node.
+   */
+  void setNextNodePtr(PageId pid)
+  { memcpy(buffer + sizeof(int), &pid, sizeof(PageId)); }
+
+  /**
+   * Read the (key, rid) pair from the eid entry.
+   * @return 0 if successful. RC_NO_SUCH_RECORD if eid is out of range.
+   */
+  RC readEntry(int eid, Key& key, RecordId& rid) {
+    if (eid < 0 || eid >= getKeyCount())
+      return RC_NO_SUCH_RECORD;
+    const char* entry = buffer + HEADER_SIZE + eid * ENTRY_SIZE;
+    memcpy(&key, entry, Traits::SIZE);
+    memcpy(&rid, entry + Traits::SIZE, sizeof(RecordId));
+    return 0;
+  }
+
+  /**
+   * Set eid to the first entry that is not smaller than (key, rid).
+   * @return 0 if that entry has the key. Otherwise RC_NO_SUCH_RECORD.
+   */
+  RC locate(const Key& key, const RecordId& rid, int& eid) {
+    int low = 0, high = getKeyCount();
+    Key k;
+    RecordId r;
+    while (low < high) {
+      int mid = (low + high) / 2;
+      readEntry(mid, k, r);
+      if (compareEntry<Key, Traits>(k, r, key, rid) < 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    eid = low;
+    if (readEntry(low, k, r) == 0 && Traits::compare(k, key) == 0)
+      return 0;
+    return RC_NO_SUCH_RECORD;
+  }
+
+  /**
+   * Insert the (key, rid) pair to the node.
+   * @return 0 if successful. RC_NODE_FULL if the node is full.
+   */
+  RC insert(const Key& key, const RecordId& rid) {
+    int count = getKeyCount(), eid;
+    if (count >= MAX_KEY_NUM)
+      return RC_NODE_FULL;
+
+    locate(key, rid, eid);
+    char* entry = buffer + HEADER_SIZE + eid * ENTRY_SIZE;
+    memmove(entry + ENTRY_SIZE, entry, (count - eid) * ENTRY_SIZE);
+    memcpy(entry, &key, Traits::SIZE);
+    memcpy(entry + Traits::SIZE, &rid, sizeof(RecordId));
+    setKeyCount(count + 1);
+    return 0;
+  }
+
+  /**
+   * Insert the (key, rid) pair and move the upper half of the entries to
+   * the empty sibling. The first entry of the sibling is returned in
+   * (siblingKey, siblingRid). Next pointers are left to the caller.
+   * @return 0 if successful. Return an error code if there is an error.
+   */
+  RC insertAndSplit(const Key& key, const RecordId& rid, BTLeafNodeT& sibling,
+                    Key& siblingKey, RecordId& siblingRid) {
+    if (sibling.getKeyCount() != 0)
+      return RC_FILE_WRITE_FAILED;
+
+    int count = getKeyCount();
+    int divide = (count + 1) / 2;
+    sibling.setKeyCount(count - divide);
+    memcpy(sibling.buffer + HEADER_SIZE, buffer + HEADER_SIZE + divide * ENTRY_SIZE,
+           (count - divide) * ENTRY_SIZE);
+    setKeyCount(divide);
+
+    //the new entry goes to the half that covers it
+    Key k;
+    RecordId r;
+    sibling.readEntry(0, k, r);
+    RC rc;
+    if (compareEntry<Key, Traits>(key, rid, k, r) < 0)
+      rc = insert(key, rid);
+    else
+      rc = sibling.insert(key, rid);
+    if (rc) return rc;
+
+    return sibling.readEntry(0, siblingKey, siblingRid);
+  }
+
+  RC read(PageId pid, const PageFile& pf) { return pf.read(pid, buffer); }
+  RC write(PageId pid, PageFile& pf) { return pf.write(pid, buffer); }
+
+ private:
+  void setKeyCount(int count) { memcpy(buffer, &count, sizeof(int)); }
+
+  char buffer[PageFile::PAGE_SIZE];
+};
+
+/**
+ * BTNonLeafNodeT: a nonleaf node of a BTreeIndexT.
+ * The node holds the key count and the first child pointer followed by
+ * (key, rid, pid) separators in sorted order. The child pointer behind a
+ * separator leads to the entries that are not smaller than it.
+ */
+template <class Key, class Traits = BTreeKeyTraits<Key> >
+class BTNonLeafNodeT {
+ public:
+  static const int ENTRY_SIZE = Traits::SIZE + sizeof(RecordId) + sizeof(PageId);
+  static const int HEADER_SIZE = sizeof(int) + sizeof(PageId);
+  static const int MAX_KEY_NUM = (PageFile::PAGE_SIZE - HEADER_SIZE) / ENTRY_SIZE;
+
+  BTNonLeafNodeT() { memset(buffer, 0, PageFile::PAGE_SIZE); }
+
+  /**
+   * Return the number of keys stored in the node.
+   */
+  int getKeyCount() {
+    int count;
+    memcpy(&count, buffer, sizeof(int));
+    return count;
+  }
+
+  /**
+   * Initialize the root node with (pid1, (key, rid), pid2).
+   */
+  void initializeRoot(PageId pid1, const Key& key, const RecordId& rid, PageId pid2) {
+    memset(buffer, 0, PageFile::PAGE_SIZE);
+    memcpy(buffer + sizeof(int), &pid1, sizeof(PageId));
+    setEntry(0, key, rid, pid2);
+    setKeyCount(1);
+  }
+
+  /**
+   * Given (searchKey, searchRid), find the child pointer to follow.
+   * @param idx[OUT] the position of the child pointer (0 <= idx <= getKeyCount())
+   * @return the PageId of the child
+   */
+  PageId locateChildPtr(const Key& searchKey, const RecordId& searchRid, int& idx) {
+    int low = 0, high = getKeyCount();
+    Key k;
+    RecordId r;
+    PageId pid;
+    while (low < high) {
+      int mid = (low + high) / 2;
+      getEntry(mid, k, r, pid);
+      if (compareEntry<Key, Traits>(k, r, searchKey, searchRid) <= 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    idx = low;
+    return getChildPtr(low);
+  }
+
+  /**
+   * Insert the separator (key, rid) with the child pointer pid behind it.
+   * @return 0 if successful. RC_NODE_FULL if the node is full.
+   */
+  RC insert(const Key& key, const RecordId& rid, PageId pid) {
+    int count = getKeyCount(), idx;
+    if (count >= MAX_KEY_NUM)
+      return RC_NODE_FULL;
+
+    locateChildPtr(key, rid, idx);
+    char* entry = buffer + HEADER_SIZE + idx * ENTRY_SIZE;
+    memmove(entry + ENTRY_SIZE, entry, (count - idx) * ENTRY_SIZE);
+    setEntry(idx, key, rid, pid);
+    setKeyCount(count + 1);
+    return 0;
+  }
+
+  /**
+   * Insert the separator (key, rid, pid) and split the node with the empty
+   * sibling. The middle separator moves up and is returned in
+   * (midKey, midRid); its child pointer becomes the first one of sibling.
+   * @return 0 if successful. Return an error code if there is an error.
+   */
+  RC insertAndSplit(const Key& key, const RecordId& rid, PageId pid,
+                    BTNonLeafNodeT& sibling, Key& midKey, RecordId& midRid) {
+    if (sibling.getKeyCount() != 0)
+      return RC_FILE_WRITE_FAILED;
+
+    //build the overfull node in a larger buffer, then cut it in two
+    int count = getKeyCount(), idx;
+    char temp [PageFile::PAGE_SIZE + ENTRY_SIZE];
+    locateChildPtr(key, rid, idx);
+    memcpy(temp, buffer, HEADER_SIZE + idx * ENTRY_SIZE);
+    char* entry = temp + HEADER_SIZE + idx * ENTRY_SIZE;
+    memcpy(entry, &key, Traits::SIZE);
+    memcpy(entry + Traits::SIZE, &rid, sizeof(RecordId));
+    memcpy(entry + Traits::SIZE + sizeof(RecordId), &pid, sizeof(PageId));
+    memcpy(entry + ENTRY_SIZE, buffer + HEADER_SIZE + idx * ENTRY_SIZE, (count - idx) * ENTRY_SIZE);
+    count++;
+
+    int mid = count / 2;
+    char* midEntry = temp + HEADER_SIZE + mid * ENTRY_SIZE;
+    memcpy(&midKey, midEntry, Traits::SIZE);
+    memcpy(&midRid, midEntry + Traits::SIZE, sizeof(RecordId));
+
+    memset(sibling.buffer, 0, PageFile::PAGE_SIZE);
+    memcpy(sibling.buffer + sizeof(int), midEntry + Traits::SIZE + sizeof(RecordId), sizeof(PageId));
+    memcpy(sibling.buffer + HEADER_SIZE, midEntry + ENTRY_SIZE, (count - mid - 1) * ENTRY_SIZE);
+    sibling.setKeyCount(count - mid - 1);
+
+    memset(buffer, 0, PageFile::PAGE_SIZE);
+    memcpy(buffer, temp, HEADER_SIZE + mid * ENTRY_SIZE);
+    setKeyCount(mid);
+    return 0;
+  }
+
+  RC read(PageId pid, const PageFile& pf) { return pf.read(pid, buffer); }
+  RC write(PageId pid, PageFile& pf) { return pf.write(pid, buffer); }
+
+ private:
+  void setKeyCount(int count) { memcpy(buffer, &count, sizeof(int)); }
+
+  PageId getChildPtr(int i) {
+    PageId pid;
+    if (i == 0)
+      memcpy(&pid, buffer + sizeof(int), sizeof(PageId));
+    else
+      memcpy(&pid, buffer + HEADER_SIZE + (i - 1) * ENTRY_SIZE + Traits::SIZE + sizeof(RecordId), sizeof(PageId));
+    return pid;
+  }
+
+  void getEntry(int i, Key& key, RecordId& rid, PageId& pid) {
+    const char* entry = buffer + HEADER_SIZE + i * ENTRY_SIZE;
+    memcpy(&key, entry, Traits::SIZE);
+    memcpy(&rid, entry + Traits::SIZE, sizeof(RecordId));
+    memcpy(&pid, entry + Traits::SIZE + sizeof(RecordId), sizeof(PageId));
+  }
+
+  void setEntry(int i, const Key& key, const RecordId& rid, PageId pid) {
+    char* entry = buffer + HEADER_SIZE + i * ENTRY_SIZE;
+    memcpy(entry, &key, Traits::SIZE);
+    memcpy(entry + Traits::SIZE, &rid, sizeof(RecordId));
+    memcpy(entry + Traits::SIZE + sizeof(RecordId), &pid, sizeof(PageId));
+  }
+
+  char buffer[PageFile::PAGE_SIZE];
+};
+
+/**
+ * BTreeIndexT: a B+tree index over keys of any type with BTreeKeyTraits.
+ *
+ * Unlike BTreeIndex, which is tuned for the int key column (compact leaves,
+ * posting lists, pinned upper levels and removal), this tree is generic:
+ * it is compiled for its key type, so an int or long long index pays no
+ * virtual dispatch and a FixedString<N> index serves the value column.
+ * Repeated keys are kept as separate entries ordered by RecordId.
+ *
+ * It is a separate, smaller tree, not BTreeIndex with a key type: it has
+ * none of the node formats, latches, snapshots, insert buffers, pinning or
+ * removal of BTreeIndex, and only supports inserts by one writer followed
+ * by reads. It is meant for the value (.vidx) and covering (.cidx) indexes,
+ * which are only built by LOAD; an index that needs any of the above
+ * belongs on BTreeIndex.
+ *
+ * The header page 0 holds the root pid, the tree height and the key size.
+ * An empty tree has no root; a tree of height 1 is a single leaf.
+ */
+template <class Key, class Traits = BTreeKeyTraits<Key> >
+class BTreeIndexT {
+ public:
+  typedef BTLeafNodeT<Key, Traits> LeafNode;
+  typedef BTNonLeafNodeT<Key, Traits> NonLeafNode;
+
+  BTreeIndexT() : rootPid(-1), treeHeight(0) { }
+
+  /**
+   * Open the index file in read or write mode.
+   * Under 'w' mode, the index file is created if it does not exist.
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& indexname, char mode) {
+    RC rc = pf.open(indexname, mode);
+    if (rc) return rc;
+
+    if (pf.endPid() == 0) {
+      if (mode != 'w') {
+        pf.close();
+        return RC_INVALID_FILE_FORMAT;
+      }
+      rootPid = -1;
+      treeHeight = 0;
+      return writeHeader();
+    }
+
+    char page[PageFile::PAGE_SIZE];
+    int header[3];
+    if ((rc = pf.read(0, page))) {
+      pf.close();
+      return rc;
+    }
+    memcpy(header, page, sizeof(header));
+    if (header[2] != Traits::SIZE) {
+      pf.close();
+      return RC_INVALID_FILE_FORMAT;
+    }
+    rootPid = header[0];
+    treeHeight = header[1];
+    return 0;
+  }
+
+  /**
+   * Close the index file.
+   * @return error code. 0 if no error
+   */
+  RC close() { return pf.close(); }
+
+  /**
+   * Insert the (key, rid) pair to the index.
+   * @return error code. 0 if no error
+   */
+  RC insert(const Key& key, const RecordId& rid) {
+    RC rc;
+
+    //the first entry makes a single leaf root
+    if (rootPid < 0) {
+      LeafNode leaf;
+      leaf.insert(key, rid);
+      rootPid = pf.endPid();
+      treeHeight = 1;
+      if ((rc = leaf.write(rootPid, pf))) return rc;
+      return writeHeader();
+    }
+
+    //descend to the leaf, remembering the nonleaf nodes passed
+    PageId path[MAX_HEIGHT];
+    PageId pid = rootPid;
+    for (int level = 0; level < treeHeight - 1; level++) {
+      NonLeafNode node;
+      int idx;
+      if ((rc = node.read(pid, pf))) return rc;
+      path[level] = pid;
+      pid = node.locateChildPtr(key, rid, idx);
+    }
+
+    LeafNode leaf;
+    if ((rc = leaf.read(pid, pf))) return rc;
+    rc = leaf.insert(key, rid);
+    if (rc == 0) return leaf.write(pid, pf);
+    if (rc != RC_NODE_FULL) return rc;
+
+    //split the leaf and push the separator up as far as needed
+    LeafNode sibling;
+    Key sepKey;
+    RecordId sepRid;
+    PageId siblingPid = pf.endPid();
+    if ((rc = leaf.insertAndSplit(key, rid, sibling, sepKey, sepRid))) return rc;
+    sibling.setNextNodePtr(leaf.getNextNodePtr());
+    leaf.setNextNodePtr(siblingPid);
+    if ((rc = sibling.write(siblingPid, pf))) return rc;
+    if ((rc = leaf.write(pid, pf))) return rc;
+
+    for (int level = treeHeight - 2; level >= 0; level--) {
+      NonLeafNode node;
+      if ((rc = node.read(path[level], pf))) return rc;
+      rc = node.insert(sepKey, sepRid, siblingPid);
+      if (rc == 0) return node.write(path[level], pf);
+      if (rc != RC_NODE_FULL) return rc;
+
+      NonLeafNode nodeSibling;
+      Key midKey;
+      RecordId midRid;
+      if ((rc = node.insertAndSplit(sepKey, sepRid, siblingPid, nodeSibling, midKey, midRid))) return rc;
+      siblingPid = pf.endPid();
+      if ((rc = nodeSibling.write(siblingPid, pf))) return rc;
+      if ((rc = node.write(path[level], pf))) return rc;
+      sepKey = midKey;
+      sepRid = midRid;
+    }
+
+    //the root was split: grow the tree by one level
+    if (treeHeight >= MAX_HEIGHT)
+      return RC_NODE_FULL;
+    NonLeafNode root;
+    root.initializeRoot(rootPid, sepKey, sepRid, siblingPid);
+    PageId newRoot = pf.endPid();
+    if ((rc = root.write(newRoot, pf))) return rc;
+    rootPid = newRoot;
+    treeHeight++;
+    return writeHeader();
+  }
+
+  /**
+   * Set the cursor to the first entry with a key not smaller than searchKey.
+   * @return 0 if that entry has searchKey. Otherwise RC_NO_SUCH_RECORD.
+   */
+  RC locate(const Key& searchKey, IndexCursor& cursor) {
+    RC rc;
+    RecordId first = { -1, -1 };
+
+    cursor.pid = -1;
+    cursor.eid = 0;
+    cursor.postPid = -1;
+    cursor.postEid = 0;
+    if (rootPid < 0)
+      return RC_NO_SUCH_RECORD;
+
+    PageId pid = rootPid;
+    for (int level = 0; level < treeHeight - 1; level++) {
+      NonLeafNode node;
+      int idx;
+      if ((rc = node.read(pid, pf))) return rc;
+      pid = node.locateChildPtr(searchKey, first, idx);
+    }
+
+    LeafNode leaf;
+    if ((rc = leaf.read(pid, pf))) return rc;
+    cursor.pid = pid;
+    rc = leaf.locate(searchKey, first, cursor.eid);
+
+    //the first entry not smaller than searchKey may start the next leaf
+    if (cursor.eid >= leaf.getKeyCount()) {
+      cursor.pid = leaf.getNextNodePtr();
+      cursor.eid = 0;
+      if (cursor.pid >= 0 && leaf.read(cursor.pid, pf) == 0) {
+        Key k;
+        RecordId r;
+        if (leaf.readEntry(0, k, r) == 0 && Traits::compare(k, searchKey) == 0)
+          return 0;
+      }
+    }
+    return rc;
+  }
+
+  /**
+   * Read up to n (key, rid) pairs starting at the cursor, crossing leaf
+   * nodes as needed, and move the cursor behind the last pair read.
+   * If high is given, the read stops at the first key greater than *high
+   * and the cursor is moved to the end, so no leaf beyond it is read.
+   * @return 0 if at least one pair was read. RC_END_OF_TREE if the cursor
+   *         is at the end of the tree. Otherwise an error code.
+   */
+  RC readForward(IndexCursor& cursor, Key keys[], RecordId rids[], int n, int& count,
+                 const Key* high = NULL) {
+    RC rc;
+    LeafNode leaf;
+
+    count = 0;
+    while (count < n && cursor.pid >= 0) {
+      if ((rc = leaf.read(cursor.pid, pf))) return rc;
+
+      int keyCount = leaf.getKeyCount();
+      while (count < n && cursor.eid < keyCount) {
+        leaf.readEntry(cursor.eid++, keys[count], rids[count]);
+        if (high && Traits::compare(keys[count], *high) > 0) {
+          cursor.pid = -1;
+          return (count > 0) ? 0 : RC_END_OF_TREE;
+        }
+        count++;
+      }
+
+      if (cursor.eid >= keyCount) {
+        cursor.pid = leaf.getNextNodePtr();
+        cursor.eid = 0;
+      }
+    }
+    return (count > 0) ? 0 : RC_END_OF_TREE;
+  }
+
+  /**
+   * Read the (key, rid) pair at the cursor and move the cursor forward.
+   * @return error code. 0 if no error
+   */
+  RC readForward(IndexCursor& cursor, Key& key, RecordId& rid) {
+    int count;
+    return readForward(cursor, &key, &rid, 1, count);
+  }
+
+ private:
+  static const int MAX_HEIGHT = 32;
+
+  RC writeHeader() {
+    char page[PageFile::PAGE_SIZE];
+    int header[3] = { rootPid, treeHeight, Traits::SIZE };
+    memset(page, 0, PageFile::PAGE_SIZE);
+    memcpy(page, header, sizeof(header));
+    return pf.write(0, page);
+  }
+
+  PageFile pf;         /// the PageFile used to store the tree
+  PageId   rootPid;    /// the PageId of the root node (-1 if the tree is empty)
+  int      treeHeight; /// the height of the tree (1 if the root is a leaf)
+};
+
+#endif /* BTREEINDEXT_H */
@@ -6,6 +6,97 @@ const int MAX_KEY_NUM = 85;
 const int MAX_PAGEID_SIZE = sizeof(int);
 using namespace std;
 
+//
+// a nonleaf node with subtree counts keeps one key less, and the count of
+// each of its child pointers behind the space of the last entry
+//
+const int COUNTED_MAX_KEY_NUM = MAX_KEY_NUM - 1;
+const int NONLEAF_COUNTS = sizeof(PageId) + MAX_KEY_NUM * (sizeof(int) + sizeof(PageId));
+
+//
+// a buffered nonleaf node keeps the first page of its insert buffer in
+// the same space, behind the key that ends a full node
+//
+const int NONLEAF_BUFFER = NONLEAF_COUNTS + sizeof(int);
+
+//
+// layout of a compact leaf node: a header of five ints (entry count,
+// next node pointer, smallest key, smallest pid, smallest sid) and the
+// bit widths of the three fields, followed by the bit-packed entries
+//
+const int COMPACT_MAX_KEY_NUM = 512;
+const int COMPACT_COUNT = 0;
+const int COMPACT_NEXT = 4;
+const int COMPACT_BASE = 8;
+const int COMPACT_WIDTH = 20;
+const int COMPACT_HEADER_SIZE = 24;
+
+//
+// a leaf with a previous node pointer keeps it in the place of the last
+// entry of a standard leaf, or behind the header of a compact leaf
+//
+const int PREV_MAX_KEY_NUM = MAX_KEY_NUM - 1;
+const int COMPACT_PREV = COMPACT_HEADER_SIZE;
+
+/*
+ * Read the width-bit unsigned value stored at bit offset pos.
+ */
+static unsigned getBits(const char* data, int pos, int width)
+{
+	if (width == 0)
+		return 0;
+
+	unsigned long long v = 0;
+	int first = pos / 8, last = (pos + width - 1) / 8;
+	for (int i = last; i >= first; i--)
+		v = (v << 8) | (unsigned char) data[i];
+	return (unsigned) ((v >> (pos % 8)) & ((1ULL << width) - 1));
+}
+
+/*
+ * Store the width-bit unsigned value v at bit offset pos.
+ */
+static void setBits(char* data, int pos, int width, unsigned v)
+{
+	for (int i = 0; i < width; i++, pos++) {
+		if ((v >> i) & 1)
+			data[pos / 8] |= (char) (1 << (pos % 8));
+		else
+			data[pos / 8] &= (char) ~(1 << (pos % 8));
+	}
+}
+
+/*
+ * Return the number of bits needed to store v.
+ */
+static int bitWidth(unsigned v)
+{
+	int width = 0;
+	while (v) {
+		width++;
+		v >>= 1;
+	}
+	return width;
+}
+
+/*
+ * Find the split position nearest to divide (searching both ways if dir
+ * is 0, otherwise only beyond divide in direction dir) that does not
+ * separate entries with the same key.
+ * @return the split position, or -1 if there is none
+ */
+static int splitPoint(const int keys[], int count, int divide, int dir)
+{
+	for (int d = (dir == 0) ? 0 : 1; d < count; d++) {
+		int lo = divide - d, hi = divide + d;
+		if (dir >= 0 && hi >= 1 && hi < count && keys[hi] != keys[hi - 1])
+			return hi;
+		if (dir <= 0 && lo >= 1 && lo < count && keys[lo] != keys[lo - 1])
+			return lo;
+	}
+	return -1;
+}
+
 /*
  * Read the content of the node from the page pid in the PageFile pf.
  * @param pid[IN] the PageId to read
@@ -34,10 +125,16 @@ RC BTLeafNode::write(PageId pid, PageFile& pf)
  */
 int BTLeafNode::getKeyCount()
 { 	
+	if (format & BT_LEAF_COMPACT) {
+		int count;
+		memcpy(&count, buffer + COMPACT_COUNT, sizeof(int));
+		return count;
+	}
+
 	int key, keySize = sizeof(int);
 	int entrySize = sizeof(RecordId) + sizeof(int);
 	char* current_idx = buffer;
-	int i, size = PAGE_SIZE - sizeof(int); //last entry will always be the PageId
+	int i, size = maxKeyCount() * entrySize; //the node pointers come after the entries
 
 	for (i = 0; i < size; i += entrySize, current_idx += entrySize) {
 		memcpy(&key, current_idx, keySize);
@@ -65,8 +162,24 @@ RC BTLeafNode::insert(int key, const RecordId& rid)
 	memset(&temp, -1, PAGE_SIZE);
 	int nextNode = 0;
 	
+	//compact nodes are decoded, extended and encoded again
+	if (format & BT_LEAF_COMPACT) {
+		int keys [COMPACT_MAX_KEY_NUM + 1];
+		RecordId rids [COMPACT_MAX_KEY_NUM + 1];
+		if (keyCount >= COMPACT_MAX_KEY_NUM)
+			return RC_NODE_FULL;
+
+		locate(key, eid);
+		unpack(keys, rids);
+		memmove(keys + eid + 1, keys + eid, (keyCount - eid) * sizeof(int));
+		memmove(rids + eid + 1, rids + eid, (keyCount - eid) * sizeof(RecordId));
+		keys[eid] = key;
+		rids[eid] = rid;
+		return pack(keys, rids, keyCount + 1);
+	}
+
 	//make sure there is enough room in the node to insert
-	if (keyCount >= MAX_KEY_NUM)
+	if (keyCount >= maxKeyCount())
 	  return RC_NODE_FULL;
 	
 	//find position to insert new entry and attach next node pointer at the end
@@ -106,92 +219,48 @@ RC BTLeafNode::insert(int key, const RecordId& rid)
  * @param rid[IN] the RecordId to insert.
  * @param sibling[IN] the sibling node to split with. This node MUST be EMPTY when this function is called.
  * @param siblingKey[OUT] the first key in the sibling node after split.
+ * @param rightEdge[IN] true if the node is the last leaf of the tree
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTLeafNode::insertAndSplit(int key, const RecordId& rid, 
-                              BTLeafNode& sibling, int& siblingKey)
+                              BTLeafNode& sibling, int& siblingKey, bool rightEdge)
 { 
 	if (sibling.getKeyCount() != 0)
 		return RC_FILE_WRITE_FAILED;
 
-	
-
 	int eid = 0; int keyCount = getKeyCount();
-	int leftOrRight = 0;
-
-	//find where the key is to be inserted, if already inserted, dont insert and return error
-	if (locate(key, eid) == 0)
-	  return RC_INVALID_RID;
-
-	//choose which sibling to insert, default left(0), else right(1)
-	if (eid > keyCount/2)
-	  leftOrRight = 1;
-	
-	//set the divide based on left or right
-	int divide = keyCount/2;
-	if (leftOrRight == 1)
-	  divide++;
-	
-	int recordSize = sizeof(RecordId), keySize = sizeof(int);
-	int entrySize = recordSize + keySize;
-
-	//idx set to beginning of split
-	char* idx = buffer + (divide * entrySize);
-	
-	//how much to copy
-	int toCopy = (keyCount - divide) * entrySize;
 
-	//save the next pointer of the sibling node and copy everything to the right
-	//of divide into sibling
-	int nextNode = sibling.getNextNodePtr();
-	int copy_idx = 0;
-	char temp [PAGE_SIZE];
-	memcpy(&temp, idx, toCopy);
-	idx = temp;
-	
-	//copynum is number of entries to move to sibling
-	int copynum = divide;
-        if(leftOrRight == 1)
-	  copynum = divide-1;
-	
-	//copy all sibling entries
-	while (copy_idx < copynum) {
-		int copied_key; RecordId copied_rid;
-		memcpy(&copied_key, idx, keySize);
-		idx += keySize;
-		memcpy(&copied_rid, idx, recordSize);
-		if (sibling.insert(copied_key, copied_rid) != 0)
+	//decode the node and insert the new entry behind the entries with
+	//the same key
+	int keys [COMPACT_MAX_KEY_NUM + 1];
+	RecordId rids [COMPACT_MAX_KEY_NUM + 1];
+	unpack(keys, rids);
+	locate(key, eid);
+	while (eid < keyCount && keys[eid] == key)
+		eid++;
+	memmove(keys + eid + 1, keys + eid, (keyCount - eid) * sizeof(int));
+	memmove(rids + eid + 1, rids + eid, (keyCount - eid) * sizeof(RecordId));
+	keys[eid] = key;
+	rids[eid] = rid;
+
+	//split half and half, keeping the entries of a key in one node. in a
+	//compact node a key far outside the old range widens the half it lands
+	//in, so shrink that half until both of them fit
+	int count = keyCount + 1;
+	int divide = splitPoint(keys, count, count / 2, 0);
+
+	//an entry appended to the last leaf starts the sibling by itself, so
+	//a stream of ascending keys leaves full leaves behind it
+	if (rightEdge && eid == keyCount && splitPoint(keys, count, keyCount, 0) >= 0)
+		divide = splitPoint(keys, count, keyCount, 0);
+	while (divide < 0
+	       || sibling.pack(keys + divide, rids + divide, count - divide) != 0
+	       || pack(keys, rids, divide) != 0) {
+		if (divide < 0)
 			return RC_FILE_WRITE_FAILED;
-		idx += recordSize;
-		copy_idx++;
-	}
-	sibling.setNextNodePtr(nextNode);
-
-	//delete everything moved to sibling node from current node
-	memset(&temp, -1, PAGE_SIZE);
-	nextNode = getNextNodePtr();
-	int toSave = divide * entrySize;
-	memcpy(&temp, buffer, toSave);
-	memset(&buffer, -1, PAGE_SIZE);
-
-	//reset pageId pointer
-	memcpy(&buffer, temp, toSave);
-	setNextNodePtr(nextNode);
-
-	//insert this key either to left of right
-	if (leftOrRight == 0) {
-	  if (insert(key, rid) != 0)
-	    return RC_FILE_WRITE_FAILED;
-	} else if (leftOrRight == 1) {
-	  if (sibling.insert(key, rid) != 0)
-	    return RC_FILE_WRITE_FAILED;
+		divide = splitPoint(keys, count, divide, eid >= divide ? 1 : -1);
 	}
-
-	//set siblingKey to first entry
-	RecordId filler;
-	if (sibling.readEntry(0, siblingKey, filler) != 0)
-	  return RC_FILE_READ_FAILED;
-
+	siblingKey = keys[divide];
 	return 0;
 }
 
@@ -215,6 +284,22 @@ RC BTLeafNode::locate(int searchKey, int& eid)
 		return RC_NO_SUCH_RECORD;
 	}
 
+	//compact entries have a fixed width, so binary search them in place
+	if (format & BT_LEAF_COMPACT) {
+		int low = 0, high = numKeys;
+		while (low < high) {
+			int mid = (low + high) / 2;
+			if (compactKey(mid) < searchKey)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		eid = low;
+		if (low < numKeys && compactKey(low) == searchKey)
+			return 0;
+		return RC_NO_SUCH_RECORD;
+	}
+
 	int keySize = sizeof(int), recordSize = sizeof(RecordId);
 	int entrySize = keySize + recordSize;	
 	int key;
@@ -247,7 +332,26 @@ RC BTLeafNode::locate(int searchKey, int& eid)
  */
 RC BTLeafNode::readEntry(int eid, int& key, RecordId& rid)
 { 
-	if (eid < 0 || eid >= MAX_KEY_NUM || eid>=getKeyCount()) //max key is 84
+	if (format & BT_LEAF_COMPACT) {
+		if (eid < 0 || eid >= getKeyCount())
+			return RC_NO_SUCH_RECORD;
+
+		int base[3];
+		unsigned char width[3];
+		memcpy(base, buffer + COMPACT_BASE, sizeof(base));
+		memcpy(width, buffer + COMPACT_WIDTH, sizeof(width));
+
+		const char* data = buffer + headerSize();
+		int pos = eid * (width[0] + width[1] + width[2]);
+		key = (int) ((unsigned) base[0] + getBits(data, pos, width[0]));
+		pos += width[0];
+		rid.pid = (int) ((unsigned) base[1] + getBits(data, pos, width[1]));
+		pos += width[1];
+		rid.sid = (int) ((unsigned) base[2] + getBits(data, pos, width[2]));
+		return 0;
+	}
+
+	if (eid < 0 || eid >= maxKeyCount() || eid>=getKeyCount()) //max key is 84
 		return RC_NO_SUCH_RECORD;
 
 	int recordSize = sizeof(RecordId);
@@ -264,12 +368,113 @@ RC BTLeafNode::readEntry(int eid, int& key, RecordId& rid)
 	return 0;
 }
 
+/*
+ * Remove the eid entry from the node.
+ * @param eid[IN] the entry number to remove
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTLeafNode::remove(int eid)
+{
+	int keyCount = getKeyCount();
+	if (eid < 0 || eid >= keyCount)
+		return RC_NO_SUCH_RECORD;
+
+	if (format & BT_LEAF_COMPACT) {
+		int keys [COMPACT_MAX_KEY_NUM];
+		RecordId rids [COMPACT_MAX_KEY_NUM];
+		unpack(keys, rids);
+		memmove(keys + eid, keys + eid + 1, (keyCount - eid - 1) * sizeof(int));
+		memmove(rids + eid, rids + eid + 1, (keyCount - eid - 1) * sizeof(RecordId));
+		return pack(keys, rids, keyCount - 1);
+	}
+
+	//shift the entries behind eid forward and clear the last one
+	int entrySize = sizeof(int) + sizeof(RecordId);
+	char* idx = buffer + (eid * entrySize);
+	memmove(idx, idx + entrySize, (keyCount - eid - 1) * entrySize);
+	memset(buffer + (keyCount - 1) * entrySize, -1, entrySize);
+	return 0;
+}
+
+/*
+ * Replace the RecordId of the eid entry, keeping its key.
+ * @param eid[IN] the entry number
+ * @param rid[IN] the new RecordId
+ * @return 0 if successful. RC_NODE_FULL if a compact node cannot
+ *         encode the new RecordId.
+ */
+RC BTLeafNode::setRecordId(int eid, const RecordId& rid)
+{
+	int keyCount = getKeyCount();
+	if (eid < 0 || eid >= keyCount)
+		return RC_NO_SUCH_RECORD;
+
+	if (format & BT_LEAF_COMPACT) {
+		int keys [COMPACT_MAX_KEY_NUM];
+		RecordId rids [COMPACT_MAX_KEY_NUM];
+		unpack(keys, rids);
+		rids[eid] = rid;
+		return pack(keys, rids, keyCount);
+	}
+
+	memcpy(buffer + eid * (sizeof(int) + sizeof(RecordId)) + sizeof(int), &rid, sizeof(RecordId));
+	return 0;
+}
+
+/*
+ * Check whether the node is less than half full.
+ * @return true if the node should borrow entries or be merged
+ */
+bool BTLeafNode::isUnderflow()
+{
+	int keyCount = getKeyCount();
+
+	//a compact node is half full by entry count or by bits used
+	if (format & BT_LEAF_COMPACT) {
+		unsigned char width[3];
+		memcpy(width, buffer + COMPACT_WIDTH, sizeof(width));
+		int bits = keyCount * (width[0] + width[1] + width[2]);
+		int maxBits = (PAGE_SIZE - headerSize()) * 8;
+		return keyCount < COMPACT_MAX_KEY_NUM / 2 && bits < maxBits / 2;
+	}
+
+	return keyCount < maxKeyCount() / 2;
+}
+
+/*
+ * Return how full the node is, by entry count or, for a compact node,
+ * by bits used, whichever is fuller.
+ * @return the fill of the node in percent
+ */
+int BTLeafNode::getFill()
+{
+	int keyCount = getKeyCount();
+
+	if (format & BT_LEAF_COMPACT) {
+		unsigned char width[3];
+		memcpy(width, buffer + COMPACT_WIDTH, sizeof(width));
+		int bits = keyCount * (width[0] + width[1] + width[2]);
+		int maxBits = (PAGE_SIZE - headerSize()) * 8;
+		int byCount = keyCount * 100 / COMPACT_MAX_KEY_NUM;
+		int byBits = bits * 100 / maxBits;
+		return byCount > byBits ? byCount : byBits;
+	}
+
+	return keyCount * 100 / maxKeyCount();
+}
+
 /*
  * Return the pid of the next slibling node.
  * @return the PageId of the next sibling node 
  */
 PageId BTLeafNode::getNextNodePtr()
 { 
+	if (format & BT_LEAF_COMPACT) {
+		PageId pid;
+		memcpy(&pid, buffer + COMPACT_NEXT, sizeof(PageId));
+		return pid;
+	}
+
 	int entrySize = sizeof(RecordId) + sizeof(int);
 	char* temp = buffer + (MAX_KEY_NUM * entrySize);
 	int key;
@@ -284,12 +489,181 @@ PageId BTLeafNode::getNextNodePtr()
  */
 RC BTLeafNode::setNextNodePtr(PageId pid)
 { 
+	if (format & BT_LEAF_COMPACT) {
+		memcpy(buffer + COMPACT_NEXT, &pid, sizeof(PageId));
+		return 0;
+	}
+
 	int entrySize = sizeof(RecordId) + sizeof(int);
 	char* temp = buffer + (MAX_KEY_NUM * entrySize);
 	memcpy(temp, &pid, MAX_PAGEID_SIZE);
 	return 0;
 }
 
+/*
+ * Return the pid of the previous sibling node.
+ * @return the PageId of the previous sibling node. -1 if there is none,
+ *         or if the node has no BT_LEAF_PREV pointer.
+ */
+PageId BTLeafNode::getPrevNodePtr()
+{
+	PageId pid = -1;
+	if (!(format & BT_LEAF_PREV))
+		return pid;
+
+	if (format & BT_LEAF_COMPACT)
+		memcpy(&pid, buffer + COMPACT_PREV, sizeof(PageId));
+	else
+		memcpy(&pid, buffer + PREV_MAX_KEY_NUM * (sizeof(int) + sizeof(RecordId)), sizeof(PageId));
+	return pid;
+}
+
+/*
+ * Set the pid of the previous sibling node. Ignored without BT_LEAF_PREV.
+ * @param pid[IN] the PageId of the previous sibling node
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTLeafNode::setPrevNodePtr(PageId pid)
+{
+	if (!(format & BT_LEAF_PREV))
+		return 0;
+
+	if (format & BT_LEAF_COMPACT)
+		memcpy(buffer + COMPACT_PREV, &pid, sizeof(PageId));
+	else
+		memcpy(buffer + PREV_MAX_KEY_NUM * (sizeof(int) + sizeof(RecordId)), &pid, sizeof(PageId));
+	return 0;
+}
+
+/*
+ * Decode all entries of the node.
+ * @param keys[OUT] the keys of the node in sorted order
+ * @param rids[OUT] the RecordIds of the node
+ * @return the number of entries decoded
+ */
+int BTLeafNode::unpack(int keys[], RecordId rids[])
+{
+	int count = getKeyCount();
+	for (int eid = 0; eid < count; eid++)
+		readEntry(eid, keys[eid], rids[eid]);
+	return count;
+}
+
+/*
+ * Encode the entries into the node, keeping its node pointers.
+ * The node is left untouched if the entries do not fit in a page.
+ * @param keys[IN] the keys to store in sorted order
+ * @param rids[IN] the RecordIds to store
+ * @param count[IN] the number of entries
+ * @return 0 if successful. RC_NODE_FULL if the entries do not fit.
+ */
+RC BTLeafNode::pack(const int keys[], const RecordId rids[], int count)
+{
+	//standard entries are stored raw in front of the next node pointer
+	if (!(format & BT_LEAF_COMPACT)) {
+		if (count > maxKeyCount())
+			return RC_NODE_FULL;
+
+		PageId next = getNextNodePtr();
+		PageId prev = getPrevNodePtr();
+		int entrySize = sizeof(int) + sizeof(RecordId);
+		memset(buffer, -1, PAGE_SIZE);
+		for (int i = 0; i < count; i++) {
+			memcpy(buffer + i * entrySize, &keys[i], sizeof(int));
+			memcpy(buffer + i * entrySize + sizeof(int), &rids[i], sizeof(RecordId));
+		}
+		setPrevNodePtr(prev);
+		return setNextNodePtr(next);
+	}
+
+	if (count > COMPACT_MAX_KEY_NUM)
+		return RC_NODE_FULL;
+
+	//frame of reference: the smallest value of each field
+	int base[3] = { 0, 0, 0 };
+	if (count > 0) {
+		base[0] = keys[0];
+		base[1] = rids[0].pid;
+		base[2] = rids[0].sid;
+	}
+	for (int i = 1; i < count; i++) {
+		if (rids[i].pid < base[1]) base[1] = rids[i].pid;
+		if (rids[i].sid < base[2]) base[2] = rids[i].sid;
+	}
+
+	//bit width of each field is set by its largest offset
+	unsigned char width[3] = { 0, 0, 0 };
+	for (int i = 0; i < count; i++) {
+		int w;
+		w = bitWidth((unsigned) keys[i] - (unsigned) base[0]);
+		if (w > width[0]) width[0] = w;
+		w = bitWidth((unsigned) rids[i].pid - (unsigned) base[1]);
+		if (w > width[1]) width[1] = w;
+		w = bitWidth((unsigned) rids[i].sid - (unsigned) base[2]);
+		if (w > width[2]) width[2] = w;
+	}
+	if (count * (width[0] + width[1] + width[2]) > (PAGE_SIZE - headerSize()) * 8)
+		return RC_NODE_FULL;
+
+	//build the page in a temporary buffer, keeping the node pointers
+	char temp [PAGE_SIZE];
+	memset(temp, 0, PAGE_SIZE);
+	memcpy(temp + COMPACT_NEXT, buffer + COMPACT_NEXT, sizeof(PageId));
+	if (format & BT_LEAF_PREV)
+		memcpy(temp + COMPACT_PREV, buffer + COMPACT_PREV, sizeof(PageId));
+	memcpy(temp + COMPACT_COUNT, &count, sizeof(int));
+	memcpy(temp + COMPACT_BASE, base, sizeof(base));
+	memcpy(temp + COMPACT_WIDTH, width, sizeof(width));
+
+	char* data = temp + headerSize();
+	int pos = 0;
+	for (int i = 0; i < count; i++) {
+		setBits(data, pos, width[0], (unsigned) keys[i] - (unsigned) base[0]);
+		pos += width[0];
+		setBits(data, pos, width[1], (unsigned) rids[i].pid - (unsigned) base[1]);
+		pos += width[1];
+		setBits(data, pos, width[2], (unsigned) rids[i].sid - (unsigned) base[2]);
+		pos += width[2];
+	}
+
+	memcpy(buffer, temp, PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * Decode the key of the eid entry of a compact node.
+ * @param eid[IN] the entry number
+ * @return the key of the entry
+ */
+int BTLeafNode::compactKey(int eid)
+{
+	int base;
+	unsigned char width[3];
+	memcpy(&base, buffer + COMPACT_BASE, sizeof(int));
+	memcpy(width, buffer + COMPACT_WIDTH, sizeof(width));
+
+	int pos = eid * (width[0] + width[1] + width[2]);
+	return (int) ((unsigned) base + getBits(buffer + headerSize(), pos, width[0]));
+}
+
+/*
+ * Return the maximum number of entries of a standard node.
+ * @return the maximum number of entries
+ */
+int BTLeafNode::maxKeyCount()
+{
+	return (format & BT_LEAF_PREV) ? PREV_MAX_KEY_NUM : MAX_KEY_NUM;
+}
+
+/*
+ * Return the size of the header of a compact node.
+ * @return the offset of the first bit-packed entry
+ */
+int BTLeafNode::headerSize()
+{
+	return COMPACT_HEADER_SIZE + ((format & BT_LEAF_PREV) ? sizeof(PageId) : 0);
+}
+
 /*
  * Read the content of the node from the page pid in the PageFile pf.
  * @param pid[IN] the PageId to read
@@ -334,9 +708,10 @@ int BTNonLeafNode::getKeyCount()
  * Insert a (key, pid) pair to the node.
  * @param key[IN] the key to insert
  * @param pid[IN] the PageId to insert
+ * @param count[IN] the number of pairs below pid (BT_NONLEAF_COUNTS only)
  * @return 0 if successful. Return an error code if the node is full.
  */
-RC BTNonLeafNode::insert(int key, PageId pid)
+RC BTNonLeafNode::insert(int key, PageId pid, int count)
 { 
 
   int keySize = sizeof(int), pageSize = sizeof(PageId);
@@ -350,7 +725,7 @@ RC BTNonLeafNode::insert(int key, PageId pid)
   int nextNode = 0;
 
   //make sure there is enough room in the node to insert
-  if (keyCount >= MAX_KEY_NUM)
+  if (keyCount >= getMaxKeyCount())
     return RC_NODE_FULL;
 
   //find position to insert new entry and attach next node pointer at the end
@@ -394,6 +769,9 @@ RC BTNonLeafNode::insert(int key, PageId pid)
   //clear old buffer and fill it with new contents
   memset(buffer, -1, PAGE_SIZE);
   memcpy(buffer, temp, PAGE_SIZE);
+
+  //the new child pointer follows the new key
+  insertCount((eid - pageSize) / entrySize + 1, count);
   return 0;
 
  }
@@ -406,104 +784,47 @@ RC BTNonLeafNode::insert(int key, PageId pid)
  * @param pid[IN] the PageId to insert
  * @param sibling[IN] the sibling node to split with. This node MUST be empty when this function is called.
  * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
+ * @param count[IN] the number of pairs below pid (BT_NONLEAF_COUNTS only)
+ * @param rightEdge[IN] true if the node is the last one of its level
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNonLeafNode::insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey)
+RC BTNonLeafNode::insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey, int count,
+                                  bool rightEdge)
 {
   if (sibling.getKeyCount() != 0)
     return RC_FILE_WRITE_FAILED;
 
-
-  int eid = 0; int keyCount = getKeyCount();
-  int leftOrRight = 0;
-
-  //find where the key is inserted
-  int keySize = sizeof(int);
-  int pageSize = sizeof(int);
-  int entrySize = keySize + pageSize;
-
-  int findkey;
-  int i;
-  char * current_idx = buffer + pageSize;
-  int maxSize = (keyCount*entrySize)+pageSize;
-  for (i = pageSize; i < maxSize ; i += entrySize, current_idx+= entrySize) {
-    //get the search key and recordID
-    memcpy(&findkey, current_idx, keySize);
-    if (findkey >= key || findkey == -1) {      
-      break;
-    }
-  }
-  eid = i;
-
-  //if eid is greater than 44 nodes
-  if (eid > (((keyCount/2)+1)*entrySize)+pageSize)
-    leftOrRight = 1;
-
-  int divide = keyCount/2 + 1;
-  if (leftOrRight == 1)
-    divide++;
-
-  //idx is beginning of copy
-  char* idx = buffer + pageSize + (divide*entrySize);
-
-  //tocopy is how much to copy
-  int toCopy = (keyCount - divide)*entrySize;
-
-  //create temp buffer and copy the last half
-  char temp [PAGE_SIZE];
-  memcpy(&temp, idx, toCopy);
-
-  //delete copied data
-  memset(idx, -1, toCopy);
-
-  //get the first pageid for sibling
-  //insert node first if needed
-  if (leftOrRight == 0) {
-  	if (insert(key, pid))
-  		return RC_FILE_WRITE_FAILED;
-  	idx = idx + keySize;
-  } else {
-  	idx = idx - pageSize;
-  }
-  
-  //idx now has the pageid for sibling
-  //initialize sibling node with root
-  PageId p1;
-  PageId p2;
-  int k;
-  memcpy(&p1, idx, pageSize);
-  char * temphead = temp;
-  memcpy(&k, temphead, keySize);
-  temphead = temphead + keySize;
-  memcpy(&p2, temphead, pageSize);
-  if (sibling.initializeRoot(p1, k, p2)){
-  	return RC_FILE_WRITE_FAILED;
-  }
-
-  //copy rest of temp buffer to sibling.
-  temphead += pageSize;
-  for(i = entrySize; i < toCopy; i += entrySize) {
-  	memcpy(&k, temphead, keySize);
-  	memcpy(&p1, temphead+keySize, pageSize);
-
-  	if(sibling.insert(k, p1)){
-  		return RC_FILE_WRITE_FAILED;
-  	}
-  	temphead += entrySize;
+  //lay out the keys, child pointers and counts with the new entry in place
+  int keyCount = getKeyCount();
+  int keys [MAX_KEY_NUM + 1];
+  PageId pids [MAX_KEY_NUM + 2];
+  int counts [MAX_KEY_NUM + 2];
+  for (int i = 0; i <= keyCount; i++) {
+    if (i < keyCount)
+      keys[i] = getKey(i);
+    pids[i] = getChildPtr(i);
+    counts[i] = getCount(i);
   }
 
-  //take midkey out of left node
-  idx = idx - pageSize;
-  memcpy(&midKey, idx, keySize);
-  
-  //delete the midkey
-  memset(idx, -1, entrySize);
-
-  //inser to right side if right side
-  if (leftOrRight == 1) {
-  	if (sibling.insert(key, pid))
-  		return RC_FILE_WRITE_FAILED;
-  }
+  int pos = locateChildIndex(key);
+  memmove(keys + pos + 1, keys + pos, (keyCount - pos) * sizeof(int));
+  memmove(pids + pos + 2, pids + pos + 1, (keyCount - pos) * sizeof(PageId));
+  memmove(counts + pos + 2, counts + pos + 1, (keyCount - pos) * sizeof(int));
+  keys[pos] = key;
+  pids[pos + 1] = pid;
+  counts[pos + 1] = count;
+  keyCount++;
+
+  //the middle key moves up to the parent and the keys behind it go to
+  //the sibling, whose first child pointer is the one behind the middle key
+  int mid = keyCount / 2;
+
+  //a key appended to the last node of a level leaves one key for the sibling
+  if (rightEdge && pos == keyCount - 1)
+    mid = keyCount - 2;
+  midKey = keys[mid];
+  sibling.store(keys + mid + 1, pids + mid + 1, counts + mid + 1, keyCount - mid - 1);
+  store(keys, pids, counts, mid);
   return 0;
 }
 
@@ -590,4 +911,639 @@ int BTNonLeafNode::getFirstKey(){
   int firstkey;
   memcpy(&firstkey, idx, sizeof(int));
   return firstkey;
-}
\ No newline at end of file
+}
+
+/*
+ * Return the i-th child pointer of the node (0 <= i <= getKeyCount()).
+ * @param i[IN] the position of the child pointer
+ * @return the PageId of the child
+ */
+PageId BTNonLeafNode::getChildPtr(int i)
+{
+  PageId pid;
+  memcpy(&pid, buffer + i * (sizeof(int) + sizeof(PageId)), sizeof(PageId));
+  return pid;
+}
+
+/*
+ * Replace the i-th child pointer of the node.
+ * @param i[IN] the position of the child pointer
+ * @param pid[IN] the PageId of the child
+ */
+void BTNonLeafNode::setChildPtr(int i, PageId pid)
+{
+  memcpy(buffer + i * (sizeof(int) + sizeof(PageId)), &pid, sizeof(PageId));
+}
+
+/*
+ * Return the i-th key of the node (0 <= i < getKeyCount()).
+ * @param i[IN] the position of the key
+ * @return the key
+ */
+int BTNonLeafNode::getKey(int i)
+{
+  int key;
+  memcpy(&key, buffer + sizeof(PageId) + i * (sizeof(int) + sizeof(PageId)), sizeof(int));
+  return key;
+}
+
+/*
+ * Replace the i-th key of the node.
+ * @param i[IN] the position of the key
+ * @param key[IN] the new key
+ */
+void BTNonLeafNode::setKey(int i, int key)
+{
+  memcpy(buffer + sizeof(PageId) + i * (sizeof(int) + sizeof(PageId)), &key, sizeof(int));
+}
+
+/*
+ * Given the searchKey, find the position of the child pointer to follow.
+ * @param searchKey[IN] the searchKey that is being looked up.
+ * @return the position of the child pointer to follow
+ */
+int BTNonLeafNode::locateChildIndex(int searchKey)
+{
+  int numKeys = getKeyCount();
+  int i;
+  for (i = 0; i < numKeys; i++) {
+    if (getKey(i) > searchKey)
+      break;
+  }
+  return i;
+}
+
+/*
+ * Remove the i-th key and the child pointer behind it.
+ * @param i[IN] the position of the key
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::remove(int i)
+{
+  int entrySize = sizeof(int) + sizeof(PageId);
+  int keyCount = getKeyCount();
+  if (i < 0 || i >= keyCount)
+    return RC_INVALID_ATTRIBUTE;
+
+  char* idx = buffer + sizeof(PageId) + i * entrySize;
+  memmove(idx, idx + entrySize, (keyCount - i - 1) * entrySize);
+  memset(buffer + sizeof(PageId) + (keyCount - 1) * entrySize, -1, entrySize);
+  removeCount(i + 1);
+  return 0;
+}
+
+/*
+ * Remove the first child pointer and the first key.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::removeFirst()
+{
+  int entrySize = sizeof(int) + sizeof(PageId);
+  int keyCount = getKeyCount();
+  if (keyCount == 0)
+    return RC_INVALID_ATTRIBUTE;
+
+  memmove(buffer, buffer + entrySize, sizeof(PageId) + (keyCount - 1) * entrySize);
+  memset(buffer + sizeof(PageId) + (keyCount - 1) * entrySize, -1, entrySize);
+  removeCount(0);
+  return 0;
+}
+
+/*
+ * Insert a (pid, key) pair in front of the node.
+ * @param pid[IN] the new first child pointer
+ * @param key[IN] the key between pid and the former first child pointer
+ * @param count[IN] the number of pairs below pid (BT_NONLEAF_COUNTS only)
+ * @return 0 if successful. Return an error code if the node is full.
+ */
+RC BTNonLeafNode::insertFirst(PageId pid, int key, int count)
+{
+  int entrySize = sizeof(int) + sizeof(PageId);
+  int keyCount = getKeyCount();
+  if (keyCount >= getMaxKeyCount())
+    return RC_NODE_FULL;
+
+  memmove(buffer + entrySize, buffer, sizeof(PageId) + keyCount * entrySize);
+  memcpy(buffer, &pid, sizeof(PageId));
+  memcpy(buffer + sizeof(PageId), &key, sizeof(int));
+  insertCount(0, count);
+  return 0;
+}
+
+/*
+ * Check whether the node is less than half full.
+ * @return true if the node should borrow entries or be merged
+ */
+bool BTNonLeafNode::isUnderflow()
+{
+  return getKeyCount() < getMaxKeyCount() / 2;
+}
+
+/*
+ * Return the maximum number of keys the node can hold.
+ * @return the maximum number of keys
+ */
+int BTNonLeafNode::getMaxKeyCount()
+{
+  return (format & BT_NONLEAF_COUNTS) ? COUNTED_MAX_KEY_NUM : MAX_KEY_NUM;
+}
+
+/*
+ * Return the number of (key, rid) pairs below the i-th child pointer.
+ * @param i[IN] the position of the child pointer
+ * @return the number of pairs. 0 without BT_NONLEAF_COUNTS.
+ */
+int BTNonLeafNode::getCount(int i)
+{
+  if (!(format & BT_NONLEAF_COUNTS))
+    return 0;
+
+  int count;
+  memcpy(&count, buffer + NONLEAF_COUNTS + i * sizeof(int), sizeof(int));
+  return count;
+}
+
+/*
+ * Set the number of (key, rid) pairs below the i-th child pointer.
+ * @param i[IN] the position of the child pointer
+ * @param count[IN] the number of pairs
+ */
+void BTNonLeafNode::setCount(int i, int count)
+{
+  if (format & BT_NONLEAF_COUNTS)
+    memcpy(buffer + NONLEAF_COUNTS + i * sizeof(int), &count, sizeof(int));
+}
+
+/*
+ * Return the number of (key, rid) pairs below the node.
+ * @return the number of pairs. 0 without BT_NONLEAF_COUNTS.
+ */
+int BTNonLeafNode::getTotal()
+{
+  int total = 0;
+  int keyCount = getKeyCount();
+  for (int i = 0; i <= keyCount; i++)
+    total += getCount(i);
+  return total;
+}
+
+/*
+ * Return the first page of the insert buffer of the node.
+ * @return the PageId of the page. -1 if the buffer is empty or the
+ *         node has none (without BT_BUFFERED)
+ */
+PageId BTNonLeafNode::getBufferPtr()
+{
+  if (!(format & BT_BUFFERED))
+    return -1;
+
+  PageId pid;
+  memcpy(&pid, buffer + NONLEAF_BUFFER, sizeof(PageId));
+  return pid;
+}
+
+/*
+ * Set the first page of the insert buffer of the node.
+ * Ignored without BT_BUFFERED.
+ * @param pid[IN] the PageId of the page. -1 for an empty buffer
+ */
+void BTNonLeafNode::setBufferPtr(PageId pid)
+{
+  if (format & BT_BUFFERED)
+    memcpy(buffer + NONLEAF_BUFFER, &pid, sizeof(PageId));
+}
+
+/*
+ * Make room for the count of a child pointer inserted at position i.
+ * @param i[IN] the position of the new child pointer
+ * @param count[IN] its count
+ */
+void BTNonLeafNode::insertCount(int i, int count)
+{
+  if (!(format & BT_NONLEAF_COUNTS))
+    return;
+
+  char* idx = buffer + NONLEAF_COUNTS + i * sizeof(int);
+  memmove(idx + sizeof(int), idx, (COUNTED_MAX_KEY_NUM - i) * sizeof(int));
+  memcpy(idx, &count, sizeof(int));
+}
+
+/*
+ * Drop the count of the child pointer removed from position i.
+ * @param i[IN] the position of the removed child pointer
+ */
+void BTNonLeafNode::removeCount(int i)
+{
+  if (!(format & BT_NONLEAF_COUNTS))
+    return;
+
+  char* idx = buffer + NONLEAF_COUNTS + i * sizeof(int);
+  memmove(idx, idx + sizeof(int), (COUNTED_MAX_KEY_NUM - i) * sizeof(int));
+  setCount(COUNTED_MAX_KEY_NUM, 0);
+}
+
+/*
+ * Rewrite the node with the given keys, child pointers and counts.
+ * @param keys[IN] the keys in sorted order
+ * @param pids[IN] the keyCount + 1 child pointers
+ * @param counts[IN] the keyCount + 1 counts
+ * @param keyCount[IN] the number of keys
+ */
+void BTNonLeafNode::store(const int keys[], const PageId pids[], const int counts[], int keyCount)
+{
+  int entrySize = sizeof(int) + sizeof(PageId);
+
+  //the node keeps its insert buffer
+  PageId bufferPid = getBufferPtr();
+  memset(buffer, -1, PAGE_SIZE);
+  setBufferPtr(bufferPid);
+  memcpy(buffer, &pids[0], sizeof(PageId));
+  for (int i = 0; i < keyCount; i++) {
+    memcpy(buffer + sizeof(PageId) + i * entrySize, &keys[i], sizeof(int));
+    memcpy(buffer + (i + 1) * entrySize, &pids[i + 1], sizeof(PageId));
+  }
+  for (int i = 0; i <= keyCount; i++)
+    setCount(i, counts[i]);
+}
+
+//
+// layout of a posting list page: entry count, next page pointer, the
+// largest value, the number of data bytes used and the entry count of the
+// whole list (kept up to date in the first page only), followed by the deltas
+// between the ascending values as 7-bit varints. a RecordId is stored as
+// the value pid * RECORDS_PER_PAGE + sid
+//
+const int POSTING_COUNT = 0;
+const int POSTING_NEXT = 4;
+const int POSTING_LAST = 8;
+const int POSTING_SIZE = 12;
+const int POSTING_TOTAL = 16;
+const int POSTING_HEADER_SIZE = 20;
+const int POSTING_MAX_SIZE = PAGE_SIZE - POSTING_HEADER_SIZE;
+
+static unsigned postingValue(const RecordId& rid)
+{ return (unsigned) rid.pid * RecordFile::RECORDS_PER_PAGE + rid.sid; }
+
+/*
+ * Append v to data as a varint at offset pos.
+ * @return the number of bytes written, 0 if they do not fit before end
+ */
+static int putVarint(char* data, int pos, int end, unsigned v)
+{
+	int len = 0;
+	do {
+		if (pos + len >= end)
+			return 0;
+		unsigned char b = v & 0x7f;
+		v >>= 7;
+		data[pos + len++] = (char) (v ? (b | 0x80) : b);
+	} while (v);
+	return len;
+}
+
+BTPostingNode::BTPostingNode()
+{
+	memset(buffer, 0, PAGE_SIZE);
+	setNextNodePtr(-1);
+}
+
+/*
+ * Read the content of the node from the page pid in the PageFile pf.
+ * @param pid[IN] the PageId to read
+ * @param pf[IN] PageFile to read from
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTPostingNode::read(PageId pid, const PageFile& pf)
+{ return pf.read(pid, buffer); }
+
+/*
+ * Write the content of the node to the page pid in the PageFile pf.
+ * @param pid[IN] the PageId to write to
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTPostingNode::write(PageId pid, PageFile& pf)
+{ return pf.write(pid, buffer); }
+
+/*
+ * Return the number of RecordIds stored in the page.
+ * @return the number of RecordIds in the page
+ */
+int BTPostingNode::getCount()
+{
+	int count;
+	memcpy(&count, buffer + POSTING_COUNT, sizeof(int));
+	return count;
+}
+
+/*
+ * Return the number of RecordIds in the whole list (first page only).
+ * @return the number of RecordIds in the list
+ */
+int BTPostingNode::getTotal()
+{
+	int total;
+	memcpy(&total, buffer + POSTING_TOTAL, sizeof(int));
+	return total;
+}
+
+/*
+ * Set the number of RecordIds in the whole list (first page only).
+ * @param total[IN] the number of RecordIds in the list
+ */
+void BTPostingNode::setTotal(int total)
+{
+	memcpy(buffer + POSTING_TOTAL, &total, sizeof(int));
+}
+
+/*
+ * Return the pid of the next page of the posting list.
+ * @return the PageId of the next page, -1 if this is the last one
+ */
+PageId BTPostingNode::getNextNodePtr()
+{
+	PageId pid;
+	memcpy(&pid, buffer + POSTING_NEXT, sizeof(PageId));
+	return pid;
+}
+
+/*
+ * Set the pid of the next page of the posting list.
+ * @param pid[IN] the PageId of the next page
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTPostingNode::setNextNodePtr(PageId pid)
+{
+	memcpy(buffer + POSTING_NEXT, &pid, sizeof(PageId));
+	return 0;
+}
+
+/*
+ * Decode all RecordIds of the page.
+ * @param rids[OUT] the RecordIds in ascending order (MAX_RID_NUM slots)
+ * @return the number of RecordIds decoded
+ */
+int BTPostingNode::readAll(RecordId rids[])
+{
+	int count = getCount();
+	const unsigned char* data = (const unsigned char*) buffer + POSTING_HEADER_SIZE;
+	unsigned v = 0;
+	int pos = 0;
+	for (int i = 0; i < count; i++) {
+		unsigned delta = 0;
+		int shift = 0;
+		do {
+			delta |= (unsigned) (data[pos] & 0x7f) << shift;
+			shift += 7;
+		} while (data[pos++] & 0x80);
+		v += delta;
+		rids[i].pid = v / RecordFile::RECORDS_PER_PAGE;
+		rids[i].sid = v % RecordFile::RECORDS_PER_PAGE;
+	}
+	return count;
+}
+
+/*
+ * Add the rid to the page.
+ * @param rid[IN] the RecordId to add
+ * @return 0 if successful. RC_NODE_FULL if the page has no room.
+ */
+RC BTPostingNode::insert(const RecordId& rid)
+{
+	int count = getCount(), size, last;
+	unsigned v = postingValue(rid);
+	memcpy(&size, buffer + POSTING_SIZE, sizeof(int));
+	memcpy(&last, buffer + POSTING_LAST, sizeof(int));
+
+	//RecordIds usually arrive in ascending order and are simply appended
+	if (count == 0 || v > (unsigned) last) {
+		if (count >= MAX_RID_NUM)
+			return RC_NODE_FULL;
+		unsigned delta = (count == 0) ? v : v - (unsigned) last;
+		int len = putVarint(buffer + POSTING_HEADER_SIZE, size, POSTING_MAX_SIZE, delta);
+		if (len == 0)
+			return RC_NODE_FULL;
+		count++;
+		size += len;
+		memcpy(buffer + POSTING_COUNT, &count, sizeof(int));
+		memcpy(buffer + POSTING_LAST, &v, sizeof(int));
+		memcpy(buffer + POSTING_SIZE, &size, sizeof(int));
+		return 0;
+	}
+
+	if (count >= MAX_RID_NUM)
+		return RC_NODE_FULL;
+
+	//otherwise decode, insert in order and encode again
+	RecordId rids [MAX_RID_NUM];
+	unsigned values [MAX_RID_NUM];
+	readAll(rids);
+	int i, j;
+	for (i = 0, j = 0; i < count; i++) {
+		unsigned w = postingValue(rids[i]);
+		if (j == i && w > v)
+			values[j++] = v;
+		values[j++] = w;
+	}
+	if (j == count)
+		values[j++] = v;
+	return encode(values, count + 1);
+}
+
+/*
+ * Remove the rid from the page.
+ * @param rid[IN] the RecordId to remove
+ * @return 0 if successful. RC_NO_SUCH_RECORD if rid is not in the page.
+ */
+RC BTPostingNode::remove(const RecordId& rid)
+{
+	RecordId rids [MAX_RID_NUM];
+	unsigned values [MAX_RID_NUM];
+	int count = readAll(rids);
+	unsigned v = postingValue(rid);
+	int j = 0;
+	for (int i = 0; i < count; i++) {
+		unsigned w = postingValue(rids[i]);
+		if (w != v || j < i)
+			values[j++] = w;
+	}
+	if (j == count)
+		return RC_NO_SUCH_RECORD;
+	return encode(values, j);
+}
+
+/*
+ * Encode the sorted values into the page, keeping its next pointer.
+ * The page is left untouched if the values do not fit.
+ * @param values[IN] the encoded RecordIds in ascending order
+ * @param count[IN] the number of values
+ * @return 0 if successful. RC_NODE_FULL if the values do not fit.
+ */
+RC BTPostingNode::encode(const unsigned values[], int count)
+{
+	char temp [PAGE_SIZE];
+	memset(temp, 0, PAGE_SIZE);
+	memcpy(temp + POSTING_NEXT, buffer + POSTING_NEXT, sizeof(PageId));
+	memcpy(temp + POSTING_TOTAL, buffer + POSTING_TOTAL, sizeof(int));
+
+	int size = 0;
+	unsigned last = 0;
+	for (int i = 0; i < count; i++) {
+		int len = putVarint(temp + POSTING_HEADER_SIZE, size, POSTING_MAX_SIZE, values[i] - last);
+		if (len == 0)
+			return RC_NODE_FULL;
+		size += len;
+		last = values[i];
+	}
+	memcpy(temp + POSTING_COUNT, &count, sizeof(int));
+	memcpy(temp + POSTING_LAST, &last, sizeof(int));
+	memcpy(temp + POSTING_SIZE, &size, sizeof(int));
+
+	memcpy(buffer, temp, PAGE_SIZE);
+	return 0;
+}
+
+//
+// layout of an insert buffer page: entry count, next page pointer and the
+// page count of the whole buffer (kept up to date in the first page only),
+// followed by the (key, rid) pairs
+//
+const int BUFFER_COUNT = 0;
+const int BUFFER_NEXT = 4;
+const int BUFFER_PAGES = 8;
+const int BUFFER_HEADER_SIZE = 12;
+const int BUFFER_ENTRY_SIZE = sizeof(int) + sizeof(RecordId);
+
+BTBufferNode::BTBufferNode()
+{
+	memset(buffer, 0, PAGE_SIZE);
+	setNextNodePtr(-1);
+	setPageCount(1);
+}
+
+/*
+ * Read the content of the node from the page pid in the PageFile pf.
+ * @param pid[IN] the PageId to read
+ * @param pf[IN] PageFile to read from
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTBufferNode::read(PageId pid, const PageFile& pf)
+{ return pf.read(pid, buffer); }
+
+/*
+ * Write the content of the node to the page pid in the PageFile pf.
+ * @param pid[IN] the PageId to write to
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTBufferNode::write(PageId pid, PageFile& pf)
+{ return pf.write(pid, buffer); }
+
+/*
+ * Add a (key, rid) pair to the page.
+ * @param key[IN] the key
+ * @param rid[IN] the RecordId
+ * @return 0 if successful. RC_NODE_FULL if the page has no room.
+ */
+RC BTBufferNode::insert(int key, const RecordId& rid)
+{
+	int count = getCount();
+	if (count >= MAX_MESSAGE_NUM)
+		return RC_NODE_FULL;
+
+	char* idx = buffer + BUFFER_HEADER_SIZE + count * BUFFER_ENTRY_SIZE;
+	memcpy(idx, &key, sizeof(int));
+	memcpy(idx + sizeof(int), &rid, sizeof(RecordId));
+	count++;
+	memcpy(buffer + BUFFER_COUNT, &count, sizeof(int));
+	return 0;
+}
+
+/*
+ * Read the (key, rid) pair of entry eid.
+ * @param eid[IN] the entry number (0 <= eid < getCount())
+ * @param key[OUT] the key
+ * @param rid[OUT] the RecordId
+ * @return 0 if successful. RC_NO_SUCH_RECORD if there is no such entry.
+ */
+RC BTBufferNode::readEntry(int eid, int& key, RecordId& rid)
+{
+	if (eid < 0 || eid >= getCount())
+		return RC_NO_SUCH_RECORD;
+
+	char* idx = buffer + BUFFER_HEADER_SIZE + eid * BUFFER_ENTRY_SIZE;
+	memcpy(&key, idx, sizeof(int));
+	memcpy(&rid, idx + sizeof(int), sizeof(RecordId));
+	return 0;
+}
+
+/*
+ * Remove entry eid. The last entry of the page takes its place.
+ * @param eid[IN] the entry number
+ * @return 0 if successful. RC_NO_SUCH_RECORD if there is no such entry.
+ */
+RC BTBufferNode::remove(int eid)
+{
+	int count = getCount();
+	if (eid < 0 || eid >= count)
+		return RC_NO_SUCH_RECORD;
+
+	count--;
+	memcpy(buffer + BUFFER_HEADER_SIZE + eid * BUFFER_ENTRY_SIZE,
+	       buffer + BUFFER_HEADER_SIZE + count * BUFFER_ENTRY_SIZE, BUFFER_ENTRY_SIZE);
+	memcpy(buffer + BUFFER_COUNT, &count, sizeof(int));
+	return 0;
+}
+
+/*
+ * Return the number of pairs stored in the page.
+ * @return the number of pairs in the page
+ */
+int BTBufferNode::getCount()
+{
+	int count;
+	memcpy(&count, buffer + BUFFER_COUNT, sizeof(int));
+	return count;
+}
+
+/*
+ * Return the number of pages of the whole buffer (first page only).
+ * @return the number of pages
+ */
+int BTBufferNode::getPageCount()
+{
+	int count;
+	memcpy(&count, buffer + BUFFER_PAGES, sizeof(int));
+	return count;
+}
+
+/*
+ * Set the number of pages of the whole buffer (first page only).
+ * @param count[IN] the number of pages
+ */
+void BTBufferNode::setPageCount(int count)
+{
+	memcpy(buffer + BUFFER_PAGES, &count, sizeof(int));
+}
+
+/*
+ * Return the pid of the next page of the buffer.
+ * @return the PageId of the next page, -1 if this is the last one
+ */
+PageId BTBufferNode::getNextNodePtr()
+{
+	PageId pid;
+	memcpy(&pid, buffer + BUFFER_NEXT, sizeof(PageId));
+	return pid;
+}
+
+/*
+ * Set the pid of the next page of the buffer.
+ * @param pid[IN] the PageId of the next page
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTBufferNode::setNextNodePtr(PageId pid)
+{
+	memcpy(buffer + BUFFER_NEXT, &pid, sizeof(PageId));
+	return 0;
+}
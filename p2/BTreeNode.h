@@ -15,13 +15,45 @@
 #include "PageFile.h"
 #include <string.h>
 
+/**
+ * Node format flags of a B+tree. The flags are chosen when the index is
+ * created, stored in its header page and handed to every node it reads.
+ */
+const int BT_LEAF_COMPACT = 0x1;  // bit-packed leaf entries (see BTLeafNode)
+const int BT_NONLEAF_COUNTS = 0x2; // subtree entry counts in nonleaf nodes
+const int BT_LEAF_PREV = 0x4;      // previous sibling pointers in leaf nodes
+const int BT_COPY_ON_WRITE = 0x8;  // nodes are copied, never overwritten (see BTreeIndex)
+const int BT_BUFFERED = 0x10;      // insert buffers in nonleaf nodes (see BTBufferNode)
+
+/**
+ * Duplicate keys. Up to BT_INLINE_RID_NUM entries of a key are kept next
+ * to each other in its leaf. Beyond that the RecordIds move to a posting
+ * list (see BTPostingNode) and the leaf keeps a single entry for the key
+ * whose rid.pid is the first posting list page and rid.sid BT_POSTING_SID.
+ */
+const int BT_INLINE_RID_NUM = 4;
+const int BT_POSTING_SID = -2;
+
 /**
  * BTLeafNode: The class representing a B+tree leaf node.
+ *
+ * A standard leaf stores up to 85 raw (key, rid) entries followed by the
+ * next sibling pointer. A BT_LEAF_COMPACT leaf instead starts with a small
+ * header (entry count, next pointer, the smallest key/pid/sid and the bit
+ * width of each field) followed by bit-packed entries that hold every field
+ * as an offset from its smallest value. The entries have a fixed width, so
+ * readEntry() and locate() decode them in place without unpacking the page.
+ * With BT_LEAF_PREV a leaf also links to its previous sibling, which takes
+ * the place of the last entry of a standard leaf (84 entries are left) or
+ * follows the header of a compact leaf.
  */
 class BTLeafNode {
   public:
-    BTLeafNode() {
+    BTLeafNode(int format = 0) {
+        this->format = format;
         memset(buffer, -1, PageFile::PAGE_SIZE);
+        if (format & BT_LEAF_COMPACT)
+          pack(NULL, NULL, 0);
     }
 
    /**
@@ -42,9 +74,13 @@ class BTLeafNode {
     * @param rid[IN] the RecordId to insert.
     * @param sibling[IN] the sibling node to split with. This node MUST be EMPTY when this function is called.
     * @param siblingKey[OUT] the first key in the sibling node after split.
+    * @param rightEdge[IN] true if the node is the last leaf of the tree. an
+    *                      entry going behind all others then moves to the
+    *                      sibling alone, so ascending inserts fill the leaves
     * @return 0 if successful. Return an error code if there is an error.
     */
-    RC insertAndSplit(int key, const RecordId& rid, BTLeafNode& sibling, int& siblingKey);
+    RC insertAndSplit(int key, const RecordId& rid, BTLeafNode& sibling, int& siblingKey,
+                      bool rightEdge = false);
 
    /**
     * If searchKey exists in the node, set eid to the index entry
@@ -68,6 +104,35 @@ class BTLeafNode {
     */
     RC readEntry(int eid, int& key, RecordId& rid);
 
+   /**
+    * Remove the eid entry from the node.
+    * @param eid[IN] the entry number to remove
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC remove(int eid);
+
+   /**
+    * Replace the RecordId of the eid entry, keeping its key.
+    * @param eid[IN] the entry number
+    * @param rid[IN] the new RecordId
+    * @return 0 if successful. RC_NODE_FULL if a compact node cannot
+    *         encode the new RecordId.
+    */
+    RC setRecordId(int eid, const RecordId& rid);
+
+   /**
+    * Check whether the node is less than half full.
+    * @return true if the node should borrow entries or be merged
+    */
+    bool isUnderflow();
+
+   /**
+    * Return how full the node is, by entry count or, for a compact node,
+    * by bits used, whichever is fuller.
+    * @return the fill of the node in percent
+    */
+    int getFill();
+
    /**
     * Return the pid of the next slibling node.
     * @return the PageId of the next sibling node 
@@ -82,6 +147,20 @@ class BTLeafNode {
     */
     RC setNextNodePtr(PageId pid);
 
+   /**
+    * Return the pid of the previous sibling node.
+    * @return the PageId of the previous sibling node. -1 if there is none,
+    *         or if the node has no BT_LEAF_PREV pointer.
+    */
+    PageId getPrevNodePtr();
+
+   /**
+    * Set the previous sibling node PageId. Ignored without BT_LEAF_PREV.
+    * @param pid[IN] the PageId of the previous sibling node
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setPrevNodePtr(PageId pid);
+
    /**
     * Return the number of keys stored in the node.
     * @return the number of keys in the node
@@ -105,6 +184,48 @@ class BTLeafNode {
     RC write(PageId pid, PageFile& pf);
 
   private:
+   /**
+    * Decode all entries of the node.
+    * @param keys[OUT] the keys of the node in sorted order
+    * @param rids[OUT] the RecordIds of the node
+    * @return the number of entries decoded
+    */
+    int unpack(int keys[], RecordId rids[]);
+
+   /**
+    * Encode the entries into the node, keeping its node pointers.
+    * The node is left untouched if the entries do not fit in a page.
+    * @param keys[IN] the keys to store in sorted order
+    * @param rids[IN] the RecordIds to store
+    * @param count[IN] the number of entries
+    * @return 0 if successful. RC_NODE_FULL if the entries do not fit.
+    */
+    RC pack(const int keys[], const RecordId rids[], int count);
+
+   /**
+    * Decode the key of the eid entry of a compact node.
+    * @param eid[IN] the entry number
+    * @return the key of the entry
+    */
+    int compactKey(int eid);
+
+   /**
+    * Return the maximum number of entries of a standard node.
+    * @return the maximum number of entries
+    */
+    int maxKeyCount();
+
+   /**
+    * Return the size of the header of a compact node.
+    * @return the offset of the first bit-packed entry
+    */
+    int headerSize();
+
+   /**
+    * The format flags of the index that owns this node.
+    */
+    int format;
+
    /**
     * The main memory buffer for loading the content of the disk page 
     * that contains the node.
@@ -113,12 +234,121 @@ class BTLeafNode {
 }; 
 
 
+/**
+ * BTPostingNode: The class representing a page of a posting list.
+ *
+ * The page holds the RecordIds of one key in ascending order, each one
+ * encoded as a variable-length delta from the one before it. Pages of a
+ * list are chained by their next pointers in no particular order, and the
+ * first page also keeps the number of RecordIds in the whole list.
+ */
+class BTPostingNode {
+  public:
+   /**
+    * The maximum number of RecordIds in a page.
+    */
+    static const int MAX_RID_NUM = 1004;
+
+    BTPostingNode();
+
+   /**
+    * Add the rid to the page.
+    * @param rid[IN] the RecordId to add
+    * @return 0 if successful. RC_NODE_FULL if the page has no room.
+    */
+    RC insert(const RecordId& rid);
+
+   /**
+    * Remove the rid from the page.
+    * @param rid[IN] the RecordId to remove
+    * @return 0 if successful. RC_NO_SUCH_RECORD if rid is not in the page.
+    */
+    RC remove(const RecordId& rid);
+
+   /**
+    * Decode all RecordIds of the page.
+    * @param rids[OUT] the RecordIds in ascending order (MAX_RID_NUM slots)
+    * @return the number of RecordIds decoded
+    */
+    int readAll(RecordId rids[]);
+
+   /**
+    * Return the number of RecordIds stored in the page.
+    * @return the number of RecordIds in the page
+    */
+    int getCount();
+
+   /**
+    * Return the number of RecordIds in the whole list (first page only).
+    * @return the number of RecordIds in the list
+    */
+    int getTotal();
+
+   /**
+    * Set the number of RecordIds in the whole list (first page only).
+    * @param total[IN] the number of RecordIds in the list
+    */
+    void setTotal(int total);
+
+   /**
+    * Return the pid of the next page of the posting list.
+    * @return the PageId of the next page, -1 if this is the last one
+    */
+    PageId getNextNodePtr();
+
+   /**
+    * Set the pid of the next page of the posting list.
+    * @param pid[IN] the PageId of the next page
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setNextNodePtr(PageId pid);
+
+   /**
+    * Read the content of the node from the page pid in the PageFile pf.
+    * @param pid[IN] the PageId to read
+    * @param pf[IN] PageFile to read from
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC read(PageId pid, const PageFile& pf);
+
+   /**
+    * Write the content of the node to the page pid in the PageFile pf.
+    * @param pid[IN] the PageId to write to
+    * @param pf[IN] PageFile to write to
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC write(PageId pid, PageFile& pf);
+
+  private:
+   /**
+    * Encode the sorted values into the page, keeping its next pointer.
+    * The page is left untouched if the values do not fit.
+    * @param values[IN] the encoded RecordIds in ascending order
+    * @param count[IN] the number of values
+    * @return 0 if successful. RC_NODE_FULL if the values do not fit.
+    */
+    RC encode(const unsigned values[], int count);
+
+   /**
+    * The main memory buffer for loading the content of the disk page 
+    * that contains the node.
+    */
+    char buffer[PageFile::PAGE_SIZE];
+};
+
+
 /**
  * BTNonLeafNode: The class representing a B+tree nonleaf node.
+ *
+ * With BT_NONLEAF_COUNTS the free space behind the entries holds, for
+ * every child pointer, the number of (key, rid) pairs below it, and the
+ * node takes one key less to make room for them. With BT_BUFFERED the
+ * same space holds the first page of the insert buffer of the node.
  */
 class BTNonLeafNode {
   public:
-    BTNonLeafNode() {
+    BTNonLeafNode(int format = 0) {
+      this->format = format;
       memset(buffer, -1, PageFile::PAGE_SIZE);
     }
     
@@ -149,9 +379,10 @@ class BTNonLeafNode {
     * Remember that all keys inside a B+tree node should be kept sorted.
     * @param key[IN] the key to insert
     * @param pid[IN] the PageId to insert
+    * @param count[IN] the number of pairs below pid (BT_NONLEAF_COUNTS only)
     * @return 0 if successful. Return an error code if the node is full.
     */
-    RC insert(int key, PageId pid);
+    RC insert(int key, PageId pid, int count = 0);
 
    /**
     * Insert the (key, pid) pair to the node
@@ -163,9 +394,14 @@ class BTNonLeafNode {
     * @param pid[IN] the PageId to insert
     * @param sibling[IN] the sibling node to split with. This node MUST be empty when this function is called.
     * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
+    * @param count[IN] the number of pairs below pid (BT_NONLEAF_COUNTS only)
+    * @param rightEdge[IN] true if the node is the last one of its level. a
+    *                      key going behind all others then leaves the sibling
+    *                      with one key, and this node nearly full
     * @return 0 if successful. Return an error code if there is an error.
     */
-    RC insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey);
+    RC insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey, int count = 0,
+                      bool rightEdge = false);
 
    /**
     * Given the searchKey, find the child-node pointer to follow and
@@ -210,7 +446,140 @@ class BTNonLeafNode {
 
     int getFirstKey();
 
+   /**
+    * Return the i-th child pointer of the node (0 <= i <= getKeyCount()).
+    * @param i[IN] the position of the child pointer
+    * @return the PageId of the child
+    */
+    PageId getChildPtr(int i);
+
+   /**
+    * Replace the i-th child pointer of the node.
+    * @param i[IN] the position of the child pointer
+    * @param pid[IN] the PageId of the child
+    */
+    void setChildPtr(int i, PageId pid);
+
+   /**
+    * Return the i-th key of the node (0 <= i < getKeyCount()).
+    * Keys smaller than key i are found below child pointer i.
+    * @param i[IN] the position of the key
+    * @return the key
+    */
+    int getKey(int i);
+
+   /**
+    * Replace the i-th key of the node.
+    * @param i[IN] the position of the key
+    * @param key[IN] the new key
+    */
+    void setKey(int i, int key);
+
+   /**
+    * Given the searchKey, find the position of the child pointer to follow.
+    * @param searchKey[IN] the searchKey that is being looked up.
+    * @return the position of the child pointer to follow
+    */
+    int locateChildIndex(int searchKey);
+
+   /**
+    * Remove the i-th key and the child pointer behind it.
+    * @param i[IN] the position of the key
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC remove(int i);
+
+   /**
+    * Remove the first child pointer and the first key.
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC removeFirst();
+
+   /**
+    * Insert a (pid, key) pair in front of the node: pid becomes the first
+    * child pointer, followed by key and the former first child pointer.
+    * @param pid[IN] the new first child pointer
+    * @param key[IN] the key between pid and the former first child pointer
+    * @param count[IN] the number of pairs below pid (BT_NONLEAF_COUNTS only)
+    * @return 0 if successful. Return an error code if the node is full.
+    */
+    RC insertFirst(PageId pid, int key, int count = 0);
+
+   /**
+    * Check whether the node is less than half full.
+    * @return true if the node should borrow entries or be merged
+    */
+    bool isUnderflow();
+
+   /**
+    * Return the maximum number of keys the node can hold.
+    * @return the maximum number of keys
+    */
+    int getMaxKeyCount();
+
+   /**
+    * Return the number of (key, rid) pairs below the i-th child pointer.
+    * @param i[IN] the position of the child pointer
+    * @return the number of pairs. 0 without BT_NONLEAF_COUNTS.
+    */
+    int getCount(int i);
+
+   /**
+    * Set the number of (key, rid) pairs below the i-th child pointer.
+    * Ignored without BT_NONLEAF_COUNTS.
+    * @param i[IN] the position of the child pointer
+    * @param count[IN] the number of pairs
+    */
+    void setCount(int i, int count);
+
+   /**
+    * Return the number of (key, rid) pairs below the node.
+    * @return the number of pairs. 0 without BT_NONLEAF_COUNTS.
+    */
+    int getTotal();
+
+   /**
+    * Return the first page of the insert buffer of the node.
+    * @return the PageId of the page. -1 if the buffer is empty or the
+    *         node has none (without BT_BUFFERED)
+    */
+    PageId getBufferPtr();
+
+   /**
+    * Set the first page of the insert buffer of the node.
+    * Ignored without BT_BUFFERED.
+    * @param pid[IN] the PageId of the page. -1 for an empty buffer
+    */
+    void setBufferPtr(PageId pid);
+
   private:
+   /**
+    * Make room for the count of a child pointer inserted at position i.
+    * @param i[IN] the position of the new child pointer
+    * @param count[IN] its count
+    */
+    void insertCount(int i, int count);
+
+   /**
+    * Drop the count of the child pointer removed from position i.
+    * @param i[IN] the position of the removed child pointer
+    */
+    void removeCount(int i);
+
+   /**
+    * Rewrite the node with the given keys, child pointers and counts.
+    * @param keys[IN] the keys in sorted order
+    * @param pids[IN] the keyCount + 1 child pointers
+    * @param counts[IN] the keyCount + 1 counts
+    * @param keyCount[IN] the number of keys
+    */
+    void store(const int keys[], const PageId pids[], const int counts[], int keyCount);
+
+   /**
+    * The format flags of the index that owns this node.
+    */
+    int format;
+
    /**
     * The main memory buffer for loading the content of the disk page 
     * that contains the node.
@@ -218,4 +587,102 @@ class BTNonLeafNode {
     char buffer[PageFile::PAGE_SIZE];
 }; 
 
+
+/**
+ * BTBufferNode: The class representing a page of the insert buffer of a
+ * nonleaf node in a BT_BUFFERED tree.
+ *
+ * The page holds (key, rid) pairs that were inserted below the node but
+ * not yet moved down to its children, in no particular order. Pages of a
+ * buffer are chained by their next pointers, new pairs go to the first
+ * page, and the first page also keeps the number of pages of the buffer.
+ */
+class BTBufferNode {
+  public:
+   /**
+    * The maximum number of pairs in a page.
+    */
+    static const int MAX_MESSAGE_NUM = 84;
+
+    BTBufferNode();
+
+   /**
+    * Add a (key, rid) pair to the page.
+    * @param key[IN] the key
+    * @param rid[IN] the RecordId
+    * @return 0 if successful. RC_NODE_FULL if the page has no room.
+    */
+    RC insert(int key, const RecordId& rid);
+
+   /**
+    * Read the (key, rid) pair of entry eid.
+    * @param eid[IN] the entry number (0 <= eid < getCount())
+    * @param key[OUT] the key
+    * @param rid[OUT] the RecordId
+    * @return 0 if successful. RC_NO_SUCH_RECORD if there is no such entry.
+    */
+    RC readEntry(int eid, int& key, RecordId& rid);
+
+   /**
+    * Remove entry eid. The last entry of the page takes its place.
+    * @param eid[IN] the entry number
+    * @return 0 if successful. RC_NO_SUCH_RECORD if there is no such entry.
+    */
+    RC remove(int eid);
+
+   /**
+    * Return the number of pairs stored in the page.
+    * @return the number of pairs in the page
+    */
+    int getCount();
+
+   /**
+    * Return the number of pages of the whole buffer (first page only).
+    * @return the number of pages
+    */
+    int getPageCount();
+
+   /**
+    * Set the number of pages of the whole buffer (first page only).
+    * @param count[IN] the number of pages
+    */
+    void setPageCount(int count);
+
+   /**
+    * Return the pid of the next page of the buffer.
+    * @return the PageId of the next page, -1 if this is the last one
+    */
+    PageId getNextNodePtr();
+
+   /**
+    * Set the pid of the next page of the buffer.
+    * @param pid[IN] the PageId of the next page
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setNextNodePtr(PageId pid);
+
+   /**
+    * Read the content of the node from the page pid in the PageFile pf.
+    * @param pid[IN] the PageId to read
+    * @param pf[IN] PageFile to read from
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC read(PageId pid, const PageFile& pf);
+
+   /**
+    * Write the content of the node to the page pid in the PageFile pf.
+    * @param pid[IN] the PageId to write to
+    * @param pf[IN] PageFile to write to
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC write(PageId pid, PageFile& pf);
+
+  private:
+   /**
+    * The main memory buffer for loading the content of the disk page 
+    * that contains the node.
+    */
+    char buffer[PageFile::PAGE_SIZE];
+};
+
 #endif /* BTREENODE_H */
@@ -0,0 +1,177 @@
+/*
+ * BloomFilter: blocked Bloom filters over the key and value columns
+ * of Bruinbase, checked before equality lookups.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include "BloomFilter.h"
+#include <string.h>
+
+using namespace std;
+
+const int PAGE_SIZE = PageFile::PAGE_SIZE;
+
+//a block is one cache line of 512 bits, and every item sets BLOOM_PROBES
+//bits of its block. BLOOM_BITS_PER_ITEM bits per item keep false
+//positives at about 1%
+const int BLOCK_SIZE = 64;
+const int BLOCK_BITS = BLOCK_SIZE * 8;
+const int BLOCKS_PER_PAGE = PAGE_SIZE / BLOCK_SIZE;
+const int BLOOM_PROBES = 7;
+const int BLOOM_BITS_PER_ITEM = 10;
+
+/*
+ * BloomFilter constructor
+ */
+BloomFilter::BloomFilter()
+{
+	mode = 'r';
+}
+
+/*
+ * Open the filter file in read or write mode.
+ * Under 'w' mode, the filter is rebuilt from the items added.
+ * @param filename[IN] the name of the filter file
+ * @param mode[IN] 'r' for read, 'w' for write
+ * @return error code. 0 if no error
+ */
+RC BloomFilter::open(const string& filename, char mode)
+{
+	if (pf.open(filename, mode))
+		return RC_FILE_OPEN_FAILED;
+	this->mode = mode;
+	hashes.clear();
+	if (mode != 'w' && mode != 'W' && pf.endPid() == 0) {
+		pf.close();
+		return RC_INVALID_FILE_FORMAT;
+	}
+	return 0;
+}
+
+/*
+ * Close the filter file, writing the filter under 'w' mode.
+ * The upper half of a hash picks the block and the lower half the bits.
+ * @return error code. 0 if no error
+ */
+RC BloomFilter::close()
+{
+	int rc = 0;
+
+	if (mode == 'w' || mode == 'W') {
+		long long bits = (long long) hashes.size() * BLOOM_BITS_PER_ITEM;
+		int pages = (int) ((bits + PAGE_SIZE * 8 - 1) / (PAGE_SIZE * 8));
+		if (pages == 0) pages = 1;
+
+		//the file is not truncated, and its size gives the filter size, so
+		//a filter written over a larger one takes up all of its pages
+		if (pages < pf.endPid()) pages = pf.endPid();
+		int blocks = pages * BLOCKS_PER_PAGE;
+
+		vector<char> filter((size_t) pages * PAGE_SIZE, 0);
+		for (size_t i = 0; i < hashes.size(); i++) {
+			unsigned long long h = hashes[i];
+			char* block = &filter[(size_t) ((h >> 32) % blocks) * BLOCK_SIZE];
+			unsigned a = (unsigned) h, b = (a >> 16) | 1;
+			for (int j = 0; j < BLOOM_PROBES; j++) {
+				unsigned bit = (a + j * b) % BLOCK_BITS;
+				block[bit / 8] |= (char) (1 << (bit % 8));
+			}
+		}
+
+		for (int p = 0; p < pages && rc == 0; p++) {
+			if (pf.write(p, &filter[(size_t) p * PAGE_SIZE]))
+				rc = RC_FILE_WRITE_FAILED;
+		}
+	}
+
+	if (pf.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	return rc;
+}
+
+/*
+ * Add a key to the filter.
+ * @param key[IN] the key
+ */
+void BloomFilter::add(int key)
+{
+	hashes.push_back(hash(key));
+}
+
+/*
+ * Add a value to the filter.
+ * @param value[IN] the value
+ */
+void BloomFilter::add(const char* value)
+{
+	hashes.push_back(hash(value));
+}
+
+/*
+ * Test whether the table may have a key.
+ * @param key[IN] the key
+ * @return false if the key is surely not in the table
+ */
+bool BloomFilter::mayContain(int key)
+{
+	return test(hash(key));
+}
+
+/*
+ * Test whether the table may have a value.
+ * @param value[IN] the value
+ * @return false if the value is surely not in the table
+ */
+bool BloomFilter::mayContain(const char* value)
+{
+	return test(hash(value));
+}
+
+/*
+ * Return the 64-bit hash of a key (the finalizer of splitmix64).
+ */
+unsigned long long BloomFilter::hash(int key)
+{
+	unsigned long long h = (unsigned) key + 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/*
+ * Return the 64-bit hash of a value (FNV-1a, with its high bits mixed
+ * down since they pick the block).
+ */
+unsigned long long BloomFilter::hash(const char* value)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	for (; *value; value++)
+		h = (h ^ (unsigned char) *value) * 0x100000001b3ULL;
+	return h ^ (h >> 29);
+}
+
+/*
+ * Test the bits of an item, reading the page of its block.
+ * A filter that cannot be read may contain anything.
+ * @param h[IN] the hash of the item
+ * @return false if the item is surely not in the filter
+ */
+bool BloomFilter::test(unsigned long long h)
+{
+	char page[PAGE_SIZE];
+
+	int blocks = pf.endPid() * BLOCKS_PER_PAGE;
+	int n = (int) ((h >> 32) % blocks);
+	if (pf.read(n / BLOCKS_PER_PAGE, page))
+		return true;
+
+	char* block = page + (n % BLOCKS_PER_PAGE) * BLOCK_SIZE;
+	unsigned a = (unsigned) h, b = (a >> 16) | 1;
+	for (int j = 0; j < BLOOM_PROBES; j++) {
+		unsigned bit = (a + j * b) % BLOCK_BITS;
+		if (!(block[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * BloomFilter: blocked Bloom filters over the key and value columns
+ * of Bruinbase, checked before equality lookups.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef BLOOMFILTER_H
+#define BLOOMFILTER_H
+
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include <string>
+#include <vector>
+
+/**
+ * A blocked Bloom filter over the keys or the values of a table, stored
+ * in a PageFile of its own. Every item sets all of its bits in a single
+ * 64-byte block, and the filter is made of whole pages of blocks, so its
+ * size follows from the size of the file and a test reads one page. The
+ * hashes of the items are collected in memory while a table is loaded,
+ * and the filter is sized and written when the file is closed, so every
+ * item of the table is added again on each load.
+ */
+class BloomFilter {
+ public:
+  BloomFilter();
+
+  /**
+   * Open the filter file in read or write mode.
+   * Under 'w' mode, the filter is rebuilt from the items added.
+   * @param filename[IN] the name of the filter file
+   * @param mode[IN] 'r' for read, 'w' for write
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& filename, char mode);
+
+  /**
+   * Close the filter file, writing the filter under 'w' mode.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Add a key to the filter.
+   * @param key[IN] the key
+   */
+  void add(int key);
+
+  /**
+   * Add a value to the filter.
+   * @param value[IN] the value
+   */
+  void add(const char* value);
+
+  /**
+   * Test whether the table may have a key. False positives are possible,
+   * false negatives are not.
+   * @param key[IN] the key
+   * @return false if the key is surely not in the table
+   */
+  bool mayContain(int key);
+
+  /**
+   * Test whether the table may have a value.
+   * @param value[IN] the value
+   * @return false if the value is surely not in the table
+   */
+  bool mayContain(const char* value);
+
+ private:
+  /**
+   * Return the 64-bit hash of a key.
+   */
+  static unsigned long long hash(int key);
+
+  /**
+   * Return the 64-bit hash of a value.
+   */
+  static unsigned long long hash(const char* value);
+
+  /**
+   * Test the bits of an item, reading the page of its block.
+   * @param h[IN] the hash of the item
+   * @return false if the item is surely not in the filter
+   */
+  bool test(unsigned long long h);
+
+  PageFile pf;         /// the PageFile used to store the filter
+  char     mode;       /// the mode the file was opened with
+
+  /// the hashes of the items added under 'w' mode
+  std::vector<unsigned long long> hashes;
+};
+
+#endif /* BLOOMFILTER_H */
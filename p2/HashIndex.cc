@@ -0,0 +1,580 @@
+/*
+ * HashIndex: an extendible hash index over the key column of Bruinbase,
+ * for key equality lookups.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include "HashIndex.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+const int PAGE_SIZE = PageFile::PAGE_SIZE;
+
+//layout of a bucket page: local depth, pair count, overflow page, pairs
+const int BUCKET_DEPTH = 0;
+const int BUCKET_COUNT = 4;
+const int BUCKET_OVERFLOW = 8;
+const int BUCKET_HEADER = 12;
+const int BUCKET_ENTRY_SIZE = sizeof(int) + sizeof(RecordId);
+
+const int HashBucket::MAX_ENTRY_NUM = (PAGE_SIZE - BUCKET_HEADER) / BUCKET_ENTRY_SIZE;
+
+//layout of the header page: global depth, number of directory pages, then
+//the directory itself if it fits, otherwise the directory pages
+const int HEADER_SLOTS = (PAGE_SIZE - 2 * sizeof(int)) / sizeof(PageId);
+const int DIR_SLOTS = PAGE_SIZE / sizeof(PageId);
+
+//the directory never outgrows the directory pages the header can list
+const int MAX_GLOBAL_DEPTH = 15;
+
+int HashIndex::pinClock = 1;
+pthread_rwlock_t HashIndex::pinLock = PTHREAD_RWLOCK_INITIALIZER;
+struct HashIndex::pinStruct HashIndex::pinned[HashIndex::PIN_INDEX_COUNT];
+
+/*
+ * HashBucket constructor: an empty bucket with no overflow page
+ */
+HashBucket::HashBucket()
+{
+	memset(buffer, 0, PAGE_SIZE);
+	setOverflowPtr(-1);
+}
+
+/*
+ * Read the content of the page into the buffer.
+ * @param pid[IN] the PageId to read
+ * @param pf[IN] PageFile to read from
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC HashBucket::read(PageId pid, const PageFile& pf)
+{
+	return pf.read(pid, buffer);
+}
+
+/*
+ * Write the content of the buffer to the page.
+ * @param pid[IN] the PageId to write to
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC HashBucket::write(PageId pid, PageFile& pf)
+{
+	return pf.write(pid, buffer);
+}
+
+/*
+ * Insert the (key, rid) pair into the page.
+ * @param key[IN] the key to insert
+ * @param rid[IN] the RecordId to insert
+ * @return 0 if successful. RC_NODE_FULL if the page is full.
+ */
+RC HashBucket::insert(int key, const RecordId& rid)
+{
+	int count = getCount();
+	if (count >= MAX_ENTRY_NUM)
+		return RC_NODE_FULL;
+
+	char* entry = buffer + BUCKET_HEADER + count * BUCKET_ENTRY_SIZE;
+	memcpy(entry, &key, sizeof(int));
+	memcpy(entry + sizeof(int), &rid, sizeof(RecordId));
+	count++;
+	memcpy(buffer + BUCKET_COUNT, &count, sizeof(int));
+	return 0;
+}
+
+/*
+ * Read the (key, rid) pair from the eid entry.
+ * @param eid[IN] the entry number to read
+ * @param key[OUT] the key from the entry
+ * @param rid[OUT] the RecordId from the entry
+ * @return 0 if successful. RC_INVALID_CURSOR if there is no such entry.
+ */
+RC HashBucket::readEntry(int eid, int& key, RecordId& rid)
+{
+	if (eid < 0 || eid >= getCount())
+		return RC_INVALID_CURSOR;
+
+	char* entry = buffer + BUCKET_HEADER + eid * BUCKET_ENTRY_SIZE;
+	memcpy(&key, entry, sizeof(int));
+	memcpy(&rid, entry + sizeof(int), sizeof(RecordId));
+	return 0;
+}
+
+/*
+ * Return the number of pairs in the page.
+ * @return the number of pairs
+ */
+int HashBucket::getCount()
+{
+	int count;
+	memcpy(&count, buffer + BUCKET_COUNT, sizeof(int));
+	return count;
+}
+
+/*
+ * Return the number of hash bits shared by the keys of the bucket.
+ * @return the local depth
+ */
+int HashBucket::getLocalDepth()
+{
+	int depth;
+	memcpy(&depth, buffer + BUCKET_DEPTH, sizeof(int));
+	return depth;
+}
+
+/*
+ * Set the number of hash bits shared by the keys of the bucket.
+ * @param depth[IN] the local depth
+ */
+void HashBucket::setLocalDepth(int depth)
+{
+	memcpy(buffer + BUCKET_DEPTH, &depth, sizeof(int));
+}
+
+/*
+ * Return the next overflow page of the bucket.
+ * @return the PageId of the page. -1 if there is none.
+ */
+PageId HashBucket::getOverflowPtr()
+{
+	PageId pid;
+	memcpy(&pid, buffer + BUCKET_OVERFLOW, sizeof(PageId));
+	return pid;
+}
+
+/*
+ * Set the next overflow page of the bucket.
+ * @param pid[IN] the PageId of the page. -1 if there is none.
+ */
+void HashBucket::setOverflowPtr(PageId pid)
+{
+	memcpy(buffer + BUCKET_OVERFLOW, &pid, sizeof(PageId));
+}
+
+/*
+ * Empty the page, keeping its local depth and overflow pointer.
+ */
+void HashBucket::clear()
+{
+	int count = 0;
+	memcpy(buffer + BUCKET_COUNT, &count, sizeof(int));
+}
+
+/*
+ * HashIndex constructor
+ */
+HashIndex::HashIndex()
+{
+	mode = 'r';
+	globalDepth = 0;
+}
+
+/*
+ * Open the index file in read or write mode.
+ * Under 'w' mode, the index file is created if it does not exist.
+ * @param indexname[IN] the name of the index file
+ * @param mode[IN] 'r' for read, 'w' for write
+ * @return error code. 0 if no error
+ */
+RC HashIndex::open(const string& indexname, char mode)
+{
+	int rc;
+
+	if (pf.open(indexname, mode))
+		return RC_FILE_OPEN_FAILED;
+
+	//directories are pinned by file, so a rebuilt index that took over
+	//the name is not served the directory of the one it replaced
+	char id [32];
+	sprintf(id, "#%ld", pf.fileId());
+	name = indexname + id;
+	this->mode = mode;
+	directory.clear();
+	dirPages.clear();
+
+	if (pf.endPid() > 0)
+		return readDirectory();
+	if (mode != 'w' && mode != 'W')
+		return RC_INVALID_FILE_FORMAT;
+
+	//a new index has one empty bucket for every key
+	globalDepth = 0;
+	directory.push_back(1);
+	rc = writeDirectory();
+	if(rc) return rc;
+	HashBucket bucket;
+	return bucket.write(1, pf);
+}
+
+/*
+ * Close the index file, writing the directory under 'w' mode.
+ * @return error code. 0 if no error
+ */
+RC HashIndex::close()
+{
+	int rc = 0;
+	if (mode == 'w' || mode == 'W')
+		rc = writeDirectory();
+	if (pf.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	return rc;
+}
+
+/*
+ * Return the hash of a key. The mixing is a bijection on 32 bits, so
+ * distinct keys differ in some bit and can always be split apart.
+ * @param key[IN] the key
+ * @return the hash value
+ */
+unsigned HashIndex::hash(int key)
+{
+	unsigned h = (unsigned) key;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * Find the bucket page of a directory slot.
+ * @param slot[IN] the directory slot
+ * @param pid[OUT] the PageId of the bucket
+ * @return error code. 0 if no error
+ */
+RC HashIndex::bucketOf(int slot, PageId& pid)
+{
+	if (!directory.empty()) {
+		pid = directory[slot];
+		return 0;
+	}
+
+	//the directory stayed on disk: take the slot from the pin if its page
+	//was read before, otherwise read only the page of the slot and pin it
+	pthread_rwlock_rdlock(&pinLock);
+	int pin = pinSlot(false);
+	pid = -1;
+	if (pin >= 0 && slot < (int) pinned[pin].directory.size())
+		pid = pinned[pin].directory[slot];
+	pthread_rwlock_unlock(&pinLock);
+	if (pid >= 0)
+		return 0;
+
+	char page[PAGE_SIZE];
+	int first = slot / DIR_SLOTS * DIR_SLOTS;
+	if (pf.read(dirPages[slot / DIR_SLOTS], page))
+		return RC_FILE_READ_FAILED;
+	memcpy(&pid, page + (slot - first) * sizeof(PageId), sizeof(PageId));
+
+	pthread_rwlock_wrlock(&pinLock);
+	pin = pinSlot(false);
+	if (pin >= 0 && slot < (int) pinned[pin].directory.size()) {
+		int n = min(DIR_SLOTS, (int) pinned[pin].directory.size() - first);
+		memcpy(&pinned[pin].directory[first], page, n * sizeof(PageId));
+	}
+	pthread_rwlock_unlock(&pinLock);
+	return 0;
+}
+
+/*
+ * Insert (key, RecordId) pair to the index.
+ * @param key[IN] the key for the value inserted into the index
+ * @param rid[IN] the RecordId for the record being inserted into the index
+ * @return error code. 0 if no error
+ */
+RC HashIndex::insert(int key, const RecordId& rid)
+{
+	int rc;
+	HashBucket bucket;
+
+	if (mode != 'w' && mode != 'W')
+		return RC_INVALID_FILE_MODE;
+
+	for (;;) {
+		int slot = hash(key) & ((1 << globalDepth) - 1);
+		PageId pid = directory[slot];
+		rc = bucket.read(pid, pf);
+		if(rc) return rc;
+		if (bucket.insert(key, rid) == 0)
+			return bucket.write(pid, pf);
+
+		//split the full bucket and try again, unless it holds the key alone
+		//or already uses every hash bit the directory can have
+		bool single = true;
+		int k;
+		RecordId r;
+		for (int eid = 0; single && bucket.readEntry(eid, k, r) == 0; eid++)
+			single = (k == key);
+		if (single || bucket.getLocalDepth() >= MAX_GLOBAL_DEPTH)
+			break;
+		rc = split(slot, bucket);
+		if(rc) return rc;
+	}
+
+	//otherwise chain the pair to the bucket: add it to the first overflow
+	//page, or to a new one put first in the chain if that one is full
+	int slot = hash(key) & ((1 << globalDepth) - 1);
+	PageId pid = directory[slot];
+	PageId next = bucket.getOverflowPtr();
+	HashBucket page;
+	if (next >= 0) {
+		rc = page.read(next, pf);
+		if(rc) return rc;
+		if (page.insert(key, rid) == 0)
+			return page.write(next, pf);
+		page = HashBucket();
+	}
+
+	page.setLocalDepth(bucket.getLocalDepth());
+	page.setOverflowPtr(next);
+	page.insert(key, rid);
+	PageId newPid = pf.endPid();
+	rc = page.write(newPid, pf);
+	if(rc) return rc;
+	bucket.setOverflowPtr(newPid);
+	return bucket.write(pid, pf);
+}
+
+/*
+ * Split the full bucket of a directory slot in two on its next hash bit,
+ * doubling the directory first if the bucket uses every bit of it.
+ * @param slot[IN] the directory slot
+ * @param bucket[IN] the bucket, as read from its page
+ * @return error code. 0 if no error
+ */
+RC HashIndex::split(int slot, HashBucket& bucket)
+{
+	int rc;
+	int depth = bucket.getLocalDepth();
+
+	if (depth == globalDepth) {
+		directory.insert(directory.end(), directory.begin(), directory.end());
+		globalDepth++;
+	}
+
+	//pairs whose next hash bit is set move to the new bucket
+	HashBucket low, high;
+	low.setLocalDepth(depth + 1);
+	high.setLocalDepth(depth + 1);
+	int k;
+	RecordId r;
+	for (int eid = 0; bucket.readEntry(eid, k, r) == 0; eid++) {
+		if ((hash(k) >> depth) & 1)
+			high.insert(k, r);
+		else
+			low.insert(k, r);
+	}
+
+	//overflow pages only hold more pairs of the one key in the bucket,
+	//so they stay with that key
+	if (bucket.getOverflowPtr() >= 0) {
+		bucket.readEntry(0, k, r);
+		if ((hash(k) >> depth) & 1)
+			high.setOverflowPtr(bucket.getOverflowPtr());
+		else
+			low.setOverflowPtr(bucket.getOverflowPtr());
+	}
+
+	PageId pid = directory[slot];
+	PageId newPid = pf.endPid();
+	rc = high.write(newPid, pf);
+	if(rc) return rc;
+	rc = low.write(pid, pf);
+	if(rc) return rc;
+
+	//repoint the directory slots of the bucket that have the bit set
+	int step = 1 << depth;
+	for (int s = slot & (step - 1); s < (int) directory.size(); s += step) {
+		if ((s >> depth) & 1)
+			directory[s] = newPid;
+	}
+	return 0;
+}
+
+/*
+ * Set the cursor to the first entry of the bucket of searchKey.
+ * @param searchKey[IN] the key to find
+ * @param cursor[OUT] the cursor for readForward()
+ * @return error code. 0 if no error
+ */
+RC HashIndex::locate(int searchKey, HashCursor& cursor)
+{
+	cursor.key = searchKey;
+	cursor.eid = 0;
+	return bucketOf(hash(searchKey) & ((1 << globalDepth) - 1), cursor.pid);
+}
+
+/*
+ * Read up to n RecordIds of the key of the cursor, and move the cursor
+ * behind the last one read. Every page is read once per call.
+ * @param cursor[IN/OUT] the cursor set by locate()
+ * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+ * @param n[IN] the maximum number of RecordIds to read
+ * @param count[OUT] the number of RecordIds read
+ * @return 0 if at least one RecordId was read. RC_END_OF_TREE if the key
+ *         has no more RecordIds. Otherwise an error code.
+ */
+RC HashIndex::readForward(HashCursor& cursor, RecordId rids[], int n, int& count)
+{
+	int rc, k;
+	RecordId r;
+	HashBucket page;
+
+	count = 0;
+	while (cursor.pid >= 0 && count < n) {
+		rc = page.read(cursor.pid, pf);
+		if(rc) return rc;
+		for (; count < n && page.readEntry(cursor.eid, k, r) == 0; cursor.eid++) {
+			if (k == cursor.key)
+				rids[count++] = r;
+		}
+
+		//continue on the overflow pages of the bucket
+		if (cursor.eid >= page.getCount()) {
+			cursor.pid = page.getOverflowPtr();
+			cursor.eid = 0;
+		}
+	}
+	return (count > 0) ? 0 : RC_END_OF_TREE;
+}
+
+/*
+ * Read the header of the index, from its pin if it has one under 'r'
+ * mode, and the whole directory under 'w' mode. Under 'r' mode a directory
+ * that does not fit in the header stays on disk.
+ * @return error code. 0 if no error
+ */
+RC HashIndex::readDirectory()
+{
+	char page[PAGE_SIZE];
+	int pageCount;
+	bool write = (mode == 'w' || mode == 'W');
+
+	//the header of a pinned index needs no page read
+	if (!write) {
+		pthread_rwlock_rdlock(&pinLock);
+		int slot = pinSlot(false);
+		if (slot >= 0) {
+			globalDepth = pinned[slot].globalDepth;
+			dirPages = pinned[slot].dirPages;
+			if (dirPages.empty())
+				directory = pinned[slot].directory;
+		}
+		pthread_rwlock_unlock(&pinLock);
+		if (slot >= 0)
+			return 0;
+	}
+
+	if (pf.read(0, page))
+		return RC_FILE_READ_FAILED;
+	memcpy(&globalDepth, page, sizeof(int));
+	memcpy(&pageCount, page + sizeof(int), sizeof(int));
+	PageId* slots = (PageId*) (page + 2 * sizeof(int));
+
+	int size = 1 << globalDepth;
+	if (pageCount == 0)
+		directory.assign(slots, slots + size);
+	else
+		dirPages.assign(slots, slots + pageCount);
+
+	if (write && pageCount > 0) {
+		directory.resize(size);
+		for (int i = 0; i < pageCount; i++) {
+			if (pf.read(dirPages[i], page))
+				return RC_FILE_READ_FAILED;
+			int n = min(DIR_SLOTS, size - i * DIR_SLOTS);
+			memcpy(&directory[i * DIR_SLOTS], page, n * sizeof(PageId));
+		}
+	}
+	if (write)
+		return 0;
+
+	//pin the header, with the directory if it is in the header
+	pthread_rwlock_wrlock(&pinLock);
+	int slot = pinSlot(true);
+	pinned[slot].globalDepth = globalDepth;
+	pinned[slot].dirPages = dirPages;
+	if (pageCount == 0)
+		pinned[slot].directory = directory;
+	else
+		pinned[slot].directory.assign(size, -1);
+	pthread_rwlock_unlock(&pinLock);
+	return 0;
+}
+
+/*
+ * Write the directory and the header page, and pin them. A directory that
+ * does not fit in the header goes to directory pages, reusing the ones it
+ * had before.
+ * @return error code. 0 if no error
+ */
+RC HashIndex::writeDirectory()
+{
+	char header[PAGE_SIZE];
+	char page[PAGE_SIZE];
+	int size = directory.size();
+	int pageCount = 0;
+
+	memset(header, -1, PAGE_SIZE);
+	if (size <= HEADER_SLOTS) {
+		memcpy(header + 2 * sizeof(int), &directory[0], size * sizeof(PageId));
+	} else {
+		pageCount = (size + DIR_SLOTS - 1) / DIR_SLOTS;
+		for (int i = 0; i < pageCount; i++) {
+			if (i >= (int) dirPages.size())
+				dirPages.push_back(pf.endPid());
+			memset(page, -1, PAGE_SIZE);
+			int n = min(DIR_SLOTS, size - i * DIR_SLOTS);
+			memcpy(page, &directory[i * DIR_SLOTS], n * sizeof(PageId));
+			if (pf.write(dirPages[i], page))
+				return RC_FILE_WRITE_FAILED;
+		}
+		memcpy(header + 2 * sizeof(int), &dirPages[0], pageCount * sizeof(PageId));
+	}
+
+	memcpy(header, &globalDepth, sizeof(int));
+	memcpy(header + sizeof(int), &pageCount, sizeof(int));
+	if (pf.write(0, header))
+		return RC_FILE_WRITE_FAILED;
+
+	//replace the pin of the index, which may be of an earlier file of the
+	//same name or of the directory before it grew
+	pthread_rwlock_wrlock(&pinLock);
+	int slot = pinSlot(true);
+	pinned[slot].globalDepth = globalDepth;
+	pinned[slot].dirPages = dirPages;
+	pinned[slot].directory = directory;
+	pthread_rwlock_unlock(&pinLock);
+	return 0;
+}
+
+/*
+ * Find the pin slot of this index, taking over the least recently
+ * used slot if the index has none. The caller holds pinLock, for writing
+ * if create is true, so the clock is only ticked atomically.
+ * @param create[IN] whether to take over a slot if none is found
+ * @return the slot number. -1 if not found and create is false.
+ */
+int HashIndex::pinSlot(bool create)
+{
+	int toEvict = 0;
+	for (int i = 0; i < PIN_INDEX_COUNT; i++) {
+		if (!pinned[i].name.empty() && pinned[i].name == name) {
+			__atomic_store_n(&pinned[i].lastAccessed,
+			                 __atomic_add_fetch(&pinClock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			return i;
+		}
+		if (pinned[i].lastAccessed < pinned[toEvict].lastAccessed)
+			toEvict = i;
+	}
+	if (!create)
+		return -1;
+
+	pinned[toEvict].name = name;
+	pinned[toEvict].lastAccessed = ++pinClock;
+	return toEvict;
+}
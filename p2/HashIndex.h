@@ -0,0 +1,252 @@
+/*
+ * HashIndex: an extendible hash index over the key column of Bruinbase,
+ * for key equality lookups.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include "RecordFile.h"
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+/**
+ * The position of a lookup in a hash index: the bucket page being read,
+ * the entry number inside it and the key looked up.
+ */
+typedef struct {
+  // PageId of the bucket page (-1 past the last page)
+  PageId  pid;
+  // The entry number inside the page
+  int     eid;
+  // The key looked up
+  int     key;
+} HashCursor;
+
+/**
+ * A bucket page of a hash index. A bucket holds (key, rid) pairs in no
+ * particular order. When it overflows with pairs of one key, which no
+ * split can separate, the extra pairs go to a chain of overflow pages.
+ */
+class HashBucket {
+ public:
+  HashBucket();
+
+  /**
+   * Read the content of the page into the buffer.
+   * @param pid[IN] the PageId to read
+   * @param pf[IN] PageFile to read from
+   * @return 0 if successful. Return an error code if there is an error.
+   */
+  RC read(PageId pid, const PageFile& pf);
+
+  /**
+   * Write the content of the buffer to the page.
+   * @param pid[IN] the PageId to write to
+   * @param pf[IN] PageFile to write to
+   * @return 0 if successful. Return an error code if there is an error.
+   */
+  RC write(PageId pid, PageFile& pf);
+
+  /**
+   * Insert the (key, rid) pair into the page.
+   * @param key[IN] the key to insert
+   * @param rid[IN] the RecordId to insert
+   * @return 0 if successful. RC_NODE_FULL if the page is full.
+   */
+  RC insert(int key, const RecordId& rid);
+
+  /**
+   * Read the (key, rid) pair from the eid entry.
+   * @param eid[IN] the entry number to read
+   * @param key[OUT] the key from the entry
+   * @param rid[OUT] the RecordId from the entry
+   * @return 0 if successful. RC_INVALID_CURSOR if there is no such entry.
+   */
+  RC readEntry(int eid, int& key, RecordId& rid);
+
+  /**
+   * Return the number of pairs in the page.
+   * @return the number of pairs
+   */
+  int getCount();
+
+  /**
+   * Return the number of hash bits shared by the keys of the bucket.
+   * @return the local depth
+   */
+  int getLocalDepth();
+
+  /**
+   * Set the number of hash bits shared by the keys of the bucket.
+   * @param depth[IN] the local depth
+   */
+  void setLocalDepth(int depth);
+
+  /**
+   * Return the next overflow page of the bucket.
+   * @return the PageId of the page. -1 if there is none.
+   */
+  PageId getOverflowPtr();
+
+  /**
+   * Set the next overflow page of the bucket.
+   * @param pid[IN] the PageId of the page. -1 if there is none.
+   */
+  void setOverflowPtr(PageId pid);
+
+  /**
+   * Empty the page, keeping its local depth and overflow pointer.
+   */
+  void clear();
+
+  static const int MAX_ENTRY_NUM;
+
+ private:
+  /**
+   * The main memory buffer for loading the content of the disk page.
+   */
+  char buffer[PageFile::PAGE_SIZE];
+};
+
+/**
+ * An extendible hash index over the key column. A directory of
+ * 2^globalDepth bucket pointers is indexed by the low bits of the hash of
+ * a key, and a full bucket is split in two, doubling the directory when
+ * the bucket already uses every bit. The header and the directory pages
+ * read are pinned in memory across HashIndex instances, so a lookup reads
+ * the bucket alone once they are, and the header page, a directory page
+ * if the directory does not fit in the header, and the bucket otherwise.
+ * The index only answers key equality; ranges need the B+tree.
+ */
+class HashIndex {
+ public:
+  HashIndex();
+
+  /**
+   * Open the index file in read or write mode.
+   * Under 'w' mode, the index file is created if it does not exist.
+   * @param indexname[IN] the name of the index file
+   * @param mode[IN] 'r' for read, 'w' for write
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& indexname, char mode);
+
+  /**
+   * Close the index file, writing the directory under 'w' mode.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Insert (key, RecordId) pair to the index.
+   * @param key[IN] the key for the value inserted into the index
+   * @param rid[IN] the RecordId for the record being inserted into the index
+   * @return error code. 0 if no error
+   */
+  RC insert(int key, const RecordId& rid);
+
+  /**
+   * Set the cursor to the first entry of the bucket of searchKey.
+   * @param searchKey[IN] the key to find
+   * @param cursor[OUT] the cursor for readForward()
+   * @return error code. 0 if no error
+   */
+  RC locate(int searchKey, HashCursor& cursor);
+
+  /**
+   * Read up to n RecordIds of the key of the cursor, and move the cursor
+   * behind the last one read. Every page is read once per call.
+   * @param cursor[IN/OUT] the cursor set by locate()
+   * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+   * @param n[IN] the maximum number of RecordIds to read
+   * @param count[OUT] the number of RecordIds read
+   * @return 0 if at least one RecordId was read. RC_END_OF_TREE if the key
+   *         has no more RecordIds. Otherwise an error code.
+   */
+  RC readForward(HashCursor& cursor, RecordId rids[], int n, int& count);
+
+ private:
+  /**
+   * Return the hash of a key. The mixing is a bijection on 32 bits, so
+   * distinct keys differ in some bit and can always be split apart.
+   * @param key[IN] the key
+   * @return the hash value
+   */
+  static unsigned hash(int key);
+
+  /**
+   * Find the bucket page of a directory slot.
+   * @param slot[IN] the directory slot
+   * @param pid[OUT] the PageId of the bucket
+   * @return error code. 0 if no error
+   */
+  RC bucketOf(int slot, PageId& pid);
+
+  /**
+   * Split the full bucket of a directory slot in two on its next hash bit,
+   * doubling the directory first if the bucket uses every bit of it.
+   * @param slot[IN] the directory slot
+   * @param bucket[IN] the bucket, as read from its page
+   * @return error code. 0 if no error
+   */
+  RC split(int slot, HashBucket& bucket);
+
+  /**
+   * Read the header of the index, from its pin if it has one under 'r'
+   * mode, and the whole directory under 'w' mode.
+   * @return error code. 0 if no error
+   */
+  RC readDirectory();
+
+  /**
+   * Write the directory and the header page, and pin them.
+   * @return error code. 0 if no error
+   */
+  RC writeDirectory();
+
+  /**
+   * Find the pin slot of this index, taking over the least recently
+   * used slot if the index has none. The caller holds pinLock, for
+   * writing if create is true.
+   * @param create[IN] whether to take over a slot if none is found
+   * @return the slot number. -1 if not found and create is false.
+   */
+  int pinSlot(bool create);
+
+  PageFile pf;         /// the PageFile used to store the index
+  std::string name;    /// the name of the index file and its inode number
+  char     mode;       /// the mode the index was opened with
+  int      globalDepth;/// the number of hash bits indexing the directory
+
+  /// the directory, held in memory under 'w' mode
+  std::vector<PageId> directory;
+
+  /// the pages storing the directory (none if it fits in the header)
+  std::vector<PageId> dirPages;
+
+  //
+  // the following members keep the header and the directory slots read of
+  // recently used indexes in memory across HashIndex instances. the pin of
+  // an index is replaced whenever its directory is written.
+  //
+  static const int PIN_INDEX_COUNT = 4; // # of indexes with a pinned directory
+
+  static int pinClock; // clock tick counter for LRU policy
+  static pthread_rwlock_t pinLock; // guards the pinned directories
+
+  static struct pinStruct {
+    std::string   name;           // index file name ("" if the slot is empty)
+    int           lastAccessed;   // the last time the slot was accessed
+    int           globalDepth;    // the header of the index
+    std::vector<PageId> dirPages;
+    std::vector<PageId> directory; // the directory, -1 for slots not read yet
+  } pinned[PIN_INDEX_COUNT];
+};
+
+#endif /* HASHINDEX_H */
@@ -0,0 +1,365 @@
+/*
+ * LearnedIndex: a learned index over the B+tree leaves of read-only
+ * Bruinbase tables.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include "LearnedIndex.h"
+#include "BTreeNode.h"
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <climits>
+#include <algorithm>
+
+using namespace std;
+
+const int PAGE_SIZE = PageFile::PAGE_SIZE;
+
+//a segment predicts the position of the leaf of every first key it
+//covers within this many leaves, so the leaf of any key is one of the
+//two leaves around the prediction. the fit keeps a little inside the
+//bound, so that rounding at lookup time cannot cross it
+const double LRN_MAX_ERROR = 0.25;
+const double LRN_FIT_ERROR = LRN_MAX_ERROR - 1e-6;
+
+//layout of the header page of a model: the root, height and end page of
+//the tree it was fit to, the segment count and the leaf count. the
+//segments follow from page 1, then the PageIds of the leaves
+const int LRN_HEADER_INTS = 5;
+
+map<string, LearnedIndex::Model> LearnedIndex::models;
+pthread_mutex_t LearnedIndex::modelLock = PTHREAD_MUTEX_INITIALIZER;
+
+LearnedIndex::LearnedIndex()
+{
+}
+
+/*
+ * Fit the model to the leaves of an index and write it to a file.
+ * @param indexname[IN] the name of the index file
+ * @param modelname[IN] the name of the model file
+ * @return error code. 0 if no error
+ */
+RC LearnedIndex::build(const string& indexname, const string& modelname)
+{
+	int rc;
+	BTreeIndex index;
+
+	rc = index.open(indexname, 'r');
+	if(rc) return rc;
+
+	//collect the leaves in key order with their first keys, leaving out
+	//empty leaves, which no key leads to
+	vector<int> keys;
+	vector<PageId> leaves;
+	PageId pid;
+	BTLeafNode leaf(index.format);
+	rc = index.findLeaf(INT_MIN, -1, 0, pid, leaf);
+	while (rc == 0 && pid >= 0) {
+		int key = INT_MIN;
+		RecordId rid;
+		if (leaf.readEntry(0, key, rid) == 0 && (keys.empty() || key > keys.back())) {
+			keys.push_back(key);
+			leaves.push_back(pid);
+		}
+		rc = index.nextLeaf(leaf, key, pid, -1, 0);
+		if (rc == 0 && pid >= 0)
+			rc = index.readLeaf(pid, leaf);
+	}
+	int header[LRN_HEADER_INTS];
+	header[0] = index.rootPid;
+	header[1] = index.treeHeight;
+	header[2] = index.pf.endPid();
+	index.close();
+	if(rc) return rc;
+
+	vector<Segment> segments;
+	fit(keys, segments);
+	header[3] = segments.size();
+	header[4] = leaves.size();
+
+	//write the model from scratch, so that no page of an older one stays
+	PageFile pf;
+	char temp[PAGE_SIZE];
+	::remove(modelname.c_str());
+	if (pf.open(modelname, 'w'))
+		return RC_FILE_OPEN_FAILED;
+
+	memset(temp, 0, PAGE_SIZE);
+	memcpy(temp, header, sizeof(header));
+	rc = pf.write(0, temp);
+
+	const int segmentsPerPage = PAGE_SIZE / sizeof(Segment);
+	PageId next = 1;
+	for (size_t i = 0; i < segments.size() && rc == 0; i += segmentsPerPage) {
+		memset(temp, 0, PAGE_SIZE);
+		size_t n = min((size_t) segmentsPerPage, segments.size() - i);
+		memcpy(temp, &segments[i], n * sizeof(Segment));
+		rc = pf.write(next++, temp);
+	}
+
+	const int leavesPerPage = PAGE_SIZE / sizeof(PageId);
+	for (size_t i = 0; i < leaves.size() && rc == 0; i += leavesPerPage) {
+		memset(temp, 0, PAGE_SIZE);
+		size_t n = min((size_t) leavesPerPage, leaves.size() - i);
+		memcpy(temp, &leaves[i], n * sizeof(PageId));
+		rc = pf.write(next++, temp);
+	}
+
+	if (pf.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	return rc;
+}
+
+/*
+ * Open an index and its model for reading.
+ * @param indexname[IN] the name of the index file
+ * @param modelname[IN] the name of the model file
+ * @return error code. RC_INVALID_FILE_FORMAT if the model was fit to
+ *         another tree
+ */
+RC LearnedIndex::open(const string& indexname, const string& modelname)
+{
+	int rc;
+	PageFile pf;
+	char temp[PAGE_SIZE];
+	int header[LRN_HEADER_INTS];
+
+	if (pf.open(modelname, 'r'))
+		return RC_FILE_OPEN_FAILED;
+	if (pf.read(0, temp)) {
+		pf.close();
+		return RC_INVALID_FILE_FORMAT;
+	}
+	memcpy(header, temp, sizeof(header));
+
+	rc = index.open(indexname, 'r');
+	if (rc == 0 && (header[0] != index.rootPid || header[1] != index.treeHeight
+	                || header[2] != index.pf.endPid())) {
+		index.close();
+		rc = RC_INVALID_FILE_FORMAT;
+	}
+	if (rc) {
+		pf.close();
+		return rc;
+	}
+
+	rc = readModel(modelname, pf, header);
+	pf.close();
+	if (rc) {
+		index.close();
+		return rc;
+	}
+	return 0;
+}
+
+/*
+ * Read the segments and the leaves of a model, or copy them from the
+ * models read before if its header page is unchanged.
+ * @param modelname[IN] the name of the model file
+ * @param pf[IN] the model file
+ * @param header[IN] the header page of the model
+ * @return error code. 0 if no error
+ */
+RC LearnedIndex::readModel(const string& modelname, const PageFile& pf, const int header[])
+{
+	int rc = 0;
+	char temp[PAGE_SIZE];
+	char id[32];
+
+	sprintf(id, "#%ld", pf.fileId());
+	string name = modelname + id;
+	vector<int> head(header, header + LRN_HEADER_INTS);
+	pthread_mutex_lock(&modelLock);
+	map<string, Model>::iterator it = models.find(name);
+	if (it != models.end() && it->second.header == head) {
+		segments = it->second.segments;
+		leaves = it->second.leaves;
+		pthread_mutex_unlock(&modelLock);
+		return 0;
+	}
+	pthread_mutex_unlock(&modelLock);
+
+	//the model is small, and is read into memory whole
+	const int segmentsPerPage = PAGE_SIZE / sizeof(Segment);
+	PageId next = 1;
+	segments.resize(header[3]);
+	for (size_t i = 0; i < segments.size() && rc == 0; i += segmentsPerPage) {
+		rc = pf.read(next++, temp);
+		size_t n = min((size_t) segmentsPerPage, segments.size() - i);
+		memcpy(&segments[i], temp, n * sizeof(Segment));
+	}
+
+	const int leavesPerPage = PAGE_SIZE / sizeof(PageId);
+	leaves.resize(header[4]);
+	for (size_t i = 0; i < leaves.size() && rc == 0; i += leavesPerPage) {
+		rc = pf.read(next++, temp);
+		size_t n = min((size_t) leavesPerPage, leaves.size() - i);
+		memcpy(&leaves[i], temp, n * sizeof(PageId));
+	}
+	if (rc)
+		return RC_FILE_READ_FAILED;
+
+	pthread_mutex_lock(&modelLock);
+	Model& model = models[name];
+	model.header = head;
+	model.segments = segments;
+	model.leaves = leaves;
+	pthread_mutex_unlock(&modelLock);
+	return 0;
+}
+
+/*
+ * Close the index.
+ * @return error code. 0 if no error
+ */
+RC LearnedIndex::close()
+{
+	segments.clear();
+	leaves.clear();
+	return index.close();
+}
+
+/*
+ * Set the cursor to the first index entry with a key >= searchKey. The
+ * leaf the model predicts is read first, then its neighbours within the
+ * error bound while searchKey is not in it.
+ * @param searchKey[IN] the key to find
+ * @param cursor[OUT] the cursor pointing to the index entry
+ * @return 0 if searchKey is found. Otherwise an error code
+ */
+RC LearnedIndex::locate(int searchKey, IndexCursor& cursor)
+{
+	int rc, lo, p, hi, key;
+	RecordId rid;
+
+	cursor.root = -1;
+	cursor.height = 0;
+	cursor.postPid = -1;
+	cursor.postEid = 0;
+	cursor.key = searchKey;
+	cursor.version = 1;
+	if (leaves.empty()) {
+		cursor.pid = -1;
+		cursor.eid = 0;
+		return RC_NO_SUCH_RECORD;
+	}
+
+	predict(searchKey, lo, p, hi);
+	BTLeafNode leaf(index.format);
+	for (;;) {
+		rc = index.readLeaf(leaves[p], leaf, &cursor.version);
+		if(rc) return rc;
+		if (p == lo || (leaf.readEntry(0, key, rid) == 0 && key <= searchKey))
+			break;
+		p--;
+	}
+	rc = leaf.locate(searchKey, cursor.eid);
+	while (cursor.eid >= leaf.getKeyCount() && p < hi) {
+		p++;
+		rc = index.readLeaf(leaves[p], leaf, &cursor.version);
+		if(rc) return rc;
+		rc = leaf.locate(searchKey, cursor.eid);
+	}
+
+	//past the last key of the leaf, the entry is the first of the next
+	cursor.pid = leaves[p];
+	if (cursor.eid >= leaf.getKeyCount()) {
+		cursor.pid = (p + 1 < (int) leaves.size()) ? leaves[p + 1] : -1;
+		cursor.eid = 0;
+		cursor.version = 1;
+	}
+	return rc;
+}
+
+/*
+ * Read the (key, rid) pair at the cursor, and move the cursor forward.
+ * @param cursor[IN/OUT] the cursor set by locate()
+ * @param key[OUT] the key of the pair
+ * @param rid[OUT] the RecordId of the pair
+ * @return error code. 0 if no error
+ */
+RC LearnedIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid)
+{
+	return index.readForward(cursor, key, rid);
+}
+
+/*
+ * Read up to n (key, rid) pairs from the cursor and move it forward.
+ * @param cursor[IN/OUT] the cursor set by locate()
+ * @param keys[OUT] the keys read. must have room for n keys
+ * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+ * @param n[IN] the maximum number of pairs to read
+ * @param count[OUT] the number of pairs read
+ * @return 0 if at least one pair was read. RC_END_OF_TREE at the end of
+ *         the tree. Otherwise an error code.
+ */
+RC LearnedIndex::readForward(IndexCursor& cursor, int keys[], RecordId rids[], int n, int& count)
+{
+	return index.readForward(cursor, keys, rids, n, count);
+}
+
+/*
+ * Fit segments to the first keys of the leaves. A segment starts at a
+ * leaf and keeps the range of slopes that pass within LRN_FIT_ERROR of
+ * every leaf after it; the segment ends before the leaf that would leave
+ * the range empty.
+ * @param keys[IN] the first key of every leaf, increasing
+ * @param segments[OUT] the segments, in key order
+ */
+void LearnedIndex::fit(const vector<int>& keys, vector<Segment>& segments)
+{
+	segments.clear();
+	int n = keys.size();
+	for (int first = 0; first < n; ) {
+		double low = 0, high = HUGE_VAL;
+		int last = first;
+		while (last + 1 < n) {
+			double dx = (double) keys[last + 1] - keys[first];
+			double dy = last + 1 - first;
+			double l = max(low, (dy - LRN_FIT_ERROR) / dx);
+			double h = min(high, (dy + LRN_FIT_ERROR) / dx);
+			if (l > h)
+				break;
+			low = l;
+			high = h;
+			last++;
+		}
+
+		Segment segment = { keys[first], first, last, last > first ? (low + high) / 2 : 0 };
+		segments.push_back(segment);
+		first = last + 1;
+	}
+}
+
+/*
+ * Return the leaves where key may be, as the model predicts them: the
+ * leaves within LRN_MAX_ERROR of the prediction and of the leaf before.
+ * The leaf the prediction falls in is the most likely one.
+ * @param key[IN] the key
+ * @param lo[OUT] the position of the leftmost leaf
+ * @param guess[OUT] the position of the most likely leaf
+ * @param hi[OUT] the position of the rightmost leaf
+ */
+void LearnedIndex::predict(int key, int& lo, int& guess, int& hi)
+{
+	//the segment of the last first key <= key, or the first segment
+	int s = 0, e = segments.size();
+	while (e - s > 1) {
+		int mid = (s + e) / 2;
+		if (segments[mid].key <= key)
+			s = mid;
+		else
+			e = mid;
+	}
+	const Segment& segment = segments[s];
+
+	double position = segment.first + segment.slope * ((double) key - segment.key);
+	lo = (int) ceil(position - LRN_MAX_ERROR - 1);
+	hi = (int) floor(position + LRN_MAX_ERROR);
+	lo = max(segment.first, min(lo, segment.last));
+	hi = max(lo, min(hi, segment.last));
+	guess = max(lo, min((int) floor(position), hi));
+}
@@ -0,0 +1,147 @@
+/*
+ * LearnedIndex: a learned index over the B+tree leaves of read-only
+ * Bruinbase tables.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef LEARNEDINDEX_H
+#define LEARNEDINDEX_H
+
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include "BTreeIndex.h"
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * A learned index over the leaves of a BTreeIndex, for tables that are
+ * loaded and then only read. A piecewise-linear model maps a key to the
+ * position of its leaf in the leaf order, off by at most LRN_MAX_ERROR
+ * leaves, so a lookup evaluates one segment of the model and reads one or
+ * two leaves instead of descending the nonleaf levels.
+ *
+ * The model is stored in a file of its own next to the index: a header
+ * page naming the tree it was fit to, the segments, and the PageId of
+ * every leaf. It is fit again by build() whenever the tree changes, and
+ * open() refuses a model fit to another tree. A model is read into memory
+ * once per process. Cursors are IndexCursors of the underlying BTreeIndex
+ * and are read the same way.
+ */
+class LearnedIndex {
+ public:
+  LearnedIndex();
+
+  /**
+   * Fit the model to the leaves of an index and write it to a file.
+   * @param indexname[IN] the name of the index file
+   * @param modelname[IN] the name of the model file
+   * @return error code. 0 if no error
+   */
+  static RC build(const std::string& indexname, const std::string& modelname);
+
+  /**
+   * Open an index and its model for reading.
+   * @param indexname[IN] the name of the index file
+   * @param modelname[IN] the name of the model file
+   * @return error code. RC_INVALID_FILE_FORMAT if the model was fit to
+   *         another tree
+   */
+  RC open(const std::string& indexname, const std::string& modelname);
+
+  /**
+   * Close the index.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Set the cursor to the first index entry with a key >= searchKey, as
+   * BTreeIndex::locate() does.
+   * @param searchKey[IN] the key to find
+   * @param cursor[OUT] the cursor pointing to the index entry
+   * @return 0 if searchKey is found. Otherwise an error code
+   */
+  RC locate(int searchKey, IndexCursor& cursor);
+
+  /**
+   * Read the (key, rid) pair at the cursor, and move the cursor forward.
+   * @param cursor[IN/OUT] the cursor set by locate()
+   * @param key[OUT] the key of the pair
+   * @param rid[OUT] the RecordId of the pair
+   * @return error code. 0 if no error
+   */
+  RC readForward(IndexCursor& cursor, int& key, RecordId& rid);
+
+  /**
+   * Read up to n (key, rid) pairs from the cursor and move it forward.
+   * @param cursor[IN/OUT] the cursor set by locate()
+   * @param keys[OUT] the keys read. must have room for n keys
+   * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+   * @param n[IN] the maximum number of pairs to read
+   * @param count[OUT] the number of pairs read
+   * @return 0 if at least one pair was read. RC_END_OF_TREE at the end of
+   *         the tree. Otherwise an error code.
+   */
+  RC readForward(IndexCursor& cursor, int keys[], RecordId rids[], int n, int& count);
+
+ private:
+  /**
+   * A segment of the model. It covers the leaves first to last, and
+   * predicts the position of key as first + slope * (key - key of first).
+   */
+  struct Segment {
+    int    key;    /// the first key of leaf first
+    int    first;  /// the position of the first leaf of the segment
+    int    last;   /// the position of the last leaf of the segment
+    double slope;  /// the leaves per key
+  };
+
+  /**
+   * Fit segments to the first keys of the leaves, each one as long as
+   * its line stays within LRN_MAX_ERROR of every leaf it covers.
+   * @param keys[IN] the first key of every leaf, increasing
+   * @param segments[OUT] the segments, in key order
+   */
+  static void fit(const std::vector<int>& keys, std::vector<Segment>& segments);
+
+  /**
+   * Return the leaves where key may be, as the model predicts them.
+   * @param key[IN] the key
+   * @param lo[OUT] the position of the leftmost leaf
+   * @param guess[OUT] the position of the most likely leaf
+   * @param hi[OUT] the position of the rightmost leaf
+   */
+  void predict(int key, int& lo, int& guess, int& hi);
+
+  /**
+   * Read the segments and the leaves of a model, or copy them from the
+   * models read before if its header page is unchanged.
+   * @param modelname[IN] the name of the model file
+   * @param pf[IN] the model file
+   * @param header[IN] the header page of the model
+   * @return error code. 0 if no error
+   */
+  RC readModel(const std::string& modelname, const PageFile& pf, const int header[]);
+
+  BTreeIndex  index;   /// the index the model was fit to
+
+  std::vector<Segment> segments; /// the segments of the model
+  std::vector<PageId>  leaves;   /// the PageId of every leaf, in key order
+
+  //
+  // the models read so far, so that a model is read from its file once
+  // per process. they are keyed by the name and inode of the model file
+  //
+  struct Model {
+    std::vector<int>     header;
+    std::vector<Segment> segments;
+    std::vector<PageId>  leaves;
+  };
+  static std::map<std::string, Model> models;
+  static pthread_mutex_t modelLock;
+};
+
+#endif /* LEARNEDINDEX_H */
@@ -0,0 +1,938 @@
+/*
+ * LsmIndex: an LSM index over the key column of write-heavy Bruinbase
+ * tables.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include "LsmIndex.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+const int PAGE_SIZE = PageFile::PAGE_SIZE;
+
+//layout of a data page: pair count, then the pairs in key order
+const int LSM_PAGE_HEADER = sizeof(int);
+const int LSM_ENTRY_SIZE = sizeof(int) + sizeof(RecordId);
+
+const int LsmPage::MAX_ENTRY_NUM = (PAGE_SIZE - LSM_PAGE_HEADER) / LSM_ENTRY_SIZE;
+
+//layout of the header page of a run: pair count, data page count,
+//smallest key, largest key. the data pages follow from page 1, then the
+//fence pages
+const int FENCES_PER_PAGE = PAGE_SIZE / sizeof(int);
+
+//layout of the manifest: the number of the next run, the run count,
+//then the number of every run, oldest first
+const int MAX_RUN_NUM = (PAGE_SIZE - 2 * sizeof(int)) / sizeof(int);
+
+//a memtable of this many pairs is written out as a run. a run belongs to
+//tier t if it holds up to MEMTABLE_SIZE * LSM_TIER_RUNS^t pairs, and
+//LSM_TIER_RUNS runs of a tier are merged into one of the next tier
+const int MEMTABLE_SIZE = 8192;
+const int LSM_TIER_RUNS = 4;
+
+//inserts wait for the merge thread once there are this many runs
+const int LSM_STALL_RUNS = 32;
+
+/*
+ * LsmPage constructor: an empty page
+ */
+LsmPage::LsmPage()
+{
+	memset(buffer, 0, PAGE_SIZE);
+}
+
+/*
+ * Read the content of the page into the buffer.
+ * @param pid[IN] the PageId to read
+ * @param pf[IN] PageFile to read from
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC LsmPage::read(PageId pid, const PageFile& pf)
+{
+	return pf.read(pid, buffer);
+}
+
+/*
+ * Write the content of the buffer to the page.
+ * @param pid[IN] the PageId to write to
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC LsmPage::write(PageId pid, PageFile& pf)
+{
+	return pf.write(pid, buffer);
+}
+
+/*
+ * Append the (key, rid) pair to the page.
+ * @param key[IN] the key to append
+ * @param rid[IN] the RecordId to append
+ * @return 0 if successful. RC_NODE_FULL if the page is full.
+ */
+RC LsmPage::append(int key, const RecordId& rid)
+{
+	int count = getCount();
+	if (count >= MAX_ENTRY_NUM)
+		return RC_NODE_FULL;
+
+	char* entry = buffer + LSM_PAGE_HEADER + count * LSM_ENTRY_SIZE;
+	memcpy(entry, &key, sizeof(int));
+	memcpy(entry + sizeof(int), &rid, sizeof(RecordId));
+	count++;
+	memcpy(buffer, &count, sizeof(int));
+	return 0;
+}
+
+/*
+ * Read the (key, rid) pair from the eid entry.
+ * @param eid[IN] the entry number to read
+ * @param key[OUT] the key from the entry
+ * @param rid[OUT] the RecordId from the entry
+ * @return 0 if successful. RC_INVALID_CURSOR if there is no such entry.
+ */
+RC LsmPage::readEntry(int eid, int& key, RecordId& rid)
+{
+	if (eid < 0 || eid >= getCount())
+		return RC_INVALID_CURSOR;
+
+	char* entry = buffer + LSM_PAGE_HEADER + eid * LSM_ENTRY_SIZE;
+	memcpy(&key, entry, sizeof(int));
+	memcpy(&rid, entry + sizeof(int), sizeof(RecordId));
+	return 0;
+}
+
+/*
+ * Return the number of pairs in the page.
+ * @return the number of pairs
+ */
+int LsmPage::getCount()
+{
+	int count;
+	memcpy(&count, buffer, sizeof(int));
+	return count;
+}
+
+/*
+ * LsmRun constructor
+ */
+LsmRun::LsmRun()
+{
+	count = 0;
+	minKey = INT_MAX;
+	maxKey = INT_MIN;
+}
+
+/*
+ * Open a run written earlier, reading its header and its fences.
+ * @param filename[IN] the name of the run file
+ * @return error code. 0 if no error
+ */
+RC LsmRun::open(const string& filename)
+{
+	char temp[PAGE_SIZE];
+	int dataPages;
+
+	if (pf.open(filename, 'r'))
+		return RC_FILE_OPEN_FAILED;
+	name = filename;
+	if (pf.read(0, temp))
+		return RC_INVALID_FILE_FORMAT;
+	memcpy(&count, temp, sizeof(int));
+	memcpy(&dataPages, temp + sizeof(int), sizeof(int));
+	memcpy(&minKey, temp + 2 * sizeof(int), sizeof(int));
+	memcpy(&maxKey, temp + 3 * sizeof(int), sizeof(int));
+
+	fences.resize(dataPages);
+	for (int i = 0; i < dataPages; i += FENCES_PER_PAGE) {
+		if (pf.read(1 + dataPages + i / FENCES_PER_PAGE, temp))
+			return RC_FILE_READ_FAILED;
+		int n = min(FENCES_PER_PAGE, dataPages - i);
+		memcpy(&fences[i], temp, n * sizeof(int));
+	}
+
+	return bloom.open(filename + ".blm", 'r');
+}
+
+/*
+ * Start writing a new run. The pairs are then given by append() in key
+ * order, and finish() completes the run.
+ * @param filename[IN] the name of the run file
+ * @return error code. 0 if no error
+ */
+RC LsmRun::create(const string& filename)
+{
+	if (pf.open(filename, 'w'))
+		return RC_FILE_OPEN_FAILED;
+	name = filename;
+	count = 0;
+	minKey = INT_MAX;
+	maxKey = INT_MIN;
+	fences.clear();
+	page = LsmPage();
+	return bloom.open(filename + ".blm", 'w');
+}
+
+/*
+ * Append a pair to a run being written, writing the data page before it
+ * when that one is full.
+ * @param key[IN] the key, not smaller than the one appended before
+ * @param rid[IN] the RecordId
+ * @return error code. 0 if no error
+ */
+RC LsmRun::append(int key, const RecordId& rid)
+{
+	int rc;
+
+	if (page.append(key, rid) != 0) {
+		rc = page.write((int) fences.size(), pf);
+		if(rc) return rc;
+		page = LsmPage();
+		page.append(key, rid);
+	}
+	if (page.getCount() == 1)
+		fences.push_back(key);
+
+	if (count++ == 0)
+		minKey = key;
+	maxKey = key;
+	bloom.add(key);
+	return 0;
+}
+
+/*
+ * Write the last data page, the fences, the header and the Bloom filter
+ * of a run being written. The run can be read afterwards.
+ * @return error code. 0 if no error
+ */
+RC LsmRun::finish()
+{
+	int rc;
+	char temp[PAGE_SIZE];
+	int dataPages = (int) fences.size();
+
+	if (page.getCount() > 0) {
+		rc = page.write(dataPages, pf);
+		if(rc) return rc;
+	}
+
+	for (int i = 0; i < dataPages; i += FENCES_PER_PAGE) {
+		memset(temp, 0, PAGE_SIZE);
+		int n = min(FENCES_PER_PAGE, dataPages - i);
+		memcpy(temp, &fences[i], n * sizeof(int));
+		if (pf.write(1 + dataPages + i / FENCES_PER_PAGE, temp))
+			return RC_FILE_WRITE_FAILED;
+	}
+
+	memset(temp, 0, PAGE_SIZE);
+	memcpy(temp, &count, sizeof(int));
+	memcpy(temp + sizeof(int), &dataPages, sizeof(int));
+	memcpy(temp + 2 * sizeof(int), &minKey, sizeof(int));
+	memcpy(temp + 3 * sizeof(int), &maxKey, sizeof(int));
+	if (pf.write(0, temp))
+		return RC_FILE_WRITE_FAILED;
+
+	rc = bloom.close();
+	if(rc) return rc;
+	return bloom.open(name + ".blm", 'r');
+}
+
+/*
+ * Close the run file.
+ * @return error code. 0 if no error
+ */
+RC LsmRun::close()
+{
+	int rc = bloom.close();
+	if (pf.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	return rc;
+}
+
+/*
+ * Delete the run file and its Bloom filter. The run stays readable
+ * while it is open.
+ * @return error code. 0 if no error
+ */
+RC LsmRun::unlink()
+{
+	int rc = 0;
+	if (::unlink(name.c_str()) < 0)
+		rc = RC_FILE_WRITE_FAILED;
+	if (::unlink((name + ".blm").c_str()) < 0)
+		rc = RC_FILE_WRITE_FAILED;
+	return rc;
+}
+
+/*
+ * Find the first data page that may hold a key >= searchKey: the page
+ * before the first one that starts at searchKey or above, since the pairs
+ * of searchKey may begin at its end.
+ * @param searchKey[IN] the key to find
+ * @return the PageId of the page. -1 if the run has no such key
+ */
+PageId LsmRun::seek(int searchKey)
+{
+	if (count == 0 || searchKey > maxKey)
+		return -1;
+	int i = (int) (lower_bound(fences.begin(), fences.end(), searchKey) - fences.begin());
+	return 1 + max(i - 1, 0);
+}
+
+/*
+ * Return the data page after pid.
+ * @param pid[IN] the PageId of a data page
+ * @return the PageId of the next data page. -1 after the last one
+ */
+PageId LsmRun::next(PageId pid)
+{
+	return (pid < (int) fences.size()) ? pid + 1 : -1;
+}
+
+/*
+ * Find the last data page that may hold a key <= searchKey: the page
+ * before the first one that starts above searchKey.
+ * @param searchKey[IN] the key to find
+ * @return the PageId of the page. -1 if the run has no such key
+ */
+PageId LsmRun::seekBackward(int searchKey)
+{
+	if (count == 0 || searchKey < minKey)
+		return -1;
+	return (PageId) (upper_bound(fences.begin(), fences.end(), searchKey) - fences.begin());
+}
+
+/*
+ * Return the data page before pid.
+ * @param pid[IN] the PageId of a data page
+ * @return the PageId of the previous data page. -1 before the first one
+ */
+PageId LsmRun::prev(PageId pid)
+{
+	return (pid > 1) ? pid - 1 : -1;
+}
+
+/*
+ * Read a data page.
+ * @param pid[IN] the PageId of the page
+ * @param page[OUT] the page read
+ * @return error code. 0 if no error
+ */
+RC LsmRun::readPage(PageId pid, LsmPage& page)
+{
+	return page.read(pid, pf);
+}
+
+/*
+ * Test whether the run may have a key.
+ * @param key[IN] the key
+ * @return false if the key is surely not in the run
+ */
+bool LsmRun::mayContain(int key)
+{
+	if (key < minKey || key > maxKey)
+		return false;
+	return bloom.mayContain(key);
+}
+
+/*
+ * LsmIndex constructor
+ */
+LsmIndex::LsmIndex()
+{
+	mode = 'r';
+	nextRun = 0;
+	merging = false;
+	joinable = false;
+	mergeRc = 0;
+	pthread_mutex_init(&runLock, NULL);
+}
+
+/*
+ * LsmIndex destructor
+ */
+LsmIndex::~LsmIndex()
+{
+	pthread_mutex_destroy(&runLock);
+}
+
+/*
+ * Return the name of the file of run n.
+ * @param n[IN] the run number
+ * @return the file name
+ */
+string LsmIndex::runName(int n)
+{
+	char suffix[16];
+	sprintf(suffix, ".%d", n);
+	return name + suffix;
+}
+
+/*
+ * Open the index file in read or write mode, and every run it names.
+ * Under 'w' mode, the index file is created if it does not exist.
+ * @param indexname[IN] the name of the index file
+ * @param mode[IN] 'r' for read, 'w' for write
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::open(const string& indexname, char mode)
+{
+	int rc;
+	char temp[PAGE_SIZE];
+
+	if (pf.open(indexname, mode))
+		return RC_FILE_OPEN_FAILED;
+	name = indexname;
+	this->mode = mode;
+	memtable.clear();
+	runs.clear();
+	numbers.clear();
+	retired.clear();
+	nextRun = 0;
+	mergeRc = 0;
+
+	if (pf.endPid() == 0) {
+		if (mode != 'w' && mode != 'W')
+			return RC_INVALID_FILE_FORMAT;
+		return writeManifest();
+	}
+
+	if (pf.read(0, temp))
+		return RC_FILE_READ_FAILED;
+	int runCount;
+	memcpy(&nextRun, temp, sizeof(int));
+	memcpy(&runCount, temp + sizeof(int), sizeof(int));
+	for (int i = 0; i < runCount; i++) {
+		int n;
+		memcpy(&n, temp + (2 + i) * sizeof(int), sizeof(int));
+		LsmRun* run = new LsmRun();
+		runs.push_back(run);
+		numbers.push_back(n);
+		rc = run->open(runName(n));
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+/*
+ * Close the index file. Under 'w' mode the memtable is written out as a
+ * run first, and the running merge is waited for.
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::close()
+{
+	int rc = 0;
+
+	if ((mode == 'w' || mode == 'W') && !memtable.empty())
+		rc = flush();
+	if (joinable) {
+		pthread_join(merger, NULL);
+		joinable = false;
+	}
+	if (rc == 0)
+		rc = mergeRc;
+
+	for (size_t i = 0; i < runs.size(); i++) {
+		runs[i]->close();
+		delete runs[i];
+	}
+	for (size_t i = 0; i < retired.size(); i++) {
+		retired[i]->close();
+		delete retired[i];
+	}
+	runs.clear();
+	numbers.clear();
+	retired.clear();
+
+	if (pf.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	return rc;
+}
+
+/*
+ * Insert (key, RecordId) pair to the index.
+ * @param key[IN] the key for the value inserted into the index
+ * @param rid[IN] the RecordId for the record being inserted into the index
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::insert(int key, const RecordId& rid)
+{
+	if (mode != 'w' && mode != 'W')
+		return RC_INVALID_FILE_MODE;
+
+	memtable.insert(make_pair(key, rid));
+	if ((int) memtable.size() < MEMTABLE_SIZE)
+		return 0;
+	return flush();
+}
+
+/*
+ * Write the memtable out as a new run, and merge runs in the background
+ * if a tier is full.
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::flush()
+{
+	int rc;
+
+	pthread_mutex_lock(&runLock);
+	int n = nextRun++;
+	pthread_mutex_unlock(&runLock);
+
+	LsmRun* run = new LsmRun();
+	rc = run->create(runName(n));
+	for (multimap<int, RecordId>::iterator it = memtable.begin(); rc == 0 && it != memtable.end(); ++it)
+		rc = run->append(it->first, it->second);
+	if (rc == 0)
+		rc = run->finish();
+	if (rc) {
+		run->close();
+		delete run;
+		return rc;
+	}
+	memtable.clear();
+
+	pthread_mutex_lock(&runLock);
+	runs.push_back(run);
+	numbers.push_back(n);
+	rc = writeManifest();
+	bool stall = ((int) runs.size() >= LSM_STALL_RUNS);
+	pthread_mutex_unlock(&runLock);
+	if(rc) return rc;
+
+	startMerge();
+
+	//the merge thread stops only when no tier is full
+	if (stall && joinable) {
+		pthread_join(merger, NULL);
+		joinable = false;
+	}
+	return 0;
+}
+
+/*
+ * Start the background merge if it is not running. A merge thread that
+ * already ended is joined first.
+ */
+void LsmIndex::startMerge()
+{
+	pthread_mutex_lock(&runLock);
+	bool running = merging;
+	pthread_mutex_unlock(&runLock);
+	if (running)
+		return;
+
+	if (joinable) {
+		pthread_join(merger, NULL);
+		joinable = false;
+	}
+
+	pthread_mutex_lock(&runLock);
+	vector<LsmRun*> picked;
+	pickRuns(picked);
+	merging = !picked.empty();
+	pthread_mutex_unlock(&runLock);
+
+	if (merging) {
+		if (pthread_create(&merger, NULL, mergeMain, this) == 0)
+			joinable = true;
+		else
+			merging = false;
+	}
+}
+
+/*
+ * The body of the background merge thread: merge full tiers until none
+ * is left.
+ * @param arg[IN] the LsmIndex
+ */
+void* LsmIndex::mergeMain(void* arg)
+{
+	LsmIndex* index = (LsmIndex*) arg;
+	vector<LsmRun*> picked;
+
+	for (;;) {
+		pthread_mutex_lock(&index->runLock);
+		index->pickRuns(picked);
+		if (picked.empty() || index->mergeRc) {
+			index->merging = false;
+			pthread_mutex_unlock(&index->runLock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&index->runLock);
+
+		RC rc = index->merge(picked);
+		if (rc) {
+			pthread_mutex_lock(&index->runLock);
+			index->mergeRc = rc;
+			pthread_mutex_unlock(&index->runLock);
+		}
+	}
+}
+
+/*
+ * Pick the oldest LSM_TIER_RUNS runs of the smallest size tier that has
+ * that many. The caller holds runLock.
+ * @param picked[OUT] the runs to merge, none if no tier is full
+ */
+void LsmIndex::pickRuns(vector<LsmRun*>& picked)
+{
+	vector<int> tiers(runs.size());
+	int top = 0;
+
+	picked.clear();
+	for (size_t i = 0; i < runs.size(); i++) {
+		long long size = MEMTABLE_SIZE;
+		int t = 0;
+		for (; runs[i]->getCount() > size; t++)
+			size *= LSM_TIER_RUNS;
+		tiers[i] = t;
+		top = max(top, t);
+	}
+
+	for (int t = 0; t <= top; t++) {
+		for (size_t i = 0; i < runs.size(); i++) {
+			if (tiers[i] == t)
+				picked.push_back(runs[i]);
+		}
+		if ((int) picked.size() >= LSM_TIER_RUNS) {
+			picked.resize(LSM_TIER_RUNS);
+			return;
+		}
+		picked.clear();
+	}
+}
+
+/*
+ * Merge runs into a new run and put it in their place. The old runs are
+ * deleted, but stay open for the cursors reading them.
+ * @param picked[IN] the runs to merge
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::merge(const vector<LsmRun*>& picked)
+{
+	int rc;
+	LsmCursor cursor;
+	int key;
+	RecordId rid;
+
+	pthread_mutex_lock(&runLock);
+	int n = nextRun++;
+	pthread_mutex_unlock(&runLock);
+
+	//read the runs through a cursor over them alone
+	cursor.highKey = INT_MAX;
+	cursor.memEid = 0;
+	cursor.runs.resize(picked.size());
+	for (size_t i = 0; i < picked.size(); i++) {
+		LsmCursor::RunPosition& pos = cursor.runs[i];
+		pos.run = picked[i];
+		pos.eid = 0;
+		pos.pid = pos.run->seek(INT_MIN);
+		if (pos.pid >= 0 && (rc = pos.run->readPage(pos.pid, pos.page)))
+			return rc;
+	}
+
+	LsmRun* run = new LsmRun();
+	rc = run->create(runName(n));
+	while (rc == 0 && (rc = readForward(cursor, key, rid)) == 0)
+		rc = run->append(key, rid);
+	if (rc == RC_END_OF_TREE)
+		rc = run->finish();
+	if (rc) {
+		run->close();
+		delete run;
+		return rc;
+	}
+
+	//the new run takes the place of the oldest one merged
+	pthread_mutex_lock(&runLock);
+	size_t at = runs.size();
+	for (size_t i = runs.size(); i-- > 0;) {
+		if (find(picked.begin(), picked.end(), runs[i]) != picked.end()) {
+			runs.erase(runs.begin() + i);
+			numbers.erase(numbers.begin() + i);
+			at = i;
+		}
+	}
+	runs.insert(runs.begin() + at, run);
+	numbers.insert(numbers.begin() + at, n);
+	retired.insert(retired.end(), picked.begin(), picked.end());
+	rc = writeManifest();
+	pthread_mutex_unlock(&runLock);
+	if(rc) return rc;
+
+	for (size_t i = 0; i < picked.size(); i++)
+		picked[i]->unlink();
+	return 0;
+}
+
+/*
+ * Write the run numbers to the index file. The caller holds runLock.
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::writeManifest()
+{
+	char temp[PAGE_SIZE];
+	int runCount = (int) runs.size();
+
+	if (runCount > MAX_RUN_NUM)
+		return RC_NODE_FULL;
+	memset(temp, 0, PAGE_SIZE);
+	memcpy(temp, &nextRun, sizeof(int));
+	memcpy(temp + sizeof(int), &runCount, sizeof(int));
+	for (int i = 0; i < runCount; i++)
+		memcpy(temp + (2 + i) * sizeof(int), &numbers[i], sizeof(int));
+	return pf.write(0, temp) ? RC_FILE_WRITE_FAILED : 0;
+}
+
+/*
+ * Set the cursor to the first pair with key >= searchKey. The scan ends
+ * after the last pair with key <= highKey, and runs with no key in the
+ * range are left out. A lookup of one key also skips the runs that the
+ * Bloom filters rule out.
+ * @param searchKey[IN] the smallest key to return
+ * @param cursor[OUT] the cursor for readForward()
+ * @param highKey[IN] the largest key to return
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::locate(int searchKey, LsmCursor& cursor, int highKey)
+{
+	int rc;
+
+	cursor.highKey = highKey;
+	cursor.lowKey = searchKey;
+	cursor.mem.clear();
+	cursor.memEid = 0;
+	cursor.runs.clear();
+	if (searchKey > highKey)
+		return 0;
+
+	multimap<int, RecordId>::iterator it = memtable.lower_bound(searchKey);
+	for (; it != memtable.end() && it->first <= highKey; ++it)
+		cursor.mem.push_back(*it);
+
+	pthread_mutex_lock(&runLock);
+	vector<LsmRun*> current(runs);
+	pthread_mutex_unlock(&runLock);
+
+	for (size_t i = 0; i < current.size(); i++) {
+		LsmRun* run = current[i];
+		if (run->getMinKey() > highKey || run->getMaxKey() < searchKey)
+			continue;
+		if (searchKey == highKey && !run->mayContain(searchKey))
+			continue;
+
+		LsmCursor::RunPosition pos;
+		pos.run = run;
+		pos.eid = 0;
+		pos.pid = run->seek(searchKey);
+		if (pos.pid < 0)
+			continue;
+		rc = run->readPage(pos.pid, pos.page);
+		if(rc) return rc;
+
+		//skip the pairs of the page below searchKey
+		int k;
+		RecordId r;
+		while (pos.page.readEntry(pos.eid, k, r) == 0 && k < searchKey)
+			pos.eid++;
+		cursor.runs.push_back(pos);
+	}
+	return 0;
+}
+
+/*
+ * Read the (key, rid) pair at the cursor, and move the cursor forward:
+ * the smallest key among the memtable and the runs is taken.
+ * @param cursor[IN/OUT] the cursor set by locate()
+ * @param key[OUT] the key of the pair
+ * @param rid[OUT] the RecordId of the pair
+ * @return 0 if a pair was read. RC_END_OF_TREE after the last pair of
+ *         the range. Otherwise an error code.
+ */
+RC LsmIndex::readForward(LsmCursor& cursor, int& key, RecordId& rid)
+{
+	int rc, k;
+	RecordId r;
+	int best = -1;
+
+	bool found = (cursor.memEid < cursor.mem.size());
+	if (found) {
+		key = cursor.mem[cursor.memEid].first;
+		rid = cursor.mem[cursor.memEid].second;
+	}
+
+	for (size_t i = 0; i < cursor.runs.size(); i++) {
+		LsmCursor::RunPosition& pos = cursor.runs[i];
+
+		//move to the next data page when the page is used up
+		while (pos.pid >= 0 && pos.page.readEntry(pos.eid, k, r) != 0) {
+			pos.pid = pos.run->next(pos.pid);
+			pos.eid = 0;
+			if (pos.pid >= 0 && (rc = pos.run->readPage(pos.pid, pos.page)))
+				return rc;
+		}
+		if (pos.pid < 0)
+			continue;
+		if (!found || k < key) {
+			key = k;
+			rid = r;
+			best = (int) i;
+			found = true;
+		}
+	}
+
+	if (!found)
+		return RC_END_OF_TREE;
+	if (key > cursor.highKey) {
+		cursor.mem.clear();
+		cursor.memEid = 0;
+		cursor.runs.clear();
+		return RC_END_OF_TREE;
+	}
+
+	if (best < 0)
+		cursor.memEid++;
+	else
+		cursor.runs[best].eid++;
+	return 0;
+}
+
+/*
+ * Read up to n (key, rid) pairs from the cursor and move it forward.
+ * @param cursor[IN/OUT] the cursor set by locate()
+ * @param keys[OUT] the keys read. must have room for n keys
+ * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+ * @param n[IN] the maximum number of pairs to read
+ * @param count[OUT] the number of pairs read
+ * @return 0 if at least one pair was read. RC_END_OF_TREE after the last
+ *         pair of the range. Otherwise an error code.
+ */
+RC LsmIndex::readForward(LsmCursor& cursor, int keys[], RecordId rids[], int n, int& count)
+{
+	int rc = 0;
+
+	count = 0;
+	while (count < n && (rc = readForward(cursor, keys[count], rids[count])) == 0)
+		count++;
+	if (count > 0)
+		return 0;
+	return rc;
+}
+
+/*
+ * Set the cursor to the last pair with key <= searchKey, for reading the
+ * index backward with readBackward(). The scan ends after the first pair
+ * with key >= lowKey, and runs with no key in the range are left out.
+ * @param searchKey[IN] the largest key to return
+ * @param cursor[OUT] the cursor for readBackward()
+ * @param lowKey[IN] the smallest key to return
+ * @return error code. 0 if no error
+ */
+RC LsmIndex::locateBackward(int searchKey, LsmCursor& cursor, int lowKey)
+{
+	int rc;
+
+	cursor.highKey = searchKey;
+	cursor.lowKey = lowKey;
+	cursor.mem.clear();
+	cursor.memEid = 0;
+	cursor.runs.clear();
+	if (lowKey > searchKey)
+		return 0;
+
+	//the pairs of the memtable go in from the largest key down
+	multimap<int, RecordId>::iterator it = memtable.upper_bound(searchKey);
+	while (it != memtable.begin() && (--it)->first >= lowKey)
+		cursor.mem.push_back(*it);
+
+	pthread_mutex_lock(&runLock);
+	vector<LsmRun*> current(runs);
+	pthread_mutex_unlock(&runLock);
+
+	for (size_t i = 0; i < current.size(); i++) {
+		LsmRun* run = current[i];
+		if (run->getMinKey() > searchKey || run->getMaxKey() < lowKey)
+			continue;
+
+		LsmCursor::RunPosition pos;
+		pos.run = run;
+		pos.pid = run->seekBackward(searchKey);
+		if (pos.pid < 0)
+			continue;
+		rc = run->readPage(pos.pid, pos.page);
+		if(rc) return rc;
+
+		//skip the pairs of the page above searchKey
+		int k;
+		RecordId r;
+		pos.eid = pos.page.getCount() - 1;
+		while (pos.page.readEntry(pos.eid, k, r) == 0 && k > searchKey)
+			pos.eid--;
+		cursor.runs.push_back(pos);
+	}
+	return 0;
+}
+
+/*
+ * Read the (key, rid) pair at the cursor, and move the cursor backward:
+ * the largest key among the memtable and the runs is taken.
+ * @param cursor[IN/OUT] the cursor set by locateBackward()
+ * @param key[OUT] the key of the pair
+ * @param rid[OUT] the RecordId of the pair
+ * @return 0 if a pair was read. RC_END_OF_TREE after the first pair of
+ *         the range. Otherwise an error code.
+ */
+RC LsmIndex::readBackward(LsmCursor& cursor, int& key, RecordId& rid)
+{
+	int rc, k;
+	RecordId r;
+	int best = -1;
+
+	bool found = (cursor.memEid < cursor.mem.size());
+	if (found) {
+		key = cursor.mem[cursor.memEid].first;
+		rid = cursor.mem[cursor.memEid].second;
+	}
+
+	for (size_t i = 0; i < cursor.runs.size(); i++) {
+		LsmCursor::RunPosition& pos = cursor.runs[i];
+
+		//move to the previous data page when the page is used up
+		while (pos.pid >= 0 && pos.page.readEntry(pos.eid, k, r) != 0) {
+			pos.pid = pos.run->prev(pos.pid);
+			if (pos.pid >= 0 && (rc = pos.run->readPage(pos.pid, pos.page)))
+				return rc;
+			pos.eid = pos.page.getCount() - 1;
+		}
+		if (pos.pid < 0)
+			continue;
+		if (!found || k > key) {
+			key = k;
+			rid = r;
+			best = (int) i;
+			found = true;
+		}
+	}
+
+	if (!found)
+		return RC_END_OF_TREE;
+	if (key < cursor.lowKey) {
+		cursor.mem.clear();
+		cursor.memEid = 0;
+		cursor.runs.clear();
+		return RC_END_OF_TREE;
+	}
+
+	if (best < 0)
+		cursor.memEid++;
+	else
+		cursor.runs[best].eid--;
+	return 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * LsmIndex: an LSM index over the key column of write-heavy Bruinbase
+ * tables.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef LSMINDEX_H
+#define LSMINDEX_H
+
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include "RecordFile.h"
+#include "BloomFilter.h"
+#include <pthread.h>
+#include <climits>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * A data page of a sorted run: (key, rid) pairs in key order.
+ */
+class LsmPage {
+ public:
+  LsmPage();
+
+  /**
+   * Read the content of the page into the buffer.
+   * @param pid[IN] the PageId to read
+   * @param pf[IN] PageFile to read from
+   * @return 0 if successful. Return an error code if there is an error.
+   */
+  RC read(PageId pid, const PageFile& pf);
+
+  /**
+   * Write the content of the buffer to the page.
+   * @param pid[IN] the PageId to write to
+   * @param pf[IN] PageFile to write to
+   * @return 0 if successful. Return an error code if there is an error.
+   */
+  RC write(PageId pid, PageFile& pf);
+
+  /**
+   * Append the (key, rid) pair to the page. The caller keeps the pairs
+   * in key order.
+   * @param key[IN] the key to append
+   * @param rid[IN] the RecordId to append
+   * @return 0 if successful. RC_NODE_FULL if the page is full.
+   */
+  RC append(int key, const RecordId& rid);
+
+  /**
+   * Read the (key, rid) pair from the eid entry.
+   * @param eid[IN] the entry number to read
+   * @param key[OUT] the key from the entry
+   * @param rid[OUT] the RecordId from the entry
+   * @return 0 if successful. RC_INVALID_CURSOR if there is no such entry.
+   */
+  RC readEntry(int eid, int& key, RecordId& rid);
+
+  /**
+   * Return the number of pairs in the page.
+   * @return the number of pairs
+   */
+  int getCount();
+
+  static const int MAX_ENTRY_NUM;
+
+ private:
+  /**
+   * The main memory buffer for loading the content of the disk page.
+   */
+  char buffer[PageFile::PAGE_SIZE];
+};
+
+/**
+ * An immutable sorted run of an LSM index, stored in a file of its own.
+ * The header page is followed by the data pages and by the fence pages,
+ * which hold the first key of every data page. The fences are kept in
+ * memory while the run is open, so a lookup reads one data page, and the
+ * keys of the run also go to a Bloom filter in a file next to it.
+ */
+class LsmRun {
+ public:
+  LsmRun();
+
+  /**
+   * Open a run written earlier.
+   * @param filename[IN] the name of the run file
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& filename);
+
+  /**
+   * Start writing a new run. The pairs are then given by append() in key
+   * order, and finish() completes the run.
+   * @param filename[IN] the name of the run file
+   * @return error code. 0 if no error
+   */
+  RC create(const std::string& filename);
+
+  /**
+   * Append a pair to a run being written.
+   * @param key[IN] the key, not smaller than the one appended before
+   * @param rid[IN] the RecordId
+   * @return error code. 0 if no error
+   */
+  RC append(int key, const RecordId& rid);
+
+  /**
+   * Write the last data page, the fences, the header and the Bloom filter
+   * of a run being written. The run can be read afterwards.
+   * @return error code. 0 if no error
+   */
+  RC finish();
+
+  /**
+   * Close the run file.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Delete the run file and its Bloom filter. The run stays readable
+   * while it is open.
+   * @return error code. 0 if no error
+   */
+  RC unlink();
+
+  /**
+   * Find the first data page that may hold a key >= searchKey.
+   * @param searchKey[IN] the key to find
+   * @return the PageId of the page. -1 if the run has no such key
+   */
+  PageId seek(int searchKey);
+
+  /**
+   * Return the data page after pid.
+   * @param pid[IN] the PageId of a data page
+   * @return the PageId of the next data page. -1 after the last one
+   */
+  PageId next(PageId pid);
+
+  /**
+   * Find the last data page that may hold a key <= searchKey.
+   * @param searchKey[IN] the key to find
+   * @return the PageId of the page. -1 if the run has no such key
+   */
+  PageId seekBackward(int searchKey);
+
+  /**
+   * Return the data page before pid.
+   * @param pid[IN] the PageId of a data page
+   * @return the PageId of the previous data page. -1 before the first one
+   */
+  PageId prev(PageId pid);
+
+  /**
+   * Read a data page.
+   * @param pid[IN] the PageId of the page
+   * @param page[OUT] the page read
+   * @return error code. 0 if no error
+   */
+  RC readPage(PageId pid, LsmPage& page);
+
+  /**
+   * Test whether the run may have a key.
+   * @param key[IN] the key
+   * @return false if the key is surely not in the run
+   */
+  bool mayContain(int key);
+
+  /**
+   * Return the number of pairs in the run.
+   * @return the number of pairs
+   */
+  int getCount() { return count; }
+
+  /**
+   * Return the smallest key of the run.
+   */
+  int getMinKey() { return minKey; }
+
+  /**
+   * Return the largest key of the run.
+   */
+  int getMaxKey() { return maxKey; }
+
+ private:
+  PageFile    pf;      /// the PageFile of the run
+  BloomFilter bloom;   /// the Bloom filter of the keys of the run
+  std::string name;    /// the name of the run file
+  int         count;   /// # of pairs in the run
+  int         minKey;  /// the smallest key of the run
+  int         maxKey;  /// the largest key of the run
+
+  /// the first key of every data page
+  std::vector<int> fences;
+
+  /// the data page being filled while the run is written
+  LsmPage     page;
+};
+
+/**
+ * The position of a scan of an LsmIndex. The scan merges the pairs of the
+ * memtable, taken when the cursor is set, with the data page being read
+ * in every run that may hold keys of the range. A backward scan takes the
+ * pairs in the opposite order.
+ */
+struct LsmCursor {
+  /// the largest key to return
+  int highKey;
+
+  /// the smallest key to return, for a backward scan
+  int lowKey;
+
+  /// the pairs of the memtable in the range in scan order, and the next
+  /// one to return
+  std::vector<std::pair<int, RecordId> > mem;
+  size_t memEid;
+
+  /// the run being read, its data page, the page and the next entry in it
+  /// (pid is -1 once the run is used up)
+  struct RunPosition {
+    LsmRun* run;
+    PageId  pid;
+    int     eid;
+    LsmPage page;
+  };
+  std::vector<RunPosition> runs;
+};
+
+/**
+ * A log-structured merge index over the key column, for tables that are
+ * appended to all the time. Inserts go to a sorted memtable in memory,
+ * and a full memtable is written out as a new sorted run, so no page is
+ * ever updated in place. A background thread merges runs of about the
+ * same size once there are LSM_TIER_RUNS of them, which keeps the number
+ * of runs a lookup reads logarithmic in the size of the index.
+ *
+ * The index file itself is a manifest naming the runs; run n is stored in
+ * indexname.n and its Bloom filter in indexname.n.blm. A cursor reads the
+ * memtable and every run at once and returns the pairs in key order, or in
+ * reverse key order, as a BTreeIndex cursor does. Runs merged away stay open for the cursors
+ * that read them until the index is closed. Inserts and cursors must not
+ * run at the same time from different threads.
+ */
+class LsmIndex {
+ public:
+  LsmIndex();
+  ~LsmIndex();
+
+  /**
+   * Open the index file in read or write mode.
+   * Under 'w' mode, the index file is created if it does not exist.
+   * @param indexname[IN] the name of the index file
+   * @param mode[IN] 'r' for read, 'w' for write
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& indexname, char mode);
+
+  /**
+   * Close the index file. Under 'w' mode the memtable is written out as a
+   * run first, and the running merge is waited for.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Insert (key, RecordId) pair to the index.
+   * @param key[IN] the key for the value inserted into the index
+   * @param rid[IN] the RecordId for the record being inserted into the index
+   * @return error code. 0 if no error
+   */
+  RC insert(int key, const RecordId& rid);
+
+  /**
+   * Set the cursor to the first pair with key >= searchKey. The scan ends
+   * after the last pair with key <= highKey, and runs with no key in the
+   * range are left out. A lookup of one key also skips the runs that the
+   * Bloom filters rule out.
+   * @param searchKey[IN] the smallest key to return
+   * @param cursor[OUT] the cursor for readForward()
+   * @param highKey[IN] the largest key to return
+   * @return error code. 0 if no error
+   */
+  RC locate(int searchKey, LsmCursor& cursor, int highKey = INT_MAX);
+
+  /**
+   * Read the (key, rid) pair at the cursor, and move the cursor forward.
+   * @param cursor[IN/OUT] the cursor set by locate()
+   * @param key[OUT] the key of the pair
+   * @param rid[OUT] the RecordId of the pair
+   * @return 0 if a pair was read. RC_END_OF_TREE after the last pair of
+   *         the range. Otherwise an error code.
+   */
+  RC readForward(LsmCursor& cursor, int& key, RecordId& rid);
+
+  /**
+   * Read up to n (key, rid) pairs from the cursor and move it forward.
+   * @param cursor[IN/OUT] the cursor set by locate()
+   * @param keys[OUT] the keys read. must have room for n keys
+   * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+   * @param n[IN] the maximum number of pairs to read
+   * @param count[OUT] the number of pairs read
+   * @return 0 if at least one pair was read. RC_END_OF_TREE after the last
+   *         pair of the range. Otherwise an error code.
+   */
+  RC readForward(LsmCursor& cursor, int keys[], RecordId rids[], int n, int& count);
+
+  /**
+   * Set the cursor to the last pair with key <= searchKey, for reading the
+   * index backward with readBackward(). The scan ends after the first pair
+   * with key >= lowKey, and runs with no key in the range are left out.
+   * @param searchKey[IN] the largest key to return
+   * @param cursor[OUT] the cursor for readBackward()
+   * @param lowKey[IN] the smallest key to return
+   * @return error code. 0 if no error
+   */
+  RC locateBackward(int searchKey, LsmCursor& cursor, int lowKey = INT_MIN);
+
+  /**
+   * Read the (key, rid) pair at the cursor, and move the cursor backward.
+   * @param cursor[IN/OUT] the cursor set by locateBackward()
+   * @param key[OUT] the key of the pair
+   * @param rid[OUT] the RecordId of the pair
+   * @return 0 if a pair was read. RC_END_OF_TREE after the first pair of
+   *         the range. Otherwise an error code.
+   */
+  RC readBackward(LsmCursor& cursor, int& key, RecordId& rid);
+
+ private:
+  /**
+   * Write the memtable out as a new run.
+   * @return error code. 0 if no error
+   */
+  RC flush();
+
+  /**
+   * Start the background merge if it is not running.
+   */
+  void startMerge();
+
+  /**
+   * The body of the background merge thread.
+   * @param arg[IN] the LsmIndex
+   */
+  static void* mergeMain(void* arg);
+
+  /**
+   * Pick the runs of the smallest size tier that is full. The caller
+   * holds runLock.
+   * @param picked[OUT] the runs to merge, none if no tier is full
+   */
+  void pickRuns(std::vector<LsmRun*>& picked);
+
+  /**
+   * Merge runs into a new run and put it in their place.
+   * @param picked[IN] the runs to merge
+   * @return error code. 0 if no error
+   */
+  RC merge(const std::vector<LsmRun*>& picked);
+
+  /**
+   * Write the run numbers to the index file. The caller holds runLock.
+   * @return error code. 0 if no error
+   */
+  RC writeManifest();
+
+  /**
+   * Return the name of the file of run n.
+   * @param n[IN] the run number
+   * @return the file name
+   */
+  std::string runName(int n);
+
+  PageFile    pf;      /// the PageFile of the manifest
+  std::string name;    /// the name of the index file
+  char        mode;    /// the mode the index was opened with
+
+  /// the pairs not yet written to a run
+  std::multimap<int, RecordId> memtable;
+
+  //
+  // the following members are shared with the merge thread and guarded
+  // by runLock
+  //
+  std::vector<LsmRun*> runs;     /// the runs, oldest first
+  std::vector<int>     numbers;  /// the number of each run
+  std::vector<LsmRun*> retired;  /// runs merged away, closed by close()
+  int         nextRun;           /// the number of the next run written
+  bool        merging;           /// whether the merge thread runs
+  bool        joinable;          /// whether the merge thread is to be joined
+  RC          mergeRc;           /// the first error of the merge thread
+  pthread_t   merger;
+  pthread_mutex_t runLock;
+};
+
+#endif /* LSMINDEX_H */
@@ -13,12 +13,17 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
 
 using std::string;
 
 int PageFile::readCount = 0;
 int PageFile::writeCount = 0;
 int PageFile::cacheClock = 1;
+int PageFile::cacheGeneration = 0;
+pthread_mutex_t PageFile::cacheLock = PTHREAD_MUTEX_INITIALIZER;
 struct PageFile::cacheStruct PageFile::readCache[PageFile::CACHE_COUNT];
 
 PageFile::PageFile() 
@@ -76,6 +81,7 @@ RC PageFile::close()
   if (::close(fd) < 0) return RC_FILE_CLOSE_FAILED;
 
   // evict all cached pages for this file
+  pthread_mutex_lock(&cacheLock);
   for (int i = 0; i < CACHE_COUNT; i++) {
     if (readCache[i].fd == fd && readCache[i].lastAccessed != 0) {
        readCache[i].fd = 0;
@@ -83,6 +89,8 @@ RC PageFile::close()
        readCache[i].lastAccessed = 0;
     }
   }
+  cacheGeneration++;
+  pthread_mutex_unlock(&cacheLock);
 
   // set the fd and epid to the initial state
   fd = -1; 
@@ -92,7 +100,7 @@ RC PageFile::close()
 
 PageId PageFile::endPid() const 
 {
-  return epid;
+  return __atomic_load_n(&epid, __ATOMIC_ACQUIRE);
 }
 
 RC PageFile::seek(PageId pid) const
@@ -102,14 +110,14 @@ RC PageFile::seek(PageId pid) const
 
 RC PageFile::write(PageId pid, const void* buffer)
 {
-  RC rc;
   if (pid < 0) return RC_INVALID_PID; 
 
-  // seek to the location of the page
-  if ((rc = seek(pid)) < 0) return rc;
+  // write the buffer to the disk page. pwrite() leaves the file offset
+  // alone, so threads sharing the file do not race on it
+  if (::pwrite(fd, buffer, PAGE_SIZE, (off_t) pid * PAGE_SIZE) != PAGE_SIZE)
+    return RC_FILE_WRITE_FAILED;
 
-  // write the buffer to the disk page
-  if (::write(fd, buffer, PAGE_SIZE) < 0) return RC_FILE_WRITE_FAILED;
+  pthread_mutex_lock(&cacheLock);
 
   // if the page is in read cache, invalidate it
   for (int i = 0; i < CACHE_COUNT; i++) {
@@ -122,59 +130,114 @@ RC PageFile::write(PageId pid, const void* buffer)
     }
   }
 
+  // a read that started before this write must not cache its old copy
+  cacheGeneration++;
+
   // if the written pid >= end pid, update the end pid
-  if (pid >= epid) epid = pid + 1;
+  if (pid >= epid) __atomic_store_n(&epid, pid + 1, __ATOMIC_RELEASE);
 
   // increase page write count
   writeCount++;
 
+  pthread_mutex_unlock(&cacheLock);
   return 0;
 }
 
-RC PageFile::read(PageId pid, void* buffer) const
+long PageFile::fileId() const
+{
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) < 0) return -1;
+  return (long) st.st_ino;
+}
+
+RC PageFile::prefetch(const PageId pids[], int n) const
 {
-  RC rc;
+  std::vector<PageId> missing;
+
+  // the pages in the read cache need no read
+  pthread_mutex_lock(&cacheLock);
+  for (int k = 0; k < n; k++) {
+    bool cached = false;
+    for (int i = 0; i < CACHE_COUNT && !cached; i++) {
+      cached = (readCache[i].fd == fd && readCache[i].pid == pids[k] &&
+                readCache[i].lastAccessed != 0);
+    }
+    if (!cached && pids[k] >= 0 && pids[k] < endPid()) missing.push_back(pids[k]);
+  }
+  pthread_mutex_unlock(&cacheLock);
+
+  // only a hint, given outside the lock: the kernel starts reading the
+  // pages in the background, one request for each run of adjacent pages
+  std::sort(missing.begin(), missing.end());
+  for (size_t k = 0; k < missing.size(); ) {
+    size_t end = k + 1;
+    while (end < missing.size() && missing[end] <= missing[end - 1] + 1) end++;
+    if (::posix_fadvise(fd, (off_t) missing[k] * PAGE_SIZE,
+                        (off_t) (missing[end - 1] - missing[k] + 1) * PAGE_SIZE,
+                        POSIX_FADV_WILLNEED) != 0) {
+      return RC_FILE_READ_FAILED;
+    }
+    k = end;
+  }
+  return 0;
+}
 
-  if (pid < 0 || pid >= epid) return RC_INVALID_PID; 
+RC PageFile::read(PageId pid, void* buffer) const
+{
+  if (pid < 0 || pid >= endPid()) return RC_INVALID_PID; 
 
   //
   // if the page is in cache, read it from there
   //
+  pthread_mutex_lock(&cacheLock);
   for (int i = 0; i < CACHE_COUNT; i++) {
     if (readCache[i].fd == fd && readCache[i].pid == pid && 
         readCache[i].lastAccessed != 0) {
        memcpy(buffer, readCache[i].buffer, PAGE_SIZE);
        readCache[i].lastAccessed = ++cacheClock;
+       pthread_mutex_unlock(&cacheLock);
        return 0;
     }
   }
+  int generation = cacheGeneration;
+  pthread_mutex_unlock(&cacheLock);
 
-  // seek to the page
-  if ((rc = seek(pid)) < 0) return rc;
-  
-  // find the cache slot to evict
-  int toEvict = 0; 
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].lastAccessed == 0) {
-      toEvict = i;
-      break;
-    }
-    if (readCache[i].lastAccessed < readCache[toEvict].lastAccessed) {
-      toEvict = i;
-    }
-  }
-  readCache[toEvict].fd = fd;
-  readCache[toEvict].pid = pid;
-  readCache[toEvict].lastAccessed = ++cacheClock;
- 
-  // read the page to cache first and copy it to the buffer
-  if (::read(fd, readCache[toEvict].buffer, PAGE_SIZE) < 0) {
+  // read the page without holding the cache lock, so that reads of
+  // different threads overlap
+  if (::pread(fd, buffer, PAGE_SIZE, (off_t) pid * PAGE_SIZE) < 0) {
     return RC_FILE_READ_FAILED;
   }
-  memcpy(buffer, readCache[toEvict].buffer, PAGE_SIZE);
+
+  pthread_mutex_lock(&cacheLock);
 
   // increase the page read count
   readCount++;
 
+  // cache the page unless a write may have made it stale or another
+  // thread has cached it meanwhile
+  bool cached = (generation != cacheGeneration);
+  for (int i = 0; i < CACHE_COUNT && !cached; i++) {
+    cached = (readCache[i].fd == fd && readCache[i].pid == pid &&
+              readCache[i].lastAccessed != 0);
+  }
+  if (!cached) {
+    // find the cache slot to evict
+    int toEvict = 0; 
+    for (int i = 0; i < CACHE_COUNT; i++) {
+      if (readCache[i].lastAccessed == 0) {
+        toEvict = i;
+        break;
+      }
+      if (readCache[i].lastAccessed < readCache[toEvict].lastAccessed) {
+        toEvict = i;
+      }
+    }
+    readCache[toEvict].fd = fd;
+    readCache[toEvict].pid = pid;
+    readCache[toEvict].lastAccessed = ++cacheClock;
+    memcpy(readCache[toEvict].buffer, buffer, PAGE_SIZE);
+  }
+
+  pthread_mutex_unlock(&cacheLock);
   return 0;
 }
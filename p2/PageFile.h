@@ -11,12 +11,15 @@
 #define PAGEFILE_H
 
 #include <string>
+#include <pthread.h>
 #include "Bruinbase.h"
 
 typedef int PageId;
 
 /**
- * read/write a file in the unit of a page
+ * read/write a file in the unit of a page.
+ * pages of one file may be read and written by several threads at once;
+ * the read cache is shared by all files and guarded by a lock.
  */
 class PageFile {
  public:
@@ -59,6 +62,24 @@ class PageFile {
    */
   RC write(PageId pid, const void *buffer);
     
+  /**
+   * tell the operating system that pages will be read soon, so that it
+   * can read them in the background while the caller goes on. pages in
+   * the read cache are skipped, and adjacent pages are asked for together.
+   * does not count as a read.
+   * @param pids[IN] the pages to read later
+   * @param n[IN] the number of pages
+   * @return error code. 0 if no error
+   */
+  RC prefetch(const PageId pids[], int n) const;
+
+  /**
+   * tell the open file apart from others, including a file that later
+   * takes over its name.
+   * @return the inode number of the file. -1 if it is not open
+   */
+  long fileId() const;
+
   /**
    * note the +1 part. The last page id in the file is actually endPid()-1.
    * that is, the last page can be read by "read(endPid()-1, buffer)".
@@ -95,6 +116,9 @@ class PageFile {
   static const int CACHE_COUNT = 10;
 
   static int cacheClock; // clock tick counter for LRU policy
+  static int cacheGeneration; // bumped by every write, so that a page read
+                              //   while it is rewritten is not cached
+  static pthread_mutex_t cacheLock; // guards the cache and the counters
 
   // the actual cache data structure
   static struct cacheStruct {
@@ -10,8 +10,11 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <climits>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <unistd.h>
 #include "Bruinbase.h"
 #include "SqlEngine.h"
 
@@ -21,6 +24,24 @@ using namespace std;
 extern FILE* sqlin;
 int sqlparse(void);
 
+// # of index entries fetched and processed together by a SELECT
+static const int INDEX_BATCH_SIZE = 64;
+
+// a key range with at most this many entries in the key index is read
+// through it rather than through the cover index, whose wide entries
+// make it taller and cost more pages than the tuples of the range
+static const int COVER_MIN_ENTRIES = 8;
+
+// how full LOAD fills the nodes of a new key index, leaving room for the
+// inserts that follow
+static const int LOAD_FILL = 90;
+
+// orders the positions of an index batch by the RecordId they point to
+struct RidOrder {
+  const RecordId* rids;
+  bool operator() (int a, int b) const { return rids[a] < rids[b]; }
+};
+
 
 RC SqlEngine::run(FILE* commandline)
 {
@@ -34,101 +55,118 @@ RC SqlEngine::run(FILE* commandline)
   return 0;
 }
 
-RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
+RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond,
+                     const SelOrder* order)
 {
- // printf("start select\n");
   RecordFile rf;   // RecordFile containing the table
   RecordId   rid;  // record cursor for table scanning
-  RecordId   rid_min;
-  RecordId   rid_max;
 
   RC     rc = 0;
   int    key;     
   string value;
   int    count;
-  int    diff;
   BTreeIndex b_idx;
+  ValueIndex v_idx;
+  CoverIndex c_idx;
+  HashIndex h_idx;
+  LsmIndex l_idx;
+  LearnedIndex n_idx;
+  StaticIndex s_idx;
+  BloomFilter k_bloom, v_bloom;
   SelCond condition;
 
   bool useIndex = false; 
-  bool EqualCond = false;
+  bool useValueIndex = false;
+  bool keyEq = false, valueEq = false;
 
   //min and max are INCLUDED in the key search, so start AND end on them
-  int key_min = -1;
-  int key_max = -1;
-  int key_equal_val = -1;
-  int key_noteq_val;  
-
-  char* value_equal_val = NULL;
-  char* value_noteq_val = NULL;
+  int key_min = INT_MIN;
+  int key_max = INT_MAX;
 
+  //bounds of the value search (NULL if open), also included
+  const char* value_min = NULL;
+  const char* value_max = NULL;
+  const char* value_eq = NULL;
 
   // check the conditions for traversing the index/table
   for (unsigned i = 0; i < cond.size(); i++) {
     condition = cond[i];
     int val = atoi(condition.value);
 
-    switch (condition.attr) {
-    //key attribute
-    case 1:
+    //conditions other than <> narrow down the range of the value index
+    if (condition.attr == 2) {
       switch (condition.comp) {
-
         case SelCond::NE:
-        key_noteq_val = val;
-          useIndex = false;
           break;
-       
         case SelCond::EQ:
-          useIndex = true;
-          EqualCond = true;
-          //check mult eq
-          if (key_equal_val != -1 && key_equal_val != val)
-            return rc;
-          key_equal_val = val;
-          break;
-
-
-
-        //else figure out the correct range of values to search
-        case SelCond::LT:
-          useIndex = true;
-          if (val < key_max || key_max == -1)
-            key_max = val;
-          break;
+          valueEq = true;
+          value_eq = condition.value;
+          // fall through
         case SelCond::GT:
-          useIndex = true;
-          if (val > key_min || key_min == -1)
-            key_min = val + 1;
-          break;
-        case SelCond::LE:
-          useIndex = true;
-          if (val < key_max || key_max == -1)
-            key_max = val + 1;
-          break;
         case SelCond::GE:
-          useIndex = true;
-          if (val > key_min || key_min == -1)        
-            key_min = val;
+          useValueIndex = true;
+          if (value_min == NULL || strcmp(condition.value, value_min) > 0)
+            value_min = condition.value;
+          if (condition.comp != SelCond::EQ) break;
+          // fall through
+        case SelCond::LT:
+        case SelCond::LE:
+          useValueIndex = true;
+          if (value_max == NULL || strcmp(condition.value, value_max) < 0)
+            value_max = condition.value;
           break;
       }
-      break;
-    //value attribute
-    //check if there are multiple equality statements, if so invalid query
-    case 2:
-      char* val = condition.value;
-      useIndex = false;
-      if(SelCond::EQ == condition.comp) {
-          //multiple equality statements is invalid
-          if (value_equal_val != NULL && strcmp(value_equal_val, val) != 0)
-            return rc;
-          value_equal_val = val;
-      }
-      break;
+      continue;
+    }
 
+    //only key conditions other than <> narrow down the index range.
+    //every condition is checked again on each tuple read.
+    if (condition.comp == SelCond::EQ) keyEq = true;
+
+    switch (condition.comp) {
+      case SelCond::NE:
+        break;
+      case SelCond::EQ:
+        useIndex = true;
+        if (val > key_min) key_min = val;
+        if (val < key_max) key_max = val;
+        break;
+      case SelCond::LT:
+        useIndex = true;
+        //no key is below INT_MIN: the range is empty
+        if (val == INT_MIN) { key_min = INT_MAX; key_max = INT_MIN; }
+        else if (val - 1 < key_max) key_max = val - 1;
+        break;
+      case SelCond::GT:
+        useIndex = true;
+        //no key is above INT_MAX: the range is empty
+        if (val == INT_MAX) { key_min = INT_MAX; key_max = INT_MIN; }
+        else if (val + 1 > key_min) key_min = val + 1;
+        break;
+      case SelCond::LE:
+        useIndex = true;
+        if (val < key_max) key_max = val;
+        break;
+      case SelCond::GE:
+        useIndex = true;
+        if (val > key_min) key_min = val;
+        break;
     }
-  } 
-  //printf("keymax is %d    ", key_max);
-  //printf("keymin is %d    ", key_min);
+  }
+
+  //an equality on value is more selective than a key range, if the
+  //table has a value index to look it up in
+  int indexes = 0;
+  if (valueEq && !keyEq && tableIndexes(table, indexes) && (indexes & IDX_VALUE))
+    useIndex = false;
+
+  //SELECT key and COUNT(*) with conditions on key alone need no tuples
+  bool indexOnly = (attr == 1 || attr == 4);
+  bool keyNe = false;
+  for (unsigned i = 0; i < cond.size(); i++) {
+    if (cond[i].attr != 1) indexOnly = false;
+    if (cond[i].comp == SelCond::NE) keyNe = true;
+  }
 
   // open the table file
   if ((rc = rf.open(table + ".tbl", 'r')) < 0) {
@@ -136,294 +174,437 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
     return rc;
   }
 
+  //an equality on a key or value the Bloom filters rule out selects
+  //nothing, and needs no tuple or index page
+  bool absent = false;
+  if (keyEq && k_bloom.open(table + ".blm", 'r') == 0) {
+    absent = !k_bloom.mayContain(key_min);
+    k_bloom.close();
+  }
+  if (!absent && valueEq && v_bloom.open(table + ".vblm", 'r') == 0) {
+    absent = !v_bloom.mayContain(value_eq);
+    v_bloom.close();
+  }
+  if (absent) {
+    if (attr == 4) fprintf(stdout, "0\n");
+    rf.close();
+    return 0;
+  }
 
+  count = 0;
+
+  //the cover index saves the table reads of a key range, but its wide
+  //entries make it taller than the key index. the key index, opened here
+  //to count the entries of the range, serves SELECT key and COUNT(*),
+  //and point lookups and narrow ranges, whose few tuples cost less
+  bool useCover = (order == NULL && useIndex && access((table + ".cidx").c_str(), F_OK) == 0);
+  bool keyIndexOpen = false;
+  if (useCover && b_idx.open(table + ".idx", 'r') == 0) {
+    keyIndexOpen = true;
+    useCover = !indexOnly && !fewEntries(b_idx, key_min, key_max, COVER_MIN_ENTRIES);
+  }
 
-
-  //open BTreeIndex to find valid tuples
-  if(useIndex){
-   // printf("using index");
-    count = 0;
-
-    //open index table
-    if ((rc = b_idx.open(table + ".idx", 'r')) < 0){
-      fprintf(stderr, "Error: index %s does not exist\n", table.c_str() );
-      goto exit_select;
+  if (order != NULL) {
+    rc = selectOrdered(attr, table, rf, cond, *order, key_min, key_max, indexOnly, count);
+  } else if ((useIndex || indexOnly) && s_idx.open(table + ".idx", table + ".sidx") == 0) {
+    //search the copy of the key index in memory, which reads no page
+    StaticCursor cursor;
+    int          keys[INDEX_BATCH_SIZE];
+    RecordId     rids[INDEX_BATCH_SIZE];
+    int          n;
+
+    //a key range is counted from the positions of its ends
+    if (attr == 4 && indexOnly && !keyNe) {
+      s_idx.countRange(key_min, key_max, count);
+      rc = RC_END_OF_TREE;
+    } else if (key_min <= key_max) {
+      s_idx.locate(key_min, cursor, key_max);
+      rc = 0;
+    } else
+      //contradicting key conditions select nothing
+      rc = RC_END_OF_TREE;
+
+    while (rc == 0 && (rc = s_idx.readForward(cursor, keys, rids, INDEX_BATCH_SIZE, n)) == 0) {
+      rc = selectBatch(attr, rf, cond, keys, rids, n, indexOnly, count);
     }
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    s_idx.close();
+  } else if (keyEq && h_idx.open(table + ".hidx", 'r') == 0) {
+    //look up a key equality in the hash index if the table has one
+    HashCursor cursor;
+    int        keys[INDEX_BATCH_SIZE];
+    RecordId   rids[INDEX_BATCH_SIZE];
+    int        n;
+
+    //contradicting key conditions select nothing
+    if (key_min == key_max)
+      rc = h_idx.locate(key_min, cursor);
+    else
+      rc = RC_END_OF_TREE;
+
+    //every entry found has the key looked up
+    for (int i = 0; i < INDEX_BATCH_SIZE; i++) keys[i] = key_min;
+
+    while (rc == 0 && (rc = h_idx.readForward(cursor, rids, INDEX_BATCH_SIZE, n)) == 0) {
+      rc = selectBatch(attr, rf, cond, keys, rids, n, indexOnly, count);
+    }
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    h_idx.close();
+  } else if ((useIndex || indexOnly) && n_idx.open(table + ".idx", table + ".lrn") == 0) {
+    //find the start of the key range through the learned model, and
+    //read the leaves of the key index from there
+    IndexCursor cursor;
+    int         keys[INDEX_BATCH_SIZE];
+    RecordId    rids[INDEX_BATCH_SIZE];
+    int         n;
+
+    //contradicting key conditions select nothing
+    if (key_min <= key_max)
+      n_idx.locate(key_min, cursor);
+    else
+      cursor.pid = -1;
+
+    while ((rc = n_idx.readForward(cursor, keys, rids, INDEX_BATCH_SIZE, n)) == 0) {
+      //stop at the first entry beyond the upper bound
+      int last = n;
+      while (last > 0 && keys[last - 1] > key_max) last--;
+      if ((rc = selectBatch(attr, rf, cond, keys, rids, last, indexOnly, count)) < 0) break;
+      if (last < n) break;
+    }
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    n_idx.close();
+  } else if (useCover && c_idx.open(table + ".cidx", 'r') == 0) {
+    //answer from the leaves of the covering index, reading the table
+    //only for values that may have been cut
+    IndexCursor cursor;
+    CoveredKey  entries[INDEX_BATCH_SIZE];
+    RecordId    rids[INDEX_BATCH_SIZE];
+    CoveredKey  low, high;
+    int         n;
+
+    //contradicting key conditions select nothing
+    low.key = key_min;
+    high.key = key_max;
+    if (key_min <= key_max)
+      c_idx.locate(low, cursor);
+    else
+      cursor.pid = -1;
+
+    while ((rc = c_idx.readForward(cursor, entries, rids, INDEX_BATCH_SIZE, n, &high)) == 0) {
+      for (int i = 0; i < n; i++) {
+        const char* v = entries[i].value.data;
+        if (v[COVER_VALUE_SIZE - 1] == 0) {
+          key = entries[i].key;
+          value = v;
+        } else if ((rc = rf.read(rids[i], key, value)) < 0) {
+          fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
+          break;
+        }
 
-    //if key_min, is higher than key_max, then not possible
-    if (key_min > key_max && key_max != -1)
-      return rc;
-
-    //equal condition or not
-    if(EqualCond == true){
-
-
-      //locate rid using key
-      IndexCursor CID;
-      rc = b_idx.locate(key_equal_val, CID);
-      if (rc == 0){
-        rc = b_idx.readForward(CID, key, rid);
-        if (rc != 0) return rc;
-      } else {
-        return rc;
+        if (!checkConditions(cond, key, value)) continue;
+        count++;
+        printTuple(attr, key, value);
       }
+      if (rc < 0) break;
+    }
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    c_idx.close();
+  } else if ((useIndex || indexOnly) && (keyIndexOpen || b_idx.open(table + ".idx", 'r') == 0)) {
+    //scan the key range through the index if the table has one
+    IndexScanner scanner;
+    int          keys[INDEX_BATCH_SIZE];
+    RecordId     rids[INDEX_BATCH_SIZE];
+    int          n;
+
+    //a key range is counted from the subtree counts, if the index has them
+    int n_range;
+    if (attr == 4 && indexOnly && !keyNe && b_idx.countRange(key_min, key_max, n_range) == 0) {
+      count = n_range;
+      rc = RC_END_OF_TREE;
+    } else if (key_min <= key_max)
+      rc = scanner.open(b_idx, key_min, key_max);
+    else
+      //contradicting key conditions select nothing
+      rc = RC_END_OF_TREE;
+
+    while (rc == 0 && (rc = scanner.next(keys, rids, INDEX_BATCH_SIZE, n)) == 0) {
+      rc = selectBatch(attr, rf, cond, keys, rids, n, indexOnly, count);
+    }
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    b_idx.close();
+    keyIndexOpen = false;
+  } else if ((useIndex || indexOnly) && l_idx.open(table + ".lsm", 'r') == 0) {
+    //merge the key range out of the memtable and the runs of the LSM index
+    LsmCursor cursor;
+    int       keys[INDEX_BATCH_SIZE];
+    RecordId  rids[INDEX_BATCH_SIZE];
+    int       n;
+
+    //contradicting key conditions select nothing
+    if (key_min <= key_max)
+      rc = l_idx.locate(key_min, cursor, key_max);
+    else
+      rc = RC_END_OF_TREE;
+
+    while (rc == 0 && (rc = l_idx.readForward(cursor, keys, rids, INDEX_BATCH_SIZE, n)) == 0) {
+      rc = selectBatch(attr, rf, cond, keys, rids, n, indexOnly, count);
+    }
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    l_idx.close();
+  } else if (useValueIndex && v_idx.open(table + ".vidx", 'r') == 0) {
+    //the index holds value prefixes, so the range is widened to the
+    //prefixes of its bounds and every tuple is checked in full
+    IndexCursor cursor;
+    ValueKey    keys[INDEX_BATCH_SIZE];
+    RecordId    rids[INDEX_BATCH_SIZE];
+    ValueKey    low = value_min ? ValueKey(value_min) : ValueKey();
+    ValueKey    high = value_max ? ValueKey(value_max) : ValueKey::max();
+    int         n;
+
+    //contradicting value conditions select nothing
+    if (value_min == NULL || value_max == NULL || strcmp(value_min, value_max) <= 0)
+      v_idx.locate(low, cursor);
+    else
+      cursor.pid = -1;
+
+    //the reads stop at the first entry beyond the upper bound
+    while ((rc = v_idx.readForward(cursor, keys, rids, INDEX_BATCH_SIZE, n, &high)) == 0) {
+      if ((rc = selectBatch(attr, rf, cond, NULL, rids, n, false, count)) < 0) break;
+    }
+    if (rc == RC_END_OF_TREE) rc = 0;
 
+    v_idx.close();
+  } else {
+    // scan the table file from the beginning
+    rid.pid = rid.sid = 0;
+    while (rid < rf.endRid()) {
       // read the tuple
       if ((rc = rf.read(rid, key, value)) < 0) {
         fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
-        return rc;
+        goto exit_select;
       }
 
       // check the conditions on the tuple
-      for (unsigned i = 0; i < cond.size(); i++) {
-        // compute the difference between the tuple value and the condition value
-        switch (cond[i].attr) {
-          case 1:
-            diff = key - atoi(cond[i].value);
-            break;
-          case 2:
-            diff = strcmp(value.c_str(), cond[i].value);
-            break;
-        }
-
-         // skip the tuple if any condition is not met
-        switch (cond[i].comp) {
-        case SelCond::EQ:
-          if (diff != 0) goto exit_select_i;
-          break;
-        case SelCond::NE:
-          if (diff == 0) goto exit_select_i;
-          break;
-        case SelCond::GT:
-          if (diff <= 0) goto exit_select_i;
-          break;
-        case SelCond::LT:
-          if (diff >= 0) goto exit_select_i;
-          break;
-        case SelCond::GE:
-          if (diff < 0) goto exit_select_i;
-          break;
-        case SelCond::LE:
-          if (diff > 0) goto exit_select_i;
-          break;
-        }
-      }
-//printf("1");
-      // the condition is met for the tuple. 
-      // increase matching tuple counter
-      count++;  
-      // print the tuple 
-      switch (attr) {
-      case 1:  // SELECT key
-        fprintf(stdout, "%d\n", key);
-        break;
-      case 2:  // SELECT value
-        fprintf(stdout, "%s\n", value.c_str());
-        break;
-      case 3:  // SELECT *
-        fprintf(stdout, "%d '%s'\n", key, value.c_str());
-        break;
-      }
-
-      if (attr == 4) {
-        fprintf(stdout, "%d\n", count);
+      if (checkConditions(cond, key, value)) {
+        // the condition is met for the tuple. 
+        // increase matching tuple counter
+        count++;
+        printTuple(attr, key, value);
       }
 
-      exit_select_i:;
-
-    } else {
-
-      int key_min_i;
-      string value_mi;
-
-      int key_max_i;
-      string value_ma;
+      // move to the next tuple
+      ++rid;
+    }
+  }
 
-      if(key_min == -1) key_min = 1;
-      IndexCursor cid_min;
-      b_idx.locate(key_min, cid_min);
-      rc = b_idx.readForward(cid_min, key_min_i, rid_min);
-      if (rc != 0) {
-        if (cid_min.pid == 2 && cid_min.eid == 0){
-          cid_min.pid = 3;
-          b_idx.readForward(cid_min, key_min_i, rid_min);
-        }
-        else return rc;
-      }
-      
-      //printf("key_min_i is %d       ", key_min_i);
-
-      if(key_max != -1){
-        IndexCursor cid_max;
-        b_idx.locate(key_max, cid_max);
-        rc = b_idx.readForward(cid_max, key_max_i, rid_max);
-        if (rc != 0) return rc;
-      }
+  // print matching tuple count if "select count(*)"
+  if (attr == 4) {
+    fprintf(stdout, "%d\n", count);
+  }
 
+  // close the table file and return
+  exit_select: 
+  if (keyIndexOpen) b_idx.close();
+  rf.close();
+  return rc;
+}
 
-      while(key_max == -1 || key_min_i < key_max_i){
+bool SqlEngine::fewEntries(BTreeIndex& idx, int keyMin, int keyMax, int limit)
+{
+  IndexScanner scanner;
+  int          key;
+  RecordId     rid;
+  int          n = 0;
+
+  if (keyMin <= keyMax && scanner.open(idx, keyMin, keyMax) == 0)
+    while (n <= limit && scanner.next(key, rid) == 0) n++;
+  return n <= limit;
+}
 
-        // read the tuple
-        if ((rc = rf.read(rid_min, key_min_i, value_mi)) < 0) {
-          fprintf(stderr, "Error1: while reading a tuple from table %s\n", table.c_str());
-          return rc;
-        }
+bool SqlEngine::checkConditions(const vector<SelCond>& cond, int key, const string& value)
+{
+  int diff;
 
-        for (unsigned i = 0; i < cond.size(); i++) {
-          // compute the difference between the tuple value and the condition value
-          switch (cond[i].attr) {
-            case 1:
-              diff = key_min_i - atoi(cond[i].value);
-              break;
-            case 2:
-              diff = strcmp(value_mi.c_str(), cond[i].value);
-              break;
-          }
-
-          // skip the tuple if any condition is not met
-          switch (cond[i].comp) {
-            case SelCond::EQ:
-              if (diff != 0) goto next_key;
-              break;
-            case SelCond::NE:
-              if (diff == 0) goto next_key;
-              break;
-            case SelCond::GT:
-              if (diff <= 0) goto next_key;
-              break;
-            case SelCond::LT:
-              if (diff >= 0) goto next_key;
-              break;
-            case SelCond::GE:
-              if (diff < 0) goto next_key;
-              break;
-            case SelCond::LE:
-              if (diff > 0) goto next_key;
-              break;
-          }
-        }
-//printf("2");
-        // the condition is met for the tuple. 
-        // increase matching tuple counter
-        count++;
-        // print the tuple 
-        switch (attr) {
-          case 1:  // SELECT key
-            fprintf(stdout, "%d\n", key_min_i);
-            break;
-          case 2:  // SELECT value
-            fprintf(stdout, "%s\n", value_mi.c_str());
-            break;
-          case 3:  // SELECT *
-            fprintf(stdout, "%d '%s'\n", key_min_i, value_mi.c_str());
-            break;
-        }
+  for (unsigned i = 0; i < cond.size(); i++) {
+    // compute the difference between the tuple value and the condition value
+    switch (cond[i].attr) {
+      case 1:
+        diff = key - atoi(cond[i].value);
+        break;
+      case 2:
+        diff = strcmp(value.c_str(), cond[i].value);
+        break;
+    }
 
-        next_key:
-        rc = b_idx.readForward(cid_min, key_min_i, rid_min);
-        if (rc != 0) {
-          //printf("broke");
-          break;
-        }
-      }
+    // the tuple fails if any condition is not met
+    switch (cond[i].comp) {
+      case SelCond::EQ:
+        if (diff != 0) return false;
+        break;
+      case SelCond::NE:
+        if (diff == 0) return false;
+        break;
+      case SelCond::GT:
+        if (diff <= 0) return false;
+        break;
+      case SelCond::LT:
+        if (diff >= 0) return false;
+        break;
+      case SelCond::GE:
+        if (diff < 0) return false;
+        break;
+      case SelCond::LE:
+        if (diff > 0) return false;
+        break;
+    }
+  }
+  return true;
+}
 
-      if (attr == 4) {
-          fprintf(stdout, "%d\n", count);
+RC SqlEngine::selectBatch(int attr, RecordFile& rf, const vector<SelCond>& cond,
+                          const int keys[], const RecordId rids[], int n,
+                          bool indexOnly, int& count)
+{
+  RC     rc;
+  int    tupleKeys[INDEX_BATCH_SIZE];
+  string values[INDEX_BATCH_SIZE];
+  int    order[INDEX_BATCH_SIZE];
+
+  // read the tuples of the batch in page order, unless the keys of the
+  // index entries are all the SELECT needs
+  if (!indexOnly) {
+    RidOrder byRid = { rids };
+    for (int i = 0; i < n; i++) order[i] = i;
+    sort(order, order + n, byRid);
+    for (int i = 0; i < n; i++) {
+      if ((rc = rf.read(rids[order[i]], tupleKeys[order[i]], values[order[i]])) < 0) {
+        fprintf(stderr, "Error: while reading a tuple from table\n");
+        return rc;
       }
-
     }
+    keys = tupleKeys;
+  }
 
-    rc = b_idx.close();
+  // check and print the tuples in index order
+  for (int i = 0; i < n; i++) {
+    // skip the tuple if any condition is not met
+    if (!checkConditions(cond, keys[i], values[i])) continue;
 
-  } else {
-    
-    //printf("not using index\n");
-
-    // scan the table file from the beginning
-    rid.pid = rid.sid = 0;
-    count = 0;
-    while (rid < rf.endRid()) {
-      // read the tuple
-      if ((rc = rf.read(rid, key, value)) < 0) {
-        fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
-        goto exit_select;
-      }
+    // the condition is met for the tuple. 
+    // increase matching tuple counter
+    count++;
+    printTuple(attr, keys[i], values[i]);
+  }
+  return 0;
+}
 
-      //printf("next\n");
-      // check the conditions on the tuple
-      for (unsigned i = 0; i < cond.size(); i++) {
-        // compute the difference between the tuple value and the condition value
-        switch (cond[i].attr) {
-          case 1:
-            diff = key - atoi(cond[i].value);
-            break;
-          case 2:
-            diff = strcmp(value.c_str(), cond[i].value);
-            break;
-        }
+// orders tuples by key, from the largest key if desc is set
+struct KeyOrder {
+  bool desc;
+  bool operator() (const pair<int, string>& a, const pair<int, string>& b) const
+  { return desc ? a.first > b.first : a.first < b.first; }
+};
 
-        // skip the tuple if any condition is not met
-        switch (cond[i].comp) {
-        case SelCond::EQ:
-          if (diff != 0) goto next_tuple;
-          break;
-        case SelCond::NE:
-          if (diff == 0) goto next_tuple;
-          break;
-        case SelCond::GT:
-          if (diff <= 0) goto next_tuple;
-          break;
-        case SelCond::LT:
-          if (diff >= 0) goto next_tuple;
-          break;
-        case SelCond::GE:
-          if (diff < 0) goto next_tuple;
-          break;
-        case SelCond::LE:
-          if (diff > 0) goto next_tuple;
-          break;
-        }
-      }
-      // the condition is met for the tuple. 
-      // increase matching tuple counter
-      count++;
-//printf("3");
-      // print the tuple 
-      switch (attr) {
-      case 1:  // SELECT key
-        fprintf(stdout, "%d\n", key);
-        break;
-      case 2:  // SELECT value
-        fprintf(stdout, "%s\n", value.c_str());
-        break;
-      case 3:  // SELECT *
-        fprintf(stdout, "%d '%s'\n", key, value.c_str());
+RC SqlEngine::selectOrdered(int attr, const string& table, RecordFile& rf,
+                            const vector<SelCond>& cond, const SelOrder& order,
+                            int keyMin, int keyMax, bool indexOnly, int& count)
+{
+  RC          rc = 0;
+  BTreeIndex  b_idx;
+  LsmIndex    l_idx;
+  int         key;
+  string      value;
+  RecordId    rid;
+
+  //contradicting key conditions select nothing
+  if (keyMin > keyMax || order.limit == 0) return 0;
+
+  bool keyIndex = (b_idx.open(table + ".idx", 'r') == 0);
+  if (keyIndex || l_idx.open(table + ".lsm", 'r') == 0) {
+    //walk the key range from the end the order starts at, merging the
+    //runs of an LSM index in that direction
+    IndexScanner scanner;
+    IndexCursor  cursor;
+    LsmCursor    lsmCursor;
+    if (!keyIndex)
+      rc = order.desc ? l_idx.locateBackward(keyMax, lsmCursor, keyMin)
+                      : l_idx.locate(keyMin, lsmCursor, keyMax);
+    else if (order.desc)
+      rc = b_idx.locateBackward(keyMax, cursor);
+    else
+      rc = scanner.open(b_idx, keyMin, keyMax);
+
+    while (rc == 0 && (order.limit < 0 || count < order.limit)) {
+      if (!keyIndex) {
+        rc = order.desc ? l_idx.readBackward(lsmCursor, key, rid)
+                        : l_idx.readForward(lsmCursor, key, rid);
+        if (rc != 0) break;
+      } else if (order.desc) {
+        if ((rc = b_idx.readBackward(cursor, key, rid)) != 0) break;
+        if (key < keyMin) break;
+      } else if ((rc = scanner.next(key, rid)) != 0) break;
+
+      // read the tuple only if the SELECT needs more than the key
+      if (!indexOnly && (rc = rf.read(rid, key, value)) < 0) {
+        fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
         break;
       }
-
-      // move to the next tuple
-      next_tuple:
-      ++rid;
+      if (!checkConditions(cond, key, value)) continue;
+      count++;
+      printTuple(attr, key, value);
     }
-  
+    if (rc == RC_END_OF_TREE) rc = 0;
+
+    if (keyIndex) b_idx.close();
+    else l_idx.close();
+    return rc;
+  }
 
-    // print matching tuple count if "select count(*)"
-    if (attr == 4) {
-      fprintf(stdout, "%d\n", count);
+  //without an index, sort the matching tuples of a table scan
+  vector<pair<int, string> > tuples;
+  rid.pid = rid.sid = 0;
+  while (rid < rf.endRid()) {
+    if ((rc = rf.read(rid, key, value)) < 0) {
+      fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
+      return rc;
     }
+    if (checkConditions(cond, key, value))
+      tuples.push_back(make_pair(key, value));
+    ++rid;
+  }
 
+  KeyOrder byKey = { order.desc };
+  stable_sort(tuples.begin(), tuples.end(), byKey);
+  for (unsigned i = 0; i < tuples.size(); i++) {
+    if (order.limit >= 0 && count >= order.limit) break;
+    count++;
+    printTuple(attr, tuples[i].first, tuples[i].second);
   }
-    
-  
-  
+  return 0;
+}
 
-  // close the table file and return
-  exit_select: 
-  rf.close();
-  return rc;
+void SqlEngine::printTuple(int attr, int key, const string& value)
+{
+  switch (attr) {
+    case 1:  // SELECT key
+      fprintf(stdout, "%d\n", key);
+      break;
+    case 2:  // SELECT value
+      fprintf(stdout, "%s\n", value.c_str());
+      break;
+    case 3:  // SELECT *
+      fprintf(stdout, "%d '%s'\n", key, value.c_str());
+      break;
+  }
 }
 
-RC SqlEngine::load(const string& table, const string& loadfile, bool index)
+RC SqlEngine::load(const string& table, const string& loadfile, bool index, int options)
 {
     //open the new file for RecordFile
     RecordFile newRecord;
@@ -433,10 +614,80 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
         return rc;
     }
 
-    //create the index
+    //a table keeps the indexes it has: a LOAD adds its tuples to every
+    //index file of the table, whether it names the index again or not
+    if (tableIndexes(table, options))
+        index = true;
+
+    //create the index, or the LSM index in its place
     BTreeIndex b_idx;
-    if (index)
-        b_idx.open(table + ".idx", 'w');
+    bool keyIndex = index && !(options & IDX_LSM);
+    int format = 0;
+    if (options & IDX_COMPACT)
+        format |= BT_LEAF_COMPACT;
+    if (options & IDX_COUNTED)
+        format |= BT_NONLEAF_COUNTS;
+    format |= BT_LEAF_PREV;
+    //a copy-on-write tree leaves out the compact leaves and their back links
+    if (options & IDX_COW)
+        format |= BT_COPY_ON_WRITE;
+    if (options & IDX_BUFFERED)
+        format |= BT_BUFFERED;
+    if (keyIndex)
+        b_idx.open(table + ".idx", 'w', format);
+    LsmIndex l_idx;
+    bool lsmIndex = index && (options & IDX_LSM);
+    if (lsmIndex && (rc = l_idx.open(table + ".lsm", 'w'))) {
+        fprintf(stderr, "Error creating LSM index with error number %d\n", rc);
+        return rc;
+    }
+
+    //and the value and covering indexes, if asked for
+    ValueIndex v_idx;
+    bool valueIndex = index && (options & IDX_VALUE);
+    if (valueIndex && (rc = v_idx.open(table + ".vidx", 'w'))) {
+        fprintf(stderr, "Error creating value index with error number %d\n", rc);
+        return rc;
+    }
+    CoverIndex c_idx;
+    bool coverIndex = index && (options & IDX_COVER);
+    if (coverIndex && (rc = c_idx.open(table + ".cidx", 'w'))) {
+        fprintf(stderr, "Error creating covering index with error number %d\n", rc);
+        return rc;
+    }
+    HashIndex h_idx;
+    bool hashIndex = index && (options & IDX_HASH);
+    if (hashIndex && (rc = h_idx.open(table + ".hidx", 'w'))) {
+        fprintf(stderr, "Error creating hash index with error number %d\n", rc);
+        return rc;
+    }
+    BloomFilter k_bloom, v_bloom;
+    bool keyBloom = index && (options & IDX_BLOOM);
+    bool valueBloom = keyBloom && (options & IDX_VALUE);
+    if ((keyBloom && (rc = k_bloom.open(table + ".blm", 'w')))
+        || (valueBloom && (rc = v_bloom.open(table + ".vblm", 'w')))) {
+        fprintf(stderr, "Error creating Bloom filter with error number %d\n", rc);
+        return rc;
+    }
+
+    //the Bloom filters are written anew from the items added, so the
+    //tuples of earlier loads go in first
+    if (keyBloom) {
+        RecordId rid;
+        int      key;
+        string   value;
+        for (rid.pid = rid.sid = 0; rid < newRecord.endRid(); ++rid) {
+            if ((rc = newRecord.read(rid, key, value)) < 0) {
+                fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
+                return rc;
+            }
+            k_bloom.add(key);
+            if (valueBloom) v_bloom.add(value.c_str());
+        }
+    }
+
+    //the pairs of the key index, built at once after the last line
+    vector<pair<int, RecordId> > pairs;
 
     fstream file;
     string line;
@@ -453,13 +704,31 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
         if (parseLoadLine(line, key, value) == 0) {
             if (newRecord.append(key, value, rid) == 0) {
                 //insert into index
-                if (index) {
-                    if(key == 4733) printf("FOUND IT");
-                    if (b_idx.insert(key, rid) != 0) {
-                        fprintf(stderr, "failed to write to index.\n");
-                        return RC_FILE_WRITE_FAILED;                        
+                if (keyIndex)
+                    pairs.push_back(make_pair(key, rid));
+                if (valueIndex && v_idx.insert(ValueKey(value.c_str()), rid) != 0) {
+                    fprintf(stderr, "failed to write to value index.\n");
+                    return RC_FILE_WRITE_FAILED;
+                }
+                if (coverIndex) {
+                    CoveredKey entry;
+                    entry.key = key;
+                    entry.value = FixedString<COVER_VALUE_SIZE>(value.c_str());
+                    if (c_idx.insert(entry, rid) != 0) {
+                        fprintf(stderr, "failed to write to covering index.\n");
+                        return RC_FILE_WRITE_FAILED;
                     }
                 }
+                if (lsmIndex && l_idx.insert(key, rid) != 0) {
+                    fprintf(stderr, "failed to write to LSM index.\n");
+                    return RC_FILE_WRITE_FAILED;
+                }
+                if (hashIndex && h_idx.insert(key, rid) != 0) {
+                    fprintf(stderr, "failed to write to hash index.\n");
+                    return RC_FILE_WRITE_FAILED;
+                }
+                if (keyBloom) k_bloom.add(key);
+                if (valueBloom) v_bloom.add(value.c_str());
             }
             else
               return RC_INVALID_ATTRIBUTE;
@@ -467,14 +736,133 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
             return RC_INVALID_ATTRIBUTE;
     }
 
+    //build the tree of a new key index with every core, or insert the
+    //pairs one by one into an index that has some already
+    if (keyIndex) {
+        rc = IndexBuilder::build(b_idx, pairs, LOAD_FILL, sysconf(_SC_NPROCESSORS_ONLN));
+        for (size_t i = 0; rc == RC_INVALID_FILE_FORMAT && i < pairs.size(); i++) {
+            if (b_idx.insert(pairs[i].first, pairs[i].second) != 0) {
+                fprintf(stderr, "failed to write to index.\n");
+                return RC_FILE_WRITE_FAILED;
+            }
+        }
+        if (rc && rc != RC_INVALID_FILE_FORMAT) {
+            fprintf(stderr, "failed to write to index.\n");
+            return RC_FILE_WRITE_FAILED;
+        }
+    }
+
     //check for file close failure
     file.close();
-    rc = b_idx.close();
+    rc = keyIndex ? b_idx.close() : 0;
+
+    //fit the learned model to the leaves as they are now, also when the
+    //load added to a table that has one
+    if (rc == 0 && keyIndex && (options & IDX_LEARNED)
+        && LearnedIndex::build(table + ".idx", table + ".lrn") != 0) {
+        fprintf(stderr, "failed to write the learned index.\n");
+        rc = RC_FILE_WRITE_FAILED;
+    }
+
+    //and the static index to the tree as it is now
+    if (rc == 0 && keyIndex && (options & IDX_STATIC)
+        && StaticIndex::create(table + ".idx", table + ".sidx") != 0) {
+        fprintf(stderr, "failed to write the static index.\n");
+        rc = RC_FILE_WRITE_FAILED;
+    }
+    if (lsmIndex && l_idx.close())
+        rc = RC_FILE_CLOSE_FAILED;
+    if (valueIndex && v_idx.close())
+        rc = RC_FILE_CLOSE_FAILED;
+    if (coverIndex && c_idx.close())
+        rc = RC_FILE_CLOSE_FAILED;
+    if (hashIndex && h_idx.close())
+        rc = RC_FILE_CLOSE_FAILED;
+    if (keyBloom && k_bloom.close())
+        rc = RC_FILE_CLOSE_FAILED;
+    if (valueBloom && v_bloom.close())
+        rc = RC_FILE_CLOSE_FAILED;
     if (file.fail() || newRecord.close() < 0 || rc)
         return RC_FILE_CLOSE_FAILED;
     return 0;
 }
 
+RC SqlEngine::rebuild(const string& table, int fill)
+{
+    IndexStats before, after;
+    RC rc;
+
+    if (fill < 1 || fill > 100) {
+        fprintf(stderr, "Error: fill factor must be from 1 to 100\n");
+        return RC_INVALID_ATTRIBUTE;
+    }
+    if ((rc = BTreeIndex::rebuild(table + ".idx", fill, before, after))) {
+        fprintf(stderr, "Error rebuilding index of table %s with error number %d\n", table.c_str(), rc);
+        return rc;
+    }
+
+    //the leaves have moved, so the learned model is fit again
+    int existing = 0;
+    tableIndexes(table, existing);
+    if ((existing & IDX_LEARNED) && (rc = LearnedIndex::build(table + ".idx", table + ".lrn"))) {
+        fprintf(stderr, "Error fitting learned index of table %s with error number %d\n", table.c_str(), rc);
+        return rc;
+    }
+    if ((existing & IDX_STATIC) && (rc = StaticIndex::create(table + ".idx", table + ".sidx"))) {
+        fprintf(stderr, "Error writing static index of table %s with error number %d\n", table.c_str(), rc);
+        return rc;
+    }
+
+    const IndexStats* stats[] = { &before, &after };
+    const char* when[] = { "before:", "after:" };
+    for (int i = 0; i < 2; i++)
+        fprintf(stdout, "%-7s height %d, %d leaves %d%% full, %d nonleaf nodes, a leaf scan seeks back %d times\n",
+                when[i], stats[i]->height, stats[i]->leafCount, stats[i]->leafFill,
+                stats[i]->nonLeafCount, stats[i]->leafSeeks);
+    return 0;
+}
+
+bool SqlEngine::tableIndexes(const string& table, int& options)
+{
+    //the key index has no flag of its own, only its variants
+    static const struct { const char* suffix; int option; } files[] = {
+        { ".idx", 0 },
+        { ".vidx", IDX_VALUE },
+        { ".cidx", IDX_COVER },
+        { ".hidx", IDX_HASH },
+        { ".blm", IDX_BLOOM },
+        { ".lsm", IDX_LSM },
+        { ".lrn", IDX_LEARNED },
+        { ".sidx", IDX_STATIC }
+    };
+    bool found = false;
+    for (unsigned i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        if (access((table + files[i].suffix).c_str(), F_OK) == 0) {
+            options |= files[i].option;
+            found = true;
+        }
+    }
+    return found;
+}
+
+int SqlEngine::indexOption(const char* name)
+{
+    if (strcasecmp(name, "compact") == 0) return IDX_COMPACT;
+    if (strcasecmp(name, "value") == 0) return IDX_VALUE;
+    if (strcasecmp(name, "cover") == 0) return IDX_COVER;
+    if (strcasecmp(name, "counted") == 0) return IDX_COUNTED;
+    if (strcasecmp(name, "hash") == 0) return IDX_HASH;
+    if (strcasecmp(name, "bloom") == 0) return IDX_BLOOM;
+    if (strcasecmp(name, "cow") == 0) return IDX_COW;
+    if (strcasecmp(name, "buffered") == 0) return IDX_BUFFERED;
+    if (strcasecmp(name, "lsm") == 0) return IDX_LSM;
+    if (strcasecmp(name, "learned") == 0) return IDX_LEARNED;
+    if (strcasecmp(name, "static") == 0) return IDX_STATIC;
+    // "on" only reads well in "WITH INDEX ON value"
+    if (strcasecmp(name, "on") == 0) return 0;
+    return -1;
+}
+
 RC SqlEngine::parseLoadLine(const string& line, int& key, string& value)
 {
     const char *s;
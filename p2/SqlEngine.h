@@ -14,6 +14,12 @@
 #include "Bruinbase.h"
 #include "RecordFile.h"
 #include "BTreeIndex.h"
+#include "BTreeIndexT.h"
+#include "HashIndex.h"
+#include "LsmIndex.h"
+#include "LearnedIndex.h"
+#include "StaticIndex.h"
+#include "BloomFilter.h"
 
 /**
  * data structure to represent a condition in the WHERE clause
@@ -24,6 +30,59 @@ struct SelCond {
   char* value;  // the value to compare
 };
 
+/**
+ * data structure for the "ORDER BY key [ASC|DESC] [LIMIT n]" clause
+ */
+struct SelOrder {
+  bool desc;    // true to return the tuples in descending key order
+  int  limit;   // the maximum number of tuples to return (-1: no limit)
+};
+
+/**
+ * options of the index created by "LOAD ... WITH INDEX <options>"
+ */
+enum IndexOption {
+  IDX_COMPACT = 0x1,    // B+tree with bit-packed leaf nodes
+  IDX_VALUE   = 0x2,    // also index the value column ("ON value")
+  IDX_COVER   = 0x4,    // also build a covering index with values in its leaves
+  IDX_COUNTED = 0x8,    // B+tree with subtree counts in its nonleaf nodes
+  IDX_HASH    = 0x10,   // also build a hash index for key equality lookups
+  IDX_BLOOM   = 0x20,   // also build Bloom filters of the keys (and values)
+  IDX_COW     = 0x40,   // B+tree copied on write, for snapshot readers
+  IDX_BUFFERED = 0x80,  // B+tree with insert buffers in its nonleaf nodes
+  IDX_LSM     = 0x100,  // LSM index of sorted runs instead of the B+tree
+  IDX_LEARNED = 0x200,  // learned model over the B+tree leaves, for read-only tables
+  IDX_STATIC  = 0x400   // copy of the B+tree in memory, for read-only tables
+};
+
+/**
+ * the index on the value column (table.vidx) is a B+tree over the first
+ * VALUE_KEY_SIZE bytes of each value
+ */
+const int VALUE_KEY_SIZE = 24;
+typedef FixedString<VALUE_KEY_SIZE> ValueKey;
+typedef BTreeIndexT<ValueKey> ValueIndex;
+
+/**
+ * the covering index (table.cidx) is a B+tree over the key column whose
+ * entries also carry the value, cut to COVER_VALUE_SIZE bytes. only the
+ * key is compared; a value that fills all bytes may have been cut and is
+ * read from the table instead.
+ */
+const int COVER_VALUE_SIZE = 32;
+struct CoveredKey {
+  int key;
+  FixedString<COVER_VALUE_SIZE> value;
+};
+
+template <>
+struct BTreeKeyTraits<CoveredKey> {
+  static const int SIZE = sizeof(CoveredKey);
+  static int compare(const CoveredKey& a, const CoveredKey& b)
+  { return (a.key < b.key) ? -1 : ((a.key > b.key) ? 1 : 0); }
+};
+typedef BTreeIndexT<CoveredKey> CoverIndex;
+
 /**
  * the class that takes, parses, and executes the user commands.
  */
@@ -47,18 +106,46 @@ class SqlEngine {
    * (1: key, 2: value, 3: *, 4: count(*))
    * @param table[IN] the table name in the FROM clause
    * @param conds[IN] list of conditions in the WHERE clause
+   * @param order[IN] the ORDER BY clause (NULL if none)
    * @return error code. 0 if no error
    */
-  static RC select(int attr, const std::string& table, const std::vector<SelCond>& conds);
+  static RC select(int attr, const std::string& table, const std::vector<SelCond>& conds,
+                   const SelOrder* order = NULL);
 
   /**
    * load a table from a load file.
    * @param table[IN] the table name in the LOAD command
    * @param loadfile[IN] the file name of the load file
    * @param index[IN] true if "WITH INDEX" option was specified
+   * @param options[IN] IndexOption flags given after "WITH INDEX"
+   * @return error code. 0 if no error
+   */
+  static RC load(const std::string& table, const std::string& loadfile, bool index, int options = 0);
+
+  /**
+   * rewrite the index of a table in key order (REBUILD INDEX), and print
+   * the shape of the tree before and after.
+   * @param table[IN] the table name in the REBUILD INDEX command
+   * @param fill[IN] how full to fill the nodes, in percent (1 to 100)
    * @return error code. 0 if no error
    */
-  static RC load(const std::string& table, const std::string& loadfile, bool index);
+  static RC rebuild(const std::string& table, int fill = 90);
+
+  /**
+   * translate an option name of the "WITH INDEX" clause.
+   * @param name[IN] the option name (e.g., "compact")
+   * @return the IndexOption flag. -1 if the name is not a valid option
+   */
+  static int indexOption(const char* name);
+
+  /**
+   * find the index files a table has.
+   * @param table[IN] the table name
+   * @param options[IN/OUT] the IndexOption flags of the files found are
+   * added to it
+   * @return true if the table has any index file
+   */
+  static bool tableIndexes(const std::string& table, int& options);
 
   /**
    * parse a line from the load file into the (key, value) pair.
@@ -68,6 +155,75 @@ class SqlEngine {
    * @return error code. 0 if no error
    */
   static RC parseLoadLine(const std::string& line, int& key, std::string& value);
+
+ private:
+  /**
+   * check whether a key index has at most limit entries in a key range,
+   * reading no more of it than that.
+   * @param idx[IN] the open key index
+   * @param keyMin[IN] the smallest key of the range
+   * @param keyMax[IN] the largest key of the range
+   * @param limit[IN] the number of entries to allow
+   * @return true if the range has at most limit entries
+   */
+  static bool fewEntries(BTreeIndex& idx, int keyMin, int keyMax, int limit);
+
+  /**
+   * check whether a tuple satisfies all conditions of the WHERE clause.
+   * @param conds[IN] list of conditions in the WHERE clause
+   * @param key[IN] the key of the tuple
+   * @param value[IN] the value of the tuple
+   * @return true if every condition is met
+   */
+  static bool checkConditions(const std::vector<SelCond>& conds, int key, const std::string& value);
+
+  /**
+   * print a tuple that matched a SELECT.
+   * @param attr[IN] attribute in the SELECT clause (1: key, 2: value, 3: *)
+   * @param key[IN] the key of the tuple
+   * @param value[IN] the value of the tuple
+   */
+  static void printTuple(int attr, int key, const std::string& value);
+
+  /**
+   * read the tuples of a batch of index entries, then check and print
+   * them in index order. the tuples are read in RecordId order, so that
+   * entries pointing to the same table page are read together. every
+   * index of a SELECT hands its entries to this function.
+   * @param attr[IN] attribute in the SELECT clause
+   * @param rf[IN] the table
+   * @param conds[IN] list of conditions in the WHERE clause
+   * @param keys[IN] the keys of the batch; only used if indexOnly is set
+   * @param rids[IN] the RecordIds of the batch
+   * @param n[IN] the number of entries in the batch
+   * @param indexOnly[IN] true if the tuples need not be read
+   * @param count[IN/OUT] matching tuple counter
+   * @return error code. 0 if no error
+   */
+  static RC selectBatch(int attr, RecordFile& rf, const std::vector<SelCond>& conds,
+                        const int keys[], const RecordId rids[], int n,
+                        bool indexOnly, int& count);
+
+  /**
+   * print the tuples that match a SELECT in key order, up to its limit.
+   * the key index, or the LSM index of a table without one, is read
+   * forward or backward from the end of the key range, so only the tuples
+   * returned are read. without an index the table is scanned and the
+   * matching tuples are sorted.
+   * @param attr[IN] attribute in the SELECT clause
+   * @param table[IN] the table name
+   * @param rf[IN] the table
+   * @param conds[IN] list of conditions in the WHERE clause
+   * @param order[IN] the ORDER BY clause
+   * @param keyMin[IN] the smallest key the conditions allow
+   * @param keyMax[IN] the largest key the conditions allow
+   * @param indexOnly[IN] true if the tuples need not be read
+   * @param count[IN/OUT] matching tuple counter
+   * @return error code. 0 if no error
+   */
+  static RC selectOrdered(int attr, const std::string& table, RecordFile& rf,
+                          const std::vector<SelCond>& conds, const SelOrder& order,
+                          int keyMin, int keyMax, bool indexOnly, int& count);
 };
 
 #endif /* SQLENGINE_H */
@@ -13,7 +13,8 @@ int  sqllex(void);
 void sqlerror(const char *str) { fprintf(stderr, "Error: %s\n", str); }
 extern "C" { int  sqlwrap() { return 1; } }
 
-static void runSelect(int attr, const char* table, const std::vector<SelCond>& conds)
+static void runSelect(int attr, const char* table, const std::vector<SelCond>& conds,
+                      const SelOrder* order = NULL)
 {
   struct tms tmsbuf;
   clock_t btime, etime;
@@ -21,7 +22,7 @@ static void runSelect(int attr, const char* table, const std::vector<SelCond>& c
 
   btime = times(&tmsbuf);
   bpagecnt = PageFile::getPageReadCount();
-  SqlEngine::select(attr, table, conds);
+  SqlEngine::select(attr, table, conds, order);
   etime = times(&tmsbuf);
   epagecnt = PageFile::getPageReadCount();
 
@@ -35,6 +36,7 @@ static void runSelect(int attr, const char* table, const std::vector<SelCond>& c
   char* string;
   SelCond* cond;
   std::vector<SelCond>* conds;
+  SelOrder* order;
 }
 
 %token SELECT FROM WHERE LOAD WITH INDEX QUIT COUNT AND OR 
@@ -42,10 +44,11 @@ static void runSelect(int attr, const char* table, const std::vector<SelCond>& c
 %token <string> INTEGER STRING ID
 %token EQUAL NEQUAL LESS LESSEQUAL GREATER GREATEREQUAL 
 
-%type <integer> attributes attribute comparator
+%type <integer> attributes attribute comparator index_options
 %type <string> table value
 %type <cond> condition
 %type <conds> conditions
+%type <order> order_clause
 %%
 
 commands:
@@ -55,6 +58,7 @@ commands:
 
 command:
         load_command { fprintf(stdout, "Bruinbase> "); }
+	| rebuild_command { fprintf(stdout, "Bruinbase> "); }
 	| select_command { fprintf(stdout, "Bruinbase> "); }
 	| quit_command
 	| error LF { fprintf(stdout, "Bruinbase> "); }
@@ -76,6 +80,44 @@ load_command:
 	  free($2);
 	  free($4);
 	}
+	| LOAD table FROM STRING WITH INDEX index_options LF { 
+	  SqlEngine::load(std::string($2), std::string($4), true, $7); 
+	  free($2);
+	  free($4);
+	}
+	;
+
+rebuild_command:
+	ID INDEX table LF {
+		bool ok = strcasecmp($1, "rebuild") == 0;
+		free($1);
+		if (!ok) { free($3); sqlerror("syntax error"); YYERROR; }
+		SqlEngine::rebuild(std::string($3));
+		free($3);
+	}
+	| ID INDEX table ID INTEGER LF {
+		bool ok = strcasecmp($1, "rebuild") == 0 && strcasecmp($4, "fill") == 0;
+		free($1);
+		free($4);
+		if (!ok) { free($3); free($5); sqlerror("syntax error"); YYERROR; }
+		SqlEngine::rebuild(std::string($3), atoi($5));
+		free($3);
+		free($5);
+	}
+	;
+
+index_options:
+	ID {
+		$$ = SqlEngine::indexOption($1);
+		free($1);
+		if ($$ < 0) { sqlerror("unknown index option"); YYERROR; }
+	}
+	| index_options ID {
+		int option = SqlEngine::indexOption($2);
+		free($2);
+		if (option < 0) { sqlerror("unknown index option"); YYERROR; }
+		$$ = $1 | option;
+	}
 	;
 
 select_command:
@@ -92,6 +134,49 @@ select_command:
 		}
 	  	delete $6;
 	}
+	| SELECT attributes FROM table order_clause LF {
+   	        std::vector<SelCond> conds;
+		runSelect($2, $4, conds, $5);
+		free($4);
+		delete $5;
+	}
+	| SELECT attributes FROM table WHERE conditions order_clause LF {
+	        runSelect($2, $4, *$6, $7);
+	  	free($4);
+	  	for (unsigned i = 0; i < $6->size(); i++) {
+		    free((*$6)[i].value);
+		}
+	  	delete $6;
+		delete $7;
+	}
+	;
+
+order_clause:
+	ID ID attribute {
+		bool ok = strcasecmp($1, "order") == 0 && strcasecmp($2, "by") == 0;
+		free($1);
+		free($2);
+		if (!ok) { sqlerror("syntax error"); YYERROR; }
+		if ($3 != 1) { sqlerror("only ORDER BY key is supported"); YYERROR; }
+		$$ = new SelOrder;
+		$$->desc = false;
+		$$->limit = -1;
+	}
+	| order_clause ID {
+		if (strcasecmp($2, "desc") == 0) $1->desc = true;
+		else if (strcasecmp($2, "asc") == 0) $1->desc = false;
+		else { free($2); delete $1; sqlerror("syntax error"); YYERROR; }
+		free($2);
+		$$ = $1;
+	}
+	| order_clause ID INTEGER {
+		bool ok = strcasecmp($2, "limit") == 0;
+		$1->limit = atoi($3);
+		free($2);
+		free($3);
+		if (!ok || $1->limit < 0) { delete $1; sqlerror("syntax error"); YYERROR; }
+		$$ = $1;
+	}
 	;
 
 conditions:
@@ -0,0 +1,339 @@
+/*
+ * StaticIndex: a static in-memory Eytzinger index over the key column of
+ * read-only Bruinbase tables.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include "StaticIndex.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+using namespace std;
+
+const int PAGE_SIZE = PageFile::PAGE_SIZE;
+
+//layout of the index file: the root, height and end page of the tree,
+//and the generation of the file
+const int STATIC_HEADER_INTS = 4;
+
+//a lookup prefetches the slots this far below the one it reads: the 16
+//descendants four levels down, which fill one 64-byte cache line
+const unsigned STATIC_PREFETCH_SLOTS = 16;
+const int STATIC_LINE_SIZE = 64;
+
+//# of pairs read from the B+tree at a time on open
+const int STATIC_LOAD_BATCH = 256;
+
+map<string, StaticIndex::Tree*> StaticIndex::trees;
+pthread_mutex_t StaticIndex::treeLock = PTHREAD_MUTEX_INITIALIZER;
+
+StaticIndex::StaticIndex()
+{
+	tree = NULL;
+}
+
+StaticIndex::~StaticIndex()
+{
+	close();
+}
+
+/*
+ * Make the index of a B+tree: write the index file naming the tree.
+ * @param indexname[IN] the name of the B+tree index file
+ * @param staticname[IN] the name of the static index file
+ * @return error code. 0 if no error
+ */
+RC StaticIndex::create(const string& indexname, const string& staticname)
+{
+	int rc;
+	BTreeIndex index;
+	PageFile pf;
+	char temp[PAGE_SIZE];
+	int header[STATIC_HEADER_INTS];
+
+	rc = index.open(indexname, 'r');
+	if(rc) return rc;
+	header[0] = index.rootPid;
+	header[1] = index.treeHeight;
+	header[2] = index.pf.endPid();
+
+	//a load that stays within the leaves keeps the root, height and end
+	//page, so the copy this process has of the tree is dropped here, and
+	//the copies of other processes by the next generation of the file. a
+	//new file starts from the time, not to repeat one that was removed
+	char id[32];
+	sprintf(id, "#%ld", index.pf.fileId());
+	index.close();
+	pthread_mutex_lock(&treeLock);
+	map<string, Tree*>::iterator it = trees.find(indexname + id);
+	if (it != trees.end()) {
+		it->second->stale = true;
+		if (it->second->refs == 0)
+			release(it->second);
+		trees.erase(it);
+	}
+	pthread_mutex_unlock(&treeLock);
+
+	if (pf.open(staticname, 'w'))
+		return RC_FILE_OPEN_FAILED;
+	if (pf.endPid() > 0 && pf.read(0, temp) == 0)
+		memcpy(&header[3], temp + 3 * sizeof(int), sizeof(int));
+	else
+		header[3] = (int) time(NULL);
+	header[3]++;
+	memset(temp, 0, PAGE_SIZE);
+	memcpy(temp, header, sizeof(header));
+	rc = pf.write(0, temp);
+	if (pf.close() && rc == 0)
+		rc = RC_FILE_CLOSE_FAILED;
+	return rc;
+}
+
+/*
+ * Open the index, reading the pairs of the B+tree into memory unless
+ * another StaticIndex of this process already did.
+ * @param indexname[IN] the name of the B+tree index file
+ * @param staticname[IN] the name of the static index file
+ * @return error code. RC_INVALID_FILE_FORMAT if the B+tree changed
+ *         since the index was made
+ */
+RC StaticIndex::open(const string& indexname, const string& staticname)
+{
+	int rc;
+	PageFile pf;
+	char temp[PAGE_SIZE];
+	BTreeIndex index;
+
+	close();
+	if (pf.open(staticname, 'r'))
+		return RC_FILE_OPEN_FAILED;
+	rc = pf.read(0, temp);
+	pf.close();
+	if(rc) return RC_INVALID_FILE_FORMAT;
+	vector<int> header(STATIC_HEADER_INTS);
+	memcpy(&header[0], temp, STATIC_HEADER_INTS * sizeof(int));
+
+	rc = index.open(indexname, 'r');
+	if(rc) return rc;
+	if (header[0] != index.rootPid || header[1] != index.treeHeight
+	    || header[2] != index.pf.endPid()) {
+		index.close();
+		return RC_INVALID_FILE_FORMAT;
+	}
+
+	char id[32];
+	sprintf(id, "#%ld", index.pf.fileId());
+	string name = indexname + id;
+	pthread_mutex_lock(&treeLock);
+	map<string, Tree*>::iterator it = trees.find(name);
+	if (it != trees.end() && it->second->header == header) {
+		tree = it->second;
+		tree->refs++;
+	}
+	pthread_mutex_unlock(&treeLock);
+	if (tree) {
+		index.close();
+		return 0;
+	}
+
+	//read the tree without the lock, and keep the copy of another thread
+	//that got there first
+	Tree* fresh;
+	rc = load(index, header, fresh);
+	index.close();
+	if(rc) return rc;
+
+	pthread_mutex_lock(&treeLock);
+	Tree*& slot = trees[name];
+	if (slot && slot->header == header) {
+		release(fresh);
+	} else {
+		if (slot) {
+			slot->stale = true;
+			if (slot->refs == 0)
+				release(slot);
+		}
+		slot = fresh;
+	}
+	tree = slot;
+	tree->refs++;
+	pthread_mutex_unlock(&treeLock);
+	return 0;
+}
+
+/*
+ * Close the index. A tree a newer copy took the place of is freed when
+ * its last reader closes.
+ * @return error code. 0 if no error
+ */
+RC StaticIndex::close()
+{
+	if (tree == NULL)
+		return 0;
+	pthread_mutex_lock(&treeLock);
+	if (--tree->refs == 0 && tree->stale)
+		release(tree);
+	pthread_mutex_unlock(&treeLock);
+	tree = NULL;
+	return 0;
+}
+
+/*
+ * Set the cursor to the first pair with key >= searchKey. The scan ends
+ * after the last pair with key <= highKey.
+ * @param searchKey[IN] the smallest key to return
+ * @param cursor[OUT] the cursor for readForward()
+ * @param highKey[IN] the largest key to return
+ * @return 0 if searchKey is found. Otherwise an error code
+ */
+RC StaticIndex::locate(int searchKey, StaticCursor& cursor, int highKey)
+{
+	unsigned k = lowerSlot(searchKey);
+	cursor.pos = (k == 0) ? (int) tree->keys.size() : tree->rank[k];
+	cursor.highKey = highKey;
+	return (k > 0 && tree->eytzinger[k] == searchKey) ? 0 : RC_NO_SUCH_RECORD;
+}
+
+/*
+ * Read up to n (key, rid) pairs from the cursor and move it forward.
+ * @param cursor[IN/OUT] the cursor set by locate()
+ * @param keys[OUT] the keys read. must have room for n keys
+ * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+ * @param n[IN] the maximum number of pairs to read
+ * @param count[OUT] the number of pairs read
+ * @return 0 if at least one pair was read. RC_END_OF_TREE after the last
+ *         pair of the range. Otherwise an error code.
+ */
+RC StaticIndex::readForward(StaticCursor& cursor, int keys[], RecordId rids[], int n, int& count)
+{
+	int end = tree->keys.size();
+	for (count = 0; count < n && cursor.pos < end; count++, cursor.pos++) {
+		if (tree->keys[cursor.pos] > cursor.highKey) {
+			cursor.pos = end;
+			break;
+		}
+		keys[count] = tree->keys[cursor.pos];
+		rids[count] = tree->rids[cursor.pos];
+	}
+	return (count > 0) ? 0 : RC_END_OF_TREE;
+}
+
+/*
+ * Count the (key, rid) pairs with lo <= key <= hi.
+ * @param lo[IN] the smallest key counted
+ * @param hi[IN] the largest key counted
+ * @param count[OUT] the number of pairs in the range
+ * @return error code. 0 if no error
+ */
+RC StaticIndex::countRange(int lo, int hi, int& count)
+{
+	count = 0;
+	if (lo > hi)
+		return 0;
+	int n = tree->keys.size();
+	unsigned from = lowerSlot(lo);
+	unsigned to = (hi == INT_MAX) ? 0 : lowerSlot(hi + 1);
+	count = (to == 0 ? n : tree->rank[to]) - (from == 0 ? n : tree->rank[from]);
+	return 0;
+}
+
+/*
+ * Return the Eytzinger slot of the first pair with key >= searchKey. The
+ * walk goes down the slots, right past smaller keys, and the slot of the
+ * answer is the last one it went left from.
+ * @param searchKey[IN] the key to find
+ * @return the slot. 0 if every key is smaller
+ */
+unsigned StaticIndex::lowerSlot(int searchKey)
+{
+	unsigned n = tree->keys.size();
+	const int* slots = tree->eytzinger;
+	unsigned k = 1;
+	while (k <= n) {
+		__builtin_prefetch(slots + k * STATIC_PREFETCH_SLOTS);
+		k = 2 * k + (slots[k] < searchKey);
+	}
+
+	//drop the right turns taken since the last left one, and that one
+	return k >> __builtin_ffs(~k);
+}
+
+/*
+ * Read the pairs of a tree into memory.
+ * @param index[IN] the B+tree, open for reading
+ * @param header[IN] the header of the index file
+ * @param tree[OUT] the tree read
+ * @return error code. 0 if no error
+ */
+RC StaticIndex::load(BTreeIndex& index, const vector<int>& header, Tree*& tree)
+{
+	int rc;
+	IndexScanner scanner;
+	int keys[STATIC_LOAD_BATCH];
+	RecordId rids[STATIC_LOAD_BATCH];
+	int n;
+
+	tree = new Tree;
+	tree->header = header;
+	tree->eytzinger = NULL;
+	tree->rank = NULL;
+	tree->refs = 0;
+	tree->stale = false;
+
+	rc = scanner.open(index, INT_MIN, INT_MAX);
+	while (rc == 0 && (rc = scanner.next(keys, rids, STATIC_LOAD_BATCH, n)) == 0) {
+		tree->keys.insert(tree->keys.end(), keys, keys + n);
+		tree->rids.insert(tree->rids.end(), rids, rids + n);
+	}
+	if (rc != RC_END_OF_TREE) {
+		release(tree);
+		return rc;
+	}
+
+	//slot 0 is unused. the slots start on a cache line, so that the 16
+	//slots a lookup prefetches share one. a prefetch past the last slot
+	//does no harm
+	size_t slots = tree->keys.size() + 1;
+	void* eytzinger;
+	if (posix_memalign(&eytzinger, STATIC_LINE_SIZE, slots * sizeof(int)) != 0) {
+		release(tree);
+		return RC_FILE_READ_FAILED;
+	}
+	tree->eytzinger = (int*) eytzinger;
+	tree->rank = new int[tree->keys.size() + 1];
+	layout(tree, 0, 1);
+	return 0;
+}
+
+/*
+ * Fill Eytzinger slot k and the slots below it with the keys from
+ * position i on, in order: the left subtree, the slot, the right subtree.
+ * @param tree[IN/OUT] the tree
+ * @param i[IN] the position of the next key to place
+ * @param k[IN] the slot
+ * @return the position of the next key to place after them
+ */
+int StaticIndex::layout(Tree* tree, int i, unsigned k)
+{
+	if (k > tree->keys.size())
+		return i;
+	i = layout(tree, i, 2 * k);
+	tree->eytzinger[k] = tree->keys[i];
+	tree->rank[k] = i;
+	return layout(tree, i + 1, 2 * k + 1);
+}
+
+/*
+ * Free a tree.
+ * @param tree[IN] the tree
+ */
+void StaticIndex::release(Tree* tree)
+{
+	free(tree->eytzinger);
+	delete [] tree->rank;
+	delete tree;
+}
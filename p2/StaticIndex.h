@@ -0,0 +1,161 @@
+/*
+ * StaticIndex: a static in-memory Eytzinger index over the key column of
+ * read-only Bruinbase tables.
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef STATICINDEX_H
+#define STATICINDEX_H
+
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include "BTreeIndex.h"
+#include <pthread.h>
+#include <climits>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * The position of a scan of a StaticIndex: the next pair in key order and
+ * the largest key to return.
+ */
+typedef struct {
+  // The position of the next pair (the pair count past the last one)
+  int     pos;
+  // The largest key to return
+  int     highKey;
+} StaticCursor;
+
+/**
+ * A read-only copy of a BTreeIndex in memory, for tables that are loaded
+ * once and then only queried. The pairs of the leaves are read on open
+ * into arrays in key order, and the keys are also laid out in Eytzinger
+ * order: the implicit binary tree of the keys, stored level by level, so
+ * that a lookup walks down the array with no pointers and the slots a few
+ * levels below share the cache lines it prefetches. A cursor is then a
+ * position in the pairs in key order, and reads no page at all.
+ *
+ * The index file holds no keys of its own, only the root, height and end
+ * page of the tree it was made for and a generation that create() moves
+ * on every time; open() refuses it once the tree has changed. The arrays
+ * are built once per generation and process, and shared by the
+ * StaticIndexes open on the same tree.
+ */
+class StaticIndex {
+ public:
+  StaticIndex();
+  ~StaticIndex();
+
+  /**
+   * Make the index of a B+tree: write the index file naming the tree.
+   * @param indexname[IN] the name of the B+tree index file
+   * @param staticname[IN] the name of the static index file
+   * @return error code. 0 if no error
+   */
+  static RC create(const std::string& indexname, const std::string& staticname);
+
+  /**
+   * Open the index, reading the pairs of the B+tree into memory unless
+   * another StaticIndex of this process already did.
+   * @param indexname[IN] the name of the B+tree index file
+   * @param staticname[IN] the name of the static index file
+   * @return error code. RC_INVALID_FILE_FORMAT if the B+tree changed
+   *         since the index was made
+   */
+  RC open(const std::string& indexname, const std::string& staticname);
+
+  /**
+   * Close the index.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Set the cursor to the first pair with key >= searchKey. The scan ends
+   * after the last pair with key <= highKey.
+   * @param searchKey[IN] the smallest key to return
+   * @param cursor[OUT] the cursor for readForward()
+   * @param highKey[IN] the largest key to return
+   * @return 0 if searchKey is found. Otherwise an error code
+   */
+  RC locate(int searchKey, StaticCursor& cursor, int highKey = INT_MAX);
+
+  /**
+   * Read up to n (key, rid) pairs from the cursor and move it forward.
+   * @param cursor[IN/OUT] the cursor set by locate()
+   * @param keys[OUT] the keys read. must have room for n keys
+   * @param rids[OUT] the RecordIds read. must have room for n RecordIds
+   * @param n[IN] the maximum number of pairs to read
+   * @param count[OUT] the number of pairs read
+   * @return 0 if at least one pair was read. RC_END_OF_TREE after the last
+   *         pair of the range. Otherwise an error code.
+   */
+  RC readForward(StaticCursor& cursor, int keys[], RecordId rids[], int n, int& count);
+
+  /**
+   * Count the (key, rid) pairs with lo <= key <= hi.
+   * @param lo[IN] the smallest key counted
+   * @param hi[IN] the largest key counted
+   * @param count[OUT] the number of pairs in the range
+   * @return error code. 0 if no error
+   */
+  RC countRange(int lo, int hi, int& count);
+
+ private:
+  /**
+   * The pairs of a tree in memory.
+   */
+  struct Tree {
+    std::vector<int>      header; /// the header of the index file it was read for
+    std::vector<int>      keys;   /// the keys, in key order
+    std::vector<RecordId> rids;   /// the RecordIds, in key order
+    int*  eytzinger;  /// the keys in Eytzinger order, from slot 1
+    int*  rank;       /// the position in key order of every Eytzinger slot
+    int   refs;       /// # of StaticIndexes reading the tree
+    bool  stale;      /// whether a newer copy of the tree took its place
+  };
+
+  /**
+   * Read the pairs of a tree into memory.
+   * @param index[IN] the B+tree, open for reading
+   * @param header[IN] the header of the index file
+   * @param tree[OUT] the tree read
+   * @return error code. 0 if no error
+   */
+  static RC load(BTreeIndex& index, const std::vector<int>& header, Tree*& tree);
+
+  /**
+   * Fill Eytzinger slot k and the slots below it with the keys from
+   * position i on.
+   * @param tree[IN/OUT] the tree
+   * @param i[IN] the position of the next key to place
+   * @param k[IN] the slot
+   * @return the position of the next key to place after them
+   */
+  static int layout(Tree* tree, int i, unsigned k);
+
+  /**
+   * Free a tree.
+   * @param tree[IN] the tree
+   */
+  static void release(Tree* tree);
+
+  /**
+   * Return the Eytzinger slot of the first pair with key >= searchKey.
+   * @param searchKey[IN] the key to find
+   * @return the slot. 0 if every key is smaller
+   */
+  unsigned lowerSlot(int searchKey);
+
+  Tree* tree;   /// the tree read (NULL if the index is not open)
+
+  //
+  // the trees read so far, keyed by the name and inode of the index file
+  //
+  static std::map<std::string, Tree*> trees;
+  static pthread_mutex_t treeLock;
+};
+
+#endif /* STATICINDEX_H */